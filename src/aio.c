@@ -0,0 +1,181 @@
+// copyright 2012–2021 nick black
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include "aio.h"
+#include "growlight.h"
+
+// glibc doesn't wrap the native AIO syscalls
+static inline int
+io_setup(unsigned nr, aio_context_t *ctx){
+	return syscall(SYS_io_setup, nr, ctx);
+}
+
+static inline int
+io_destroy(aio_context_t ctx){
+	return syscall(SYS_io_destroy, ctx);
+}
+
+static inline int
+io_submit(aio_context_t ctx, long nr, struct iocb **cbs){
+	return syscall(SYS_io_submit, ctx, nr, cbs);
+}
+
+static inline int
+io_getevents(aio_context_t ctx, long minnr, long nr, struct io_event *evs,
+		struct timespec *timeout){
+	return syscall(SYS_io_getevents, ctx, minnr, nr, evs, timeout);
+}
+
+uint64_t aioq_nsec(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void aioq_destroy(aioq *q){
+	unsigned z;
+
+	if(q->ctx){
+		io_destroy(q->ctx);
+		q->ctx = 0;
+	}
+	if(q->efd >= 0){
+		close(q->efd);
+	}
+	if(q->bufs){
+		for(z = 0 ; z < q->depth ; ++z){
+			free(q->bufs[z]);
+		}
+	}
+	free(q->freeslots);
+	free(q->issued);
+	free(q->bufs);
+	free(q->cbs);
+	memset(q, 0, sizeof(*q));
+	q->fd = -1;
+	q->efd = -1;
+}
+
+int aioq_init(aioq *q, int fd, unsigned depth, unsigned bsize){
+	unsigned z;
+	int r;
+
+	memset(q, 0, sizeof(*q));
+	q->fd = fd;
+	q->efd = -1;
+	q->depth = depth;
+	q->bsize = bsize;
+	if(depth == 0 || bsize == 0){
+		diag("Invalid queue (depth %u, block size %u)\n", depth, bsize);
+		return -1;
+	}
+	if((q->cbs = calloc(depth, sizeof(*q->cbs))) == NULL ||
+			(q->bufs = calloc(depth, sizeof(*q->bufs))) == NULL ||
+			(q->issued = calloc(depth, sizeof(*q->issued))) == NULL ||
+			(q->freeslots = calloc(depth, sizeof(*q->freeslots))) == NULL){
+		diag("Couldn't allocate %u AIO slots (%s?)\n", depth, strerror(errno));
+		aioq_destroy(q);
+		return -1;
+	}
+	for(z = 0 ; z < depth ; ++z){
+		void *buf;
+
+		if( (r = posix_memalign(&buf, 4096, bsize)) ){
+			diag("Couldn't allocate %u aligned bytes (%s?)\n", bsize, strerror(r));
+			aioq_destroy(q);
+			return -1;
+		}
+		memset(buf, 0, bsize);
+		q->bufs[z] = buf;
+		q->freeslots[z] = depth - z - 1;
+	}
+	if((q->efd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK)) < 0){
+		diag("Couldn't create eventfd (%s?)\n", strerror(errno));
+		aioq_destroy(q);
+		return -1;
+	}
+	if(io_setup(depth, &q->ctx)){
+		diag("Couldn't set up AIO context of depth %u (%s?)\n", depth, strerror(errno));
+		q->ctx = 0;
+		aioq_destroy(q);
+		return -1;
+	}
+	return 0;
+}
+
+unsigned char *aioq_nextbuf(const aioq *q){
+	if(q->inflight == q->depth){
+		return NULL;
+	}
+	return q->bufs[q->freeslots[q->depth - q->inflight - 1]];
+}
+
+int aioq_submit(aioq *q, int write, uintmax_t off, unsigned len){
+	struct iocb *cb;
+	unsigned slot;
+
+	if(q->inflight == q->depth || len > q->bsize){
+		return -1;
+	}
+	slot = q->freeslots[q->depth - q->inflight - 1];
+	cb = &q->cbs[slot];
+	memset(cb, 0, sizeof(*cb));
+	cb->aio_data = slot;
+	cb->aio_fildes = q->fd;
+	cb->aio_lio_opcode = write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+	cb->aio_buf = (uintptr_t)q->bufs[slot];
+	cb->aio_nbytes = len;
+	cb->aio_offset = off;
+	cb->aio_flags = IOCB_FLAG_RESFD;
+	cb->aio_resfd = q->efd;
+	q->issued[slot] = aioq_nsec();
+	if(io_submit(q->ctx, 1, &cb) != 1){
+		diag("Couldn't submit %u-byte %s at %ju (%s?)\n", len,
+			write ? "write" : "read", off, strerror(errno));
+		return -1;
+	}
+	++q->inflight;
+	return slot;
+}
+
+int aioq_reap(aioq *q, unsigned min, aioqcb cb, void *curry){
+	struct io_event evs[q->depth];
+	struct timespec zero = { 0, 0 };
+	uint64_t now, count;
+	int r, z;
+
+	if(min > q->inflight){
+		min = q->inflight;
+	}
+	if(q->inflight == 0){
+		return 0;
+	}
+	// we reap everything available regardless; just clear the notification
+	while(read(q->efd, &count, sizeof(count)) < 0 && errno == EINTR){
+		;
+	}
+	do{
+		r = io_getevents(q->ctx, min, q->inflight, evs, min ? NULL : &zero);
+	}while(r < 0 && errno == EINTR);
+	if(r < 0){
+		diag("Error reaping AIO completions (%s?)\n", strerror(errno));
+		return -1;
+	}
+	now = aioq_nsec();
+	for(z = 0 ; z < r ; ++z){
+		unsigned slot = evs[z].data;
+
+		cb(q, slot, (long)evs[z].res, now - q->issued[slot], curry);
+		q->freeslots[q->depth - q->inflight] = slot;
+		--q->inflight;
+	}
+	return r;
+}
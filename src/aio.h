@@ -0,0 +1,59 @@
+// copyright 2012–2021 nick black
+#ifndef GROWLIGHT_AIO
+#define GROWLIGHT_AIO
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <linux/aio_abi.h>
+
+// A fixed-depth queue of O_DIRECT requests against a single file descriptor,
+// driven through the kernel's native AIO interface (io_submit(2) and
+// friends, without libaio). Each slot owns a page-aligned buffer of bsize
+// bytes. Slots are handed out by aioq_submit(), and returned as their
+// completions are reaped. Completions are signaled on the eventfd efd, so that
+// several queues can be driven from one poll(2)ing thread.
+typedef struct aioq {
+	aio_context_t ctx;
+	int fd;
+	int efd;		// eventfd signaled on completion
+	unsigned depth;		// number of slots
+	unsigned bsize;		// bytes per slot buffer
+	unsigned inflight;	// slots currently submitted
+	struct iocb *cbs;
+	unsigned char **bufs;
+	uint64_t *issued;	// submission time (ns) per slot
+	unsigned *freeslots;	// stack of available slots
+} aioq;
+
+// Invoked for each completion with the slot, its result (bytes transferred or
+// -errno), and the latency of the request in nanoseconds. The slot's buffer
+// remains valid until the callback returns.
+typedef void (*aioqcb)(aioq *,unsigned,long,uint64_t,void *);
+
+int aioq_init(aioq *,int,unsigned,unsigned);
+void aioq_destroy(aioq *);
+
+// Buffer of the next slot aioq_submit() will use, so that writes can fill it
+// beforehand. NULL if all slots are in flight.
+unsigned char *aioq_nextbuf(const aioq *);
+
+// Submit a read (write == 0) or write of len bytes at off. Returns the slot
+// used, or -1 if all slots are in flight or the submission failed.
+int aioq_submit(aioq *,int,uintmax_t,unsigned);
+
+// Wait for at least min completions, passing each to the callback. A min of 0
+// reaps whatever has completed without blocking. Returns the number reaped, or
+// -1 on error.
+int aioq_reap(aioq *,unsigned,aioqcb,void *);
+
+// CLOCK_MONOTONIC, in nanoseconds.
+uint64_t aioq_nsec(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,17 +3,17 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <iconv.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/mman.h>
 
 #include "apm.h"
 #include "ptypes.h"
 #include "ptable.h"
+#include "blockio.h"
 #include "growlight.h"
 
 #define DEFAULT_APM_ENTRIES 32
-#define LBA_SIZE 512u
 
 static const uint8_t APM_SIG[2] = { 0x4d, 0x50 };
 
@@ -79,182 +79,58 @@ initialize_apm(void *map, size_t lba, uintmax_t sectors, unsigned entries){
 	return 0;
 }
 
-// Write out a apm on the device represented by fd, using lbasize-byte LBA. We
-// can either zero it all out, or create a new empty apm. Set realdata not
-// equal to 0 to perform the latterj
+// Write out an apm at the start of the device. We can either zero it all out,
+// or create a new empty apm. Set realdata not equal to 0 to perform the
+// latter.
 static int
-write_apm(int fd, ssize_t lbasize, uintmax_t sectors, unsigned realdata){
-	int pgsize = getpagesize();
-	apm_entry *mhead;
-	size_t mapsize;
-	void *map;
+write_apm(blockio *b, unsigned realdata){
+	const size_t lbas = b->lbas > DEFAULT_APM_ENTRIES + 1 ? DEFAULT_APM_ENTRIES + 1 : b->lbas;
+	int ret = -1;
+	void *buf;
 
-	assert(pgsize > 0 && pgsize % lbasize == 0);
-	mapsize = lbasize * (DEFAULT_APM_ENTRIES + 1);
-	mapsize = ((mapsize / pgsize) + !!(mapsize % pgsize)) * pgsize;
-	assert(mapsize % pgsize == 0 && mapsize);
-	map = mmap(NULL, mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-	if(map == MAP_FAILED){
-		diag("Error mapping %zub at %d (%s?)\n", mapsize, fd, strerror(errno));
+	if((buf = blockio_alloc(b, DEFAULT_APM_ENTRIES + 1)) == NULL){
 		return -1;
 	}
-	mhead = (apm_entry *)map;
-	if(!realdata){
-		memset(mhead, 0, lbasize * (sectors > DEFAULT_APM_ENTRIES + 1 ?
-				DEFAULT_APM_ENTRIES + 1 : sectors));
-	}else{
-		if(initialize_apm(mhead, lbasize, sectors, DEFAULT_APM_ENTRIES)){
-			munmap(map, mapsize);
-			return -1;
+	if(!realdata || initialize_apm(buf, b->lbasize, b->lbas, DEFAULT_APM_ENTRIES) == 0){
+		if(blockio_write(b, buf, 0, lbas) == 0){
+			ret = blockio_flush(b);
 		}
 	}
-	if(msync(map, mapsize, MS_SYNC|MS_INVALIDATE)){
-		diag("Error syncing %d (%s?)\n", fd, strerror(errno));
-		munmap(map, mapsize);
-		return -1;
-	}
-	if(munmap(map, mapsize)){
-		diag("Error unmapping %d (%s?)\n", fd, strerror(errno));
-		return -1;
-	}
-	return 0;
+	free(buf);
+	return ret;
 }
 
-int new_apm(device *d){
-	int fd;
-
-	if(d->layout != LAYOUT_NONE){
-		diag("Won't create partition table on non-disk %s\n", d->name);
-		return -1;
-	}
-	if(d->size % LBA_SIZE){
-		diag("Won't create apm on (%ju %% %u == %juB) disk %s\n",
-			d->size, LBA_SIZE, d->size % LBA_SIZE, d->name);
-		return -1;
-	}
-	if(d->size < LBA_SIZE){
-		diag("Won't create apm on empty disk %s\n", d->name);
-		return -1;
-	}
-	if((fd = openat(devfd, d->name, O_RDWR|O_CLOEXEC|O_DIRECT)) < 0){
-		diag("Couldn't open %s (%s?)\n", d->name, strerror(errno));
-		return -1;
-	}
-	if(write_apm(fd, LBA_SIZE, d->size / LBA_SIZE, 1)){
-		close(fd);
-		return -1;
-	}
-	if(fsync(fd)){
-		diag("Warning: error syncing %d for %s (%s?)\n", fd, d->name, strerror(errno));
-	}
-	if(close(fd)){
-		diag("Error closing %d for %s (%s?)\n", fd, d->name, strerror(errno));
-		return -1;
-	}
-	return 0;
+int new_apm(blockio *b){
+	return write_apm(b, 1);
 }
 
-int zap_apm(device *d){
-	int fd;
-
-	if(d->layout != LAYOUT_NONE){
-		diag("Won't zap partition table on non-disk %s\n", d->name);
-		return -1;
-	}
-	if(d->blkdev.pttable == NULL || strcmp(d->blkdev.pttable, "apm")){
-		diag("No apm on disk %s\n", d->name);
-		return -1;
-	}
-	if(d->size < LBA_SIZE || d->size % LBA_SIZE){
-		diag("Won't zap apm on (%ju %% %u == %juB) disk %s\n",
-			d->size, LBA_SIZE, d->size % LBA_SIZE, d->name);
-		return -1;
-	}
-	if((fd = openat(devfd, d->name, O_RDWR|O_CLOEXEC|O_DIRECT)) < 0){
-		diag("Couldn't open %s (%s?)\n", d->name, strerror(errno));
-		return -1;
-	}
-	if(write_apm(fd, LBA_SIZE, d->size / LBA_SIZE, 0)){
-		close(fd);
-		return -1;
-	}
-	if(fsync(fd)){
-		diag("Warning: error syncing %d for %s (%s?)\n", fd, d->name, strerror(errno));
-	}
-	if(close(fd)){
-		diag("Error closing %d for %s (%s?)\n", fd, d->name, strerror(errno));
-		return -1;
-	}
-	return 0;
-}
-
-// Map the first Apple Partition Map entry, and the disk's first sector
-static void *
-map_apm(const device *d, size_t *mapsize, int *fd, size_t lbasize){
-	const int pgsize = getpagesize();
-	void *map;
-
-	if(pgsize < 0){
-		diag("Bad pgsize for apm: %d\n", pgsize);
-		return MAP_FAILED;
-	}
-	if((*fd = openat(devfd, d->name, O_RDWR|O_CLOEXEC|O_DIRECT)) < 0){
-		diag("Couldn't open %s (%s?)\n", d->name, strerror(errno));
-		return MAP_FAILED;
-	}
-	*mapsize = lbasize * (DEFAULT_APM_ENTRIES + 1);
-	*mapsize = ((*mapsize / pgsize) + !!(*mapsize % pgsize)) * pgsize;
-	assert(*mapsize % pgsize == 0);
-	map = mmap(NULL, *mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, *fd, 0);
-	if(map == MAP_FAILED){
-		diag("Couldn't map apm header (%s?)\n", strerror(errno));
-		close(*fd);
-		return map;
-	}
-	return map;
+int zap_apm(blockio *b){
+	return write_apm(b, 0);
 }
 
-// Pass the return from map_apm(), ie the MBR boot sector
-static int
-unmap_apm(const device *parent, void *map, size_t mapsize, int fd){
-	const int pgsize = getpagesize();
-
-	assert(parent->layout == LAYOUT_NONE);
-	if(pgsize < 0){
-		diag("Warning: bad pgsize for apm: %d\n", pgsize);
-	}
-	if(munmap(map, mapsize)){
-		int e = errno;
-
-		diag("Error munmapping %s (%s?)\n", parent->name, strerror(errno));
-		close(fd);
-		errno = e;
-		return -1;
-	}
-	return 0;
-}
-
-uintmax_t first_apm(const device *d){
-	uintmax_t fsector;
-	size_t mapsize;
+// The first entry, in block 1, records the size of the map.
+uintmax_t first_apm(const device *d, const blockcap *cap){
+	uintmax_t fsector = -1;
+	const apm_entry *capm;
 	apm_entry *apm;
-	void *map;
-	int fd;
+	blockio b;
 
-	if((map = map_apm(d, &mapsize, &fd, LBA_SIZE)) == MAP_FAILED){
-		return -1;
+	if(cap && (capm = blockcap_lba(cap, 1, 1))){
+		return 1 + capm->partition_count;
 	}
-	if(mapsize < LBA_SIZE * (DEFAULT_APM_ENTRIES + 1)){
-		diag("APM size too small (%zu < %u)\n", mapsize, LBA_SIZE * (DEFAULT_APM_ENTRIES + 1));
-		unmap_apm(d, map, mapsize, fd);
+	if(blockio_open(&b, d, O_RDONLY)){
 		return -1;
 	}
-	apm = (apm_entry *)((char *)map + LBA_SIZE);
-	fsector = 1 + apm->partition_count;
-	unmap_apm(d, map, mapsize, fd);
+	if( (apm = blockio_alloc(&b, 1)) ){
+		if(blockio_read(&b, apm, 1, 1) == 0){
+			fsector = 1 + apm->partition_count;
+		}
+		free(apm);
+	}
+	blockio_close(&b);
 	return fsector;
 }
 
-uintmax_t last_apm(const device *d){
+uintmax_t last_apm(const device *d, const blockcap *cap __attribute__ ((unused))){
 	return d->logsec && d->size ? d->size / d->logsec - 1 : 0;
 }
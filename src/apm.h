@@ -9,13 +9,15 @@ extern "C" {
 #include <stdint.h>
 
 struct device;
+struct blockio;
+struct blockcap;
 
 // Pass the block device
-int new_apm(struct device *);
-int zap_apm(struct device *);
+int new_apm(struct blockio *);
+int zap_apm(struct blockio *);
 
-uintmax_t first_apm(const struct device *);
-uintmax_t last_apm(const struct device *);
+uintmax_t first_apm(const struct device *, const struct blockcap *);
+uintmax_t last_apm(const struct device *, const struct blockcap *);
 
 #ifdef __cplusplus
 }
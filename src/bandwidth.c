@@ -0,0 +1,302 @@
+// copyright 2012–2021 nick black
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sysfs.h"
+#include "bandwidth.h"
+#include "growlight.h"
+
+// Read a sysfs node of the form "6.0 Gbps" or "480", scaled by unit.
+static uintmax_t
+sysfs_rate(const char *node, double unit){
+	double rate;
+	char *s;
+
+	if((s = get_sysfs_string(AT_FDCWD, node)) == NULL){
+		return 0;
+	}
+	rate = strtod(s, NULL);
+	free(s);
+	return rate > 0 ? (uintmax_t)(rate * unit) : 0;
+}
+
+uintmax_t pcie_link_bw(const char *sysfs, unsigned *gen, unsigned *lanes){
+	char path[PATH_MAX];
+	unsigned long l = 0;
+	unsigned g = 0;
+	double gts = 0;
+	char *s;
+
+	if((unsigned)snprintf(path, sizeof(path), "%s/current_link_speed", sysfs) >= sizeof(path)){
+		return 0;
+	}
+	// "8.0 GT/s PCIe" on recent kernels, "8 GT/s" or "Unknown" on others
+	if( (s = get_sysfs_string(AT_FDCWD, path)) ){
+		gts = strtod(s, NULL);
+		free(s);
+	}
+	if(gts > 0){
+		g = gts < 4 ? 1 : gts < 6.5 ? 2 : gts < 12 ? 3 : gts < 24 ? 4 : gts < 48 ? 5 : 6;
+	}
+	if((unsigned)snprintf(path, sizeof(path), "%s/current_link_width", sysfs) >= sizeof(path)){
+		return 0;
+	}
+	if( (s = get_sysfs_string(AT_FDCWD, path)) ){
+		l = strtoul(s, NULL, 10);
+		free(s);
+	}
+	if(g == 0 || l == 0 || l > 32){
+		return 0;
+	}
+	if(gen){
+		*gen = g;
+	}
+	if(lanes){
+		*lanes = l;
+	}
+	return pcie_lane_bw(g) * l;
+}
+
+// libata names ports ataN, and their (non-PMP) links linkN.
+static uintmax_t
+ata_link_bw(const char *path){
+	const char *c = path;
+	unsigned long port = 0;
+	char node[PATH_MAX];
+	char *e;
+
+	while( (c = strstr(c, "/ata")) ){
+		c += strlen("/ata");
+		if(isdigit(*c)){
+			port = strtoul(c, &e, 10);
+			if(*e == '/'){
+				break;
+			}
+		}
+	}
+	if(c == NULL){
+		return 0;
+	}
+	snprintf(node, sizeof(node), "/sys/class/ata_link/link%lu/sata_spd", port);
+	return sysfs_rate(node, 1000000000.0);
+}
+
+// USB devices are named bus-port[.port...]; interfaces add a ":config.if".
+static int
+usb_device_p(const char *s, size_t len){
+	unsigned dash = 0;
+	size_t z;
+
+	if(len == 0 || !isdigit(s[0]) || !isdigit(s[len - 1])){
+		return 0;
+	}
+	for(z = 0 ; z < len ; ++z){
+		if(s[z] == '-'){
+			if(dash++){
+				return 0;
+			}
+		}else if(!isdigit(s[z]) && !(dash && s[z] == '.')){
+			return 0;
+		}
+	}
+	return dash;
+}
+
+// The deepest USB device on the path is the disk (or its bridge); its speed
+// node holds the negotiated rate in Mbps.
+static uintmax_t
+usb_link_bw(const char *path){
+	const char *c, *e, *end = NULL;
+	char node[PATH_MAX];
+
+	for(c = path ; *c ; c = e){
+		while(*c == '/'){
+			++c;
+		}
+		if((e = strchr(c, '/')) == NULL){
+			e = c + strlen(c);
+		}
+		if(usb_device_p(c, e - c)){
+			end = e;
+		}
+	}
+	if(end == NULL){
+		return 0;
+	}
+	if((unsigned)snprintf(node, sizeof(node), "%.*s/speed", (int)(end - path), path) >= sizeof(node)){
+		return 0;
+	}
+	return sysfs_rate(node, 1000000.0);
+}
+
+uintmax_t device_link_bw(const device *d, const char *fn){
+	uintmax_t bw;
+	char *buf;
+
+	if(d->layout != LAYOUT_NONE){
+		return 0;
+	}
+	if(d->blkdev.transport == DIRECT_NVME){
+		return d->c ? d->c->bandwidth : 0;
+	}
+	if((buf = realpath(fn, NULL)) == NULL){
+		return 0;
+	}
+	if((bw = ata_link_bw(buf)) == 0){
+		bw = usb_link_bw(buf);
+	}
+	free(buf);
+	// SAS HBAs don't publish sata_spd; fall back to what the disk reported
+	// in IDENTIFY, preferring the negotiated rate.
+	if(bw == 0){
+		bw = d->blkdev.caps.satacur ? d->blkdev.caps.satacur : d->blkdev.caps.satamax;
+	}
+	return bw;
+}
+
+static int
+pci_address_p(const char *s){
+	unsigned dom, bus, dev, func;
+	int n = 0;
+
+	if(sscanf(s, "%x:%x:%x.%x%n", &dom, &bus, &dev, &func, &n) != 4){
+		return 0;
+	}
+	return s[n] == '\0';
+}
+
+// Walk the bridges and switch ports between a PCIe function and the root
+// complex. Returns the narrowest of their links (0 if none are known), and
+// writes the topmost port, if any, to rootport.
+static uintmax_t
+pcie_uplink(const char *sysfs, char *narrowest, char *rootport){
+	char path[PATH_MAX];
+	uintmax_t min = 0;
+	char *e;
+
+	*narrowest = '\0';
+	*rootport = '\0';
+	if(strlen(sysfs) >= sizeof(path)){
+		return 0;
+	}
+	strcpy(path, sysfs);
+	while( (e = strrchr(path, '/')) ){
+		uintmax_t bw;
+
+		*e = '\0';
+		if((e = strrchr(path, '/')) == NULL || !pci_address_p(e + 1)){
+			break;
+		}
+		if((bw = pcie_link_bw(path, NULL, NULL)) && (min == 0 || bw < min)){
+			min = bw;
+			strcpy(narrowest, path);
+		}
+		strcpy(rootport, path);
+	}
+	return min;
+}
+
+typedef struct portload {
+	char *path;
+	uintmax_t demand;
+	unsigned members;
+} portload;
+
+int find_oversubscription(oversubcb cb, void *curry){
+	char narrowest[PATH_MAX], rootport[PATH_MAX];
+	unsigned z, nports = 0, ncontrollers = 0;
+	const controller *c;
+	unsigned stop = 0;
+	portload *ports;
+	int found = 0;
+
+	for(c = get_controllers() ; c ; c = c->next){
+		++ncontrollers;
+	}
+	if((ports = calloc(ncontrollers ? ncontrollers : 1, sizeof(*ports))) == NULL){
+		diag("Couldn't allocate port table (%s?)\n", strerror(errno));
+		return -1;
+	}
+	for(c = get_controllers() ; c ; c = c->next){
+		uintmax_t demand = 0, supply, uplink = 0;
+		unsigned members = 0;
+		const device *d;
+
+		if(c->bus != BUS_PCIe){
+			continue;
+		}
+		for(d = c->blockdevs ; d ; d = d->next){
+			if(d->layout == LAYOUT_NONE && device_bw(d)){
+				demand += device_bw(d);
+				++members;
+			}
+		}
+		if(c->sysfs){
+			uplink = pcie_uplink(c->sysfs, narrowest, rootport);
+		}else{
+			*narrowest = '\0';
+			*rootport = '\0';
+		}
+		supply = c->bandwidth;
+		if(uplink && (supply == 0 || uplink < supply)){
+			supply = uplink;
+		}else if(c->sysfs){
+			strcpy(narrowest, c->sysfs);
+		}
+		if(supply && demand > supply && !stop){
+			oversub o = {
+				.level = OVERSUB_CONTROLLER,
+				.name = c->ident,
+				.supply = supply,
+				.demand = demand,
+				.members = members,
+				.bottleneck = narrowest,
+			};
+
+			++found;
+			stop = cb(&o, curry) != 0;
+		}
+		if(*rootport == '\0' || demand == 0){
+			continue;
+		}
+		for(z = 0 ; z < nports ; ++z){
+			if(strcmp(ports[z].path, rootport) == 0){
+				break;
+			}
+		}
+		if(z == nports){
+			if((ports[z].path = strdup(rootport)) == NULL){
+				continue;
+			}
+			++nports;
+		}
+		ports[z].demand += supply && supply < demand ? supply : demand;
+		++ports[z].members;
+	}
+	for(z = 0 ; z < nports ; ++z){
+		uintmax_t supply = pcie_link_bw(ports[z].path, NULL, NULL);
+
+		// a lone controller was already checked against this link
+		if(ports[z].members > 1 && supply && ports[z].demand > supply && !stop){
+			oversub o = {
+				.level = OVERSUB_ROOTPORT,
+				.name = strrchr(ports[z].path, '/') + 1,
+				.supply = supply,
+				.demand = ports[z].demand,
+				.members = ports[z].members,
+				.bottleneck = ports[z].path,
+			};
+
+			++found;
+			stop = cb(&o, curry) != 0;
+		}
+		free(ports[z].path);
+	}
+	free(ports);
+	return found;
+}
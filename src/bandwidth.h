@@ -0,0 +1,50 @@
+// copyright 2012–2021 nick black
+#ifndef GROWLIGHT_BANDWIDTH
+#define GROWLIGHT_BANDWIDTH
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+struct device;
+
+// Negotiated PCIe link of the sysfs PCI device directory, from
+// current_link_speed and current_link_width. Returns bits per second after
+// encoding overhead, or 0 if unknown. gen and lanes are filled in if known.
+uintmax_t pcie_link_bw(const char *, unsigned *, unsigned *);
+
+// Negotiated link rate of a whole disk in bits per second, or 0 if unknown:
+// sata_spd (or failing that, IDENTIFY DEVICE) for ATA, the USB device's
+// speed for USB, and the controller's PCIe link for NVMe. Takes the sysfs
+// link as read when dereferencing /sys/block/*.
+uintmax_t device_link_bw(const struct device *, const char *);
+
+// A link whose downstream demand exceeds what it can carry.
+typedef struct oversub {
+	enum {
+		OVERSUB_CONTROLLER,	// devices vs. the controller's path to the host
+		OVERSUB_ROOTPORT,	// controllers vs. their PCIe root port
+	} level;
+	const char *name;		// controller ident, or root port address
+	uintmax_t supply;		// bits per second the link can carry
+	uintmax_t demand;		// aggregate bits per second beneath it
+	unsigned members;		// devices or controllers contributing
+	const char *bottleneck;		// sysfs node of the narrowest link
+} oversub;
+
+// Compare the aggregate link rates of devices against every controller's
+// PCIe link and the narrowest bridge or switch above it, and the aggregate
+// of controllers against each PCIe root port. The callback is invoked for
+// each oversubscribed link; a non-zero return stops the walk. Returns the
+// number of oversubscribed links found, or -1 on error. Call with the
+// growlight lock held.
+typedef int (*oversubcb)(const oversub *, void *);
+int find_oversubscription(oversubcb, void *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
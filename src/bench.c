@@ -0,0 +1,306 @@
+// copyright 2012–2021 nick black
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aio.h"
+#include "jobs.h"
+#include "bench.h"
+#include "growlight.h"
+
+// Writes are aligned to the largest block size of the sweep.
+#define BENCH_MAXBSIZE (1024 * 1024)
+
+static const struct benchpoint {
+	unsigned bsize;
+	unsigned qdepth;
+	unsigned random;
+} sweep[] = {
+	{ .bsize = 128 * 1024, .qdepth = 1, .random = 0, },
+	{ .bsize = BENCH_MAXBSIZE, .qdepth = 1, .random = 0, },
+	{ .bsize = BENCH_MAXBSIZE, .qdepth = 8, .random = 0, },
+	{ .bsize = 4096, .qdepth = 1, .random = 1, },
+	{ .bsize = 4096, .qdepth = 4, .random = 1, },
+	{ .bsize = 4096, .qdepth = 32, .random = 1, },
+	{ .bsize = 64 * 1024, .qdepth = 1, .random = 1, },
+	{ .bsize = 64 * 1024, .qdepth = 32, .random = 1, },
+};
+
+// Latencies are kept in a log-linear histogram: 8 linear buckets per power of
+// two, giving better than 12.5% precision from nanoseconds to centuries.
+#define LATBUCKETS (62 * 8)
+
+static inline unsigned
+lat_bucket(uint64_t ns){
+	unsigned msb;
+
+	if(ns < 8){
+		return ns;
+	}
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - 2) * 8 + ((ns >> (msb - 3)) & 7);
+}
+
+// Largest latency which falls into bucket b.
+static inline uint64_t
+lat_bucket_max(unsigned b){
+	unsigned shift;
+
+	if(b < 8){
+		return b;
+	}
+	shift = b / 8 - 1;
+	return ((uint64_t)(8 + b % 8 + 1) << shift) - 1;
+}
+
+typedef struct benchstate {
+	benchresult *br;
+	uint64_t latsum;
+	int err;
+	uint64_t hist[LATBUCKETS];
+} benchstate;
+
+static void
+bench_complete(aioq *q, unsigned slot, long res, uint64_t lat, void *vbs){
+	benchstate *bs = vbs;
+
+	if(res != (long)q->cbs[slot].aio_nbytes){
+		if(!bs->err){
+			diag("Benchmark %s failed at %ju (%s)\n",
+				bs->br->write ? "write" : "read",
+				(uintmax_t)q->cbs[slot].aio_offset,
+				res < 0 ? strerror(-res) : "short transfer");
+		}
+		bs->err = 1;
+		return;
+	}
+	++bs->br->ios;
+	bs->br->bytes += res;
+	bs->latsum += lat;
+	if(lat > bs->br->lat_max){
+		bs->br->lat_max = lat;
+	}
+	++bs->hist[lat_bucket(lat)];
+}
+
+static uint64_t
+percentile(const benchstate *bs, unsigned permille){
+	uint64_t want, seen = 0;
+	unsigned b;
+
+	want = (bs->br->ios * permille + 999) / 1000;
+	for(b = 0 ; b < LATBUCKETS ; ++b){
+		if((seen += bs->hist[b]) >= want && seen){
+			uint64_t m = lat_bucket_max(b);
+			return m > bs->br->lat_max ? bs->br->lat_max : m;
+		}
+	}
+	return bs->br->lat_max;
+}
+
+// xorshift64; we want cheap and uncompressible, not cryptographic.
+static inline uint64_t
+bench_rand(uint64_t *s){
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+// Run one point of the sweep over the extent [off, off + len), which must be
+// aligned to bsize.
+static int
+bench_point(int fd, uintmax_t off, uintmax_t len, unsigned msec, benchresult *br){
+	uint64_t start, deadline, seed;
+	uintmax_t nblocks, cursor;
+	benchstate *bs;
+	unsigned z;
+	aioq q;
+
+	if((nblocks = len / br->bsize) == 0){
+		diag("Extent of %ju bytes is too small for %u-byte blocks\n", len, br->bsize);
+		return -1;
+	}
+	if((bs = malloc(sizeof(*bs))) == NULL){
+		diag("Couldn't allocate benchmark state (%s?)\n", strerror(errno));
+		return -1;
+	}
+	memset(bs, 0, sizeof(*bs));
+	bs->br = br;
+	if(aioq_init(&q, fd, br->qdepth, br->bsize)){
+		free(bs);
+		return -1;
+	}
+	seed = aioq_nsec() | 1;
+	if(br->write){
+		for(z = 0 ; z < q.depth ; ++z){
+			uint64_t *w = (uint64_t *)q.bufs[z];
+			unsigned i;
+
+			for(i = 0 ; i < br->bsize / sizeof(*w) ; ++i){
+				w[i] = bench_rand(&seed);
+			}
+		}
+	}
+	cursor = 0;
+	start = aioq_nsec();
+	deadline = start + msec * 1000000ull;
+	do{
+		while(!bs->err && q.inflight < q.depth && aioq_nsec() < deadline && !job_cancelled()){
+			uintmax_t blk = br->random ? bench_rand(&seed) % nblocks : cursor++ % nblocks;
+
+			if(aioq_submit(&q, br->write, off + blk * br->bsize, br->bsize) < 0){
+				bs->err = 1;
+			}
+		}
+		if(aioq_reap(&q, 1, bench_complete, bs) < 0){
+			bs->err = 1;
+			break;
+		}
+	}while(q.inflight || (!bs->err && aioq_nsec() < deadline && !job_cancelled()));
+	br->nsec = aioq_nsec() - start;
+	aioq_destroy(&q);
+	if(bs->err || br->ios == 0){
+		free(bs);
+		return -1;
+	}
+	br->lat_mean = bs->latsum / br->ios;
+	br->lat_p50 = percentile(bs, 500);
+	br->lat_p90 = percentile(bs, 900);
+	br->lat_p99 = percentile(bs, 990);
+	br->lat_p999 = percentile(bs, 999);
+	free(bs);
+	return 0;
+}
+
+// Partition extents are kept in 512-byte units (as exported by sysfs), while
+// the usable area of the disk is in logical blocks. Return the partition's
+// extent in logical blocks, rounded outwards. An msdos extended partition is
+// reported as only its first sector or two, but holds the logical partitions
+// and the EBRs in the gaps between them, so it is taken to run through the
+// end of the last logical partition.
+static void
+part_extent(const device *d, const device *p, uintmax_t *first, uintmax_t *last){
+	uintmax_t lsector = p->partdev.lsector;
+	const device *l;
+
+	if(p->partdev.ptstate.extended){
+		for(l = d->parts ; l ; l = l->next){
+			if(l->partdev.ptstate.logical && l->partdev.lsector > lsector){
+				lsector = l->partdev.lsector;
+			}
+		}
+	}
+	*first = p->partdev.fsector * 512 / d->logsec;
+	*last = ((lsector + 1) * 512 + d->logsec - 1) / d->logsec - 1;
+}
+
+int bench_write_extent(const device *d, uintmax_t *off, uintmax_t *len){
+	uintmax_t prev, bestoff, bestlen, end, pfirst = 0, plast = 0;
+	const device *p;
+
+	if(d->layout != LAYOUT_NONE || d->blkdev.pttable == NULL || d->logsec == 0){
+		diag("Write benchmarks require a partitioned block device\n");
+		return -1;
+	}
+	if(d->roflag || d->mnttype || d->slave){
+		diag("Won't write to %s: device is in use\n", d->name);
+		return -1;
+	}
+	bestoff = bestlen = 0;
+	prev = first_usable_sector(d);
+	for(p = d->parts ; ; p = p->next){
+		if(p){
+			part_extent(d, p, &pfirst, &plast);
+		}
+		end = p ? pfirst : last_usable_sector(d) + 1;
+		if(end > prev && end - prev > bestlen){
+			bestoff = prev;
+			bestlen = end - prev;
+		}
+		if(p == NULL){
+			break;
+		}
+		if(plast + 1 > prev){
+			prev = plast + 1;
+		}
+	}
+	bestoff *= d->logsec;
+	bestlen *= d->logsec;
+	end = (bestoff + bestlen) / BENCH_MAXBSIZE * BENCH_MAXBSIZE;
+	bestoff = (bestoff + BENCH_MAXBSIZE - 1) / BENCH_MAXBSIZE * BENCH_MAXBSIZE;
+	if(end <= bestoff){
+		diag("No unallocated space on %s for write benchmarks\n", d->name);
+		return -1;
+	}
+	*off = bestoff;
+	*len = end - bestoff;
+	return 0;
+}
+
+int benchmark_blockdev(const char *name, unsigned writes, unsigned msec,
+			benchcb cb, void *curry){
+	uintmax_t woff = 0, wlen = 0, size;
+	const device *d;
+	unsigned w, z, logsec;
+	int fd;
+
+	lock_growlight();
+	if((d = find_device(name)) == NULL){
+		diag("Couldn't find device %s\n", name);
+		unlock_growlight();
+		return -1;
+	}
+	if(d->logsec == 0 || d->size == 0){
+		diag("Can't benchmark %s: no media\n", d->name);
+		unlock_growlight();
+		return -1;
+	}
+	if(writes && bench_write_extent(d, &woff, &wlen)){
+		unlock_growlight();
+		return -1;
+	}
+	// the device can be rescanned out from under us once we unlock
+	logsec = d->logsec;
+	size = d->size;
+	unlock_growlight();
+	if((fd = openat(devfd, name, (writes ? O_RDWR : O_RDONLY)|O_CLOEXEC|O_DIRECT)) < 0){
+		diag("Couldn't open %s (%s?)\n", name, strerror(errno));
+		return -1;
+	}
+	for(w = 0 ; w <= !!writes ; ++w){
+		for(z = 0 ; z < sizeof(sweep) / sizeof(*sweep) ; ++z){
+			const unsigned points = sizeof(sweep) / sizeof(*sweep);
+			benchresult br;
+
+			job_progress(w * points + z, (!!writes + 1) * points);
+
+			if(sweep[z].bsize % logsec || (!w && size < sweep[z].bsize)){
+				continue;
+			}
+			memset(&br, 0, sizeof(br));
+			br.bsize = sweep[z].bsize;
+			br.qdepth = sweep[z].qdepth;
+			br.random = sweep[z].random;
+			br.write = w;
+			if(bench_point(fd, w ? woff : 0,
+					w ? wlen : size / br.bsize * br.bsize,
+					msec, &br) || job_cancelled()){
+				close(fd);
+				return -1;
+			}
+			if(cb(&br, curry)){
+				close(fd);
+				return 0;
+			}
+		}
+	}
+	if(close(fd)){
+		diag("Error closing %s (%s?)\n", name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
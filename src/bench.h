@@ -0,0 +1,59 @@
+// copyright 2012–2021 nick black
+#ifndef GROWLIGHT_BENCH
+#define GROWLIGHT_BENCH
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+struct device;
+
+typedef struct benchresult {
+	unsigned bsize;		// bytes per request
+	unsigned qdepth;	// requests kept in flight
+	unsigned random;	// random (as opposed to sequential) offsets
+	unsigned write;		// writes (only ever to unallocated space)
+	uintmax_t ios;		// completed requests
+	uintmax_t bytes;	// bytes transferred
+	uint64_t nsec;		// wall time of the run
+	uint64_t lat_mean;	// latencies in nanoseconds
+	uint64_t lat_p50;
+	uint64_t lat_p90;
+	uint64_t lat_p99;
+	uint64_t lat_p999;
+	uint64_t lat_max;
+} benchresult;
+
+static inline uintmax_t
+bench_bps(const benchresult *br){
+	return br->nsec ? br->bytes * 1000000000ull / br->nsec : 0;
+}
+
+static inline uintmax_t
+bench_iops(const benchresult *br){
+	return br->nsec ? br->ios * 1000000000ull / br->nsec : 0;
+}
+
+// Invoked once per completed point of the sweep. Return non-zero to stop.
+typedef int (*benchcb)(const benchresult *,void *);
+
+// Sweep sequential and random O_DIRECT reads across a range of block sizes
+// and queue depths, spending msec milliseconds on each point. If writes is
+// non-zero, the sweep is repeated with writes confined to the largest
+// unallocated extent of a partitioned, unmounted disk (or fails if there is
+// no such extent). growlight is locked only while looking up the named
+// device, so this can be run as a job.
+int benchmark_blockdev(const char *,unsigned,unsigned,benchcb,void *);
+
+// Find the largest extent of a partitioned, unused disk not claimed by any
+// partition (nor by an msdos extended partition's EBRs), aligned to 1MiB.
+// The byte offset and length are written to the uintmax_ts.
+int bench_write_extent(const struct device *,uintmax_t *,uintmax_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,241 @@
+// copyright 2012–2021 nick black
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+
+#include "aio.h"
+#include "blockio.h"
+#include "growlight.h"
+
+int blockio_open(blockio *b, const device *d, int flags){
+	uint64_t size = 0;
+	int lbasize = 0;
+	long pgsize;
+
+	memset(b, 0, sizeof(*b));
+	snprintf(b->name, sizeof(b->name), "%s", d->name);
+	if((b->fd = openat(devfd, d->name, flags|O_DIRECT|O_CLOEXEC)) < 0){
+		diag("Couldn't open %s (%s?)\n", d->name, strerror(errno));
+		return -1;
+	}
+	if(ioctl(b->fd, BLKSSZGET, &lbasize) || lbasize <= 0){
+		lbasize = d->logsec ? d->logsec : 512;
+	}
+	if(ioctl(b->fd, BLKGETSIZE64, &size) || size == 0){
+		size = d->size;
+	}
+	// O_DIRECT wants block-aligned memory; page alignment satisfies any block
+	// size up to the page size.
+	pgsize = sysconf(_SC_PAGESIZE);
+	b->lbasize = lbasize;
+	b->align = pgsize > lbasize ? (size_t)pgsize : (size_t)lbasize;
+	if(lbasize < 512 || (lbasize & (lbasize - 1)) || size % lbasize){
+		diag("Bad geometry on %s (%ju bytes, %dB blocks)\n", d->name, (uintmax_t)size, lbasize);
+		close(b->fd);
+		b->fd = -1;
+		return -1;
+	}
+	b->lbas = size / lbasize;
+	return 0;
+}
+
+int blockio_close(blockio *b){
+	int ret = 0;
+
+	if(b->writes){
+		verbf("%s: %ju blocks in %u write%s (%.1fus mean, %.1fus max), %.1fus flushing\n",
+			b->name, (uintmax_t)b->wblocks, b->writes, b->writes == 1 ? "" : "s",
+			b->wnsec / 1000.0 / b->writes, b->wmaxnsec / 1000.0, b->fnsec / 1000.0);
+	}
+	if(b->fd >= 0 && close(b->fd)){
+		diag("Error closing %s (%s?)\n", b->name, strerror(errno));
+		ret = -1;
+	}
+	b->fd = -1;
+	return ret;
+}
+
+void *blockio_alloc(const blockio *b, size_t n){
+	size_t len = n * b->lbasize;
+	void *buf;
+
+	if(n == 0 || len / n != b->lbasize){
+		diag("Invalid I/O of %zu blocks on %s\n", n, b->name);
+		return NULL;
+	}
+	if( (errno = posix_memalign(&buf, b->align, len)) ){
+		diag("Couldn't allocate %zub for %s (%s?)\n", len, b->name, strerror(errno));
+		return NULL;
+	}
+	memset(buf, 0, len);
+	return buf;
+}
+
+static int
+blockio_range_p(const blockio *b, uint64_t lba, size_t n){
+	if(n == 0 || lba >= b->lbas || n > b->lbas - lba){
+		diag("Invalid I/O (%zu blocks at %ju) on %ju-block %s\n", n,
+			(uintmax_t)lba, (uintmax_t)b->lbas, b->name);
+		return 0;
+	}
+	return 1;
+}
+
+int blockio_read(blockio *b, void *buf, uint64_t lba, size_t n){
+	const size_t len = n * b->lbasize;
+	ssize_t r;
+
+	if(!blockio_range_p(b, lba, n)){
+		return -1;
+	}
+	if((r = pread(b->fd, buf, len, lba * b->lbasize)) != (ssize_t)len){
+		if(r >= 0){
+			errno = EIO;
+		}
+		diag("Error reading %zu blocks at %ju from %s (%s?)\n", n,
+			(uintmax_t)lba, b->name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int blockio_write(blockio *b, const void *buf, uint64_t lba, size_t n){
+	const size_t len = n * b->lbasize;
+	uint64_t start, nsec;
+	ssize_t r;
+
+	if(!blockio_range_p(b, lba, n)){
+		return -1;
+	}
+	start = aioq_nsec();
+	r = pwrite(b->fd, buf, len, lba * b->lbasize);
+	nsec = aioq_nsec() - start;
+	if(r != (ssize_t)len){
+		if(r >= 0){
+			errno = EIO;
+		}
+		diag("Error writing %zu blocks at %ju to %s (%s?)\n", n,
+			(uintmax_t)lba, b->name, strerror(errno));
+		return -1;
+	}
+	++b->writes;
+	b->wblocks += n;
+	b->wnsec += nsec;
+	if(nsec > b->wmaxnsec){
+		b->wmaxnsec = nsec;
+	}
+	return 0;
+}
+
+int blockio_flush(blockio *b){
+	uint64_t start = aioq_nsec();
+
+	if(fdatasync(b->fd)){
+		diag("Error syncing %s (%s?)\n", b->name, strerror(errno));
+		return -1;
+	}
+	b->fnsec += aioq_nsec() - start;
+	return 0;
+}
+
+// Read n blocks at lba into buf, which is suitably aligned.
+static int
+blockcap_pread(const blockcap *c, int fd, void *buf, uint64_t lba, size_t n){
+	const size_t len = n * c->lbasize;
+	ssize_t r;
+
+	if((r = pread(fd, buf, len, lba * c->lbasize)) != (ssize_t)len){
+		if(r >= 0){
+			errno = EIO;
+		}
+		verbf("Error reading %zu blocks at %ju from %s (%s?)\n", n,
+			(uintmax_t)lba, c->name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int blockcap_read(blockcap *c, const device *d, int fd){
+	uint64_t size = 0, start;
+	int lbasize = 0, fl, ret;
+	size_t n, align;
+	long pgsize;
+
+	memset(c, 0, sizeof(*c));
+	c->name = d->name;
+	// A drive without media reports no size; that isn't worth a diagnostic.
+	if(ioctl(fd, BLKSSZGET, &lbasize) || ioctl(fd, BLKGETSIZE64, &size) || size == 0){
+		verbf("Couldn't get geometry of %s (%s?)\n", d->name, strerror(errno));
+		return -1;
+	}
+	if(lbasize < 512 || (lbasize & (lbasize - 1)) || size % lbasize){
+		diag("Bad geometry on %s (%ju bytes, %dB blocks)\n", d->name, (uintmax_t)size, lbasize);
+		return -1;
+	}
+	c->lbasize = lbasize;
+	c->lbas = size / lbasize;
+	if((n = BLOCKCAP_BYTES / lbasize) == 0){
+		n = 1;
+	}
+	if(c->lbas <= n * 2){
+		c->headlbas = c->lbas;
+	}else{
+		c->headlbas = n;
+		c->taillbas = n;
+	}
+	pgsize = sysconf(_SC_PAGESIZE);
+	align = pgsize > lbasize ? (size_t)pgsize : (size_t)lbasize;
+	if( (errno = posix_memalign((void **)&c->head, align, (c->headlbas + c->taillbas) * lbasize)) ){
+		diag("Couldn't allocate capture for %s (%s?)\n", d->name, strerror(errno));
+		c->head = NULL;
+		return -1;
+	}
+	c->tail = c->head + c->headlbas * lbasize;
+	// Some devices refuse O_DIRECT; the buffer is aligned either way.
+	if((fl = fcntl(fd, F_GETFL)) < 0 || fcntl(fd, F_SETFL, fl | O_DIRECT)){
+		verbf("Couldn't use direct I/O on %s (%s?)\n", d->name, strerror(errno));
+	}
+	start = aioq_nsec();
+	ret = blockcap_pread(c, fd, c->head, 0, c->headlbas);
+	if(ret == 0 && c->taillbas){
+		ret = blockcap_pread(c, fd, c->tail, c->lbas - c->taillbas, c->taillbas);
+	}
+	if(fl >= 0 && fcntl(fd, F_SETFL, fl)){
+		diag("Couldn't restore flags on %s (%s?)\n", d->name, strerror(errno));
+		ret = -1;
+	}
+	if(ret){
+		blockcap_free(c);
+		return -1;
+	}
+	verbf("\tCaptured %zu+%zu blocks in %.1fus\n", c->headlbas, c->taillbas,
+		(aioq_nsec() - start) / 1000.0);
+	return 0;
+}
+
+void blockcap_free(blockcap *c){
+	free(c->head);
+	c->head = c->tail = NULL;
+	c->headlbas = c->taillbas = 0;
+}
+
+const void *blockcap_lba(const blockcap *c, uint64_t lba, size_t n){
+	uint64_t tailstart;
+
+	if(c->head == NULL || n == 0 || lba >= c->lbas || n > c->lbas - lba){
+		return NULL;
+	}
+	if(lba + n <= c->headlbas){
+		return c->head + lba * c->lbasize;
+	}
+	tailstart = c->lbas - c->taillbas;
+	if(c->taillbas && lba >= tailstart){
+		return c->tail + (lba - tailstart) * c->lbasize;
+	}
+	return NULL;
+}
@@ -0,0 +1,81 @@
+// copyright 2012–2021 nick black
+#ifndef GROWLIGHT_BLOCKIO
+#define GROWLIGHT_BLOCKIO
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct device;
+
+// Sector-granular access to a whole disk's partition tables. The device is
+// opened O_DIRECT, and all transfers are whole logical blocks to and from
+// buffers from blockio_alloc(), so that the page cache can't hold a stale (or
+// torn) copy of a table behind the kernel's back. Writes are durable only
+// once blockio_flush() succeeds. Latencies of writes and flushes are
+// accumulated, and reported via verbf() by blockio_close(). Nothing refers
+// back to the device once it's open, so the blockio can be used without the
+// growlight lock.
+typedef struct blockio {
+	int fd;
+	char name[NAME_MAX + 1];	// device name, for diagnostics
+	unsigned lbasize;	// logical block size in bytes
+	uint64_t lbas;		// device size in logical blocks
+	size_t align;		// buffer alignment
+	unsigned writes;	// pwrite(2)s issued
+	uint64_t wblocks;	// blocks written
+	uint64_t wnsec;		// total time spent in pwrite(2)
+	uint64_t wmaxnsec;	// slowest single pwrite(2)
+	uint64_t fnsec;		// total time spent in fdatasync(2)
+} blockio;
+
+// Open a whole disk with O_DIRECT and the access mode in flags (O_RDONLY or
+// O_RDWR). The logical block size is taken from the kernel, falling back to
+// the device's sysfs value.
+int blockio_open(blockio *, const struct device *, int);
+int blockio_close(blockio *);
+
+// A zeroed buffer suitable for transferring n blocks. Release with free().
+void *blockio_alloc(const blockio *, size_t);
+
+// Transfer n blocks starting at lba. Short transfers are errors.
+int blockio_read(blockio *, void *, uint64_t, size_t);
+int blockio_write(blockio *, const void *, uint64_t, size_t);
+
+// fdatasync(2) the device.
+int blockio_flush(blockio *);
+
+// The first and last BLOCKCAP_BYTES of a whole disk (the whole disk, if it's
+// no larger than both), read once during discovery through a descriptor the
+// caller already holds. The MBR hash and partition table parsers consume
+// these blocks, rather than each opening and reading the disk anew.
+#define BLOCKCAP_BYTES 65536
+
+typedef struct blockcap {
+	const char *name;	// device name, for diagnostics
+	unsigned lbasize;	// logical block size in bytes
+	uint64_t lbas;		// device size in logical blocks
+	size_t headlbas;	// blocks captured from LBA 0
+	size_t taillbas;	// blocks captured ending at the last LBA
+	unsigned char *head;
+	unsigned char *tail;	// within head's allocation
+} blockcap;
+
+// Capture the head and tail of a whole disk using fd, which is switched to
+// O_DIRECT for the duration, and then restored. On failure, the capture is
+// left empty, and blockcap_lba() will return NULL.
+int blockcap_read(blockcap *, const struct device *, int);
+void blockcap_free(blockcap *);
+
+// The n blocks starting at lba, or NULL if they weren't captured.
+const void *blockcap_lba(const blockcap *, uint64_t, size_t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
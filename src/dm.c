@@ -1,107 +1,236 @@
 // copyright 2012–2021 nick black
 #include <errno.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <libdevmapper.h>
 
 #include "dm.h"
+#include "dmstats.h"
 #include "sysfs.h"
 #include "growlight.h"
 
-int explore_dm_sysfs(device *d,int dirfd){
-	/*unsigned long rd;
-	mdslave **enqm;*/
+#define SYSDEVBLOCK "/sys/dev/block/"
 
-	d->dmdev.disks = 1;
-	if((d->model = strdup("Linux devmapper")) == NULL){
+// Resolve a table's "major:minor" to the kernel's name for the device.
+static char *
+dm_devname(const char *majmin){
+	char path[PATH_MAX],lbuf[PATH_MAX],*base;
+	int r;
+
+	if(snprintf(path,sizeof(path),SYSDEVBLOCK "%s",majmin) >= (int)sizeof(path)){
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	if((r = readlink(path,lbuf,sizeof(lbuf))) < 0 || r >= (int)sizeof(lbuf)){
+		return NULL;
+	}
+	lbuf[r] = '\0';
+	if( (base = strrchr(lbuf,'/')) ){
+		++base;
+	}else{
+		base = lbuf;
+	}
+	return strdup(base);
+}
+
+static transport_e
+dm_transport(transport_e cur,const device *subd){
+	transport_e t;
+
+	switch(subd->layout){
+		case LAYOUT_NONE:
+			t = subd->blkdev.transport;
+			break;
+		case LAYOUT_MDADM:
+			t = subd->mddev.transport;
+			break;
+		case LAYOUT_DM:
+			t = subd->dmdev.transport;
+			break;
+		case LAYOUT_PARTITION:
+			t = subd->partdev.parent->blkdev.transport;
+			break;
+		case LAYOUT_ZPOOL:
+			t = subd->zpool.transport;
+			break;
+		default:
+			diag("Unknown layout %d on %s\n",subd->layout,subd->name);
+			return cur;
+	}
+	if(cur == AGGREGATE_UNKNOWN){
+		return t;
+	}
+	return cur == t ? cur : AGGREGATE_MIXED;
+}
+
+static int
+dm_add_slave(device *d,const char *name){
+	mdslave **enqm,*m;
+	device *subd;
+
+	for(enqm = &d->dmdev.slaves ; *enqm ; enqm = &(*enqm)->next){
+		if(strcmp((*enqm)->name,name) == 0){
+			return 0; // striped and multipath targets repeat devices
+		}
+	}
+	if((m = malloc(sizeof(*m))) == NULL){
 		return -1;
 	}
-	if((d->dmdev.uuid = get_sysfs_string(dirfd,"uuid")) == NULL){
-		verbf("Warning: no 'uuid' content in dm device %s\n",d->name);
+	if((m->name = strdup(name)) == NULL){
+		free(m);
+		return -1;
 	}
-	if((d->dmdev.dmname = get_sysfs_string(dirfd,"name")) == NULL){
-		verbf("Warning: no 'name' content in dm device %s\n",d->name);
+	m->next = NULL;
+	*enqm = m;
+	++d->dmdev.disks;
+	lock_growlight();
+	if( (subd = lookup_device(name)) ){
+		d->dmdev.transport = dm_transport(d->dmdev.transport,subd);
+	}else{
+		diag("Couldn't look up %s component %s\n",d->name,name);
 	}
-	d->dmdev.transport = AGGREGATE_UNKNOWN;
-	// FIXME need to browse slaves/ subdirectory in sysfs entry
-	/*enqm = &d->dmdev.slaves;
-	for(rd = 0 ; rd < d->dmdev.disks ; ++rd){
-		char buf[NAME_MAX],lbuf[NAME_MAX],*c;
-		device *subd;
-		mdslave *m;
-		int r;
-
-		if(snprintf(buf,sizeof(buf),"rd%lu",rd) >= (int)sizeof(buf)){
-			diag("Couldn't look up raid device %lu\n",rd);
-			errno = ENAMETOOLONG;
-			return -1;
+	unlock_growlight();
+	return 0;
+}
+
+// Is word among the space-separated words of list?
+static int
+listed(const char *list,const char *word){
+	size_t len = strlen(word);
+	const char *s;
+
+	for(s = list ; (s = strstr(s,word)) ; s += len){
+		if((s == list || s[-1] == ' ') && (s[len] == ' ' || s[len] == '\0')){
+			return 1;
 		}
-		r = readlinkat(dirfd,buf,lbuf,sizeof(lbuf));
-		if((r < 0 && errno != ENOENT) || r >= (int)sizeof(lbuf)){
-			int e = errno;
+	}
+	return 0;
+}
 
-			diag("Couldn't look up slave %s (%s?)\n",buf,strerror(errno));
-			errno = e;
-			return -1;
-		}else if(r < 0 && errno == ENOENT){
-			// missing/faulted device -- represent somehow?
+// Every target type (linear, striped, crypt, thin, thin-pool, cache,
+// multipath, raid...) names the devices it maps in its table as
+// "major:minor", and nothing else in a table takes that form.
+static int
+dm_add_target(device *d,dmtarget ***enqt,uint64_t start,uint64_t length,
+			const char *type,const char *params){
+	char devs[BUFSIZ] = "";
+	size_t pos = 0;
+	dmtarget *dt;
+	char tok[32];
+	int n;
+
+	while(sscanf(params," %31s%n",tok,&n) == 1){
+		unsigned maj,min;
+		char *name,c;
+
+		params += n;
+		if(!isdigit((unsigned char)tok[0]) ||
+				sscanf(tok,"%u:%u%c",&maj,&min,&c) != 2){
 			continue;
 		}
-		lbuf[r] = '\0';
-		if(strncmp(lbuf,"dev-",4)){
-			diag("Couldn't get device from %s\n",lbuf);
-			return -1;
+		if((name = dm_devname(tok)) == NULL){
+			diag("Couldn't resolve %s in %s table\n",tok,d->name);
+			continue;
 		}
-		if((c = strdup(lbuf + 4)) == NULL){
+		if(dm_add_slave(d,name)){
+			free(name);
 			return -1;
 		}
-		if((m = malloc(sizeof(*m))) == NULL){
-			free(c);
-			return -1;
+		if(!listed(devs,name)){
+			pos += snprintf(devs + pos,sizeof(devs) - pos,"%s%s",pos ? " " : "",name);
+			if(pos >= sizeof(devs)){
+				pos = sizeof(devs) - 1;
+			}
 		}
-		m->name = c;
-		m->next = NULL;
-		*enqm = m;
-		enqm = &m->next;
-		//m->component = subd;
-		lock_growlight();
-		if((subd = lookup_device(c)) == NULL){
-			unlock_growlight();
-			return -1;
+		free(name);
+	}
+	if((dt = malloc(sizeof(*dt))) == NULL){
+		return -1;
+	}
+	dt->start = start;
+	dt->length = length;
+	dt->next = NULL;
+	if((dt->type = strdup(type)) == NULL){
+		free(dt);
+		return -1;
+	}
+	if((dt->devs = strdup(devs)) == NULL){
+		free(dt->type);
+		free(dt);
+		return -1;
+	}
+	**enqt = dt;
+	*enqt = &dt->next;
+	return 0;
+}
+
+// Read the device's table through libdevmapper.
+static int
+explore_dm_table(device *d){
+	uint64_t start,length;
+	char *type,*params;
+	dmtarget **enqt;
+	struct dm_task *dmt;
+	void *next = NULL;
+	int r = 0;
+
+	if((dmt = dm_task_create(DM_DEVICE_TABLE)) == NULL){
+		diag("Couldn't create dm task for %s\n",d->name);
+		return -1;
+	}
+	if(!dm_task_set_name(dmt,d->dmdev.dmname) || !dm_task_run(dmt)){
+		diag("Couldn't read dm table for %s\n",d->name);
+		dm_task_destroy(dmt);
+		return -1;
+	}
+	enqt = &d->dmdev.targets;
+	do{
+		next = dm_get_next_target(dmt,next,&start,&length,&type,&params);
+		if(type == NULL){ // device has no table loaded
+			break;
+		}
+		if(dm_add_target(d,&enqt,start,length,type,params ? params : "")){
+			r = -1;
+			break;
+		}
+	}while(next);
+	dm_task_destroy(dmt);
+	return r;
+}
+
+int explore_dm_sysfs(device *d,int dirfd){
+	const dmtarget *dt;
+
+	d->dmdev.transport = AGGREGATE_UNKNOWN;
+	d->dmdev.disks = 0;
+	if((d->model = strdup("Linux devmapper")) == NULL){
+		return -1;
+	}
+	if((d->dmdev.uuid = get_sysfs_string(dirfd,"uuid")) == NULL){
+		verbf("Warning: no 'uuid' content in dm device %s\n",d->name);
+	}
+	if((d->dmdev.dmname = get_sysfs_string(dirfd,"name")) == NULL){
+		verbf("Warning: no 'name' content in dm device %s\n",d->name);
+		return 0;
+	}
+	dmstats_reattach(d);
+	if(explore_dm_table(d)){
+		return 0; // still usable as a block device
+	}
+	// The level is the type of every target, or "mixed"
+	for(dt = d->dmdev.targets ; dt ; dt = dt->next){
+		if(strcmp(dt->type,d->dmdev.targets->type)){
+			break;
 		}
-		switch(subd->layout){
-			case LAYOUT_NONE:
-				if(d->dmdev.transport == AGGREGATE_UNKNOWN){
-					d->dmdev.transport = subd->blkdev.transport;
-				}else if(d->dmdev.transport != subd->blkdev.transport){
-					d->dmdev.transport = AGGREGATE_MIXED;
-				}
-				break;
-			case LAYOUT_MDADM:
-				if(d->dmdev.transport == AGGREGATE_UNKNOWN){
-					d->dmdev.transport = subd->dmdev.transport;
-				}else if(d->dmdev.transport != subd->dmdev.transport){
-					d->dmdev.transport = AGGREGATE_MIXED;
-				}
-				break;
-			case LAYOUT_PARTITION:
-				if(d->dmdev.transport == AGGREGATE_UNKNOWN){
-					d->dmdev.transport = subd->partdev.parent->blkdev.transport;
-				}else if(d->dmdev.transport != subd->partdev.parent->blkdev.transport){
-					d->dmdev.transport = AGGREGATE_MIXED;
-				}
-				break;
-			case LAYOUT_ZPOOL:
-				if(d->dmdev.transport == AGGREGATE_UNKNOWN){
-					d->dmdev.transport = subd->zpool.transport;
-				}else if(d->dmdev.transport != subd->zpool.transport){
-					d->dmdev.transport = AGGREGATE_MIXED;
-				}
-				break;
-			default:
-				diag("Unknown layout %d on %s\n",subd->layout,subd->name);
-				break;
+	}
+	if(d->dmdev.targets){
+		if((d->dmdev.level = strdup(dt ? "mixed" : d->dmdev.targets->type)) == NULL){
+			return -1;
 		}
-		unlock_growlight();
-	}*/
+	}
 	return 0;
 }
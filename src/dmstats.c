@@ -0,0 +1,337 @@
+// copyright 2012–2021 nick black
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libdevmapper.h>
+
+#include "dmstats.h"
+#include "growlight.h"
+
+// Monitors of devices being rescanned, awaiting rediscovery
+static dmstatmon *detached;
+
+static void
+dmstatmon_free(dmstatmon *m){
+	unsigned z;
+
+	if(m == NULL){
+		return;
+	}
+	for(z = 0 ; z < m->nareas ; ++z){
+		free(m->areas[z].bins);
+		free(m->areas[z].lastbins);
+	}
+	free(m->areas);
+	free(m->bounds);
+	free(m->dmname);
+	free(m->dmuuid);
+	if(m->dms){
+		dm_stats_destroy(m->dms);
+	}
+	free(m);
+}
+
+// Delete the region and free the monitor. Deletion fails if the region went
+// away with its device, in which case there's nothing left to leak.
+static int
+dmstatmon_delete(dmstatmon *m){
+	int r = dm_stats_delete_region(m->dms, m->region) ? 0 : -1;
+
+	dmstatmon_free(m);
+	return r;
+}
+
+// Learn the areas' extents and the histogram's bins from the first read.
+static int
+dmstatmon_layout(dmstatmon *m){
+	struct dm_histogram *h;
+	unsigned z;
+	int b;
+
+	for(z = 0 ; z < m->nareas ; ++z){
+		dmstatarea *a = &m->areas[z];
+
+		if(!dm_stats_get_area_start(m->dms, &a->start, m->region, z) ||
+				!dm_stats_get_area_len(m->dms, &a->len, m->region, z)){
+			return -1;
+		}
+	}
+	if((h = dm_stats_get_histogram(m->dms, m->region, 0)) == NULL){
+		return 0; // no histogram support
+	}
+	if((b = dm_histogram_get_nr_bins(h)) <= 0){
+		return 0;
+	}
+	if((m->bounds = malloc(sizeof(*m->bounds) * b)) == NULL){
+		return -1;
+	}
+	for(z = 0 ; z < (unsigned)b ; ++z){
+		m->bounds[z] = dm_histogram_get_bin_lower(h, z);
+	}
+	for(z = 0 ; z < m->nareas ; ++z){
+		if((m->areas[z].bins = calloc(b, sizeof(*m->areas[z].bins))) == NULL ||
+				(m->areas[z].lastbins = calloc(b, sizeof(*m->areas[z].lastbins))) == NULL){
+			return -1;
+		}
+	}
+	m->nbins = b;
+	return 0;
+}
+
+void dmstats_area_update(dmstatarea *a, unsigned nbins, uint64_t rsectors,
+			uint64_t wsectors, uint64_t ios, const uint64_t *bins){
+	unsigned b;
+
+	a->rsectors = rsectors - a->lastr;
+	a->wsectors = wsectors - a->lastw;
+	a->ios = ios - a->lastios;
+	a->lastr = rsectors;
+	a->lastw = wsectors;
+	a->lastios = ios;
+	for(b = 0 ; b < nbins ; ++b){
+		a->bins[b] = bins[b] - a->lastbins[b];
+		a->lastbins[b] = bins[b];
+	}
+}
+
+unsigned dmstats_sum_areas(const dmstatmon *m, unsigned first, unsigned n, dmstatarea *sum){
+	unsigned z, b;
+
+	sum->start = sum->len = 0;
+	sum->rsectors = sum->wsectors = sum->ios = 0;
+	for(b = 0 ; b < m->nbins ; ++b){
+		sum->bins[b] = 0;
+	}
+	if(first >= m->nareas){
+		return 0;
+	}
+	if(n > m->nareas - first){
+		n = m->nareas - first;
+	}
+	sum->start = m->areas[first].start;
+	for(z = first ; z < first + n ; ++z){
+		const dmstatarea *a = &m->areas[z];
+
+		sum->len += a->len;
+		sum->rsectors += a->rsectors;
+		sum->wsectors += a->wsectors;
+		sum->ios += a->ios;
+		for(b = 0 ; b < m->nbins ; ++b){
+			sum->bins[b] += a->bins[b];
+		}
+	}
+	return n;
+}
+
+// Counters are totals since the region was created; keep the changes.
+static int
+dmstatmon_read(dmstatmon *m){
+	struct timespec now;
+	unsigned z, b;
+
+	if(!dm_stats_populate(m->dms, DMSTATS_PROGRAM_ID, m->region)){
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(m->polls == 0 && dmstatmon_layout(m)){
+		return -1;
+	}
+	uint64_t counts[m->nbins ? m->nbins : 1];
+	for(z = 0 ; z < m->nareas ; ++z){
+		dmstatarea *a = &m->areas[z];
+		struct dm_histogram *h = NULL;
+		uint64_t r, w, ios;
+
+		r = dm_stats_get_counter(m->dms, DM_STATS_READ_SECTORS_COUNT, m->region, z);
+		w = dm_stats_get_counter(m->dms, DM_STATS_WRITE_SECTORS_COUNT, m->region, z);
+		ios = dm_stats_get_counter(m->dms, DM_STATS_READS_COUNT, m->region, z) +
+			dm_stats_get_counter(m->dms, DM_STATS_WRITES_COUNT, m->region, z);
+		if(m->nbins){
+			h = dm_stats_get_histogram(m->dms, m->region, z);
+		}
+		for(b = 0 ; b < m->nbins ; ++b){
+			// a missing histogram shows no change
+			counts[b] = h ? dm_histogram_get_bin_count(h, b) : a->lastbins[b];
+		}
+		dmstats_area_update(a, m->nbins, r, w, ios, counts);
+	}
+	if(m->polls++){
+		m->interval = (now.tv_sec - m->last.tv_sec) +
+			(now.tv_nsec - m->last.tv_nsec) / 1000000000.0;
+	}
+	m->last = now;
+	return 0;
+}
+
+int dmstats_start(device *d, unsigned areas, const char *bounds){
+	struct dm_histogram *h = NULL;
+	dmstatmon *m;
+	int precise;
+
+	if(d->layout != LAYOUT_DM || d->dmdev.dmname == NULL){
+		diag("%s is not a device-mapper device\n", d->name);
+		return -1;
+	}
+	if(areas == 0 || areas > DMSTATS_MAX_AREAS){
+		diag("Areas must be between 1 and %u\n", DMSTATS_MAX_AREAS);
+		return -1;
+	}
+	if(bounds && *bounds){
+		if(!dm_stats_driver_supports_histogram()){
+			diag("Kernel doesn't support dm-stats histograms\n");
+			return -1;
+		}
+		if((h = dm_histogram_bounds_from_string(bounds)) == NULL){
+			diag("Bad histogram bounds: %s\n", bounds);
+			return -1;
+		}
+	}
+	if((m = calloc(1, sizeof(*m))) == NULL ||
+			(m->areas = calloc(areas, sizeof(*m->areas))) == NULL ||
+			(m->dmname = strdup(d->dmdev.dmname)) == NULL ||
+			(d->dmdev.uuid && *d->dmdev.uuid &&
+			 (m->dmuuid = strdup(d->dmdev.uuid)) == NULL)){
+		diag("Couldn't allocate dm-stats monitor\n");
+		dm_histogram_bounds_destroy(h);
+		dmstatmon_free(m);
+		return -1;
+	}
+	m->nareas = areas;
+	// Sub-millisecond bounds need nanosecond timestamps
+	precise = h && (strstr(bounds, "us") || strstr(bounds, "ns")) &&
+		dm_stats_driver_supports_precise();
+	if((m->dms = dm_stats_create(DMSTATS_PROGRAM_ID)) == NULL ||
+			!dm_stats_bind_name(m->dms, d->dmdev.dmname) ||
+			!dm_stats_create_region(m->dms, &m->region, 0, 0, -(int64_t)areas,
+						precise, h, DMSTATS_PROGRAM_ID, NULL)){
+		diag("Couldn't create dm-stats region on %s\n", d->name);
+		dm_histogram_bounds_destroy(h);
+		m->nareas = 0;
+		dmstatmon_free(m);
+		return -1;
+	}
+	dm_histogram_bounds_destroy(h);
+	// A small device might be split into fewer areas than asked
+	if(dm_stats_list(m->dms, DMSTATS_PROGRAM_ID) &&
+			dm_stats_get_region_nr_areas(m->dms, m->region) < areas){
+		m->nareas = dm_stats_get_region_nr_areas(m->dms, m->region);
+	}
+	if(dmstatmon_read(m)){
+		diag("Couldn't read dm-stats region on %s\n", d->name);
+		dmstatmon_delete(m);
+		return -1;
+	}
+	dmstats_stop(d);
+	d->dmdev.stats = m;
+	return 0;
+}
+
+int dmstats_stop(device *d){
+	uint64_t region;
+	dmstatmon *m;
+
+	if(d->layout != LAYOUT_DM || (m = d->dmdev.stats) == NULL){
+		return 0;
+	}
+	d->dmdev.stats = NULL;
+	region = m->region;
+	if(dmstatmon_delete(m)){
+		diag("Couldn't delete dm-stats region %ju on %s\n", (uintmax_t)region, d->name);
+		return -1;
+	}
+	return 0;
+}
+
+void dmstats_detach(device *d){
+	dmstatmon *m;
+
+	if(d->layout != LAYOUT_DM || (m = d->dmdev.stats) == NULL){
+		return;
+	}
+	d->dmdev.stats = NULL;
+	m->next = detached;
+	detached = m;
+}
+
+static int
+dmstatmon_of(const dmstatmon *m, const device *d){
+	if(m->dmuuid){
+		return d->dmdev.uuid && strcmp(m->dmuuid, d->dmdev.uuid) == 0;
+	}
+	return d->dmdev.dmname && strcmp(m->dmname, d->dmdev.dmname) == 0;
+}
+
+void dmstats_reattach(device *d){
+	dmstatmon **m;
+
+	if(d->layout != LAYOUT_DM || d->dmdev.stats){
+		return;
+	}
+	for(m = &detached ; *m ; m = &(*m)->next){
+		if(dmstatmon_of(*m, d)){
+			d->dmdev.stats = *m;
+			*m = (*m)->next;
+			d->dmdev.stats->next = NULL;
+			return;
+		}
+	}
+}
+
+void dmstats_shutdown(void){
+	const controller *c;
+	dmstatmon *m;
+
+	for(c = get_controllers() ; c ; c = c->next){
+		device *d;
+
+		for(d = c->blockdevs ; d ; d = d->next){
+			dmstats_stop(d);
+		}
+	}
+	while( (m = detached) ){
+		detached = m->next;
+		dmstatmon_delete(m);
+	}
+}
+
+void dmstats_poll(void){
+	const glightui *gui = get_glightui();
+	const controller *c;
+	dmstatmon *m;
+
+	while( (m = detached) ){
+		detached = m->next;
+		diag("Stopped monitoring %s; it went away\n", m->dmname);
+		dmstatmon_delete(m);
+	}
+	for(c = get_controllers() ; c ; c = c->next){
+		device *d;
+
+		for(d = c->blockdevs ; d ; d = d->next){
+			if(d->layout != LAYOUT_DM || d->dmdev.stats == NULL){
+				continue;
+			}
+			if(dmstatmon_read(d->dmdev.stats)){
+				diag("Stopped monitoring %s; couldn't read its dm-stats region\n", d->name);
+				m = d->dmdev.stats;
+				d->dmdev.stats = NULL;
+				dmstatmon_delete(m);
+			}
+			if(gui){
+				d->uistate = gui->block_event(d, d->uistate);
+			}
+		}
+	}
+}
+
+void dmstats_ns_str(uint64_t ns, char *buf, size_t len){
+	static const char *units[] = { "ns", "us", "ms", "s", };
+	unsigned u = 0;
+
+	while(ns && ns % 1000 == 0 && u < sizeof(units) / sizeof(*units) - 1){
+		ns /= 1000;
+		++u;
+	}
+	snprintf(buf, len, "%ju%s", (uintmax_t)ns, units[u]);
+}
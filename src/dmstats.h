@@ -0,0 +1,92 @@
+// copyright 2012–2021 nick black
+#ifndef GROWLIGHT_DMSTATS
+#define GROWLIGHT_DMSTATS
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <time.h>
+#include <stdint.h>
+
+struct device;
+struct dm_stats;
+
+// A dm device can be monitored with a dm-stats region covering it, split
+// into areas of equal size, each with a histogram of I/O latencies. The
+// region's counters are read each second by the event thread, and the
+// changes since the previous read kept, so each area's throughput and the
+// spread of its latencies can be shown. Only monitored devices are read.
+#define DMSTATS_PROGRAM_ID "growlight"
+#define DMSTATS_MAX_AREAS 256
+#define DMSTATS_DEFAULT_AREAS 16
+#define DMSTATS_DEFAULT_BOUNDS "100us,1ms,10ms,100ms"
+
+typedef struct dmstatarea {
+	uint64_t start;			// first sector of the area
+	uint64_t len;			// sectors in the area
+	// Changes over the last interval
+	uint64_t rsectors, wsectors;	// sectors read and written
+	uint64_t ios;			// I/Os completed
+	uint64_t *bins;			// I/Os completed per latency bin
+	// Totals as of the last poll
+	uint64_t lastr, lastw, lastios;
+	uint64_t *lastbins;
+} dmstatarea;
+
+typedef struct dmstatmon {
+	struct dm_stats *dms;		// libdevmapper handle
+	uint64_t region;		// region ID from the kernel
+	char *dmname, *dmuuid;		// identify the device across rescans
+	struct dmstatmon *next;		// while detached (see dmstats_detach())
+	unsigned nareas;
+	unsigned nbins;			// 0 if the kernel lacks histograms
+	uint64_t *bounds;		// lower bound of each bin, in ns
+	unsigned polls;			// successful polls (deltas need 2)
+	struct timespec last;		// time of the last poll
+	double interval;		// seconds covered by the changes
+	dmstatarea *areas;
+} dmstatmon;
+
+// The remainder must be called with the growlight lock held.
+
+// Create a region over the entire dm device with the given number of areas
+// (at most DMSTATS_MAX_AREAS) and latency histogram bounds ("1ms,10ms",
+// units of ns, us, ms or s), replacing any existing monitor of the device.
+int dmstats_start(struct device *, unsigned, const char *);
+
+// Delete the device's region, if it has one, and free its monitor.
+int dmstats_stop(struct device *);
+
+// Read every monitored region, calling block_event for each device read. A
+// region which can't be read is deleted, and its monitor freed.
+void dmstats_poll(void);
+
+// A rescan frees and rediscovers the device. Its monitor is set aside when
+// it's reset, and given back when a device with the same dm uuid (or, absent
+// one, name) is discovered. Monitors still unclaimed at the next poll belong
+// to devices which went away, and are deleted.
+void dmstats_detach(struct device *);
+void dmstats_reattach(struct device *);
+
+// Delete every region we created, whether attached or not.
+void dmstats_shutdown(void);
+
+// Fold the counters read from one area into its changes since the last
+// read. bins holds nbins cumulative histogram counts.
+void dmstats_area_update(dmstatarea *, unsigned nbins, uint64_t rsectors,
+			uint64_t wsectors, uint64_t ios, const uint64_t *bins);
+
+// Sum the changes of n areas starting at the indexed one (for display of
+// several per row), clamped to the monitor's areas. The sum's bins must
+// have room for the monitor's nbins. Returns the number of areas summed.
+unsigned dmstats_sum_areas(const dmstatmon *, unsigned, unsigned, dmstatarea *);
+
+// Describe a latency in the largest unit dividing it evenly ("250us").
+void dmstats_ns_str(uint64_t, char *, size_t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,682 @@
+// copyright 2012–2021 nick black
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sg.h"
+#include "nvme.h"
+#include "sysfs.h"
+#include "drivefeat.h"
+#include "growlight.h"
+
+static const char *atafeature_names[ATAFEAT_COUNT] = {
+	"wcache",
+	"lookahead",
+	"apm",
+	"aam",
+	"standby",
+};
+
+const char *atafeature_str(atafeature f){
+	return f < ATAFEAT_COUNT ? atafeature_names[f] : NULL;
+}
+
+int atafeature_parse(const char *name, atafeature *f){
+	unsigned z;
+
+	for(z = 0 ; z < ATAFEAT_COUNT ; ++z){
+		if(strcmp(name, atafeature_names[z]) == 0){
+			*f = z;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int
+parse_level(const char *val, unsigned min, unsigned max, unsigned *level){
+	unsigned long l;
+	char *end;
+
+	errno = 0;
+	l = strtoul(val, &end, 0);
+	if(errno || end == val || *end || l < min || l > max){
+		return -1;
+	}
+	*level = l;
+	return 0;
+}
+
+int atafeature_resolve(atafeature f, const char *val, atasetting *as){
+	unsigned on = strcmp(val, "on") == 0 || strcmp(val, "1") == 0;
+	unsigned off = strcmp(val, "off") == 0 || strcmp(val, "0") == 0;
+	unsigned level;
+
+	memset(as, 0, sizeof(*as));
+	switch(f){
+		case ATAFEAT_WCACHE:
+			if(!on && !off){
+				break;
+			}
+			as->subcmd = on ? ATA_SF_WCACHE_ON : ATA_SF_WCACHE_OFF;
+			return 0;
+		case ATAFEAT_LOOKAHEAD:
+			if(!on && !off){
+				break;
+			}
+			as->subcmd = on ? ATA_SF_LOOKAHEAD_ON : ATA_SF_LOOKAHEAD_OFF;
+			return 0;
+		case ATAFEAT_APM:
+			// hdparm's convention of 255 for "disable" is kept
+			if(strcmp(val, "off") == 0 || strcmp(val, "255") == 0){
+				as->subcmd = ATA_SF_APM_OFF;
+				return 0;
+			}
+			if(parse_level(val, 1, 254, &level)){
+				break;
+			}
+			as->subcmd = ATA_SF_APM_ON;
+			as->count = level;
+			return 0;
+		case ATAFEAT_AAM:
+			if(strcmp(val, "off") == 0){
+				as->subcmd = ATA_SF_AAM_OFF;
+				return 0;
+			}
+			if(parse_level(val, 128, 254, &level)){
+				break;
+			}
+			as->subcmd = ATA_SF_AAM_ON;
+			as->count = level;
+			return 0;
+		case ATAFEAT_STANDBY:
+			// 1-240: units of 5s; 241-251: units of 30m; 252: 21m;
+			// 253: vendor-defined; 255: 21m15s
+			if(strcmp(val, "off") == 0){
+				level = 0;
+			}else if(parse_level(val, 0, 255, &level) || level == 254){
+				break;
+			}
+			as->standby = 1;
+			as->count = level;
+			return 0;
+		default:
+			break;
+	}
+	diag("Invalid value for %s: %s\n", atafeature_str(f), val);
+	return -1;
+}
+
+static int
+feature_supported(const atafeatures *af, atafeature f){
+	switch(f){
+		case ATAFEAT_WCACHE: return af->wcache_supported;
+		case ATAFEAT_LOOKAHEAD: return af->lookahead_supported;
+		case ATAFEAT_APM: return af->apm_supported;
+		case ATAFEAT_AAM: return af->aam_supported;
+		case ATAFEAT_STANDBY: return 1;
+		default: return 0;
+	}
+}
+
+int ata_set_feature(device **ds, unsigned n, atafeature f, const char *val){
+	const glightui *gui = get_glightui();
+	unsigned z, failed = 0;
+	int fds[n ? n : 1];
+	atasetting as;
+	int ret = -1;
+
+	if(f >= ATAFEAT_COUNT){
+		diag("Invalid ATA feature %d\n", f);
+		return -1;
+	}
+	if(atafeature_resolve(f, val, &as)){
+		return -1;
+	}
+	for(z = 0 ; z < n ; ++z){
+		fds[z] = -1;
+	}
+	for(z = 0 ; z < n ; ++z){
+		device *d = ds[z];
+		atafeatures af;
+
+		if(d->layout != LAYOUT_NONE || !d->blkdev.realdev || !d->blkdev.ataid){
+			diag("%s is not an ATA device\n", d->name);
+			goto done;
+		}
+		if((fds[z] = openat(devfd, d->name, O_RDONLY|O_NONBLOCK|O_CLOEXEC)) < 0){
+			diag("Couldn't open %s (%s?)\n", d->name, strerror(errno));
+			goto done;
+		}
+		if(sg_ata_features(fds[z], &af)){
+			diag("Couldn't identify %s (%s?)\n", d->name, strerror(errno));
+			goto done;
+		}
+		if(!feature_supported(&af, f)){
+			diag("%s doesn't support %s\n", d->name, atafeature_str(f));
+			goto done;
+		}
+	}
+	for(z = 0 ; z < n ; ++z){
+		device *d = ds[z];
+		int r;
+
+		if(as.standby){
+			r = sg_set_standby(fds[z], as.count);
+		}else{
+			r = sg_set_features(fds[z], as.subcmd, as.count);
+		}
+		if(r){
+			diag("Couldn't set %s to %s on %s (%s?)\n", atafeature_str(f),
+				val, d->name, strerror(errno));
+			++failed;
+			continue;
+		}
+		verbf("Set %s to %s on %s\n", atafeature_str(f), val, d->name);
+		if(sg_refresh_features(d, fds[z]) == 0 && gui){
+			d->uistate = gui->block_event(d, d->uistate);
+		}
+	}
+	ret = failed ? -1 : 0;
+
+done:
+	for(z = 0 ; z < n ; ++z){
+		if(fds[z] >= 0){
+			close(fds[z]);
+		}
+	}
+	return ret;
+}
+
+static const char *nvmefeature_names[NVMEFEAT_COUNT] = {
+	"apst",
+	"wcache",
+	"power",
+	"arbitration",
+	"coalesce",
+};
+
+const char *nvmefeature_str(nvmefeature f){
+	return f < NVMEFEAT_COUNT ? nvmefeature_names[f] : NULL;
+}
+
+static const char *nvmefeature_descs[NVMEFEAT_COUNT] = {
+	"autonomous power state transitions (on/off)",
+	"volatile write cache (on/off)",
+	"power state (0 is the highest-powered)",
+	"arbitration burst and low,medium,high weights",
+	"interrupt coalescing threshold and time (100us units, 0 disables)",
+};
+
+const char *nvmefeature_desc(nvmefeature f){
+	return f < NVMEFEAT_COUNT ? nvmefeature_descs[f] : NULL;
+}
+
+int nvmefeature_value(const nvmefeatures *nf, nvmefeature f, char *buf, size_t len){
+	int r;
+
+	switch(f){
+		case NVMEFEAT_APST:
+			if(!nf->apst_supported){
+				return -1;
+			}
+			r = snprintf(buf, len, "%s", nf->apst ? "on" : "off");
+			break;
+		case NVMEFEAT_WCACHE:
+			if(!nf->vwc_present){
+				return -1;
+			}
+			r = snprintf(buf, len, "%s", nf->vwc ? "on" : "off");
+			break;
+		case NVMEFEAT_POWER:
+			r = snprintf(buf, len, "%u", nf->power_state);
+			break;
+		case NVMEFEAT_ARBITRATION:
+			r = snprintf(buf, len, "%u,%u,%u,%u", nf->arb_burst, nf->arb_low + 1,
+					nf->arb_medium + 1, nf->arb_high + 1);
+			break;
+		case NVMEFEAT_COALESCE:
+			r = snprintf(buf, len, "%u,%u", nf->coalesce_threshold + 1,
+					nf->coalesce_time);
+			break;
+		default:
+			return -1;
+	}
+	return r < 0 || (size_t)r >= len ? -1 : 0;
+}
+
+int nvmefeature_parse(const char *name, nvmefeature *f){
+	unsigned z;
+
+	for(z = 0 ; z < NVMEFEAT_COUNT ; ++z){
+		if(strcmp(name, nvmefeature_names[z]) == 0){
+			*f = z;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// Parse n comma-separated levels, each within [min[i], max[i]].
+static int
+parse_levels(const char *val, unsigned n, const unsigned *min,
+		const unsigned *max, unsigned *levels){
+	const char *cur = val;
+	unsigned z;
+
+	for(z = 0 ; z < n ; ++z){
+		unsigned long l;
+		char *end;
+
+		errno = 0;
+		l = strtoul(cur, &end, 0);
+		if(errno || end == cur || l < min[z] || l > max[z]){
+			return -1;
+		}
+		if(*end != (z + 1 < n ? ',' : '\0')){
+			return -1;
+		}
+		levels[z] = l;
+		cur = end + 1;
+	}
+	return 0;
+}
+
+int nvmefeature_resolve(nvmefeature f, const char *val, unsigned *fid, uint32_t *cdw11){
+	unsigned on = strcmp(val, "on") == 0 || strcmp(val, "1") == 0;
+	unsigned off = strcmp(val, "off") == 0 || strcmp(val, "0") == 0;
+	unsigned levels[4];
+
+	switch(f){
+		case NVMEFEAT_APST:
+			if(!on && !off){
+				break;
+			}
+			*fid = NVME_FEAT_AUTO_PST;
+			*cdw11 = on;
+			return 0;
+		case NVMEFEAT_WCACHE:
+			if(!on && !off){
+				break;
+			}
+			*fid = NVME_FEAT_VOLATILE_WC;
+			*cdw11 = on;
+			return 0;
+		case NVMEFEAT_POWER:
+			if(parse_level(val, 0, 31, &levels[0])){
+				break;
+			}
+			*fid = NVME_FEAT_POWER_MGMT;
+			*cdw11 = levels[0];
+			return 0;
+		case NVMEFEAT_ARBITRATION:{
+			const unsigned min[4] = { 0, 1, 1, 1, };
+			const unsigned max[4] = { 7, 256, 256, 256, };
+
+			if(parse_levels(val, 4, min, max, levels)){
+				break;
+			}
+			// weights are 0's based
+			*fid = NVME_FEAT_ARBITRATION;
+			*cdw11 = levels[0] | ((levels[1] - 1) << 8) |
+				((levels[2] - 1) << 16) | ((uint32_t)(levels[3] - 1) << 24);
+			return 0;
+		}case NVMEFEAT_COALESCE:{
+			const unsigned min[2] = { 1, 0, };
+			const unsigned max[2] = { 256, 255, };
+
+			if(parse_levels(val, 2, min, max, levels)){
+				break;
+			}
+			*fid = NVME_FEAT_IRQ_COALESCE;
+			*cdw11 = (levels[0] - 1) | (levels[1] << 8);
+			return 0;
+		}default:
+			break;
+	}
+	diag("Invalid value for %s: %s\n", nvmefeature_str(f), val);
+	return -1;
+}
+
+static int
+nvme_feature_supported(const nvmefeatures *nf, nvmefeature f, uint32_t cdw11){
+	switch(f){
+		case NVMEFEAT_APST: return nf->apst_supported;
+		case NVMEFEAT_WCACHE: return nf->vwc_present;
+		case NVMEFEAT_POWER: return cdw11 <= nf->npss;
+		case NVMEFEAT_ARBITRATION: return 1;
+		case NVMEFEAT_COALESCE: return 1;
+		default: return 0;
+	}
+}
+
+static int
+is_nvme(const device *d){
+	return d->layout == LAYOUT_NONE && d->blkdev.realdev &&
+		d->blkdev.transport == DIRECT_NVME;
+}
+
+int nvme_device_features(const device *d, nvmefeatures *nf){
+	int fd, r;
+
+	if(!is_nvme(d)){
+		diag("%s is not an NVMe device\n", d->name);
+		return -1;
+	}
+	if((fd = openat(devfd, d->name, O_RDONLY|O_NONBLOCK|O_CLOEXEC)) < 0){
+		diag("Couldn't open %s (%s?)\n", d->name, strerror(errno));
+		return -1;
+	}
+	r = nvme_features(fd, nf);
+	close(fd);
+	if(r){
+		diag("Couldn't get features of %s (%s?)\n", d->name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int nvme_set_features(device **ds, unsigned n, nvmefeature f, const char *val){
+	const glightui *gui = get_glightui();
+	unsigned z, fid, failed = 0;
+	int fds[n ? n : 1];
+	uint32_t cdw11;
+	int ret = -1;
+
+	if(f >= NVMEFEAT_COUNT){
+		diag("Invalid NVMe feature %d\n", f);
+		return -1;
+	}
+	if(nvmefeature_resolve(f, val, &fid, &cdw11)){
+		return -1;
+	}
+	for(z = 0 ; z < n ; ++z){
+		fds[z] = -1;
+	}
+	for(z = 0 ; z < n ; ++z){
+		device *d = ds[z];
+		nvmefeatures nf;
+
+		if(!is_nvme(d)){
+			diag("%s is not an NVMe device\n", d->name);
+			goto done;
+		}
+		if((fds[z] = openat(devfd, d->name, O_RDONLY|O_NONBLOCK|O_CLOEXEC)) < 0){
+			diag("Couldn't open %s (%s?)\n", d->name, strerror(errno));
+			goto done;
+		}
+		if(nvme_features(fds[z], &nf)){
+			diag("Couldn't get features of %s (%s?)\n", d->name, strerror(errno));
+			goto done;
+		}
+		if(!nvme_feature_supported(&nf, f, cdw11)){
+			diag("%s doesn't support %s %s\n", d->name, nvmefeature_str(f), val);
+			goto done;
+		}
+	}
+	for(z = 0 ; z < n ; ++z){
+		device *d = ds[z];
+
+		if(nvme_set_feature(fds[z], fid, cdw11)){
+			diag("Couldn't set %s to %s on %s (%s?)\n", nvmefeature_str(f),
+				val, d->name, strerror(errno));
+			++failed;
+			continue;
+		}
+		verbf("Set %s to %s on %s\n", nvmefeature_str(f), val, d->name);
+		if(nvme_refresh_features(d, fds[z]) == 0 && gui){
+			d->uistate = gui->block_event(d, d->uistate);
+		}
+	}
+	ret = failed ? -1 : 0;
+
+done:
+	for(z = 0 ; z < n ; ++z){
+		if(fds[z] >= 0){
+			close(fds[z]);
+		}
+	}
+	return ret;
+}
+
+// Apply the latency preset to one controller via its namespace d, appending
+// what changed to buf. Returns the number of changes, or -1 if any failed.
+static int
+nvme_latency_device(device *d, int fd, char *buf, size_t len){
+	unsigned changes = 0, failed = 0;
+	size_t off = 0;
+	nvmefeatures nf;
+	struct {
+		unsigned want;
+		unsigned fid;
+		uint32_t cdw11;
+		const char *desc;
+	} steps[] = {
+		{ 0, NVME_FEAT_AUTO_PST, 0, "apst off", },
+		{ 0, NVME_FEAT_POWER_MGMT, 0, NULL, },
+		{ 0, NVME_FEAT_IRQ_COALESCE, 0, "coalescing off", },
+		{ 0, NVME_FEAT_VOLATILE_WC, 1, "wcache on", },
+	};
+	char psdesc[32];
+	unsigned z;
+
+	if(nvme_features(fd, &nf)){
+		diag("Couldn't get features of %s (%s?)\n", d->name, strerror(errno));
+		return -1;
+	}
+	steps[0].want = nf.apst_supported && nf.apst;
+	if( (steps[1].want = nf.power_state != 0) ){
+		snprintf(psdesc, sizeof(psdesc), "power state %u->0", nf.power_state);
+		steps[1].desc = psdesc;
+	}
+	steps[2].want = nf.coalesce_time != 0;
+	steps[3].want = nf.vwc_present && !nf.vwc;
+	for(z = 0 ; z < sizeof(steps) / sizeof(*steps) ; ++z){
+		if(!steps[z].want){
+			continue;
+		}
+		if(nvme_set_feature(fd, steps[z].fid, steps[z].cdw11)){
+			diag("Couldn't set %s on %s (%s?)\n", steps[z].desc, d->name, strerror(errno));
+			++failed;
+			continue;
+		}
+		if(off < len){
+			off += snprintf(buf + off, len - off, "%s%s", changes ? ", " : "", steps[z].desc);
+		}
+		++changes;
+	}
+	return failed ? -1 : (int)changes;
+}
+
+// These features belong to the controller, so they're set once per
+// controller, through whichever of its namespaces comes first. Every
+// namespace's cached features are refreshed.
+int nvme_latency_preset(void){
+	const glightui *gui = get_glightui();
+	unsigned changed = 0, failed = 0, nctrls = 0, z;
+	const controller *c;
+	device *d;
+
+	for(c = get_controllers() ; c ; c = c->next){
+		for(d = c->blockdevs ; d ; d = d->next){
+			nctrls += is_nvme(d) && !d->blkdev.unloaded;
+		}
+	}
+	char ctrls[nctrls ? nctrls : 1][NAME_MAX + 1];
+	nctrls = 0;
+	for(c = get_controllers() ; c ; c = c->next){
+		for(d = c->blockdevs ; d ; d = d->next){
+			char buf[BUFSIZ], ctrl[NAME_MAX + 1];
+			int fd, r;
+
+			if(!is_nvme(d) || d->blkdev.unloaded){
+				continue;
+			}
+			// without sysfs's link, treat the namespace as its own controller
+			if(nvme_controller_name(d->name, ctrl, sizeof(ctrl))){
+				snprintf(ctrl, sizeof(ctrl), "%s", d->name);
+			}
+			if((fd = openat(devfd, d->name, O_RDONLY|O_NONBLOCK|O_CLOEXEC)) < 0){
+				diag("Couldn't open %s (%s?)\n", d->name, strerror(errno));
+				++failed;
+				continue;
+			}
+			for(z = 0 ; z < nctrls ; ++z){
+				if(strcmp(ctrls[z], ctrl) == 0){
+					break;
+				}
+			}
+			if(z == nctrls){
+				strcpy(ctrls[nctrls++], ctrl);
+				if((r = nvme_latency_device(d, fd, buf, sizeof(buf))) < 0){
+					++failed;
+				}else if(r){
+					diag("%s: favoring latency (%s)\n", ctrl, buf);
+					++changed;
+				}
+			}
+			if(nvme_refresh_features(d, fd) == 0 && gui){
+				d->uistate = gui->block_event(d, d->uistate);
+			}
+			close(fd);
+		}
+	}
+	if(!failed && !changed){
+		diag("No NVMe controller needed changes\n");
+	}
+	return failed ? -1 : (int)changed;
+}
+
+int nvme_device_lbafs(const device *d, nvmelbafs *lf){
+	int fd, r;
+
+	if(!is_nvme(d)){
+		diag("%s is not an NVMe device\n", d->name);
+		return -1;
+	}
+	if((fd = openat(devfd, d->name, O_RDONLY|O_NONBLOCK|O_CLOEXEC)) < 0){
+		diag("Couldn't open %s (%s?)\n", d->name, strerror(errno));
+		return -1;
+	}
+	r = nvme_lba_formats(fd, lf);
+	close(fd);
+	if(r){
+		diag("Couldn't identify namespace %s (%s?)\n", d->name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+// The kernel revalidates the namespace after a format, but needn't have done
+// so by the time the command returns. Wait a while for the new sector size.
+#define LBAF_SETTLE_MS 5000
+
+static void
+await_logsec(const char *name, unsigned lbads){
+	const struct timespec ts = { .tv_sec = 0, .tv_nsec = 100000000, };
+	char path[NAME_MAX + 32];
+	unsigned waited;
+
+	snprintf(path, sizeof(path), "%s/queue/logical_block_size", name);
+	for(waited = 0 ; waited < LBAF_SETTLE_MS ; waited += 100){
+		unsigned long ul;
+
+		if(get_sysfs_uint(sysfd, path, &ul) == 0 && ul == lbads){
+			return;
+		}
+		nanosleep(&ts, NULL);
+	}
+	verbf("%s didn't report %uB sectors after %ums\n", name, lbads, LBAF_SETTLE_MS);
+}
+
+int nvme_reformat(const char *dev, int lbaf){
+	char name[NAME_MAX + 1], path[NAME_MAX + 32];
+	nvmeerasecaps caps;
+	const device *d;
+	nvmeclaim claim;
+	nvmelbafs lf;
+	unsigned z;
+	int fd, r;
+
+	lock_growlight();
+	if((d = find_device(dev)) == NULL){
+		diag("Couldn't find device %s\n", dev);
+		unlock_growlight();
+		return -1;
+	}
+	if(!is_nvme(d)){
+		diag("%s is not an NVMe device\n", d->name);
+		unlock_growlight();
+		return -1;
+	}
+	snprintf(name, sizeof(name), "%s", d->name);
+	unlock_growlight();
+	// O_EXCL refuses devices which are mounted or otherwise claimed
+	if((fd = openat(devfd, name, O_RDWR|O_EXCL|O_CLOEXEC)) < 0){
+		diag("Couldn't open %s exclusively (%s?)\n", name, strerror(errno));
+		return -1;
+	}
+	if(nvme_lba_formats(fd, &lf)){
+		diag("Couldn't identify namespace %s (%s?)\n", name, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if(lbaf < 0 && (lbaf = nvme_best_lbaf(&lf, sysconf(_SC_PAGESIZE))) < 0){
+		diag("%s has no usable LBA format without metadata\n", name);
+		close(fd);
+		return -1;
+	}
+	if((unsigned)lbaf >= lf.count || lf.lbaf[lbaf].lbads == 0){
+		diag("%s has no LBA format %d\n", name, lbaf);
+		close(fd);
+		return -1;
+	}
+	if(lf.lbaf[lbaf].ms){
+		diag("LBA format %d of %s carries metadata, which isn't supported\n", lbaf, name);
+		close(fd);
+		return -1;
+	}
+	if(nvme_erase_caps(fd, &caps)){
+		diag("Couldn't identify NVMe controller of %s (%s?)\n", name, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	// With FNA bit 0 set, formatting any namespace formats them all
+	memset(&claim, 0, sizeof(claim));
+	if(caps.format_all){
+		if(nvme_claim_namespaces(name, NULL, 0, &claim)){
+			diag("Not formatting %s; its controller formats all namespaces together\n", name);
+			close(fd);
+			return -1;
+		}
+		for(z = 0 ; z < claim.n ; ++z){
+			diag("Formatting %s will also format %s\n", name, claim.names[z]);
+		}
+	}
+	diag("Formatting %s to LBA format %d (%uB)\n", name, lbaf, lf.lbaf[lbaf].lbads);
+	if( (r = nvme_format_lbaf(fd, lbaf)) ){
+		diag("Couldn't format %s (%s?)\n", name, strerror(errno));
+	}
+	nvme_release_namespaces(&claim);
+	close(fd);
+	if(r == 0){
+		await_logsec(name, lf.lbaf[lbaf].lbads);
+	}
+	// Even a failed format might have changed the namespace. The
+	// controller's scan also picks up the new capacity.
+	snprintf(path, sizeof(path), "%s/device/rescan_controller", name);
+	writeat_sysfs(sysfd, path, "1\n");
+	rescan_device(name);
+	for(z = 0 ; z < claim.n ; ++z){
+		rescan_device(claim.names[z]);
+	}
+	if(r == 0){
+		diag("Formatted %s to %uB sectors\n", name, lf.lbaf[lbaf].lbads);
+	}
+	return r;
+}
@@ -0,0 +1,103 @@
+// copyright 2012–2021 nick black
+#ifndef GROWLIGHT_DRIVEFEAT
+#define GROWLIGHT_DRIVEFEAT
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct device;
+struct nvmefeatures;
+
+// Drive features set via ATA SET FEATURES (and, for the standby timer, IDLE).
+// These settings are lost when the drive is power cycled.
+typedef enum {
+	ATAFEAT_WCACHE,		// volatile write cache: "on" or "off"
+	ATAFEAT_LOOKAHEAD,	// read look-ahead: "on" or "off"
+	ATAFEAT_APM,		// Advanced Power Management: 1-254 or "off"
+	ATAFEAT_AAM,		// Automatic Acoustic Management: 128-254 or "off"
+	ATAFEAT_STANDBY,	// standby timer: 0 (disabled)-255 or "off"
+	ATAFEAT_COUNT
+} atafeature;
+
+const char *atafeature_str(atafeature);
+// Returns -1 if the name isn't an ATA feature.
+int atafeature_parse(const char *, atafeature *);
+
+// Set the feature on each of n ATA devices. Every device is checked for
+// support before any is changed; thereafter, each device is set in turn, and
+// failures are reported without stopping the others. Returns -1 if any device
+// couldn't be set. Call with the growlight lock held.
+int ata_set_feature(struct device **, unsigned, atafeature, const char *);
+
+// A request resolved to the command implementing it, exposed for testing.
+// Returns -1 (having diagnosed it) if the value is invalid for the feature.
+typedef struct atasetting {
+	unsigned standby;	// IDLE rather than SET FEATURES
+	unsigned char subcmd;	// SET FEATURES subcommand (ATA_SF_*)
+	unsigned char count;	// level, or IDLE's standby timer
+} atasetting;
+
+int atafeature_resolve(atafeature, const char *, atasetting *);
+
+// NVMe controller features set via Set Features. These aren't saved, and
+// revert when the controller is reset.
+typedef enum {
+	NVMEFEAT_APST,		// autonomous power state transitions: "on" or "off"
+	NVMEFEAT_WCACHE,	// volatile write cache: "on" or "off"
+	NVMEFEAT_POWER,		// power state: 0 through the controller's NPSS
+	NVMEFEAT_ARBITRATION,	// "burst,low,medium,high": log2 burst (7 is
+				//  unlimited), then weights 1-256
+	NVMEFEAT_COALESCE,	// "threshold,time": completions 1-256, and
+				//  100µs units 0 (disabled)-255
+	NVMEFEAT_COUNT
+} nvmefeature;
+
+const char *nvmefeature_str(nvmefeature);
+const char *nvmefeature_desc(nvmefeature);
+// Returns -1 if the name isn't an NVMe feature.
+int nvmefeature_parse(const char *, nvmefeature *);
+
+// Write the feature's current value in the form accepted when setting it.
+// Returns -1 if the controller doesn't support the feature, or it won't fit.
+int nvmefeature_value(const struct nvmefeatures *, nvmefeature, char *, size_t);
+
+// Resolve a value to its Feature Identifier and Dword 11, exposed for
+// testing. Returns -1 (having diagnosed it) if the value is invalid.
+int nvmefeature_resolve(nvmefeature, const char *, unsigned *, uint32_t *);
+
+// Read the current features of an NVMe device. Calls diag() on failure.
+int nvme_device_features(const struct device *, struct nvmefeatures *);
+
+// Set the feature on each of n NVMe devices, with the same semantics as
+// ata_set_feature(). Call with the growlight lock held.
+int nvme_set_features(struct device **, unsigned, nvmefeature, const char *);
+
+// Favor latency over power on every NVMe controller: APST off, power state
+// 0, no interrupt coalescing, and the volatile write cache (if any) on.
+// Each controller is changed once, however many namespaces it exposes.
+// Changes are reported via diag(). Returns the number of controllers
+// changed, or -1 if any couldn't be. Call with the growlight lock held.
+int nvme_latency_preset(void);
+
+// The NVMe namespace's LBA formats. Calls diag() on failure.
+struct nvmelbafs;
+int nvme_device_lbafs(const struct device *, struct nvmelbafs *);
+
+// Format the NVMe namespace to the indexed LBA format, or if lbaf is
+// negative, to the best-performing format the kernel can use. This destroys
+// all data on the namespace, which must not be in use. Where the controller
+// formats all of its namespaces together (FNA bit 0), each of them must be
+// free to be claimed, and all are destroyed. The device is then
+// rescanned. The namespace is looked up by name, and the growlight lock is
+// taken only as needed, so this can be run as a job.
+int nvme_reformat(const char *, int lbaf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
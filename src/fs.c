@@ -71,13 +71,22 @@ static int
 xfs_mkfs(const char *dev, const struct mkfsmarshal *mkm){
 	// allow -c (badblock check) FIXME
 	const char *name = mkm->name;
+	char opts[64] = "";
+	int off = 0;
 
 	if(name == NULL){
 		name = "SprezzaXFS";
 	}
-	// FIXME set -s to the physical sector size
-	if(vspopen_drain("mkfs.xfs %s-L \"%s\" %s",
-			mkm->force ? "-f ": "", name, dev)){
+
+	if(mkm->physsec > 512 && mkm->physsec <= 32768){
+		off = snprintf(opts, sizeof(opts), "-s size=%u ", mkm->physsec);
+	}
+	if(mkm->stride && mkm->swidth){
+		snprintf(opts + off, sizeof(opts) - off, "-d su=%ju,sw=%ju ",
+				mkm->stride, mkm->swidth);
+	}
+	if(vspopen_drain("mkfs.xfs %s%s-L \"%s\" %s",
+			mkm->force ? "-f ": "", opts, name, dev)){
 		return -1;
 	}
 	return 0;
@@ -90,7 +99,7 @@ create_ntfs(const char *dev, const struct mkfsmarshal *mkm){
 	if(name == NULL){
 		name = "SprezzaNTFS";
 	}
-	if(vspopen_drain("mkfs.ntfs -v %s-U -L \"%s\" %s",
+	if(vspopen_progress(progress_percent, "mkfs.ntfs -v %s-U -L \"%s\" %s",
 			mkm->force ? "-F " : "", name, dev)){
 		return -1;
 	}
@@ -169,10 +178,10 @@ ext4_mkfs(const char *dev, const struct mkfsmarshal *mkm){
 	// FIXME Support a thorough mode or something where we use:
 	// -E lazy_itable_init=0,lazy_journal_init=0 -O ^uninit_bg" or something
 	if(mkm->stride && mkm->swidth){
-		if(vspopen_drain("mkfs.ext4 -Estride=%ju,stripe_width=%ju %s-b -2048 -L \"%s\" -O dir_index,extent %s",
+		if(vspopen_progress(progress_fraction, "mkfs.ext4 -Estride=%ju,stripe_width=%ju %s-b -2048 -L \"%s\" -O dir_index,extent %s",
 			mkm->stride, mkm->swidth, mkm->force ? "-F " : "", name, dev)){
 		}
-	}else if(vspopen_drain("mkfs.ext4 %s-b -2048 -L \"%s\" -O dir_index,extent %s",
+	}else if(vspopen_progress(progress_fraction, "mkfs.ext4 %s-b -2048 -L \"%s\" -O dir_index,extent %s",
 			     mkm->force ? "-F " : "", name, dev)){
 		return -1;
 	}
@@ -192,10 +201,10 @@ ext3_mkfs(const char *dev, const struct mkfsmarshal *mkm){
 	}
 	//if(vspopen_drain("mkfs.ext3 %s-b -2048 -E lazy_itable_init=0,lazy_journal_init=0 -L \"%s\" -O dir_index,extent %s",
 	if(mkm->stride && mkm->swidth){
-		if(vspopen_drain("mkfs.ext3 -Estride=%ju,stripe_width=%ju %s-b -2048 -L \"%s\" -O dir_index,extent %s",
+		if(vspopen_progress(progress_fraction, "mkfs.ext3 -Estride=%ju,stripe_width=%ju %s-b -2048 -L \"%s\" -O dir_index,extent %s",
 			mkm->stride, mkm->swidth, mkm->force ? "-F ": "", name, dev)){
 		}
-	}else if(vspopen_drain("mkfs.ext3 %s-b -2048 -L \"%s\" -O dir_index,extent %s",
+	}else if(vspopen_progress(progress_fraction, "mkfs.ext3 %s-b -2048 -L \"%s\" -O dir_index,extent %s",
 			mkm->force ? "-F ": "", name, dev)){
 		return -1;
 	}
@@ -214,10 +223,10 @@ ext2_mkfs(const char *dev, const struct mkfsmarshal *mkm){
 		name = "SprezzaEXT2";
 	}
 	if(mkm->stride && mkm->swidth){
-		if(vspopen_drain("mkfs.ext2 -Estride=%ju,stripe_width=%ju %s-b -2048 -L \"%s\" -O dir_index,extent %s",
+		if(vspopen_progress(progress_fraction, "mkfs.ext2 -Estride=%ju,stripe_width=%ju %s-b -2048 -L \"%s\" -O dir_index,extent %s",
 			mkm->stride, mkm->swidth, mkm->force ? "-F " : "", name, dev)){
 		}
-	}else if(vspopen_drain("mkfs.ext2 %s-b -2048 -L \"%s\" -O dir_index,extent %s",
+	}else if(vspopen_progress(progress_fraction, "mkfs.ext2 %s-b -2048 -L \"%s\" -O dir_index,extent %s",
 			mkm->force ? "-F " : "", name, dev)){
 		return -1;
 	}
@@ -596,7 +605,12 @@ err:
 	return NULL;
 }
 
-int make_filesystem(device *d, const char *pty, const char *name){
+// Validate the request, and capture everything the mkfs tool will need from
+// the device, so that it can run without the growlight lock held.
+static int
+mkfs_prepare(const device *d, const char *pty, const char *name,
+		const struct fs **fs, char *dbuf, size_t dlen,
+		struct mkfsmarshal *marsh){
 	const struct fs *pt;
 	int force = 0;
 
@@ -626,11 +640,8 @@ int make_filesystem(device *d, const char *pty, const char *name){
 	}
 	for(pt = fss ; pt->name ; ++pt){
 		if(strcmp(pt->name,pty) == 0){
-			char dbuf[PATH_MAX],*mnttype;
-			struct mkfsmarshal marsh;
-
-			memset(&marsh,0,sizeof(marsh));
-			if(snprintf(dbuf,sizeof(dbuf),"/dev/%s",d->name) >= (int)sizeof(dbuf)){
+			memset(marsh,0,sizeof(*marsh));
+			if(snprintf(dbuf,dlen,"/dev/%s",d->name) >= (int)dlen){
 				diag("Bad name: %s\n",d->name);
 				return -1;
 			}
@@ -638,23 +649,21 @@ int make_filesystem(device *d, const char *pty, const char *name){
 				diag("Don't know how to make %s\n",pty);
 				return -1;
 			}
-			if((mnttype = strdup(pty)) == NULL){
-				return -1;
-			}
 			// FIXME needs accept/set UUID!
-			marsh.name = name;
-			marsh.force = force;
+			marsh->name = name;
+			marsh->force = force;
 			if(d->layout == LAYOUT_MDADM){
-				marsh.stride = d->mddev.stride;
-				marsh.swidth = d->mddev.swidth;
-			}
-			if(pt->mkfs(dbuf,&marsh)){
-				free(mnttype);
-				return -1;
+				marsh->stride = d->mddev.stride;
+				marsh->swidth = d->mddev.swidth;
+			}else{
+				const device *disk = d->layout == LAYOUT_PARTITION ?
+							d->partdev.parent : d;
+
+				if(disk && disk->layout == LAYOUT_NONE){
+					marsh->physsec = disk->physsec;
+				}
 			}
-			// FIXME reprobe device?
-			free(d->mnttype);
-			d->mnttype = mnttype;
+			*fs = pt;
 			return 0;
 		}
 	}
@@ -662,6 +671,52 @@ int make_filesystem(device *d, const char *pty, const char *name){
 	return -1;
 }
 
+int make_filesystem(device *d, const char *pty, const char *name){
+	char dev[sizeof(d->name)];
+
+	strcpy(dev,d->name);
+	return make_filesystem_unlocked(dev,pty,name);
+}
+
+// mkfs's own udev events can see the device rescanned (and freed) while it
+// runs, so it's looked up anew afterwards. If it has been rescanned, blkid
+// will already have supplied its mnttype.
+int make_filesystem_unlocked(const char *dev, const char *pty, const char *name){
+	char dbuf[PATH_MAX],*mnttype;
+	struct mkfsmarshal marsh;
+	const struct fs *pt;
+	device *d;
+	int r;
+
+	lock_growlight();
+	if((d = find_device(dev)) == NULL){
+		diag("Couldn't find device %s\n",dev);
+		r = -1;
+	}else{
+		r = mkfs_prepare(d,pty,name,&pt,dbuf,sizeof(dbuf),&marsh);
+	}
+	unlock_growlight();
+	if(r){
+		return -1;
+	}
+	if((mnttype = strdup(pty)) == NULL){
+		return -1;
+	}
+	if(pt->mkfs(dbuf,&marsh)){
+		free(mnttype);
+		return -1;
+	}
+	lock_growlight();
+	if( (d = find_device(dev)) ){
+		free(d->mnttype);
+		d->mnttype = mnttype;
+	}else{
+		free(mnttype);
+	}
+	unlock_growlight();
+	return 0;
+}
+
 int parse_filesystems(const glightui *gui __attribute__ ((unused)), const char *fn){
 	off_t len,idx;
 	char *map;
@@ -704,6 +759,8 @@ int parse_filesystems(const glightui *gui __attribute__ ((unused)), const char *
 }
 
 int wipe_filesystem(device *d){
+	char name[sizeof(d->name)];
+
 	if(!d->mnttype){
 		diag("No filesystem on %s\n",d->name);
 		return -1;
@@ -712,10 +769,13 @@ int wipe_filesystem(device *d){
 		diag("%s is in use (%ux) and cannot be wiped\n",d->name,d->mnt.count);
 		return -1;
 	}
-	if(vspopen_drain("wipefs -a /dev/%s",d->name)){
+	strcpy(name,d->name);
+	if(vspopen_drain("wipefs -a /dev/%s",name)){
 		return -1;
 	}
-	rescan_blockdev(d);
+	if( (d = find_device(name)) ){
+		rescan_blockdev(d);
+	}
 	return 0;
 }
 
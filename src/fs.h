@@ -12,9 +12,15 @@ struct growlight_ui;
 #include <string.h>
 #include <stdint.h>
 
-// Create the given type of filesystem on this device
+// Create the given type of filesystem on this device. The growlight lock is
+// dropped while mkfs runs (see popen.h), so the device might have been
+// rescanned and freed by the time this returns.
 int make_filesystem(struct device *,const char *,const char *);
+// As above, but takes the named device, and the growlight lock only while
+// inspecting and updating it, not while the filesystem is being built.
+int make_filesystem_unlocked(const char *,const char *,const char *);
 int parse_filesystems(const struct growlight_ui *,const char *);
+// Likewise drops the lock while wipefs runs.
 int wipe_filesystem(struct device *);
 
 static inline int
@@ -38,6 +44,7 @@ struct mkfsmarshal {
 	int force;		// supply a force directive, if one exists
 	uintmax_t stride;	// opt. for raid array of strideB chunks
 	uintmax_t swidth;	// opt. for raid array of swidth stripe width
+	unsigned physsec;	// underlying disk's physical sector, or 0
 };
 
 // Does the filesystem support the concept of a name/label?
@@ -4,22 +4,25 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <iconv.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/mman.h>
 #include <sys/random.h>
+#include <linux/blkpg.h>
 #include <linux/byteorder/little_endian.h>
 
 #include "gpt.h"
 #include "ptypes.h"
 #include "ptable.h"
+#include "blockio.h"
 #include "growlight.h"
 
-#define LBA_SIZE 512u
-#define MBR_SIZE (LBA_SIZE - MBR_OFFSET)
+// The MBR lives in the first 512 bytes of LBA 0, whatever the block size
+#define MBR_SIZE (512u - MBR_OFFSET)
 
 static const unsigned char __attribute__ ((nonstring))
-GPT_PROTECTIVE_MBR[LBA_SIZE - MBR_OFFSET] =
+GPT_PROTECTIVE_MBR[MBR_SIZE] =
  "\x00\x00\x00\x00\x00\x00"  // 6 bytes of zeros
  "\x80"                      // bootable (violation of GPT spec, but some
                              //  BIOS/MBR *and* UEFI won't boot otherwise)
@@ -62,51 +65,26 @@ int update_crc(gpt_header *head, const gpt_entry *gpes){
   return 0;
 }
 
-static int
-update_backup(int fd, const gpt_header *ghead, unsigned gptlbas, uint64_t lbas,
-              unsigned lbasize, unsigned pgsize, int realdata){
-  // Cannot look to ghead->backuplba, because we might be zeroing things
-  // out, and have already lost it in the primary.
-  const uint64_t backuplba = lbas - 1;
-  const uint64_t absdevoff = (backuplba - (gptlbas - 1)) * lbasize;
-  const size_t mapoff = absdevoff % pgsize;
-  gpt_header *gh;
-  size_t mapsize;
-  void *map;
+// LBAs occupied by an array of MINIMUM_GPT_ENTRIES entries
+static size_t
+gpt_entry_lbas(unsigned lbasize){
+  return (MINIMUM_GPT_ENTRIES * sizeof(gpt_entry) + lbasize - 1) / lbasize;
+}
 
-  mapsize = lbasize * gptlbas + mapoff;
-  mapsize = pgsize * (mapsize / pgsize + !!mapoff);
-  if((map = mmap(NULL, mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd,
-                 absdevoff - mapoff)) == MAP_FAILED){
-    diag("Error mapping %zub at %d (%s?)\n", mapsize, fd, strerror(errno));
-    return -1;
-  }
-  verbf("Mapped %zub at %p:%zu devoff %ju\n", mapsize, map, mapoff, (uintmax_t)(absdevoff - mapoff));
-  if(realdata){
-    // Copy the partition table entries -- all but the first of the
-    // primary header's sectors to all but the last of the backup
-    // header's sectors.
-    memcpy((char *)map + mapoff, (char *)ghead + lbasize, (gptlbas - 1) * lbasize);
-    // Copy the header, always a single LBA sector
-    gh = (gpt_header *)((char *)map + lbasize * (gptlbas - 1) + mapoff);
-    memcpy(gh, ghead, lbasize);
-    gh->lba = gh->backuplba;
-    gh->backuplba = 1;
-    gh->partlba = gh->lba - (gptlbas - 1);
-    update_crc(gh, (const gpt_entry *)((char *)map + mapoff));
-  }else{
-    memset(map + mapoff, 0, gptlbas * lbasize);
-  }
-  if(msync(map, mapsize, MS_SYNC|MS_INVALIDATE)){
-    diag("Error syncing %d (%s)\n", fd, strerror(errno));
-    munmap(map, mapsize);
-    return -1;
-  }
-  if(munmap(map, mapsize)){
-    diag("Error unmapping %d (%s)\n", fd, strerror(errno));
-    return -1;
-  }
-  return 0;
+// Build the backup corresponding to a primary header and its entries in buf,
+// laid out as on disk: the entries, followed by the header in the final LBA.
+// buf must hold 1 + entlbas blocks.
+static void
+gpt_backup(void *buf, const gpt_header *ghead, const gpt_entry *gpe,
+           size_t entlbas, unsigned lbasize){
+  gpt_header *bh = (gpt_header *)((char *)buf + entlbas * lbasize);
+
+  memcpy(buf, gpe, entlbas * lbasize);
+  memcpy(bh, ghead, lbasize);
+  bh->lba = ghead->backuplba;
+  bh->backuplba = ghead->lba;
+  bh->partlba = bh->lba - entlbas;
+  update_crc(bh, buf);
 }
 
 int initialize_gpt(gpt_header *gh, size_t lbasize, uint64_t backuplba,
@@ -149,162 +127,70 @@ int initialize_gpt(gpt_header *gh, size_t lbasize, uint64_t backuplba,
   return 0;
 }
 
-// Write out a GPT and its backup on the device represented by fd, using
-// lbasize-byte LBA. The device ought have lbas lbasize-byte sectors. We will
-// write to the second-from-the-first, and the final, groups of sectors. lbas
-// must be greater than or equal to 1 + 2 * (1 + ceil(16k / lbasize).
-//
-// We can either zero it all out, or create a new empty GPT. Set realdata not
-// equal to 0 to perform the latter.
+// Write out an empty GPT and its backup, along with a protective MBR. If
+// realdata is 0, instead zero out both copies and the MBR's partition table.
+// Boot code in LBA 0 is preserved either way. Cannot look to any existing
+// header for the backup's location, since it might be corrupt.
 static int
-write_gpt(int fd, ssize_t lbasize, uint64_t lbas, unsigned realdata){
-  ssize_t s = lbasize - (MINIMUM_GPT_ENTRIES * sizeof(gpt_entry) % lbasize);
-  const size_t gptlbas = 1 + !!s + (MINIMUM_GPT_ENTRIES * sizeof(gpt_entry) / lbasize);
-  uint64_t backuplba = lbas - 1;
-  int pgsize = getpagesize();
-  gpt_header *ghead;
-  size_t mapsize;
-  void *map;
-  off_t off;
+write_gpt(blockio *b, unsigned realdata){
+  const size_t entlbas = gpt_entry_lbas(b->lbasize);
+  const uint64_t backuplba = b->lbas - 1;
+  void *prim, *back;
+  gpt_header *gh;
+  int ret = -1;
 
-  if(pgsize <= 0 || (pgsize % lbasize)){
+  if(b->lbas < 3 + 2 * entlbas){
+    diag("Won't create GPT on %ju-block disk %s\n", (uintmax_t)b->lbas, b->name);
     return -1;
   }
-  // The first copy goes into LBA 1. Calculate offset into map due to
-  // lbasize possibly (probably) not equalling the page size.
-  if((off = lbasize % pgsize) == 0){
-    mapsize = 0;
-  }else{
-    mapsize = lbasize;
-  }
-  mapsize += gptlbas * lbasize;
-  mapsize = ((mapsize / pgsize) + !!(mapsize % pgsize)) * pgsize;
-  if(mapsize % pgsize){
+  if((prim = blockio_alloc(b, 2 + entlbas)) == NULL){
     return -1;
   }
-  map = mmap(NULL, mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-  if(map == MAP_FAILED){
-    diag("Error mapping %zub at %d (%s?)\n", mapsize, fd, strerror(errno));
+  if((back = blockio_alloc(b, 1 + entlbas)) == NULL){
+    free(prim);
     return -1;
   }
-  ghead = (gpt_header *)((char *)map + off);
-  if(!realdata){
-    memset(ghead, 0, gptlbas * lbasize);
-  }else{
-    if(initialize_gpt(ghead, lbasize, backuplba, gptlbas, NULL)){
-      munmap(map, mapsize);
-      return -1;
+  if(blockio_read(b, prim, 0, 1)){
+    goto done;
+  }
+  gh = (gpt_header *)((char *)prim + b->lbasize);
+  if(realdata){
+    memcpy((char *)prim + MBR_OFFSET, GPT_PROTECTIVE_MBR, MBR_SIZE);
+    if(initialize_gpt(gh, b->lbasize, backuplba, 2 + entlbas, NULL)){
+      goto done;
     }
-    if(update_crc(ghead, (const gpt_entry *)((char *)ghead + lbasize))){
-      munmap(map, mapsize);
-      return -1;;
+    if(update_crc(gh, (const gpt_entry *)((char *)gh + b->lbasize))){
+      goto done;
     }
+    gpt_backup(back, gh, (const gpt_entry *)((char *)gh + b->lbasize), entlbas, b->lbasize);
+  }else{
+    memset((char *)prim + MBR_OFFSET, 0, MBR_SIZE);
   }
-  if(msync(map, mapsize, MS_SYNC|MS_INVALIDATE)){
-    diag("Error syncing %d (%s?)\n", fd, strerror(errno));
-    munmap(map, mapsize);
-    return -1;
-  }
-  if(update_backup(fd, ghead, gptlbas, lbas, lbasize, pgsize, realdata)){
-    munmap(map, mapsize);
-    return -1;
+  if(blockio_write(b, prim, 0, 2 + entlbas)){
+    goto done;
   }
-  if(munmap(map, mapsize)){
-    diag("Error unmapping %d (%s?)\n", fd, strerror(errno));
-    return -1;
+  if(blockio_write(b, back, backuplba - entlbas, 1 + entlbas)){
+    goto done;
   }
-  return 0;
-}
+  ret = blockio_flush(b);
 
-int new_gpt(device *d){
-  size_t mapsize;
-  void *map;
-  int fd;
+done:
+  free(back);
+  free(prim);
+  return ret;
+}
 
-  if(d->layout != LAYOUT_NONE){
-    diag("Won't create partition table on non-disk %s\n", d->name);
-    return -1;
-  }
-  if(d->size % LBA_SIZE){
-    diag("Won't create GPT on (%ju %% %u == %juB) disk %s\n",
-      d->size, LBA_SIZE, d->size % LBA_SIZE, d->name);
-    return -1;
-  }
-  if(d->size < LBA_SIZE + 2 * (LBA_SIZE + MINIMUM_GPT_ENTRIES * sizeof(gpt_entry))){
-    diag("Won't create GPT on %juB disk %s\n",d->size,d->name);
-    return -1;
-  }
-  if((fd = openat(devfd, d->name, O_RDWR|O_CLOEXEC|O_DIRECT)) < 0){
-    diag("Couldn't open %s (%s?)\n", d->name, strerror(errno));
-    return -1;
-  }
-  // protective MBR in first LBA
-  mapsize = getpagesize(); // FIXME check for insanity
-  if((map = mmap(NULL, mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED){
-    diag("Couldn't map %s (%s?)\n", d->name, strerror(errno));
-    close(fd);
-    return -1;
-  }
-  memcpy((char *)map + MBR_OFFSET, GPT_PROTECTIVE_MBR, MBR_SIZE);
-  if(munmap(map, mapsize)){
-    diag("Couldn't unmap MBR for %s (%s?)\n", d->name, strerror(errno));
-    close(fd);
-    return -1;
-  }
-  if(write_gpt(fd, LBA_SIZE, d->size / LBA_SIZE, 1)){
-    diag("Couldn't write GPT on %s (%s?)\n", d->name, strerror(errno));
-    close(fd);
-    return -1;
-  }
-  if(fsync(fd)){
-    diag("Warning: error syncing %d for %s (%s?)\n", fd, d->name, strerror(errno));
-  }
-  if(close(fd)){
-    diag("Error closing %d for %s (%s?)\n", fd, d->name, strerror(errno));
+int new_gpt(blockio *b){
+  if(write_gpt(b, 1)){
+    diag("Couldn't write GPT on %s\n", b->name);
     return -1;
   }
   return 0;
 }
 
-int zap_gpt(device *d){
-  size_t mapsize;
-  void *map;
-  int fd;
-
-  if(d->layout != LAYOUT_NONE){
-    diag("Won't zap partition table on non-disk %s\n", d->name);
-    return -1;
-  }
-  if(d->blkdev.pttable == NULL || strcmp(d->blkdev.pttable, "gpt")){
-    diag("No GPT on disk %s\n", d->name);
-    return -1;
-  }
-  if((fd = openat(devfd, d->name, O_RDWR|O_CLOEXEC|O_DIRECT)) < 0){
-    diag("Couldn't open %s (%s?)\n", d->name, strerror(errno));
-    return -1;
-  }
-  mapsize = getpagesize(); // FIXME check for insanity
-  if((map = mmap(NULL, mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED){
-    diag("Couldn't map %s (%s?)\n", d->name, strerror(errno));
-    close(fd);
-    return -1;
-  }
-  memset((char *)map + MBR_OFFSET, 0, MBR_SIZE);
-  if(munmap(map, mapsize)){
-    diag("Couldn't unmap MBR for %s (%s?)\n", d->name, strerror(errno));
-    close(fd);
-    return -1;
-  }
-  if(write_gpt(fd, LBA_SIZE, d->size / LBA_SIZE, 0)){
-    diag("Couldn't write GPT on %s (%s?)\n", d->name, strerror(errno));
-    close(fd);
-    return -1;
-  }
-  if(fsync(fd)){
-    diag("Warning: error syncing %d for %s (%s?)\n", fd, d->name, strerror(errno));
-  }
-  if(close(fd)){
-    diag("Error closing %d for %s (%s?)\n", fd, d->name, strerror(errno));
+int zap_gpt(blockio *b){
+  if(write_gpt(b, 0)){
+    diag("Couldn't zap GPT on %s\n", b->name);
     return -1;
   }
   return 0;
@@ -336,463 +222,563 @@ gpt_name(const wchar_t *name, void *name16le, size_t olen){
   return 0;
 }
 
-static void *
-const_map_gpt(const device *d, size_t *mapsize, int *fd, size_t lbasize){
-  const int pgsize = getpagesize();
-  const unsigned gptlbas = 1 + (MINIMUM_GPT_ENTRIES * sizeof(struct gpt_entry) / lbasize);
-  void *map;
+// Read the primary GPT header of a whole disk.
+static int
+read_gpt_header(const device *d, const blockcap *cap, gpt_header *gh){
+  const void *lba1;
+  int ret = -1;
+  blockio b;
+  void *buf;
 
-  if(pgsize < 0){
-    diag("Bad pgsize for GPT: %d\n", pgsize);
-    return MAP_FAILED;
-  }
-  if(MINIMUM_GPT_ENTRIES * sizeof(struct gpt_entry) % lbasize){
-    diag("Bad lbasize for GPT: %zu\n", lbasize);
-    return MAP_FAILED;
-  }
-  // The first copy goes into LBA 1. Calculate offset into map due to
-  // lbasize possibly (probably) not equalling the page size.
-  if(lbasize % pgsize == 0){
-    *mapsize = 0;
-  }else{
-    *mapsize = lbasize;
-  }
-  *mapsize += gptlbas * lbasize;
-  *mapsize = ((*mapsize / pgsize) + !!(*mapsize % pgsize)) * pgsize;
-  if(*mapsize % pgsize){
-    diag("Bad mapsize %zu for page size %d\n", *mapsize, pgsize);
-    return MAP_FAILED;
-  }
-  if((*fd = openat(devfd, d->name, O_RDONLY|O_CLOEXEC|O_DIRECT)) < 0){
-    diag("Couldn't open %s (%s?)\n", d->name, strerror(errno));
-    return MAP_FAILED;
-  }
-  map = mmap(NULL, *mapsize, PROT_READ, MAP_SHARED, *fd, 0);
-  if(map == MAP_FAILED){
-    diag("Couldn't map GPT header (%s?)\n", strerror(errno));
-    close(*fd);
-    return map;
-  }
-  return map;
-}
-
-// Map the primary GPT header, its table, and the MBR boot sector.
-static void *
-map_gpt(device *d, size_t *mapsize, int *fd, size_t lbasize){
-  const int pgsize = getpagesize();
-  const unsigned gptlbas = 1 + (MINIMUM_GPT_ENTRIES * sizeof(struct gpt_entry) / lbasize);
-  void *map;
-
-  if(pgsize < 0){
-    diag("Bad pgsize for GPT: %d\n", pgsize);
-    return MAP_FAILED;
-  }
-  if(MINIMUM_GPT_ENTRIES * sizeof(struct gpt_entry) % lbasize){
-    diag("Bad lbasize for GPT: %zu\n", lbasize);
-    return MAP_FAILED;
-  }
-  if((*fd = openat(devfd, d->name, O_RDWR|O_CLOEXEC|O_DIRECT)) < 0){
-    diag("Couldn't open %s (%s?)\n", d->name, strerror(errno));
-    return MAP_FAILED;
-  }
-  // The first copy goes into LBA 1. Calculate offset into map due to
-  // lbasize possibly (probably) not equalling the page size.
-  if(lbasize % pgsize == 0){
-    *mapsize = 0;
+  assert(d->layout == LAYOUT_NONE);
+  if(cap && (lba1 = blockcap_lba(cap, 1, 1))){
+    memcpy(gh, lba1, sizeof(*gh));
   }else{
-    *mapsize = lbasize;
+    if(blockio_open(&b, d, O_RDONLY)){
+      return -1;
+    }
+    if( (buf = blockio_alloc(&b, 1)) ){
+      if(blockio_read(&b, buf, 1, 1) == 0){
+        memcpy(gh, buf, sizeof(*gh));
+        ret = 0;
+      }
+      free(buf);
+    }
+    blockio_close(&b);
+    if(ret){
+      return -1;
+    }
   }
-  *mapsize += gptlbas * lbasize;
-  *mapsize = ((*mapsize / pgsize) + !!(*mapsize % pgsize)) * pgsize;
-  assert(*mapsize % pgsize == 0);
-  map = mmap(NULL, *mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, *fd, 0);
-  if(map == MAP_FAILED){
-    diag("Couldn't map GPT header (%s?)\n", strerror(errno));
-    close(*fd);
-    return map;
+  if(memcmp(&gh->signature, gpt_signature, sizeof(gh->signature))){
+    diag("No GPT signature on %s\n", d->name);
+    return -1;
   }
-  return map;
+  return 0;
+}
+
+// Larger tables are legal, but nobody makes them
+#define MAXIMUM_GPT_ENTRIES 1024
+
+struct gpt_txn {
+  device *d;                  // consulted only while staging edits
+  blockio b;
+  size_t entlbas;             // LBAs occupied by the partition entry array
+  void *buf;                  // MBR, primary header, and entries, as on disk
+  gpt_header *ghead;
+  gpt_entry *gpe;
+  gpt_entry *orig;            // entries as read, to compute kernel updates
+  char (*names)[BLKPG_DEVNAMELTH]; // names of partitions we've added
+  unsigned edits;
+};
+
+static inline int
+gpe_used_p(const gpt_entry *gpe){
+  static const uint8_t zguid[GUIDSIZE];
+
+  // if there're any non-zero bits in either the type or partition guid,
+  // assume it's being used.
+  return memcmp(gpe->type_guid, zguid, sizeof(zguid)) ||
+         memcmp(gpe->part_guid, zguid, sizeof(zguid));
 }
 
-// Pass the return from map_gpt(), ie the MBR boot sector + primary GPT
 static int
-const_unmap_gpt(const device *parent, void *map, size_t mapsize, int fd){
-  assert(parent->layout == LAYOUT_NONE);
-  if(munmap(map, mapsize)){
-    int e = errno;
+gpt_header_valid_p(const gpt_txn *t, const gpt_header *gh){
+  unsigned char hcopy[sizeof(*gh)];
+  uint32_t crc;
 
-    diag("Error munmapping %s (%s?)\n", parent->name, strerror(errno));
-    close(fd);
-    errno = e;
-    return -1;
+  if(memcmp(&gh->signature, gpt_signature, sizeof(gh->signature))){
+    diag("No GPT signature on %s\n", t->b.name);
+    return 0;
   }
-  return 0;
+  if(gh->headsize != sizeof(*gh) || gh->partsize != sizeof(gpt_entry) ||
+      gh->partcount < MINIMUM_GPT_ENTRIES || gh->partcount > MAXIMUM_GPT_ENTRIES){
+    diag("Unsupported GPT geometry on %s (%u %u %u)\n", t->b.name,
+         gh->headsize, gh->partsize, gh->partcount);
+    return 0;
+  }
+  if(gh->lba != 1 || gh->partlba != 2 || gh->backuplba >= t->b.lbas ||
+      gh->first_usable > gh->last_usable || gh->last_usable >= gh->backuplba){
+    diag("Invalid GPT layout on %s\n", t->b.name);
+    return 0;
+  }
+  memcpy(hcopy, gh, sizeof(hcopy));
+  ((gpt_header *)hcopy)->crc = 0;
+  crc = crc32(0, hcopy, sizeof(hcopy));
+  if(crc != gh->crc){
+    diag("Bad GPT header CRC on %s (%08x != %08x)\n", t->b.name, crc, gh->crc);
+    return 0;
+  }
+  return 1;
 }
 
-// Pass the return from map_gpt(), ie the MBR boot sector + primary GPT
+// Read LBA 0 (the MBR), the primary header, and the primary entries.
 static int
-unmap_gpt(const device *parent, void *map, size_t mapsize, int fd, size_t lbasize){
-  const uint64_t gptlbas = 1 + (MINIMUM_GPT_ENTRIES * sizeof(gpt_entry) / lbasize);
-  gpt_header *gpt = (gpt_header *)((char *)map + lbasize);
-  gpt_entry *gpe = (gpt_entry *)((char *)map + 2 * lbasize);
-  const uint64_t lbas = parent->size / lbasize;
-  const int pgsize = getpagesize();
+gpt_txn_read(gpt_txn *t){
+  const unsigned lbasize = t->b.lbasize;
+  gpt_header *gh;
+  size_t entbytes;
 
-  assert(parent->layout == LAYOUT_NONE);
-  if(pgsize < 0){
-    diag("Warning: bad pgsize for GPT: %d\n", pgsize);
+  if((t->buf = blockio_alloc(&t->b, 2)) == NULL){
+    return -1;
   }
-  if(update_crc(gpt, gpe)){
-    munmap(map, mapsize);
-    close(fd);
+  if(blockio_read(&t->b, t->buf, 0, 2)){
     return -1;
   }
-  if(update_backup(fd, gpt, gptlbas, lbas, LBA_SIZE, pgsize, 1)){
-    munmap(map, mapsize);
-    close(fd);
+  gh = (gpt_header *)((char *)t->buf + lbasize);
+  if(!gpt_header_valid_p(t, gh)){
     return -1;
   }
-  if(munmap(map, mapsize)){
-    int e = errno;
-
-    diag("Error munmapping %s (%s?)\n", parent->name, strerror(errno));
-    close(fd);
-    errno = e;
+  entbytes = (size_t)gh->partcount * gh->partsize;
+  t->entlbas = (entbytes + lbasize - 1) / lbasize;
+  free(t->buf);
+  if((t->buf = blockio_alloc(&t->b, 2 + t->entlbas)) == NULL){
+    return -1;
+  }
+  if(blockio_read(&t->b, t->buf, 0, 2 + t->entlbas)){
+    return -1;
+  }
+  t->ghead = (gpt_header *)((char *)t->buf + lbasize);
+  t->gpe = (gpt_entry *)((char *)t->buf + 2 * lbasize);
+  if(crc32(0, (const void *)t->gpe, entbytes) != t->ghead->partcrc){
+    diag("Bad GPT entry CRC on %s\n", t->b.name);
+    return -1;
+  }
+  if((t->orig = malloc(entbytes)) == NULL){
+    diag("Couldn't allocate %zub for GPT (%s?)\n", entbytes, strerror(errno));
+    return -1;
+  }
+  memcpy(t->orig, t->gpe, entbytes);
+  if((t->names = calloc(t->ghead->partcount, sizeof(*t->names))) == NULL){
+    diag("Couldn't allocate GPT names (%s?)\n", strerror(errno));
     return -1;
   }
   return 0;
 }
 
-int add_gpt(device *d, const wchar_t *name, uintmax_t fsec, uintmax_t lsec, unsigned long long code){
-  static const uint8_t zguid[GUIDSIZE];
-  const size_t lbasize = LBA_SIZE;
-  unsigned char tguid[GUIDSIZE];
-  char cname[BUFSIZ];
-  gpt_header *ghead;
-  unsigned z, partno;
-  gpt_entry *gpe;
-  size_t mapsize;
-  uint64_t lbas;
-  void *map;
-  int fd, r;
+gpt_txn *gpt_txn_begin(device *d){
+  gpt_txn *t;
 
-  if(!name){
-    diag("GPT partitions ought be named!\n");
-    return -1;
-  }
   if(!d){
     diag("Passed a NULL device\n");
-    return -1;
+    return NULL;
   }
   if(d->layout != LAYOUT_NONE){
-    diag("Won't add partition to non-disk %s\n", d->name);
-    return -1;
+    diag("Won't edit partition table on non-disk %s\n", d->name);
+    return NULL;
   }
   if(d->blkdev.pttable == NULL || strcmp(d->blkdev.pttable, "gpt")){
     diag("No GPT on disk %s\n", d->name);
-    return -1;
+    return NULL;
   }
-  if(d->size % lbasize){
-    diag("Disk size is not a multiple of LBA size, aborting\n");
+  if((t = malloc(sizeof(*t))) == NULL){
+    diag("Couldn't allocate GPT transaction (%s?)\n", strerror(errno));
+    return NULL;
+  }
+  memset(t, 0, sizeof(*t));
+  t->d = d;
+  if(blockio_open(&t->b, d, O_RDWR)){
+    free(t);
+    return NULL;
+  }
+  if(gpt_txn_read(t)){
+    gpt_txn_abort(t);
+    return NULL;
+  }
+  return t;
+}
+
+void gpt_txn_abort(gpt_txn *t){
+  if(t){
+    blockio_close(&t->b);
+    free(t->names);
+    free(t->orig);
+    free(t->buf);
+    free(t);
+  }
+}
+
+static gpt_entry *
+gpt_txn_entry(gpt_txn *t, unsigned pno){
+  if(pno == 0 || pno > t->ghead->partcount || !gpe_used_p(&t->gpe[pno - 1])){
+    diag("No partition %u in GPT on %s\n", pno, t->b.name);
+    return NULL;
+  }
+  return &t->gpe[pno - 1];
+}
+
+int gpt_txn_add(gpt_txn *t, const wchar_t *name, uintmax_t fsec, uintmax_t lsec,
+                unsigned long long code){
+  const device *d = t->d;
+  unsigned char tguid[GUIDSIZE];
+  uintmax_t align;
+  gpt_entry *gpe;
+  unsigned z;
+
+  if(!name){
+    diag("GPT partitions ought be named!\n");
     return -1;
   }
-  lbas = d->size / lbasize;
   // Align it properly
-  if(fsec % (d->physsec / d->logsec)){
-    fsec += (d->physsec / d->logsec) - (fsec % (d->physsec / d->logsec));
-    assert(fsec % (d->physsec / d->logsec) == 0);
+  align = d->logsec ? io_alignment(d, d->logsec) / d->logsec : 1;
+  if(align > 1 && fsec % align){
+    fsec += align - fsec % align;
   }
-  if(lsec < fsec || lsec > last_usable_sector(d) || fsec < first_usable_sector(d)){
-    diag("Bad sector spec (%ju:%ju) on %ju disk\n", fsec, lsec, lbas);
+  if(lsec < fsec || lsec > t->ghead->last_usable || fsec < t->ghead->first_usable){
+    diag("Bad sector spec (%ju:%ju) on %ju disk\n", fsec, lsec, (uintmax_t)t->b.lbas);
     return -1;
   }
   if(get_gpt_guid(code, tguid)){
     diag("Not a valid GPT typecode: %llu\n", code);
     return -1;
   }
-  if((map = map_gpt(d, &mapsize, &fd, LBA_SIZE)) == MAP_FAILED){
-    return -1;
-  }
-  ghead = (gpt_header *)((char *)map + LBA_SIZE);
-  gpe = (gpt_entry *)((char *)map + 2 * LBA_SIZE);
-  // Determine the next available partition number, and verify that no
-  // existing partitions overlap with this one.
-  partno = ghead->partcount;
-  for(z = 0 ; z < ghead->partcount ; ++z){
-    // if there're any non-zero bits in either the type or
-    // partition guid, assume it's being used.
-    if(memcmp(gpe[z].type_guid, zguid, sizeof(zguid)) || memcmp(gpe[z].part_guid, zguid, sizeof(zguid))){
-      if((gpe[z].first_lba >= fsec && gpe[z].first_lba <= lsec) ||
-          (gpe[z].last_lba <= lsec && gpe[z].last_lba >= fsec)){
-        diag("Partition overlap (%ju:%ju) ([%u]%ju:%ju)\n", fsec, lsec,
-            z, gpe[z].first_lba, gpe[z].last_lba);
-      }
-      continue;
-    }
-    if(partno == ghead->partcount){
-      partno = z;
+  for(z = 0 ; z < t->ghead->partcount ; ++z){
+    if(!gpe_used_p(&t->gpe[z])){
+      break;
     }
   }
-  if((z = partno) == ghead->partcount){
+  if(z == t->ghead->partcount){
     diag("no entry for a new partition in %s\n", d->name);
-    munmap(map, mapsize);
-    close(fd);
     return -1;
   }
-  diag("First sector: %ju last sector: %ju count: %ju size: %ju\n",
-      (uintmax_t)fsec,
-      (uintmax_t)lsec,
-      (uintmax_t)(lsec - fsec),
-      (uintmax_t)((lsec - fsec) * d->logsec));
-  memcpy(gpe[z].type_guid, tguid, sizeof(tguid));
-  if(gpt_name(name, gpe[z].name, sizeof(gpe[z].name))){
-    memset(gpe + z, 0, sizeof(*gpe));
-    munmap(map, mapsize);
-    close(fd);
+  gpe = &t->gpe[z];
+  memset(gpe, 0, sizeof(*gpe));
+  if(gpt_name(name, gpe->name, sizeof(gpe->name))){
+    memset(gpe, 0, sizeof(*gpe));
     return -1;
   }
-  if(getrandom(gpe[z].part_guid, GUIDSIZE, GRND_NONBLOCK) != GUIDSIZE){
+  if(getrandom(gpe->part_guid, GUIDSIZE, GRND_NONBLOCK) != GUIDSIZE){
     diag("Couldn't get %d random bytes (%s)\n", GUIDSIZE, strerror(errno));
-    memset(gpe + z, 0, sizeof(*gpe));
-    munmap(map, mapsize);
-    close(fd);
+    memset(gpe, 0, sizeof(*gpe));
     return -1;
   }
-  gpe[z].flags = 0;
-  gpe[z].first_lba = fsec;
-  gpe[z].last_lba = lsec;
-  if(unmap_gpt(d, map, mapsize, fd, LBA_SIZE)){
-    close(fd);
-    return -1;
-  }
-  snprintf(cname, sizeof(cname) - 1, "%ls", name);
-  if(fsync(fd)){
-    diag("Couldn't sync %d for %s\n", fd, d->name);
-  }
-  r = blkpg_add_partition(fd, fsec * LBA_SIZE,
-      (lsec - fsec + 1) * LBA_SIZE, z + 1, cname);
-  if(close(fd)){
-    int e = errno;
+  memcpy(gpe->type_guid, tguid, sizeof(tguid));
+  gpe->flags = 0;
+  gpe->first_lba = fsec;
+  gpe->last_lba = lsec;
+  snprintf(t->names[z], sizeof(*t->names), "%ls", name);
+  diag("First sector: %ju last sector: %ju count: %ju size: %ju\n",
+      (uintmax_t)fsec,
+      (uintmax_t)lsec,
+      (uintmax_t)(lsec - fsec + 1),
+      (uintmax_t)((lsec - fsec + 1) * t->b.lbasize));
+  ++t->edits;
+  return z + 1;
+}
+
+int gpt_txn_del(gpt_txn *t, unsigned pno){
+  gpt_entry *gpe;
 
-    diag("Error closing %s (%s?)\n", d->name, strerror(errno));
-    errno = e;
+  if((gpe = gpt_txn_entry(t, pno)) == NULL){
     return -1;
   }
-  return r;
+  memset(gpe, 0, sizeof(*gpe));
+  t->names[pno - 1][0] = '\0';
+  ++t->edits;
+  return 0;
 }
 
-int name_gpt(device *d, const wchar_t *name){
+int gpt_txn_name(gpt_txn *t, unsigned pno, const wchar_t *name){
+  uint16_t name16[sizeof(((gpt_entry *)NULL)->name) / sizeof(uint16_t)];
   gpt_entry *gpe;
-  size_t mapsize;
-  void *map;
-  int fd;
 
-  assert(d->layout == LAYOUT_PARTITION);
-  if((map = map_gpt(d->partdev.parent, &mapsize, &fd, LBA_SIZE)) == MAP_FAILED){
-    return -1;
-  }
-  gpe = (gpt_entry *)((char *)map + 2 * LBA_SIZE);
-  if(gpt_name(name, gpe[d->partdev.pnumber].name, sizeof(gpe->name))){
-    munmap(map, mapsize);
-    close(fd);
+  if((gpe = gpt_txn_entry(t, pno)) == NULL){
     return -1;
   }
-  if(unmap_gpt(d->partdev.parent, map, mapsize, fd, LBA_SIZE)){
-    close(fd);
+  memset(name16, 0, sizeof(name16));
+  if(gpt_name(name, name16, sizeof(name16))){
     return -1;
   }
-  if(close(fd)){
-    diag("Error closing %s (%s?)\n", d->name, strerror(errno));
+  memcpy(gpe->name, name16, sizeof(gpe->name));
+  ++t->edits;
+  return 0;
+}
+
+int gpt_txn_uuid(gpt_txn *t, unsigned pno, const void *uuid){
+  gpt_entry *gpe;
+
+  if((gpe = gpt_txn_entry(t, pno)) == NULL){
     return -1;
   }
+  memcpy(gpe->part_guid, uuid, GUIDSIZE);
+  ++t->edits;
   return 0;
 }
 
-int uuid_gpt(device *d, const void *uuid){
+int gpt_txn_flags(gpt_txn *t, unsigned pno, uint64_t flags){
   gpt_entry *gpe;
-  size_t mapsize;
-  void *map;
-  int fd;
 
-  assert(d->layout == LAYOUT_PARTITION);
-  if((map = map_gpt(d->partdev.parent, &mapsize, &fd, LBA_SIZE)) == MAP_FAILED){
+  if((gpe = gpt_txn_entry(t, pno)) == NULL){
     return -1;
   }
-  gpe = (gpt_entry *)((char *)map + 2 * LBA_SIZE);
-  memcpy(gpe[d->partdev.pnumber].name, uuid, GUIDSIZE);
-  if(unmap_gpt(d->partdev.parent, map, mapsize, fd, LBA_SIZE)){
-    close(fd);
+  gpe->flags = flags;
+  ++t->edits;
+  return 0;
+}
+
+int gpt_txn_flag(gpt_txn *t, unsigned pno, uint64_t flag, unsigned status){
+  gpt_entry *gpe;
+
+  if((gpe = gpt_txn_entry(t, pno)) == NULL){
     return -1;
   }
-  if(close(fd)){
-    diag("Error closing %s (%s?)\n", d->name, strerror(errno));
-    return -1;
+  if(status){
+    gpe->flags |= flag;
+  }else{
+    gpe->flags &= ~flag;
   }
+  ++t->edits;
   return 0;
 }
 
-int flags_gpt(device *d, uint64_t flag){
+int gpt_txn_code(gpt_txn *t, unsigned pno, unsigned long long code){
+  unsigned char tguid[GUIDSIZE];
   gpt_entry *gpe;
-  size_t mapsize;
-  void *map;
-  int fd;
 
-  assert(d->layout == LAYOUT_PARTITION);
-  if((map = map_gpt(d->partdev.parent, &mapsize, &fd, LBA_SIZE)) == MAP_FAILED){
+  if((gpe = gpt_txn_entry(t, pno)) == NULL){
     return -1;
   }
-  gpe = (gpt_entry *)((char *)map + 2 * LBA_SIZE);
-  gpe[d->partdev.pnumber].flags = flag;
-  if(unmap_gpt(d->partdev.parent, map, mapsize, fd, LBA_SIZE)){
-    close(fd);
+  if(get_gpt_guid(code, tguid)){
+    diag("Not a valid GPT typecode: %llu\n", code);
     return -1;
   }
-  if(close(fd)){
-    diag("Error closing %s (%s?)\n", d->name, strerror(errno));
+  memcpy(gpe->type_guid, tguid, sizeof(tguid));
+  ++t->edits;
+  return 0;
+}
+
+typedef struct gpt_extent {
+  uint64_t first, last;
+  unsigned idx;
+} gpt_extent;
+
+static int
+gpt_extent_cmp(const void *va, const void *vb){
+  const gpt_extent *a = va, *b = vb;
+
+  return a->first < b->first ? -1 : a->first > b->first;
+}
+
+int gpt_check_entries(const gpt_header *gh, const gpt_entry *gpe){
+  gpt_extent *ext;
+  unsigned z, n = 0;
+  int ret = 0;
+
+  if((ext = malloc(sizeof(*ext) * gh->partcount)) == NULL){
+    diag("Couldn't allocate %u extents (%s?)\n", gh->partcount, strerror(errno));
     return -1;
   }
-  return 0;
+  for(z = 0 ; z < gh->partcount ; ++z){
+    if(!gpe_used_p(&gpe[z])){
+      continue;
+    }
+    if(gpe[z].first_lba > gpe[z].last_lba || gpe[z].first_lba < gh->first_usable ||
+        gpe[z].last_lba > gh->last_usable){
+      diag("Partition %u (%ju:%ju) lies outside usable area (%ju:%ju)\n", z + 1,
+          (uintmax_t)gpe[z].first_lba, (uintmax_t)gpe[z].last_lba,
+          (uintmax_t)gh->first_usable, (uintmax_t)gh->last_usable);
+      ret = -1;
+    }
+    ext[n].first = gpe[z].first_lba;
+    ext[n].last = gpe[z].last_lba;
+    ext[n].idx = z;
+    ++n;
+  }
+  qsort(ext, n, sizeof(*ext), gpt_extent_cmp);
+  for(z = 1 ; z < n ; ++z){
+    if(ext[z].first <= ext[z - 1].last){
+      diag("Partition overlap ([%u]%ju:%ju) ([%u]%ju:%ju)\n",
+          ext[z - 1].idx + 1, (uintmax_t)ext[z - 1].first, (uintmax_t)ext[z - 1].last,
+          ext[z].idx + 1, (uintmax_t)ext[z].first, (uintmax_t)ext[z].last);
+      ret = -1;
+    }
+  }
+  free(ext);
+  return ret;
 }
 
-int flag_gpt(device *d, uint64_t flag, unsigned status){
-  gpt_entry *gpe;
-  size_t mapsize;
-  void *map;
-  int fd;
+static inline int
+gpe_moved_p(const gpt_entry *a, const gpt_entry *b){
+  return gpe_used_p(a) != gpe_used_p(b) || a->first_lba != b->first_lba ||
+         a->last_lba != b->last_lba;
+}
 
-  assert(d->layout == LAYOUT_PARTITION);
-  if((map = map_gpt(d->partdev.parent, &mapsize, &fd, LBA_SIZE)) == MAP_FAILED){
+// Inform the kernel of partitions which have vanished, moved, or appeared.
+static int
+gpt_txn_blkpg(gpt_txn *t){
+  const gpt_header *gh = t->ghead;
+  int ret = 0;
+  unsigned z;
+
+  for(z = 0 ; z < gh->partcount ; ++z){
+    const gpt_entry *o = &t->orig[z];
+
+    if(gpe_used_p(o) && gpe_moved_p(o, &t->gpe[z])){
+      if(blkpg_del_partition(t->b.fd, o->first_lba * t->b.lbasize,
+                             (o->last_lba - o->first_lba + 1) * t->b.lbasize,
+                             z + 1, t->b.name)){
+        ret = -1;
+      }
+    }
+  }
+  for(z = 0 ; z < gh->partcount ; ++z){
+    const gpt_entry *n = &t->gpe[z];
+
+    if(gpe_used_p(n) && gpe_moved_p(n, &t->orig[z])){
+      if(blkpg_add_partition(t->b.fd, n->first_lba * t->b.lbasize,
+                             (n->last_lba - n->first_lba + 1) * t->b.lbasize,
+                             z + 1, t->names[z][0] ? t->names[z] : t->b.name)){
+        ret = -1;
+      }
+    }
+  }
+  return ret;
+}
+
+int gpt_txn_commit(gpt_txn *t){
+  const uint64_t backuplba = t->ghead->backuplba;
+  void *backup;
+  int ret;
+
+  if(t->edits == 0){
+    gpt_txn_abort(t);
+    return 0;
+  }
+  if(gpt_check_entries(t->ghead, t->gpe) || update_crc(t->ghead, t->gpe)){
+    gpt_txn_abort(t);
     return -1;
   }
-  gpe = (gpt_entry *)((char *)map + 2 * LBA_SIZE);
-  if(status){
-    gpe[d->partdev.pnumber].flags |= flag;
-  }else{
-    gpe[d->partdev.pnumber].flags &= ~flag;
+  if((backup = blockio_alloc(&t->b, 1 + t->entlbas)) == NULL){
+    gpt_txn_abort(t);
+    return -1;
   }
-  if(unmap_gpt(d->partdev.parent, map, mapsize, fd, LBA_SIZE)){
-    close(fd);
+  gpt_backup(backup, t->ghead, t->gpe, t->entlbas, t->b.lbasize);
+  if(blockio_write(&t->b, t->ghead, t->ghead->lba, 1 + t->entlbas) ||
+      blockio_write(&t->b, backup, backuplba - t->entlbas, 1 + t->entlbas) ||
+      blockio_flush(&t->b)){
+    diag("Couldn't commit GPT to %s\n", t->b.name);
+    free(backup);
+    gpt_txn_abort(t);
     return -1;
   }
-  if(close(fd)){
-    diag("Error closing %s (%s?)\n", d->name, strerror(errno));
+  free(backup);
+  verbf("Committed %u GPT edit%s to %s\n", t->edits, t->edits == 1 ? "" : "s", t->b.name);
+  ret = gpt_txn_blkpg(t);
+  gpt_txn_abort(t);
+  return ret;
+}
+
+// The single-edit operations are each their own transaction.
+int add_gpt(device *d, const wchar_t *name, uintmax_t fsec, uintmax_t lsec, unsigned long long code){
+  gpt_txn *t;
+
+  if((t = gpt_txn_begin(d)) == NULL){
     return -1;
   }
-  return 0;
+  if(gpt_txn_add(t, name, fsec, lsec, code) < 0){
+    gpt_txn_abort(t);
+    return -1;
+  }
+  return gpt_txn_commit(t);
 }
 
-int code_gpt(device *d, unsigned long long code){
-  unsigned g = d->partdev.pnumber;
-  unsigned char tguid[GUIDSIZE];
-  gpt_entry *gpe;
-  size_t mapsize;
-  void *map;
-  int fd;
+int name_gpt(device *d, const wchar_t *name){
+  gpt_txn *t;
 
   assert(d->layout == LAYOUT_PARTITION);
-  if(get_gpt_guid(code, tguid)){
-    diag("Not a valid GPT typecode: %llu\n", code);
+  if((t = gpt_txn_begin(d->partdev.parent)) == NULL){
     return -1;
   }
-  if((map = map_gpt(d->partdev.parent, &mapsize, &fd, LBA_SIZE)) == MAP_FAILED){
+  if(gpt_txn_name(t, d->partdev.pnumber, name)){
+    gpt_txn_abort(t);
     return -1;
   }
-  gpe = (gpt_entry *)((char *)map + 2 * LBA_SIZE);
-  if(gpe[g].first_lba == 0 && gpe[g].last_lba == 0){
-    diag("Not a valid GPT partition: %s\n", d->name);
-    unmap_gpt(d->partdev.parent, map, mapsize, fd, LBA_SIZE);
-    close(fd);
+  return gpt_txn_commit(t);
+}
+
+int uuid_gpt(device *d, const void *uuid){
+  gpt_txn *t;
+
+  assert(d->layout == LAYOUT_PARTITION);
+  if((t = gpt_txn_begin(d->partdev.parent)) == NULL){
     return -1;
   }
-  memcpy(gpe[g].type_guid, tguid, sizeof(tguid));
-  if(unmap_gpt(d->partdev.parent, map, mapsize, fd, LBA_SIZE)){
-    close(fd);
+  if(gpt_txn_uuid(t, d->partdev.pnumber, uuid)){
+    gpt_txn_abort(t);
     return -1;
   }
-  if(close(fd)){
-    diag("Error closing %s (%s?)\n", d->name, strerror(errno));
+  return gpt_txn_commit(t);
+}
+
+int flags_gpt(device *d, uint64_t flag){
+  gpt_txn *t;
+
+  assert(d->layout == LAYOUT_PARTITION);
+  if((t = gpt_txn_begin(d->partdev.parent)) == NULL){
     return -1;
   }
-  return 0;
+  if(gpt_txn_flags(t, d->partdev.pnumber, flag)){
+    gpt_txn_abort(t);
+    return -1;
+  }
+  return gpt_txn_commit(t);
 }
 
-int del_gpt(const device *p){
-  gpt_entry *gpe;
-  size_t mapsize;
-  unsigned g;
-  void *map;
-  int fd, r;
+int flag_gpt(device *d, uint64_t flag, unsigned status){
+  gpt_txn *t;
 
-  assert(p->layout == LAYOUT_PARTITION);
-  g = p->partdev.pnumber - 1;
-  if((map = map_gpt(p->partdev.parent, &mapsize, &fd, LBA_SIZE)) == MAP_FAILED){
+  assert(d->layout == LAYOUT_PARTITION);
+  if((t = gpt_txn_begin(d->partdev.parent)) == NULL){
     return -1;
   }
-  gpe = (gpt_entry *)((char *)map + 2 * LBA_SIZE);
-  memset(&gpe[g], 0, sizeof(*gpe));
-  if(unmap_gpt(p->partdev.parent, map, mapsize, fd, LBA_SIZE)){
-    close(fd);
+  if(gpt_txn_flag(t, d->partdev.pnumber, flag, status)){
+    gpt_txn_abort(t);
     return -1;
   }
-  if(fsync(fd)){
-    diag("Couldn't sync %d for %s\n", fd, p->name);
+  return gpt_txn_commit(t);
+}
+
+int code_gpt(device *d, unsigned long long code){
+  gpt_txn *t;
+
+  assert(d->layout == LAYOUT_PARTITION);
+  if((t = gpt_txn_begin(d->partdev.parent)) == NULL){
+    return -1;
   }
-  r = blkpg_del_partition(fd, p->partdev.fsector * LBA_SIZE,
-        p->size, p->partdev.pnumber,
-        p->partdev.parent->name);
-  if(close(fd)){
-    diag("Couldn't close %s (%s?)\n", p->partdev.parent->name, strerror(errno));
+  if(gpt_txn_code(t, d->partdev.pnumber, code)){
+    gpt_txn_abort(t);
     return -1;
   }
-  return r;
+  return gpt_txn_commit(t);
 }
 
-uintmax_t first_gpt(const device *d){
-  gpt_header *ghead;
-  size_t mapsize;
-  uintmax_t r;
-  void *map;
-  int fd;
+int del_gpt(const device *p){
+  gpt_txn *t;
 
-  assert(d->layout == LAYOUT_NONE);
-  if((map = const_map_gpt(d, &mapsize, &fd, LBA_SIZE)) == MAP_FAILED){
-    return 0;
-  }
-  ghead = (gpt_header *)((char *)map + LBA_SIZE);
-  r = ghead->first_usable;
-  assert(r);
-  if(const_unmap_gpt(d, map, mapsize, fd)){
-    close(fd);
-    return 0;
+  assert(p->layout == LAYOUT_PARTITION);
+  if((t = gpt_txn_begin(p->partdev.parent)) == NULL){
+    return -1;
   }
-  if(close(fd)){
-    diag("Couldn't close GPT map %d on %s (%s?)\n", fd, d->name, strerror(errno));
-    return 0;
+  if(gpt_txn_del(t, p->partdev.pnumber)){
+    gpt_txn_abort(t);
+    return -1;
   }
-  assert(r);
-  return r;
+  return gpt_txn_commit(t);
 }
 
-uintmax_t last_gpt(const device *d){
-  gpt_header *ghead;
-  size_t mapsize;
-  uintmax_t r;
-  void *map;
-  int fd;
+uintmax_t first_gpt(const device *d, const blockcap *cap){
+  gpt_header gh;
 
-  assert(d->layout == LAYOUT_NONE);
-  if((map = const_map_gpt(d, &mapsize, &fd, LBA_SIZE)) == MAP_FAILED){
-    return 0;
-  }
-  ghead = (gpt_header *)((char *)map + LBA_SIZE);
-  r = ghead->last_usable;
-  if(const_unmap_gpt(d, map, mapsize, fd)){
-    close(fd);
+  if(read_gpt_header(d, cap, &gh)){
     return 0;
   }
-  if(close(fd)){
-    diag("Couldn't close GPT map %d on %s (%s?)\n", fd, d->name, strerror(errno));
+  return gh.first_usable;
+}
+
+uintmax_t last_gpt(const device *d, const blockcap *cap){
+  gpt_header gh;
+
+  if(read_gpt_header(d, cap, &gh)){
     return 0;
   }
-  return r;
+  return gh.last_usable;
 }
@@ -12,10 +12,12 @@ extern "C" {
 #define GUIDSIZE 16	// 128 opaque bits
 
 struct device;
+struct blockio;
+struct blockcap;
 
 // Pass the block device
-int new_gpt(struct device *);
-int zap_gpt(struct device *);
+int new_gpt(struct blockio *);
+int zap_gpt(struct blockio *);
 int add_gpt(struct device *,const wchar_t *,uintmax_t,uintmax_t,unsigned long long);
 
 // Pass the partition
@@ -26,8 +28,10 @@ int flag_gpt(struct device *,uint64_t,unsigned);
 int flags_gpt(struct device *,uint64_t);
 int code_gpt(struct device *,unsigned long long);
 
-uintmax_t first_gpt(const struct device *);
-uintmax_t last_gpt(const struct device *);
+// First and last usable LBAs from the primary header, taken from the capture
+// if it holds LBA 1 (it may be NULL).
+uintmax_t first_gpt(const struct device *, const struct blockcap *);
+uintmax_t last_gpt(const struct device *, const struct blockcap *);
 
 // One LBA block, padded with zeroes at the end. 92 bytes.
 typedef struct __attribute__ ((packed)) gpt_header {
@@ -68,6 +72,33 @@ typedef struct __attribute__ ((packed)) gpt_entry {
 // Update CRCs over GPT header and (->partcount >= MINIMUM_GPT_ENTRIES) GPT PEs
 int update_crc(gpt_header *head, const gpt_entry *gpes);
 
+// Verify that every used entry lies within the usable area described by the
+// header, and that no two entries overlap.
+int gpt_check_entries(const gpt_header *gh, const gpt_entry *gpes);
+
+// A transaction stages any number of edits to a disk's GPT in memory. Nothing
+// is written until gpt_txn_commit(), which validates the result once, writes
+// the primary and backup tables with a single flush, and then informs the
+// kernel of every partition added, removed or moved. The transaction is
+// freed by gpt_txn_commit() and gpt_txn_abort(), successful or not. Callers
+// ought rescan the device afterwards. Partitions are referenced by their
+// (1-based) numbers. Adding a partition consults the device, so edits must be
+// staged with the growlight lock held, but the commit touches only the
+// transaction, and can be made without it.
+typedef struct gpt_txn gpt_txn;
+
+gpt_txn *gpt_txn_begin(struct device *);
+// Returns the new partition's number
+int gpt_txn_add(gpt_txn *, const wchar_t *, uintmax_t, uintmax_t, unsigned long long);
+int gpt_txn_del(gpt_txn *, unsigned);
+int gpt_txn_name(gpt_txn *, unsigned, const wchar_t *);
+int gpt_txn_uuid(gpt_txn *, unsigned, const void *);
+int gpt_txn_flags(gpt_txn *, unsigned, uint64_t);
+int gpt_txn_flag(gpt_txn *, unsigned, uint64_t, unsigned);
+int gpt_txn_code(gpt_txn *, unsigned, unsigned long long);
+int gpt_txn_commit(gpt_txn *);
+void gpt_txn_abort(gpt_txn *);
+
 // Initialize the 'lbasize'-byte sector headed by 'gh' as a GPT primary. The
 // backup is at sector 'backuplba'. 'firstusable' is the first LBA at which an
 // actual partition may be placed. Provide a GUIDSIZE-byte UUID, or NULL for a
@@ -9,6 +9,7 @@
 #include <limits.h>
 #include <locale.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <getopt.h>
 #include <unistd.h>
 #include <dirent.h>
@@ -37,11 +38,12 @@
 #include "mbr.h"
 #include "zfs.h"
 #include "swap.h"
+#include "jobs.h"
 #include "udev.h"
 #include "nvme.h"
 #include "crypt.h"
 #include "mdadm.h"
-#include "popen.h"
+#include "dmstats.h"
 #include "smart.h"
 #include "sysfs.h"
 #include "stats.h"
@@ -49,7 +51,11 @@
 #include "mounts.h"
 #include "target.h"
 #include "threads.h"
+#include "blockio.h"
+#include "queue.h"
+#include "healthmon.h"
 #include "version.h"
+#include "bandwidth.h"
 #include "libblkid.h"
 #include "growlight.h"
 #include "aggregate.h"
@@ -70,9 +76,11 @@ int sysfd = -1; // Hold a reference to SYSROOT, for openat() etc
 int devfd = -1; // Hold a reference to DEVROOT
 
 static unsigned usepci;
+static unsigned autotune; // apply queue profiles to disks as they're found
 static const glightui *gui;
 static struct pci_access *pciacc;
 static pthread_mutex_t lock; // recursive, initialized in growlight_init()
+static __thread unsigned lockdepth; // how many times this thread holds lock
 
 static unsigned thrcount;
 static pthread_mutex_t barrier = PTHREAD_MUTEX_INITIALIZER;
@@ -92,67 +100,80 @@ static device *create_new_device(const char *);
 static device *create_new_device_inner(const char *);
 
 // Diagnostics. We keep the last MAXIMUM_LOG_ENTRIES records around for clients
-// to examine at their leisure, ala dmesg(1).
-static unsigned rblast;
-static logent logs[MAXIMUM_LOG_ENTRIES];
-static pthread_mutex_t loglock = PTHREAD_MUTEX_INITIALIZER;
+// to examine at their leisure, ala dmesg(1). Slots are preallocated, and
+// written without locking by any number of producers: a writer takes a ticket
+// from logseq, and the slot's stamp is odd (2 * ticket + 1) while it is being
+// written, and even (2 * ticket + 2) once it is committed. Readers copy a slot
+// and recheck its stamp, discarding anything that changed underneath them.
+typedef struct logslot {
+  _Atomic(uint64_t) stamp;
+  logent ent;
+} logslot;
+
+static _Atomic(uint64_t) logseq;
+static logslot logs[MAXIMUM_LOG_ENTRIES];
 
 const glightui *get_glightui(void){
   return gui;
 }
 
 static void
-add_log(const char *fmt, va_list vac){
-  va_list vacc;
-  char *b;
+add_log(logsev sev, const char *fmt, va_list vac){
+  uint64_t ticket = atomic_fetch_add(&logseq, 1);
+  logslot *ls = &logs[ticket % MAXIMUM_LOG_ENTRIES];
+  uint64_t old = atomic_load_explicit(&ls->stamp, memory_order_relaxed);
   int len;
 
-  va_copy(vacc,vac);
-  pthread_mutex_lock(&loglock);
-  if(++rblast == sizeof(logs) / sizeof(*logs)){
-    rblast = 0;
-  }
-  // FIXME reuse the entry!
-  len = vsnprintf(NULL, 0, fmt, vac);
-  if( (b = malloc(len + 1)) ){
-    logs[rblast].when = time(NULL);
-    if(logs[rblast].msg){
-      free(logs[rblast].msg);
-    }
-    logs[rblast].msg = b;
-    vsnprintf(b, len + 1, fmt, vacc);
-  }
-  pthread_mutex_unlock(&loglock);
-  va_end(vacc);
+  // Someone a full lap behind us still holds the slot, or someone a lap
+  // ahead of us already claimed it. Either way, drop the record rather than
+  // wait for them.
+  do{
+    if((old & 1) || old >= 2 * ticket + 1){
+      return;
+    }
+  }while(!atomic_compare_exchange_weak_explicit(&ls->stamp, &old, 2 * ticket + 1,
+                                                memory_order_acquire,
+                                                memory_order_relaxed));
+  ls->ent.when = time(NULL);
+  ls->ent.sev = sev;
+  len = vsnprintf(ls->ent.msg, sizeof(ls->ent.msg), fmt, vac);
+  if(len < 0){
+    ls->ent.msg[0] = '\0';
+  }else if((size_t)len >= sizeof(ls->ent.msg)){
+    ls->ent.msg[sizeof(ls->ent.msg) - 2] = '\n'; // keep the line terminated
+  }
+  atomic_store_explicit(&ls->stamp, 2 * ticket + 2, memory_order_release);
 }
 
 int get_logs(unsigned n, logent *cplogs){
+  uint64_t head, ticket;
   unsigned idx = 0;
-  unsigned rb;
 
   if(n == 0 || n > MAXIMUM_LOG_ENTRIES){
     return -1;
   }
-  pthread_mutex_lock(&loglock);
-  rb = rblast;
-  while(logs[rb].msg){
-    if((cplogs[idx].msg = strdup(logs[rb].msg)) == NULL){
-      while(idx){
-        free(cplogs[--idx].msg);
-      }
-      return -1;
+  head = atomic_load(&logseq);
+  // Walk back at most one lap from the most recent ticket. Slots which are
+  // being written, or which have been lapped while we copied them, are
+  // skipped.
+  for(ticket = head ; ticket && head - ticket < MAXIMUM_LOG_ENTRIES ; --ticket){
+    const logslot *ls = &logs[(ticket - 1) % MAXIMUM_LOG_ENTRIES];
+    uint64_t stamp = atomic_load_explicit(&ls->stamp, memory_order_acquire);
+
+    if(stamp != 2 * ticket){
+      continue;
     }
-    cplogs[idx].when = logs[rb].when;
-    if(rb-- == 0){
-      rb = sizeof(logs) / sizeof(*logs) - 1;
+    memcpy(&cplogs[idx], &ls->ent, sizeof(*cplogs));
+    atomic_thread_fence(memory_order_acquire);
+    if(atomic_load_explicit(&ls->stamp, memory_order_relaxed) != stamp){
+      continue;
     }
     if(++idx == n){
       break; // got all requested
     }
   }
-  pthread_mutex_unlock(&loglock);
   if(idx < n){
-    cplogs[idx].msg = NULL;
+    cplogs[idx].msg[0] = '\0';
   }
   return idx;
 }
@@ -163,25 +184,27 @@ void diag(const char *fmt,...){
   va_copy(vac, ap);
   if(gui){
     gui->vdiag(fmt, ap);
-    add_log(fmt, vac);
+    add_log(LOGSEV_DIAG, fmt, vac);
   }else{
     vfprintf(stderr, fmt, ap);
   }
   va_end(vac);
+  va_end(ap);
 }
 
+// Verbose output which won't be displayed isn't recorded, either; don't pay
+// for formatting it.
 void verbf(const char *fmt,...){
-  va_list ap;
-
-  va_start(ap,fmt);
-  if(verbose){
-    va_list vac;
+  va_list vac,ap;
 
-    va_copy(vac,ap);
-    gui->vdiag(fmt,vac);
-    va_end(vac);
+  if(!verbose){
+    return;
   }
-  add_log(fmt,ap);
+  va_start(ap,fmt);
+  va_copy(vac,ap);
+  gui->vdiag(fmt,vac);
+  va_end(vac);
+  add_log(LOGSEV_VERBOSE,fmt,ap);
   va_end(ap);
 }
 
@@ -331,19 +354,14 @@ find_pcie_controller(unsigned domain, unsigned bus, unsigned dev,
       if(data){
         c->pcie.gen = data & PCI_EXP_LNKSTA_SPEED;
         c->pcie.lanes_neg = (data & PCI_EXP_LNKSTA_WIDTH) >> 4u;
-        if(c->pcie.gen == 1){
-          c->bandwidth = 250u * 8u * 1000000ull;
-        }else if(c->pcie.gen == 2){
-          c->bandwidth = 500u * 8u * 1000000ull;
-        }else if(c->pcie.gen == 3){
-          c->bandwidth = 1000u * 8u * 1000000ull;
-        }else if(c->pcie.gen == 4){
-          c->bandwidth = 2000u * 8u * 1000000ull;
-        }
-        c->bandwidth *= c->pcie.lanes_neg;
+        c->bandwidth = pcie_lane_bw(c->pcie.gen) * c->pcie.lanes_neg;
       }
       pci_free_dev(pcidev);
     }
+    // without libpci (or its capability), fall back to sysfs
+    if(c->bandwidth == 0 && c->sysfs){
+      c->bandwidth = pcie_link_bw(c->sysfs, &c->pcie.gen, &c->pcie.lanes_neg);
+    }
     for(pre = &controllers ; *pre ; pre = &(*pre)->next){
       int r = (*pre)->ident ? strcmp(c->ident, (*pre)->ident) : -1;
 
@@ -376,9 +394,12 @@ internal_device_reset(device *d){
       free(d->blkdev.pttable); d->blkdev.pttable = NULL;
       free(d->blkdev.serial); d->blkdev.serial = NULL;
       free(d->blkdev.wwn); d->blkdev.wwn = NULL;
+      // a rescan reuses the device, so its health history (and polling
+      // interval) are kept; free_device() releases them
       if(d->c){
-        d->c->demand -= transport_bw(d->blkdev.transport);
+        d->c->demand -= device_bw(d);
       }
+      d->blkdev.linkbw = 0;
       break;
     }case LAYOUT_MDADM:{
       mdslave *md;
@@ -394,15 +415,25 @@ internal_device_reset(device *d){
       free(d->mddev.pttable); d->mddev.pttable = NULL;
       d->mddev.degraded = 0;
       d->mddev.resync = 0;
+      free(d->mddev.sync_action); d->mddev.sync_action = NULL;
       break;
     }case LAYOUT_DM:{
+      dmtarget *dt;
       mdslave *md;
 
+      // kept for the device's return, should this be a rescan
+      dmstats_detach(d);
       while( (md = d->dmdev.slaves) ){
         d->dmdev.slaves = md->next;
         free(md->name);
         free(md);
       }
+      while( (dt = d->dmdev.targets) ){
+        d->dmdev.targets = dt->next;
+        free(dt->type);
+        free(dt->devs);
+        free(dt);
+      }
       free(d->dmdev.level); d->dmdev.level = NULL;
       free(d->dmdev.uuid); d->dmdev.uuid = NULL;
       free(d->dmdev.dmname); d->dmdev.dmname = NULL;
@@ -441,6 +472,10 @@ free_device(device *d){
       }
     }
     internal_device_reset(d);
+    if(d->layout == LAYOUT_NONE){
+      free(d->blkdev.health);
+      d->blkdev.health = NULL;
+    }
     // FIXME might these not belong in internal_device_reset() also?
     free_stringlist(&d->mntops);
     free_stringlist(&d->mnt);
@@ -921,6 +956,7 @@ void add_new_virtual_blockdev(device *d){
 static inline device *
 rescan(const char *name,device *d){
   char buf[PATH_MAX] = "";
+  blockcap cap;
   int fd,r;
 
   // Not an optimization, but rather insurance that we don't perform an
@@ -929,6 +965,7 @@ rescan(const char *name,device *d){
     strcpy(d->name,name);
   }
   d->swapprio = SWAP_INVALID;
+  memset(&cap, 0, sizeof(cap));
   if(readlinkat(sysfd,name,buf,sizeof(buf)) < 0){
     diag("Couldn't read link at %s%s (%s)\n",
       SYSROOT,name,strerror(errno));
@@ -980,8 +1017,8 @@ rescan(const char *name,device *d){
     blkid_parttable ptbl;
     blkid_partlist ppl;
     blkid_probe pr;
+    int dfd = -1;
     int pars;
-    int dfd;
 
     if(d->layout == LAYOUT_NONE && d->blkdev.realdev){
       int roflag;
@@ -1017,22 +1054,32 @@ rescan(const char *name,device *d){
       }else if(d->c->transport == TRANSPORT_USB3){
         d->blkdev.transport = SERIAL_USB3;
       }
+      d->blkdev.linkbw = device_link_bw(d, buf);
+      verbf("\tLink: %juMbps\n", d->blkdev.linkbw / 1000000);
       if((d->blkdev.biossha1 = malloc(20)) == NULL){
         diag("Couldn't alloc SHA1 buf (%s)\n",strerror(errno));
         close(dfd);
         clobber_device(d);
         return NULL;
       }
-      if(mbrsha1(d, dfd, d->blkdev.biossha1)){
+      // Read the head and tail of the disk once. The MBR hash and partition
+      // table parsers work from the capture, and blkid probes the disk and
+      // its partitions through dfd, rather than each opening it anew.
+      if(blockcap_read(&cap, d, dfd) || mbrsha1(&cap, d->blkdev.biossha1)){
         verbf("Couldn't read MBR for %s\n", name);
         free(d->blkdev.biossha1);
         d->blkdev.biossha1 = NULL;
       }
-      close(dfd);
+      // Without a capture (most likely, there's no medium), leave blkid to
+      // open the device by name, so that it can tell us why it failed.
+      if(cap.head == NULL){
+        close(dfd);
+        dfd = -1;
+      }
     }
     snprintf(devbuf, sizeof(devbuf), DEVROOT "/%s", name);
     // FIXME move all this to its own function
-    if(probe_blkid_superblock(devbuf, &pr, d) == 0){
+    if(probe_blkid_superblock(devbuf, dfd, NULL, &pr, d) == 0){
       if( (ppl = blkid_probe_get_partitions(pr)) && (ptbl = blkid_partlist_get_table(ppl))){
         const char *pttable;
         device *p;
@@ -1047,45 +1094,60 @@ rescan(const char *name,device *d){
           case LAYOUT_DM: d->dmdev.pttable = strdup(pttable); break;
           default: diag("Bad layout %d\n",d->layout); assert(0); break;
         }
-        for(p = d->parts ; p ; p = p->next){
-          blkid_partition part;
-
-          part = blkid_partlist_devno_to_partition(ppl, p->devno);
-          if(part){
-            unsigned long long flags;
+        unsigned np = 0, z;
 
-            if(probe_blkid_superblock(p->name, NULL, p)){
-              clobber_device(d);
-              blkid_free_probe(pr);
-              return NULL;
+        for(p = d->parts ; p ; p = p->next){
+          ++np;
+        }
+        device *ps[np ? np : 1];
+        blkid_partition parts[np ? np : 1];
+        np = 0;
+        for(p = d->parts ; p ; p = p->next){
+          if( (parts[np] = blkid_partlist_devno_to_partition(ppl, p->devno)) ){
+            ps[np++] = p;
+          }
+        }
+        // Partitions are probed concurrently; if any fail, so does the disk.
+        if(probe_blkid_partitions(d, dfd, ps, parts, np)){
+          if(dfd >= 0){
+            close(dfd);
+          }
+          blockcap_free(&cap);
+          clobber_device(d);
+          blkid_free_probe(pr);
+          return NULL;
+        }
+        for(z = 0 ; z < np ; ++z){
+          blkid_partition part = parts[z];
+          unsigned long long flags;
+
+          p = ps[z];
+          flags = blkid_partition_get_flags(part);
+          if(strcmp(pttable, "gpt") == 0){
+            // FIXME verify bootable flag?
+          }else{
+            if(blkid_partition_is_logical(part)){
+              p->partdev.ptstate.logical = 1;
             }
-            flags = blkid_partition_get_flags(part);
-            if(strcmp(pttable, "gpt") == 0){
-              // FIXME verify bootable flag?
-            }else{
-              if(blkid_partition_is_logical(part)){
-                p->partdev.ptstate.logical = 1;
-              }
-              if(blkid_partition_is_extended(part)){
-                p->partdev.ptstate.extended = 1;
-              }
-              if(blkid_partition_is_primary(part)){
-                if(d->blkdev.biossha1){
-                  d->blkdev.biosboot = !zerombrp(d->blkdev.biossha1);
-                }
+            if(blkid_partition_is_extended(part)){
+              p->partdev.ptstate.extended = 1;
+            }
+            if(blkid_partition_is_primary(part)){
+              if(d->blkdev.biossha1){
+                d->blkdev.biosboot = !zerombrp(d->blkdev.biossha1);
               }
-              if((flags & 0xff) != 0){
-                if(p->partdev.ptype != PARTROLE_PRIMARY || ((flags & 0xffu) != 0x80)
-                    || p->partdev.ptstate.logical || p->partdev.ptstate.extended){
-                  diag("Warning: BIOS+MBR boot byte was %02llx on %s (0x%u)\n",
-                      flags & 0xffu,p->name,p->partdev.ptype);
-                }
+            }
+            if((flags & 0xff) != 0){
+              if(p->partdev.ptype != PARTROLE_PRIMARY || ((flags & 0xffu) != 0x80)
+                  || p->partdev.ptstate.logical || p->partdev.ptstate.extended){
+                diag("Warning: BIOS+MBR boot byte was %02llx on %s (0x%u)\n",
+                    flags & 0xffu,p->name,p->partdev.ptype);
               }
             }
-            p->partdev.flags = flags;
+          }
+          p->partdev.flags = flags;
 // BIOS boot flag byte ought not be set to anything but 0 unless we're on a
 // primary partition and doing BIOS+MBR booting, in which case it must be 0x80.
-          }
         }
       }else{
         verbf("\tNo partition table\n");
@@ -1099,12 +1161,19 @@ rescan(const char *name,device *d){
       blkid_free_probe(pr);
     }else if((d->layout != LAYOUT_NONE || !d->blkdev.removable) || errno != ENOMEDIUM){
       diag("Couldn't probe %s (%s)\n", name,strerror(errno));
+      if(dfd >= 0){
+        close(dfd);
+      }
+      blockcap_free(&cap);
       clobber_device(d);
       return NULL;
     }else{
       verbf("\tDevice is unloaded/inaccessible\n");
       d->blkdev.unloaded = 1;
     }
+    if(dfd >= 0){
+      close(dfd);
+    }
   }
   if(d->logsec || d->physsec){
     device *p;
@@ -1120,14 +1189,15 @@ rescan(const char *name,device *d){
     }
   }
   if(d->layout == LAYOUT_NONE){
-    d->blkdev.first_usable = lookup_first_usable_sector(d);
-    d->blkdev.last_usable = lookup_last_usable_sector(d);
+    d->blkdev.first_usable = lookup_first_usable_sector(d, &cap);
+    d->blkdev.last_usable = lookup_last_usable_sector(d, &cap);
   }
+  blockcap_free(&cap);
   lock_growlight();
     d->next = d->c->blockdevs;
     d->c->blockdevs = d;
     if(d->layout == LAYOUT_NONE){
-      d->c->demand += transport_bw(d->blkdev.transport);
+      d->c->demand += device_bw(d);
     }
     d->uistate = gui->block_event(d,d->uistate);
   unlock_growlight();
@@ -1147,7 +1217,16 @@ create_new_device_inner(const char *name){
     return NULL;
   }
   memset(d,0,sizeof(*d));
-  return rescan(name,d);
+  if((d = rescan(name,d)) && autotune){
+    const queueprofile *qp;
+
+    lock_growlight();
+    if( (qp = queue_profile_for(d)) ){
+      queue_profile_apply(d, qp);
+    }
+    unlock_growlight();
+  }
+  return d;
 }
 
 struct dlist {
@@ -1265,6 +1344,27 @@ device *lookup_device(const char *name){
   return d;
 }
 
+device *find_device(const char *name){
+  controller *c;
+  device *d;
+
+  for(c = controllers ; c ; c = c->next){
+    for(d = c->blockdevs ; d ; d = d->next){
+      device *p;
+
+      if(strcmp(name, d->name) == 0){
+        return d;
+      }
+      for(p = d->parts ; p ; p = p->next){
+        if(strcmp(name, p->name) == 0){
+          return p;
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
 static void *
 scan_mdalias(void *vname){
   char buf[PATH_MAX + 1], path[PATH_MAX + 1];
@@ -1506,7 +1606,7 @@ version(const char *name){
 static void
 usage(const char *name, int disphelp){
   diag("usage: %s [ -h|--help ] [ -v|--verbose ] [ -V|--version ]\n"
-    "\t[ -t|--target=path ] [ --notroot ] [ -i|--import ]%s\n",
+    "\t[ -t|--target=path ] [ --notroot ] [ -i|--import ] [ --tune ]%s\n",
     name, disphelp ? " [ --disphelp ]" : "");
 }
 
@@ -1693,6 +1793,8 @@ event_posix_thread(void *unsafe){
           if(statcount >= 0){
             update_stats(dstats, &timeq, statcount);
           }
+          md_sync_poll();
+          dmstats_poll();
           unlock_growlight();
           if(statcount >= 0){
             free(dstats);
@@ -1931,6 +2033,11 @@ int growlight_init(int argc, char * const *argv, const glightui *ui, int *disphe
       .has_arg = 0,
       .flag = NULL,
       .val = 'V',
+    }, {
+      .name = "tune",
+      .has_arg = 0,
+      .flag = NULL,
+      .val = 'Q',
     }, {
       .name = "disphelp",
       .has_arg = 0,
@@ -2000,6 +2107,9 @@ int growlight_init(int argc, char * const *argv, const glightui *ui, int *disphe
     }case 'R':{
       notroot = 1;
       break;
+    }case 'Q':{
+      autotune = 1;
+      break;
     }case 'D':{
       if(!detcopy){
         diag("Error: unknown option --disphelp\n");
@@ -2099,6 +2209,9 @@ int growlight_init(int argc, char * const *argv, const glightui *ui, int *disphe
   if(event_thread(fd, udevfd, syswd, bypathwd, byidwd, mdwd)){
     goto err;
   }
+  if(healthmon_start()){
+    goto err;
+  }
   return 0;
 
 err:
@@ -2111,10 +2224,18 @@ err:
 int growlight_stop(int retcode){
   int r = 0;
 
+  // Job threads use devices, controllers and the event thread's state
+  diag("Stopping jobs...\n");
+  r |= jobs_stop();
   diag("Killing the event thread...\n");
   r |= kill_event_thread();
+  diag("Stopping the health monitor...\n");
+  r |= healthmon_stop();
   /*diag("Closing libblkid...\n");
   r |= close_blkid();*/
+  lock_growlight();
+  dmstats_shutdown();
+  unlock_growlight();
   diag("Freeing devtable...\n");
   free_devtable();
   if(usepci){
@@ -2173,19 +2294,6 @@ int reset_controller(controller *c){
   return 0;
 }
 
-int benchmark_blockdev(const device *d){
-  char buf[PATH_MAX];
-
-  if(snprintf(buf, sizeof(buf), "hdparm -t /dev/%s", d->name) >= (int)sizeof(buf)){
-    diag("Name too long: %s\n", d->name);
-    return -1;
-  }
-  if(popen_drain(buf)){
-    return -1;
-  }
-  return 0;
-}
-
 // Tell the kernel to rescan the device. This shouldn't really ever be
 // necessary except (a) on initialization, if the kernel doesn't have an
 // understanding equivalent to what we detect or (b) if some external process
@@ -2234,12 +2342,33 @@ int rescan_blockdev_blkrrpart(const device *d){
 
 void lock_growlight(void){
   pthread_mutex_lock(&lock);
+  ++lockdepth;
 }
 
 void unlock_growlight(void){
+  --lockdepth;
   pthread_mutex_unlock(&lock);
 }
 
+unsigned growlight_locked(void){
+  return lockdepth;
+}
+
+unsigned release_growlight(void){
+  unsigned held = lockdepth;
+
+  while(lockdepth){
+    unlock_growlight();
+  }
+  return held;
+}
+
+void reacquire_growlight(unsigned held){
+  while(held--){
+    lock_growlight();
+  }
+}
+
 int rescan_device(const char *name){
   device **lnk;
   controller *c;
@@ -40,6 +40,7 @@ extern int sysfd,devfd;
 	// This isn't really suitable for use as a library to programs beyond
 	// growlight. Not yet, in any case.
 
+struct jobinfo;
 struct controller;
 
 // Growlight's callback-based UI
@@ -60,6 +61,10 @@ typedef struct growlight_ui {
 
 	// Controller state followed by block state
 	void (*block_free)(void *,void *);
+
+	// Called as jobs change state or make progress, from arbitrary
+	// threads, without the growlight lock held (can be NULL)
+	void (*job_event)(const struct jobinfo *);
 } glightui;
 
 const glightui *get_glightui(void);
@@ -76,6 +81,16 @@ typedef struct mdslave {
 	struct mdslave *next;		// Next in this md device
 } mdslave;
 
+// One line of a device-mapper table. Parameters aren't kept, as they can
+// include key material; only the devices they name.
+typedef struct dmtarget {
+	uint64_t start;			// First sector mapped
+	uint64_t length;		// Sectors mapped
+	char *type;			// "linear", "striped", "crypt"...
+	char *devs;			// Underlying devices, space-separated
+	struct dmtarget *next;
+} dmtarget;
+
 typedef enum {
 	TRANSPORT_UNKNOWN,
 	PARALLEL_ATA,
@@ -98,6 +113,31 @@ typedef enum {
 	RWVERIFY_SUPPORTED_ON,
 } rwverify_status;
 
+typedef enum {
+	ZONED_NONE,
+	ZONED_DRIVE,		// drive-managed (SMR behind a conventional interface)
+	ZONED_HOSTAWARE,
+	ZONED_HOSTMANAGED,
+} zoned_e;
+
+// Performance capabilities, from ATA IDENTIFY DEVICE and the SCSI Block
+// Limits (B0h) and Block Device Characteristics (B1h) VPD pages. Zero means
+// unknown or unsupported.
+typedef struct diskcaps {
+	unsigned ncq: 1;		// Native Command Queueing
+	unsigned trim: 1;		// TRIM (ATA) or UNMAP (SCSI)
+	unsigned drat: 1;		// Deterministic Read After TRIM
+	unsigned rzat: 1;		// ...which returns zeroes
+	unsigned zoned: 2;		// zoned_e
+	unsigned queue_depth;		// NCQ queue depth
+	unsigned formfactor;		// VPD B1h nominal form factor code
+	uintmax_t satamax;		// fastest supported SATA rate, bps
+	uintmax_t satacur;		// negotiated SATA rate, bps
+	uint32_t optxfer;		// optimal transfer length, bytes
+	uint32_t optxfergran;		// optimal transfer length granularity
+	uint32_t unmapgran;		// optimal unmap granularity, bytes
+} diskcaps;
+
 typedef struct {
 	unsigned count;
 	char **list;
@@ -105,6 +145,16 @@ typedef struct {
 
 #define SSD_ROTATION -1
 
+// Declared outside of struct device so that C++ (the unit tests) sees the
+// enumerators at file scope.
+typedef enum {
+	LAYOUT_NONE,
+	LAYOUT_MDADM,
+	LAYOUT_DM,
+	LAYOUT_PARTITION,
+	LAYOUT_ZPOOL,
+} layout_e;
+
 // An (non-link) entry in the device hierarchy, representing a block-type
 // device (this includes hardware block devices, virtual block devices, and
 // partitions). A partition corresponds to one and only one block device (which
@@ -151,6 +201,8 @@ typedef struct device {
 	union { // keyed off value of "layout" enum below
 		struct {
 			transport_e transport;
+			uintmax_t linkbw;	// Negotiated link rate in bits per
+						//  second, 0 if unknown
 			unsigned realdev: 1;	// Is itself a real block device
 			unsigned removable: 1;	// Removable media
 			unsigned wcache: 1;	// Write cache enabled
@@ -161,6 +213,15 @@ typedef struct device {
 						//  2: supported, on
 						//  (see rwverify_status above)
 			unsigned unloaded: 1;	// No media loaded
+			unsigned ataid: 1;	// Answered ATA IDENTIFY DEVICE
+			unsigned lookahead: 2;	// Read look-ahead, as rwverify
+			unsigned apmsup: 1;	// Advanced Power Management
+			unsigned aamsup: 1;	// Automatic Acoustic Management
+			uint8_t apm;		// APM level, 0 if disabled
+			uint8_t aam;		// AAM level, 0 if disabled
+			unsigned apst: 2;	// NVMe APST, as rwverify
+			uint8_t powerstate;	// NVMe power state
+			diskcaps caps;		// Decoded from IDENTIFY / VPD
 			void *biossha1;		// SHA1 of first 440 bytes
 			char *pttable;		// Partition table type (can be NULL)
 			char *serial;		// Serial number (can be NULL)
@@ -176,6 +237,7 @@ typedef struct device {
 			int smart;		// -1 for no support, otherwise
 						//  SkSmartOverall enum values
 			uint64_t celsius;	// Last-polled temperature
+			struct healthlog *health; // Polled history (healthmon.h)
 		} blkdev;
 		struct { // mdadm (MDRAID)
 			unsigned long disks;	// RAID disks in md
@@ -186,7 +248,24 @@ typedef struct device {
 			transport_e transport;
 			unsigned long degraded;	// number of missing devices
 			char *pttable;		// Partition table type (can be NULL)
-			unsigned resync;
+			unsigned resync;	// sync_completed isn't "none"
+			// Resync/recovery progress, kept current by
+			// md_sync_poll() while the array is syncing
+			char *sync_action;	// "idle", "resync", "recover"...
+			uintmax_t sync_done;	// sectors completed of sync_total
+			uintmax_t sync_total;	// 0 while the sync is "delayed"
+			unsigned long sync_speed; // KiB/s, recent average
+			unsigned long sync_min;	// sync_speed_min, KiB/s
+			unsigned long sync_max;	// sync_speed_max, KiB/s
+			unsigned sync_min_local: 1; // limits set on this array,
+			unsigned sync_max_local: 1; //  not the system defaults
+			unsigned long stripe_cache; // stripes cached, 0 if not
+						//  RAID4/5/6
+			long group_threads;	// raid5 workers per NUMA group,
+						//  -1 if not RAID4/5/6
+			uintmax_t bitmap_chunk;	// write-intent bitmap chunk
+						//  in bytes, 0 if no bitmap
+			unsigned bitmap_file: 1; // bitmap is in an external file
 			uintmax_t stride;	// Chunk (stride in ext4 talk)
 			unsigned swidth;	// Stripe width (non-parity drives)
 		} mddev;
@@ -194,6 +273,8 @@ typedef struct device {
 			unsigned long disks;	// disks in DM
 			char *level;		// DM level
 			mdslave *slaves;	// DM components
+			dmtarget *targets;	// DM table, in order
+			struct dmstatmon *stats; // dm-stats monitor (dmstats.h)
 			char *uuid;
 			char *dmname;
 			transport_e transport;
@@ -227,13 +308,7 @@ typedef struct device {
 			unsigned state;		// POOL_STATE_[UN]AVAILABLE
 		} zpool;
 	};
-	enum {
-		LAYOUT_NONE,
-		LAYOUT_MDADM,
-		LAYOUT_DM,
-		LAYOUT_PARTITION,
-		LAYOUT_ZPOOL,
-	} layout;
+	layout_e layout;
 	struct device *parts;	// Partitions (can be NULL)
 	dev_t devno;		// Don't expose this non-persistent datum
 	statpack stats;		// Stats since device came online, as returned
@@ -276,11 +351,15 @@ typedef struct controller {
 			//  1.0: 2.5GT/s each way
 			//  2.0: 5GT/s each way
 			//  3.0: 8GT/s each way
+			//  4.0: 16GT/s each way
+			//  5.0: 32GT/s each way
+			//  6.0: 64GT/s each way (PAM4)
 			//
-			// 1.0 and 2.0 use 8/10 encoding, while 3.0 uses 8/128
-			// encoding. 1.0 thus gives you a peak of 250MB/s/lane,
-			// and 2.0 offers 500MB/s/lane. Further overheads can
-			// reduce the useful throughput.
+			// 1.0 and 2.0 use 8/10 encoding, 3.0 through 5.0 use
+			// 128/130 encoding, and 6.0 uses 242/256 FLITs. 1.0
+			// thus gives you a peak of 250MB/s/lane, and 2.0 offers
+			// 500MB/s/lane (see pcie_lane_bw()). Further overheads
+			// can reduce the useful throughput.
 			unsigned gen;
 			// A physical slot can be incompletely wired, allowing
 			// a card of n lanes to be used in a slot with only m
@@ -324,6 +403,9 @@ const controller *get_controllers(void);
 
 // These are similarly no good FIXME
 device *lookup_device(const char *name);
+// Like lookup_device(), but never creates the device; NULL if it's unknown.
+// growlight must be locked.
+device *find_device(const char *name);
 controller *lookup_controller(const char *name);
 
 // Supported partition table types
@@ -361,12 +443,19 @@ int rescan_controller(controller *);
 int rescan_blockdev(const device *);
 int rescan_blockdev_blkrrpart(const device *);
 
-int benchmark_blockdev(const device *);
-
 // Very coarse locking
 void lock_growlight(void);
 void unlock_growlight(void);
 
+// How many times the calling thread holds the lock (0 if it doesn't).
+unsigned growlight_locked(void);
+
+// Drop every hold the calling thread has on the lock, returning the count
+// for reacquire_growlight(). Any device pointer looked up under the lock is
+// suspect once it's been released; look devices up again by name.
+unsigned release_growlight(void);
+void reacquire_growlight(unsigned);
+
 int rescan_device(const char *);
 
 void add_new_virtual_blockdev(device *);
@@ -384,11 +473,28 @@ pcie_gen(unsigned gen){
 		case 1: return "1.0";
 		case 2: return "2.0";
 		case 3: return "3.0";
-    case 4: return "4.0";
+		case 4: return "4.0";
+		case 5: return "5.0";
+		case 6: return "6.0";
 		default: return "unknown";
 	}
 }
 
+// Usable bits per second of one lane, after line encoding: 8b/10b through
+// 2.0, 128b/130b through 5.0, and 242B/256B FLITs on 6.0.
+static inline uintmax_t
+pcie_lane_bw(unsigned gen){
+	switch(gen){
+		case 1: return 2500000000ull * 8 / 10;
+		case 2: return 5000000000ull * 8 / 10;
+		case 3: return 8000000000ull * 128 / 130;
+		case 4: return 16000000000ull * 128 / 130;
+		case 5: return 32000000000ull * 128 / 130;
+		case 6: return 64000000000ull * 242 / 256;
+		default: return 0;
+	}
+}
+
 static inline int
 parttype_aggregablep(unsigned pt){
 	const ptype *pptr;
@@ -421,11 +527,26 @@ transport_str(transport_e t){
 	 	t == AGGREGATE_MIXED ? "Mix" : "?";
 }
 
+static inline const char *
+zoned_str(unsigned z){
+	return z == ZONED_DRIVE ? "drive-managed" :
+		z == ZONED_HOSTAWARE ? "host-aware" :
+		z == ZONED_HOSTMANAGED ? "host-managed" : "none";
+}
+
+// VPD B1h NOMINAL FORM FACTOR
+static inline const char *
+formfactor_str(unsigned f){
+	return f == 1 ? "5.25\"" : f == 2 ? "3.5\"" : f == 3 ? "2.5\"" :
+		f == 4 ? "1.8\"" : f == 5 ? "<1.8\"" : "unknown";
+}
+
+// Nominal rate of the transport. NVMe is assumed to be PCIe 3.0 x4; prefer
+// device_bw(), which knows the negotiated link.
 static inline uintmax_t
 transport_bw(transport_e t){
-  // FIXME NVMe is dependent on PCIe version and number of links
 	return t == DIRECT_NVME ? 32000000000 :
-    t == SERIAL_USB3 ? 5000000000 :
+		t == SERIAL_USB3 ? 5000000000 :
 		t == SERIAL_USB2 ? 480000000 :
 		t == SERIAL_USB ? 12000000 :
 		t == SERIAL_ATAIII ? 6000000000 :
@@ -434,9 +555,17 @@ transport_bw(transport_e t){
 		t == PARALLEL_ATA ? 133000000 : 0;
 }
 
+static inline uintmax_t
+device_bw(const device *d){
+	if(d->layout != LAYOUT_NONE){
+		return 0;
+	}
+	return d->blkdev.linkbw ? d->blkdev.linkbw : transport_bw(d->blkdev.transport);
+}
+
 static inline const char *
 guidstr_be(const void *guid,char *str){
-	const unsigned char *gc = guid;
+	const unsigned char *gc = (const unsigned char *)guid;
 
 	sprintf(str,"%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
 			gc[3], gc[2], gc[1], gc[0], gc[5], gc[4], gc[7], gc[6], gc[8],
@@ -446,7 +575,7 @@ guidstr_be(const void *guid,char *str){
 
 static inline const char *
 guidstr(const void *guid,char *str){
-	const unsigned char *gc = guid;
+	const unsigned char *gc = (const unsigned char *)guid;
 
 	sprintf(str,"%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
 			gc[0], gc[1], gc[2], gc[3], gc[4], gc[5], gc[6], gc[7], gc[8],
@@ -458,16 +587,26 @@ guidstr(const void *guid,char *str){
 // lookup on a TSD (omphalos_ctx_key).
 void diagnostic(const char *,...) __attribute__ ((format (printf,1,2)));
 
+typedef enum {
+	LOGSEV_VERBOSE,		// verbf(), only recorded when verbose
+	LOGSEV_DIAG,		// diag()
+} logsev;
+
+// Longer messages are truncated (but remain newline-terminated).
+#define LOGENT_MSGLEN 256
+
 typedef struct logent {
-        char *msg;
-        time_t when;
+	char msg[LOGENT_MSGLEN];
+	time_t when;
+	logsev sev;
 } logent;
 
 #define MAXIMUM_LOG_ENTRIES 1024
 
-// Get up to the last n diagnostics. n should not be 0 nor greater than
-// MAXIMUM_LOG_ENTRIES. If there are less than n present, they'll be copied
-// into the first n logents; logent[n].msg will then be NULL.
+// Get up to the last n diagnostics, most recent first. n should not be 0 nor
+// greater than MAXIMUM_LOG_ENTRIES. No memory is allocated; the records are
+// copied into the caller's logents. If there are less than n present, they'll
+// be copied into the first n logents; logent[n].msg will then be empty.
 int get_logs(unsigned,logent *);
 
 static inline int
@@ -521,7 +660,7 @@ static inline int
 add_string(stringlist *sl,const char *s){
 	char **tmp;
 
-	if((tmp = realloc(sl->list,sizeof(*sl->list) * (sl->count + 1))) == NULL){
+	if((tmp = (char **)realloc(sl->list,sizeof(*sl->list) * (sl->count + 1))) == NULL){
 		return -1;
 	}
 	sl->list = tmp;
@@ -538,7 +677,7 @@ add_string_exclusive(stringlist *sl,const char *s){
 	if(string_included_p(sl,s)){
 		return 0;
 	}
-	if((tmp = realloc(sl->list,sizeof(*sl->list) * (sl->count + 1))) == NULL){
+	if((tmp = (char **)realloc(sl->list,sizeof(*sl->list) * (sl->count + 1))) == NULL){
 		return -1;
 	}
 	sl->list = tmp;
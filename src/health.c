@@ -1,31 +1,530 @@
 // copyright 2012–2021 nick black
-#include <assert.h>
+#include <poll.h>
+#include <limits.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/stat.h>
 
-#include "popen.h"
+#include "aio.h"
+#include "jobs.h"
 #include "health.h"
 #include "growlight.h"
 
-int badblock_scan(device *d, unsigned rw){
-	char cmd[PATH_MAX];
+// Checkpoints of in-progress (and the results of completed) scans live here,
+// keyed by the most stable identifier the device offers.
+#define BADBLOCK_STATEDIR "/var/lib/growlight"
+#define BADBLOCK_MAGIC "growlight-badblocks 1"
 
+#define BADBLOCK_QDEPTH 8
+#define BADBLOCK_CHUNK (1024 * 1024)
+#define BADBLOCK_PROGRESS_SEC 5
+#define BADBLOCK_CHECKPOINT_SEC 60
+
+// Each disk's scan proceeds in windows of up to BADBLOCK_QDEPTH chunks, all
+// outstanding at once. A read-write scan first writes a pattern over the
+// entire window, then reads it back. Chunks which fail or miscompare are
+// rescanned sector by sector once the window has drained, and the window is
+// committed to the checkpoint only then.
+typedef struct bbscan {
+	// copied from the device, which can be rescanned out from under us
+	char name[NAME_MAX + 1];
+	unsigned logsec;
+	int fd;
+	unsigned rw;
+	unsigned secsize;	// granularity of bad block reports
+	aioq q;
+	uintmax_t size;		// bytes to scan
+	uintmax_t next;		// start of current window
+	uintmax_t wend;		// end of current window
+	uintmax_t resumed;	// offset at which we started/resumed
+	unsigned writing;	// pattern write phase of a rw window
+	unsigned nfailed;
+	uintmax_t failed[BADBLOCK_QDEPTH];	// chunk offsets to rescan
+	uintmax_t *bad;		// bad logical sectors
+	unsigned nbad, badalloc;
+	uint64_t start, lastprog, lastckpt;
+	int err;
+	int done;
+	char ckpath[PATH_MAX];
+} bbscan;
+
+// The pattern is a function of the offset, so verification needn't keep a
+// copy of what was written.
+static void
+fill_pattern(void *buf, uintmax_t off, size_t len){
+	uint64_t *w = buf;
+	size_t z;
+
+	for(z = 0 ; z < len / sizeof(*w) ; ++z){
+		w[z] = (off + z * sizeof(*w)) ^ 0xa5a55a5a6b6bb6b6ull;
+	}
+}
+
+static int
+check_pattern(const void *buf, uintmax_t off, size_t len){
+	const uint64_t *w = buf;
+	size_t z;
+
+	for(z = 0 ; z < len / sizeof(*w) ; ++z){
+		if(w[z] != ((off + z * sizeof(*w)) ^ 0xa5a55a5a6b6bb6b6ull)){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// lba is in logical blocks, while partition extents are in 512-byte units.
+// The device is looked up anew, since it might have been rescanned (or
+// removed) since the scan began. growlight must be locked.
+static const char *
+bad_partition(const bbscan *s, uintmax_t lba){
+	uintmax_t sector = lba * (s->logsec / 512);
+	const device *d, *p;
+
+	if((d = find_device(s->name)) == NULL){
+		return NULL;
+	}
+	for(p = d->parts ; p ; p = p->next){
+		if(p->partdev.fsector <= sector && p->partdev.lsector >= sector){
+			return p->name;
+		}
+	}
+	return NULL;
+}
+
+static int
+add_bad(bbscan *s, uintmax_t lba){
+	const char *pname;
+
+	if(s->nbad == s->badalloc){
+		unsigned na = s->badalloc ? s->badalloc * 2 : 64;
+		uintmax_t *tmp;
+
+		if((tmp = realloc(s->bad, sizeof(*tmp) * na)) == NULL){
+			diag("Couldn't record bad sector %ju on %s (%s?)\n",
+				lba, s->name, strerror(errno));
+			return -1;
+		}
+		s->bad = tmp;
+		s->badalloc = na;
+	}
+	s->bad[s->nbad++] = lba;
+	lock_growlight();
+	pname = bad_partition(s, lba);
+	diag("Bad sector %ju on %s%s%s%s\n", lba, s->name,
+		pname ? " (" : "", pname ? pname : "", pname ? ")" : "");
+	unlock_growlight();
+	return 0;
+}
+
+static int
+checkpoint_path(const device *d, char *path, size_t len){
+	const char *id = d->blkdev.wwn ? d->blkdev.wwn :
+		d->blkdev.serial ? d->blkdev.serial : d->name;
+	char *c;
+	int r;
+
+	r = snprintf(path, len, "%s/badblocks-%s", BADBLOCK_STATEDIR, id);
+	if(r < 0 || (size_t)r >= len){
+		diag("Bad name: %s\n", id);
+		return -1;
+	}
+	for(c = path + strlen(BADBLOCK_STATEDIR) + 1 ; *c ; ++c){
+		if(*c == '/' || *c == ' '){
+			*c = '_';
+		}
+	}
+	return 0;
+}
+
+static int
+write_checkpoint(bbscan *s){
+	char tmp[PATH_MAX + 4];
+	unsigned z;
+	FILE *fp;
+
+	if(mkdir(BADBLOCK_STATEDIR, 0755) && errno != EEXIST){
+		diag("Couldn't mkdir %s (%s?)\n", BADBLOCK_STATEDIR, strerror(errno));
+		return -1;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.new", s->ckpath);
+	if((fp = fopen(tmp, "we")) == NULL){
+		diag("Couldn't open %s (%s?)\n", tmp, strerror(errno));
+		return -1;
+	}
+	fprintf(fp, "%s\ndevice %s\nsize %ju\nsector %u\nmode %s\nnext %ju\n",
+		BADBLOCK_MAGIC, s->name, s->size, s->secsize,
+		s->rw ? "rw" : "ro", s->next);
+	for(z = 0 ; z < s->nbad ; ++z){
+		fprintf(fp, "bad %ju\n", s->bad[z]);
+	}
+	if(fflush(fp) || fsync(fileno(fp))){
+		diag("Couldn't write %s (%s?)\n", tmp, strerror(errno));
+		fclose(fp);
+		unlink(tmp);
+		return -1;
+	}
+	if(fclose(fp)){
+		diag("Couldn't write %s (%s?)\n", tmp, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	if(rename(tmp, s->ckpath)){
+		diag("Couldn't rename %s (%s?)\n", tmp, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+// Pick up where an interrupted scan of the same device, in the same mode,
+// left off. A missing, mismatched, or complete checkpoint starts afresh.
+static int
+load_checkpoint(bbscan *s){
+	char line[128], mode[3];
+	unsigned secsize;
+	uintmax_t v;
+	FILE *fp;
+
+	if((fp = fopen(s->ckpath, "re")) == NULL){
+		return 0;
+	}
+	if(fgets(line, sizeof(line), fp) == NULL || strncmp(line, BADBLOCK_MAGIC, strlen(BADBLOCK_MAGIC))){
+		fclose(fp);
+		return 0;
+	}
+	while(fgets(line, sizeof(line), fp)){
+		if(sscanf(line, "size %ju", &v) == 1){
+			if(v != s->size){
+				break;
+			}
+		}else if(sscanf(line, "sector %u", &secsize) == 1){
+			if(secsize != s->secsize){
+				break;
+			}
+		}else if(sscanf(line, "mode %2s", mode) == 1){
+			if(strcmp(mode, s->rw ? "rw" : "ro")){
+				break;
+			}
+		}else if(sscanf(line, "next %ju", &v) == 1){
+			if(v >= s->size || v % BADBLOCK_CHUNK){
+				break;
+			}
+			s->next = v;
+		}else if(sscanf(line, "bad %ju", &v) == 1){
+			if(s->nbad == s->badalloc){
+				unsigned na = s->badalloc ? s->badalloc * 2 : 64;
+				uintmax_t *tmp;
+
+				if((tmp = realloc(s->bad, sizeof(*tmp) * na)) == NULL){
+					break;
+				}
+				s->bad = tmp;
+				s->badalloc = na;
+			}
+			s->bad[s->nbad++] = v;
+		}
+	}
+	if(!feof(fp)){ // mismatch; discard whatever we picked up
+		s->next = 0;
+		s->nbad = 0;
+	}
+	fclose(fp);
+	if(s->next){
+		diag("Resuming scan of %s at %ju (%u bad sectors so far)\n",
+			s->name, s->next, s->nbad);
+	}
+	return 0;
+}
+
+static void
+bbscan_complete(aioq *q, unsigned slot, long res, uint64_t lat, void *vs){
+	const struct iocb *cb = &q->cbs[slot];
+	bbscan *s = vs;
+	unsigned z;
+
+	(void)lat;
+	if(res == (long)cb->aio_nbytes){
+		if(!s->rw || s->writing || !check_pattern(q->bufs[slot], cb->aio_offset, res)){
+			return;
+		}
+	}
+	for(z = 0 ; z < s->nfailed ; ++z){
+		if(s->failed[z] == (uintmax_t)cb->aio_offset){
+			return;
+		}
+	}
+	s->failed[s->nfailed++] = cb->aio_offset;
+}
+
+// Rescan a failed chunk one sector at a time, synchronously.
+static int
+rescan_chunk(bbscan *s, uintmax_t off){
+	unsigned char *buf = s->q.bufs[0];
+	uintmax_t end, sec;
+	size_t len;
+
+	end = off + BADBLOCK_CHUNK > s->size ? s->size : off + BADBLOCK_CHUNK;
+	for(sec = off ; sec < end ; sec += len){
+		int bad = 0;
+
+		len = end - sec < s->secsize ? end - sec : s->secsize;
+		if(s->rw){
+			fill_pattern(buf, sec, len);
+			if(pwrite(s->fd, buf, len, sec) != (ssize_t)len){
+				bad = 1;
+			}
+		}
+		if(!bad && pread(s->fd, buf, len, sec) != (ssize_t)len){
+			bad = 1;
+		}
+		if(!bad && s->rw && check_pattern(buf, sec, len)){
+			bad = 1;
+		}
+		if(bad && add_bad(s, sec / s->logsec)){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+submit_window(bbscan *s){
+	uintmax_t off;
+
+	for(off = s->next ; off < s->wend ; off += BADBLOCK_CHUNK){
+		unsigned len = s->wend - off < BADBLOCK_CHUNK ? s->wend - off : BADBLOCK_CHUNK;
+		unsigned char *buf;
+
+		if(s->writing && (buf = aioq_nextbuf(&s->q))){
+			fill_pattern(buf, off, len);
+		}
+		if(aioq_submit(&s->q, s->writing, off, len) < 0){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Called whenever the scan's queue has drained: finish the current window
+// (if any), and start the next one.
+static int
+bbscan_advance(bbscan *s){
+	unsigned z;
+
+	if(s->wend){
+		if(s->writing){
+			s->writing = 0;
+			return submit_window(s);
+		}
+		for(z = 0 ; z < s->nfailed ; ++z){
+			if(rescan_chunk(s, s->failed[z])){
+				return -1;
+			}
+		}
+		s->nfailed = 0;
+		s->next = s->wend;
+	}
+	if(s->next >= s->size){
+		s->done = 1;
+		return 0;
+	}
+	s->wend = s->next + (uintmax_t)BADBLOCK_QDEPTH * BADBLOCK_CHUNK;
+	if(s->wend > s->size){
+		s->wend = s->size;
+	}
+	s->writing = s->rw;
+	return submit_window(s);
+}
+
+static void
+bbscan_progress(const bbscan *s, uint64_t now){
+	uintmax_t bps = 0;
+
+	if(now > s->start){
+		bps = (s->next - s->resumed) * 1000000000ull / (now - s->start);
+	}
+	diag("%s: %ju/%ju MiB (%.2f%%) at %ju MiB/s, %u bad sectors\n",
+		s->name, s->next >> 20, s->size >> 20,
+		s->next * 100.0 / s->size, bps >> 20, s->nbad);
+}
+
+static int
+bbscan_init(bbscan *s, const char *name, unsigned rw){
+	const device *d;
+
+	memset(s, 0, sizeof(*s));
+	s->fd = -1;
+	s->rw = rw;
+	lock_growlight();
+	if((d = find_device(name)) == NULL){
+		diag("Couldn't find device %s\n", name);
+		goto err;
+	}
 	if(d->layout != LAYOUT_NONE){
 		diag("Block scans are performed only on raw block devices\n");
-		return -1;
+		goto err;
+	}
+	if(d->logsec == 0 || d->size == 0){
+		diag("No media in %s\n", d->name);
+		goto err;
+	}
+	if(rw && d->roflag){
+		diag("%s is read-only\n", d->name);
+		goto err;
 	}
-	// FIXME supply -b blocksize argument!
-	if(snprintf(cmd, sizeof(cmd), "badblocks -v -s %s /dev/%s",
-		rw ? d->mnt.count ? "-n" : "-w" : "", d->name) >= (int)sizeof(cmd)){
-		diag("Bad name: %s\n", d->name);
+	snprintf(s->name, sizeof(s->name), "%s", d->name);
+	s->logsec = d->logsec;
+	s->secsize = d->physsec ? d->physsec : d->logsec;
+	s->size = d->size / d->logsec * d->logsec;
+	if(checkpoint_path(d, s->ckpath, sizeof(s->ckpath))){
+		goto err;
+	}
+	unlock_growlight();
+	// O_EXCL refuses devices which are mounted or otherwise claimed
+	if((s->fd = openat(devfd, s->name, (rw ? O_RDWR|O_EXCL : O_RDONLY)|O_CLOEXEC|O_DIRECT)) < 0){
+		diag("Couldn't open %s%s (%s?)\n", s->name, rw ? " exclusively" : "", strerror(errno));
 		return -1;
 	}
-	if(popen_drain(cmd)){
+	if(aioq_init(&s->q, s->fd, BADBLOCK_QDEPTH, BADBLOCK_CHUNK)){
+		close(s->fd);
+		s->fd = -1;
 		return -1;
 	}
+	load_checkpoint(s);
+	s->resumed = s->next;
+	s->start = s->lastprog = s->lastckpt = aioq_nsec();
 	return 0;
+
+err:
+	unlock_growlight();
+	return -1;
+}
+
+static int
+bbscan_finish(bbscan *s){
+	int ret = s->err;
+
+	aioq_destroy(&s->q);
+	if(close(s->fd)){
+		diag("Error closing %s (%s?)\n", s->name, strerror(errno));
+		ret = -1;
+	}
+	if(s->done){
+		if(write_checkpoint(s)){
+			ret = -1;
+		}
+		diag("Scan of %s complete: %u bad sector%s (recorded in %s)\n", s->name,
+			s->nbad, s->nbad == 1 ? "" : "s", s->ckpath);
+	}else{
+		write_checkpoint(s);
+		diag("Scan of %s interrupted at %ju; it will resume from there\n",
+			s->name, s->next);
+	}
+	free(s->bad);
+	return ret;
+}
+
+// Scan all n devices concurrently from this one thread, multiplexing their
+// completions via poll(2).
+int badblock_scan_multi(const char * const *names, unsigned n, unsigned rw){
+	struct pollfd pfds[n];
+	unsigned z, active;
+	bbscan *scans;
+	int ret = 0;
+
+	if(n == 0){
+		return 0;
+	}
+	if((scans = calloc(n, sizeof(*scans))) == NULL){
+		diag("Couldn't allocate scan state (%s?)\n", strerror(errno));
+		return -1;
+	}
+	for(z = 0 ; z < n ; ++z){
+		if(bbscan_init(&scans[z], names[z], rw)){
+			while(z--){
+				aioq_destroy(&scans[z].q);
+				close(scans[z].fd);
+				free(scans[z].bad);
+			}
+			free(scans);
+			return -1;
+		}
+	}
+	do{
+		uintmax_t done = 0, total = 0;
+		uint64_t now = aioq_nsec();
+		int cancelled = job_cancelled();
+
+		active = 0;
+		for(z = 0 ; z < n ; ++z){
+			bbscan *s = &scans[z];
+
+			done += s->next;
+			total += s->size;
+			pfds[z].fd = -1;
+			pfds[z].events = POLLIN;
+			if(s->done || s->err){
+				continue;
+			}
+			// let anything in flight land, then stop; the checkpoint
+			// will pick up from the last completed window
+			if(cancelled && s->q.inflight == 0){
+				s->err = -1;
+				continue;
+			}
+			if(aioq_reap(&s->q, 0, bbscan_complete, s) < 0){
+				s->err = -1;
+				continue;
+			}
+			if(cancelled){
+				pfds[z].fd = s->q.efd;
+				++active;
+				continue;
+			}
+			if(s->q.inflight == 0 && bbscan_advance(s)){
+				s->err = -1;
+				continue;
+			}
+			if(s->done){
+				continue;
+			}
+			if(now - s->lastprog >= BADBLOCK_PROGRESS_SEC * 1000000000ull){
+				bbscan_progress(s, now);
+				s->lastprog = now;
+			}
+			if(now - s->lastckpt >= BADBLOCK_CHECKPOINT_SEC * 1000000000ull){
+				write_checkpoint(s);
+				s->lastckpt = now;
+			}
+			pfds[z].fd = s->q.efd;
+			++active;
+		}
+		job_progress(done, total);
+		if(active && poll(pfds, n, 1000) < 0 && errno != EINTR){
+			diag("Error polling scans (%s?)\n", strerror(errno));
+			break;
+		}
+	}while(active);
+	for(z = 0 ; z < n ; ++z){
+		// drain anything left in flight following an error
+		while(scans[z].q.inflight){
+			if(aioq_reap(&scans[z].q, 1, bbscan_complete, &scans[z]) < 0){
+				break;
+			}
+		}
+		if(bbscan_finish(&scans[z])){
+			ret = -1;
+		}
+	}
+	free(scans);
+	return ret;
+}
+
+int badblock_scan(const char *name, unsigned rw){
+	return badblock_scan_multi(&name, 1, rw);
 }
@@ -6,9 +6,16 @@
 extern "C" {
 #endif
 
-struct device;
+// Scan a raw block device for unreadable sectors, reporting progress and each
+// bad sector via diag(). If rw is non-zero, a pattern is written and verified;
+// this destroys the device's contents, and requires that it not be in use.
+// Progress is checkpointed, and an interrupted scan resumes where it left off.
+// growlight is locked only to look up the named device and to report bad
+// sectors against its partitions.
+int badblock_scan(const char *,unsigned);
 
-int badblock_scan(struct device *,unsigned);
+// Scan several devices concurrently.
+int badblock_scan_multi(const char * const *,unsigned,unsigned);
 
 #ifdef __cplusplus
 }
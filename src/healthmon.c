@@ -0,0 +1,347 @@
+// copyright 2012–2021 nick black
+#include <time.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <atasmart.h>
+
+#include "nvme.h"
+#include "jobs.h"
+#include "smart.h"
+#include "healthmon.h"
+#include "growlight.h"
+
+// Most disks polled in any one second
+#define HEALTHMON_POLLS_PER_TICK 4
+// Failing disks back off exponentially, to no less than once an hour
+#define HEALTHMON_MAX_BACKOFF 3600
+
+typedef struct polltarget {
+	char name[NAME_MAX + 1];
+	unsigned nvme;
+	int r;			// result of the poll
+	int err;		// errno, if it failed
+	healthstat hs;
+} polltarget;
+
+static pthread_mutex_t monlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t moncond = PTHREAD_COND_INITIALIZER;
+static pthread_t montid;
+static unsigned running, stopping;
+
+static uint64_t
+sat_mul(uint64_t a, uint64_t b){
+	if(b && a > UINT64_MAX / b){
+		return UINT64_MAX;
+	}
+	return a * b;
+}
+
+static int
+poll_nvme(const char *name, healthstat *hs){
+	nvmehealth h;
+	int fd, r;
+
+	if((fd = openat(devfd, name, O_RDONLY|O_NONBLOCK|O_CLOEXEC)) < 0){
+		return -1;
+	}
+	r = nvme_health(fd, &h);
+	close(fd);
+	if(r){
+		return -1;
+	}
+	hs->smart = h.critical_warning ? SK_SMART_OVERALL_BAD_STATUS : SK_SMART_OVERALL_GOOD;
+	hs->celsius = h.celsius;
+	hs->percent_used = h.percent_used;
+	// data units are thousands of 512-byte blocks
+	hs->bytes_read = sat_mul(h.units_read, 512000);
+	hs->bytes_written = sat_mul(h.units_written, 512000);
+	hs->media_errors = h.media_errors;
+	hs->throttle_secs = h.throttle_secs;
+	if(h.media_written){
+		hs->wa_host = hs->bytes_written;
+		hs->wa_media = h.media_written;
+	}
+	return 0;
+}
+
+static int
+poll_ata(const char *name, healthstat *hs){
+	atahealth h;
+	int r;
+
+	if( (r = smart_health(name, &h)) ){
+		return r;
+	}
+	hs->smart = h.overall;
+	hs->celsius = h.celsius;
+	hs->bytes_read = sat_mul(h.lbas_read, 512);
+	hs->bytes_written = sat_mul(h.lbas_written, 512);
+	hs->media_errors = h.uncorrectable;
+	// Host program pages and FTL program pages together are every page
+	// programmed; the host's share is what it asked for.
+	if(h.host_pages){
+		hs->wa_host = h.host_pages;
+		hs->wa_media = h.host_pages + h.ftl_pages;
+	}
+	return 0;
+}
+
+static healthlog *
+healthlog_get(device *d){
+	healthlog *h;
+
+	if( (h = d->blkdev.health) ){
+		return h;
+	}
+	if((h = calloc(1, sizeof(*h))) == NULL){
+		return NULL;
+	}
+	h->interval = d->c->transport == TRANSPORT_NVME ?
+			HEALTHMON_NVME_INTERVAL : HEALTHMON_ATA_INTERVAL;
+	h->next = time(NULL);
+	d->blkdev.health = h;
+	return h;
+}
+
+static void
+healthlog_record(device *d, healthlog *h, const polltarget *t, time_t now){
+	const glightui *gui = get_glightui();
+	healthsample *s;
+	unsigned changed;
+
+	if(t->r > 0){ // asleep; try again at the usual time
+		return;
+	}
+	if(t->r < 0){
+		if(h->failures++ == 0){
+			verbf("Couldn't poll health of %s (%s?)\n", d->name, strerror(t->err));
+		}
+		if(h->failures < 8 && ((uint64_t)h->interval << h->failures) < HEALTHMON_MAX_BACKOFF){
+			h->next = now + ((time_t)h->interval << h->failures);
+		}else{
+			h->next = now + HEALTHMON_MAX_BACKOFF;
+		}
+		return;
+	}
+	h->failures = 0;
+	++h->polls;
+	h->last = t->hs;
+	h->last.when = now;
+	s = &h->samples[h->head];
+	s->when = now;
+	s->celsius = t->hs.celsius;
+	s->wa_host = t->hs.wa_host;
+	s->wa_media = t->hs.wa_media;
+	h->head = (h->head + 1) % HEALTH_HISTORY;
+	if(h->nsamples < HEALTH_HISTORY){
+		++h->nsamples;
+	}
+	changed = d->blkdev.smart != t->hs.smart;
+	d->blkdev.smart = t->hs.smart;
+	if(t->hs.celsius >= 0 && d->blkdev.celsius != (uint64_t)t->hs.celsius){
+		d->blkdev.celsius = t->hs.celsius;
+		changed = 1;
+	}
+	if(changed && gui){
+		d->uistate = gui->block_event(d, d->uistate);
+	}
+}
+
+// Choose the disks due for a poll, poll them without the lock held, and
+// record the results. The disks might have disappeared in the meantime, and
+// so are looked up anew by name.
+static void
+healthmon_tick(void){
+	polltarget ts[HEALTHMON_POLLS_PER_TICK];
+	const controller *c;
+	unsigned n = 0, z;
+	time_t now;
+
+	now = time(NULL);
+	lock_growlight();
+	for(c = get_controllers() ; c && n < HEALTHMON_POLLS_PER_TICK ; c = c->next){
+		device *d;
+
+		if(c->transport != TRANSPORT_ATA && c->transport != TRANSPORT_NVME){
+			continue;
+		}
+		for(d = c->blockdevs ; d && n < HEALTHMON_POLLS_PER_TICK ; d = d->next){
+			healthlog *h;
+
+			if(d->layout != LAYOUT_NONE || !d->blkdev.realdev || d->blkdev.unloaded){
+				continue;
+			}
+			if(c->transport == TRANSPORT_ATA && d->blkdev.smart < 0){
+				continue;
+			}
+			if((h = healthlog_get(d)) == NULL || h->interval == 0 || h->next > now){
+				continue;
+			}
+			if(jobs_running_on(d)){
+				continue;
+			}
+			h->next = now + h->interval;
+			memset(&ts[n], 0, sizeof(ts[n]));
+			snprintf(ts[n].name, sizeof(ts[n].name), "%s", d->name);
+			ts[n].nvme = c->transport == TRANSPORT_NVME;
+			++n;
+		}
+	}
+	unlock_growlight();
+	for(z = 0 ; z < n ; ++z){
+		polltarget *t = &ts[z];
+
+		t->hs.celsius = -1;
+		if(t->nvme){
+			t->r = poll_nvme(t->name, &t->hs);
+		}else{
+			t->r = poll_ata(t->name, &t->hs);
+		}
+		t->err = errno;
+	}
+	if(n == 0){
+		return;
+	}
+	now = time(NULL);
+	lock_growlight();
+	for(z = 0 ; z < n ; ++z){
+		device *d;
+
+		if((d = lookup_device(ts[z].name)) && d->layout == LAYOUT_NONE && d->blkdev.health){
+			healthlog_record(d, d->blkdev.health, &ts[z], now);
+		}
+	}
+	unlock_growlight();
+}
+
+static void *
+healthmon_thread(void *v){
+	(void)v;
+	pthread_mutex_lock(&monlock);
+	while(!stopping){
+		struct timespec ts;
+
+		pthread_mutex_unlock(&monlock);
+		healthmon_tick();
+		clock_gettime(CLOCK_REALTIME, &ts);
+		++ts.tv_sec;
+		pthread_mutex_lock(&monlock);
+		if(!stopping){
+			pthread_cond_timedwait(&moncond, &monlock, &ts);
+		}
+	}
+	pthread_mutex_unlock(&monlock);
+	return NULL;
+}
+
+int healthmon_start(void){
+	int r;
+
+	pthread_mutex_lock(&monlock);
+	if(running){
+		pthread_mutex_unlock(&monlock);
+		return 0;
+	}
+	stopping = 0;
+	if( (r = pthread_create(&montid, NULL, healthmon_thread, NULL)) ){
+		pthread_mutex_unlock(&monlock);
+		diag("Couldn't launch health monitor (%s?)\n", strerror(r));
+		return -1;
+	}
+	running = 1;
+	pthread_mutex_unlock(&monlock);
+	return 0;
+}
+
+// Must not be called with the growlight lock held, as the monitor might be
+// waiting on it.
+int healthmon_stop(void){
+	int r;
+
+	pthread_mutex_lock(&monlock);
+	if(!running){
+		pthread_mutex_unlock(&monlock);
+		return 0;
+	}
+	stopping = 1;
+	pthread_cond_signal(&moncond);
+	pthread_mutex_unlock(&monlock);
+	if( (r = pthread_join(montid, NULL)) ){
+		diag("Couldn't join health monitor (%s?)\n", strerror(r));
+		return -1;
+	}
+	pthread_mutex_lock(&monlock);
+	running = 0;
+	pthread_mutex_unlock(&monlock);
+	return 0;
+}
+
+int healthmon_set_interval(device *d, unsigned secs){
+	healthlog *h;
+
+	if(d->layout != LAYOUT_NONE || !d->blkdev.realdev){
+		diag("Health is only monitored on real block devices\n");
+		return -1;
+	}
+	if(d->c->transport != TRANSPORT_ATA && d->c->transport != TRANSPORT_NVME){
+		diag("%s is neither ATA nor NVMe\n", d->name);
+		return -1;
+	}
+	if(secs && secs < HEALTHMON_MIN_INTERVAL){
+		diag("Polling interval must be at least %us\n", HEALTHMON_MIN_INTERVAL);
+		return -1;
+	}
+	if((h = healthlog_get(d)) == NULL){
+		diag("Couldn't allocate health log (%s?)\n", strerror(errno));
+		return -1;
+	}
+	h->interval = secs;
+	h->failures = 0;
+	h->next = time(NULL);
+	return 0;
+}
+
+const healthsample *healthmon_sample(const healthlog *h, unsigned i){
+	if(i >= h->nsamples){
+		return NULL;
+	}
+	return &h->samples[(h->head + HEALTH_HISTORY - h->nsamples + i) % HEALTH_HISTORY];
+}
+
+int healthmon_temperature_range(const healthlog *h, int *min, int *max){
+	const healthsample *s;
+	unsigned z, found = 0;
+
+	for(z = 0 ; (s = healthmon_sample(h, z)) ; ++z){
+		if(s->celsius < 0){
+			continue;
+		}
+		if(!found++){
+			*min = *max = s->celsius;
+		}else if(s->celsius < *min){
+			*min = s->celsius;
+		}else if(s->celsius > *max){
+			*max = s->celsius;
+		}
+	}
+	return found ? 0 : -1;
+}
+
+double healthmon_write_amp(const healthlog *h){
+	const healthsample *first, *last;
+
+	if(h->nsamples == 0 || (last = healthmon_sample(h, h->nsamples - 1))->wa_host == 0){
+		return -1;
+	}
+	first = healthmon_sample(h, 0);
+	if(first->wa_host && last->wa_host > first->wa_host && last->wa_media >= first->wa_media){
+		return (double)(last->wa_media - first->wa_media) / (last->wa_host - first->wa_host);
+	}
+	return (double)last->wa_media / last->wa_host;
+}
@@ -0,0 +1,86 @@
+// copyright 2012–2021 nick black
+#ifndef GROWLIGHT_HEALTHMON
+#define GROWLIGHT_HEALTHMON
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <time.h>
+#include <stdint.h>
+
+struct device;
+
+// SMART (ATA) and Health Information (NVMe) data is polled in the background,
+// keeping blkdev.smart and blkdev.celsius current, and recording a short
+// history. Each disk is polled at its own interval; no more than a few disks
+// are polled in any second, and failing disks are polled ever less often.
+// Disks with running jobs are skipped, as are ATA disks in standby. The
+// history, and any interval set with healthmon_set_interval(), outlive
+// rescans of the disk, and are lost only when it goes away.
+#define HEALTH_HISTORY 128
+
+// Default and minimum intervals between polls of a disk, in seconds
+#define HEALTHMON_NVME_INTERVAL 60
+#define HEALTHMON_ATA_INTERVAL 300
+#define HEALTHMON_MIN_INTERVAL 10
+
+// One successful poll. Counters are the device's lifetime totals, and are 0
+// when the device doesn't report them.
+typedef struct healthstat {
+	time_t when;
+	int smart;		// SkSmartOverall value
+	int celsius;		// -1 if unknown
+	unsigned percent_used;	// NVMe estimate of endurance consumed
+	uint64_t bytes_read;	// host I/O, as counted by the device
+	uint64_t bytes_written;
+	uint64_t media_errors;	// NVMe media errors / ATA uncorrectables
+	uint64_t throttle_secs;	// time spent thermally throttled (NVMe)
+	// Host and media writes, in the same (device-specific) units, for
+	// estimating write amplification. Both are 0 if unsupported.
+	uint64_t wa_host, wa_media;
+} healthstat;
+
+typedef struct healthsample {
+	time_t when;
+	int celsius;
+	uint64_t wa_host, wa_media;
+} healthsample;
+
+typedef struct healthlog {
+	unsigned interval;	// seconds between polls; 0 disables polling
+	time_t next;		// time of the next poll
+	unsigned failures;	// consecutive failed polls
+	unsigned polls;		// successful polls
+	healthstat last;	// most recent successful poll
+	unsigned nsamples;	// valid samples, up to HEALTH_HISTORY
+	unsigned head;		// index at which the next sample is written
+	healthsample samples[HEALTH_HISTORY];
+} healthlog;
+
+int healthmon_start(void);
+int healthmon_stop(void);
+
+// The remainder must be called with the growlight lock held.
+
+// Set the disk's polling interval in seconds (0 disables polling), and poll
+// it at the next opportunity.
+int healthmon_set_interval(struct device *, unsigned);
+
+// The ith oldest sample, or NULL if there are fewer than i + 1.
+const healthsample *healthmon_sample(const healthlog *, unsigned);
+
+// Lowest and highest temperatures in the history. Returns -1 if no sample
+// recorded a temperature.
+int healthmon_temperature_range(const healthlog *, int *, int *);
+
+// Media writes per host write over the history, or over the device's life if
+// nothing was written during the history. Returns a negative value if the
+// device doesn't report media writes.
+double healthmon_write_amp(const healthlog *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,587 @@
+// copyright 2012–2021 nick black
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "fs.h"
+#include "ssd.h"
+#include "aio.h"
+#include "jobs.h"
+#include "bench.h"
+#include "health.h"
+#include "secure.h"
+#include "drivefeat.h"
+#include "growlight.h"
+
+// Progress is passed to the UI no more often than this
+#define JOB_NOTIFY_NSEC 1000000000ull
+
+// Devices can be freed by a rescan or removal at any time the growlight lock
+// isn't held, including while their jobs run, so jobs refer to them by name.
+typedef struct job {
+	unsigned id;
+	char desc[64];
+	char dev[NAME_MAX + 1];
+	char root[NAME_MAX + 1];	// whole-disk device containing dev
+	const controller *c;
+	uintmax_t bw;			// transport bandwidth charged to c
+	uintmax_t cbw;			// c's bandwidth when we were queued
+	jobfxn fxn;
+	jobdiscard discard;		// may be NULL
+	void *arg;
+	jobstate state;			// protected by joblock
+	_Atomic(unsigned) cancelled;
+	_Atomic(uintmax_t) done, total;
+	_Atomic(uint64_t) lastnotify;
+	time_t queued, started, finished;
+	struct job *next;
+} job;
+
+static pthread_mutex_t joblock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobcond = PTHREAD_COND_INITIALIZER;
+static job *jobs;		// most recent first
+static unsigned runners;	// job threads not yet finished with us
+static unsigned stopping;	// jobs_stop() was called
+static unsigned nextjobid = 1;
+static __thread job *curjob;
+
+const char *jobstate_str(jobstate s){
+	switch(s){
+		case JOB_QUEUED: return "queued";
+		case JOB_RUNNING: return "running";
+		case JOB_DONE: return "done";
+		case JOB_FAILED: return "failed";
+		case JOB_CANCELLED: return "cancelled";
+	}
+	return "unknown";
+}
+
+// Only immutable fields and atomics are read, save state; callers not holding
+// joblock must supply the state themselves.
+static void
+job_info(const job *j, jobstate state, jobinfo *ji){
+	memset(ji, 0, sizeof(*ji));
+	ji->id = j->id;
+	strcpy(ji->desc, j->desc);
+	strcpy(ji->dev, j->dev);
+	ji->state = state;
+	ji->done = atomic_load(&j->done);
+	ji->total = atomic_load(&j->total);
+	ji->queued = j->queued;
+	ji->started = j->started;
+	ji->finished = j->finished;
+}
+
+// Never call with joblock held; the UI will want to take its own locks, and
+// might well be calling into us holding them.
+static void
+job_notify(const jobinfo *ji){
+	const glightui *gui = get_glightui();
+
+	if(gui && gui->job_event){
+		gui->job_event(ji);
+	}
+}
+
+static int
+jobs_conflict(const job *a, const job *b){
+	if(strcmp(a->root, b->root)){
+		return 0;
+	}
+	return !strcmp(a->dev, b->dev) || !strcmp(a->dev, a->root) || !strcmp(b->dev, b->root);
+}
+
+static int
+job_admissible_locked(const job *j){
+	uintmax_t demand = 0;
+	unsigned running = 0;
+	const job *o;
+
+	for(o = jobs ; o ; o = o->next){
+		if(o->state != JOB_RUNNING){
+			continue;
+		}
+		if(jobs_conflict(j, o)){
+			return 0;
+		}
+		if(o->c == j->c){
+			++running;
+			demand += o->bw;
+		}
+	}
+	if(running == 0){
+		return 1;
+	}
+	if(j->cbw && j->bw){
+		return demand + j->bw <= j->cbw;
+	}
+	return running < JOBS_PER_CONTROLLER;
+}
+
+// Finish a job which will never run, handing back its argument. The caller
+// passes it to the discard function once joblock has been released.
+static void *
+job_abandon_locked(job *j){
+	void *arg = j->arg;
+
+	j->state = JOB_CANCELLED;
+	j->finished = time(NULL);
+	j->arg = NULL;
+	return arg;
+}
+
+static void
+job_discard(jobdiscard discard, void *arg){
+	if(discard){
+		discard(arg);
+	}
+	free(arg);
+}
+
+static void *job_thread(void *);
+
+// Start whatever the controllers can take, oldest jobs first. A job whose
+// thread can't be created stays queued, and is retried the next time a job
+// is submitted or finishes.
+static void
+schedule_locked(void){
+	unsigned n = 0, z;
+	job *j;
+
+	for(j = jobs ; j ; j = j->next){
+		n += j->state == JOB_QUEUED;
+	}
+	if(n == 0 || stopping){
+		return;
+	}
+	job *queued[n];
+	n = 0;
+	for(j = jobs ; j ; j = j->next){
+		if(j->state == JOB_QUEUED){
+			queued[n++] = j;
+		}
+	}
+	for(z = n ; z-- ; ){
+		pthread_attr_t attr;
+		pthread_t tid;
+		int r;
+
+		j = queued[z];
+		if(!job_admissible_locked(j)){
+			continue;
+		}
+		j->state = JOB_RUNNING;
+		j->started = time(NULL);
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if( (r = pthread_create(&tid, &attr, job_thread, j)) ){
+			j->state = JOB_QUEUED;
+			j->started = 0;
+		}else{
+			++runners;
+		}
+		pthread_attr_destroy(&attr);
+	}
+}
+
+static void *
+job_thread(void *vj){
+	job *j = vj;
+	jobinfo ji;
+	int r = 0;
+
+	curjob = j;
+	job_info(j, JOB_RUNNING, &ji);
+	job_notify(&ji);
+	lock_growlight();
+	if(find_device(j->dev) == NULL){
+		diag("%s went away before %s could run\n", j->dev, j->desc);
+		r = -1;
+	}
+	unlock_growlight();
+	if(r == 0){
+		r = j->fxn(j->dev, j->arg);
+	}else if(j->discard){
+		j->discard(j->arg);
+	}
+	pthread_mutex_lock(&joblock);
+	j->finished = time(NULL);
+	j->state = atomic_load(&j->cancelled) ? JOB_CANCELLED : r ? JOB_FAILED : JOB_DONE;
+	job_info(j, j->state, &ji);
+	free(j->arg);
+	j->arg = NULL;
+	schedule_locked();
+	pthread_mutex_unlock(&joblock);
+	// j may be freed by jobs_clear() from here on
+	curjob = NULL;
+	job_notify(&ji);
+	pthread_mutex_lock(&joblock);
+	if(--runners == 0){
+		pthread_cond_broadcast(&jobcond);
+	}
+	pthread_mutex_unlock(&joblock);
+	return NULL;
+}
+
+int job_submit_discard(const char *desc, device *d, jobfxn fxn, jobdiscard discard,
+			const void *arg, size_t arglen){
+	const device *root;
+	jobinfo ji;
+	job *j;
+	int id;
+
+	if((j = malloc(sizeof(*j))) == NULL){
+		diag("Couldn't allocate job (%s?)\n", strerror(errno));
+		return -1;
+	}
+	memset(j, 0, sizeof(*j));
+	if(arglen){
+		if((j->arg = malloc(arglen)) == NULL){
+			diag("Couldn't allocate job (%s?)\n", strerror(errno));
+			free(j);
+			return -1;
+		}
+		memcpy(j->arg, arg, arglen);
+	}
+	snprintf(j->desc, sizeof(j->desc), "%s", desc);
+	root = d->layout == LAYOUT_PARTITION && d->partdev.parent ? d->partdev.parent : d;
+	strcpy(j->dev, d->name);
+	strcpy(j->root, root->name);
+	j->c = d->c;
+	j->bw = device_bw(root);
+	j->cbw = d->c ? d->c->bandwidth : 0;
+	j->fxn = fxn;
+	j->discard = discard;
+	j->queued = time(NULL);
+	pthread_mutex_lock(&joblock);
+	if(stopping){
+		pthread_mutex_unlock(&joblock);
+		diag("Not accepting jobs while shutting down\n");
+		free(j->arg);
+		free(j);
+		return -1;
+	}
+	id = j->id = nextjobid++;
+	j->state = JOB_QUEUED;
+	j->next = jobs;
+	jobs = j;
+	job_info(j, JOB_QUEUED, &ji);
+	schedule_locked();
+	pthread_mutex_unlock(&joblock);
+	job_notify(&ji);
+	return id;
+}
+
+int job_submit(const char *desc, device *d, jobfxn fxn, const void *arg, size_t arglen){
+	return job_submit_discard(desc, d, fxn, NULL, arg, arglen);
+}
+
+int job_cancel(unsigned id){
+	jobdiscard discard = NULL;
+	void *arg = NULL;
+	jobinfo ji;
+	job *j;
+
+	pthread_mutex_lock(&joblock);
+	for(j = jobs ; j ; j = j->next){
+		if(j->id == id){
+			break;
+		}
+	}
+	if(j == NULL || (j->state != JOB_QUEUED && j->state != JOB_RUNNING)){
+		pthread_mutex_unlock(&joblock);
+		diag("No active job %u\n", id);
+		return -1;
+	}
+	atomic_store(&j->cancelled, 1);
+	if(j->state == JOB_QUEUED){
+		discard = j->discard;
+		arg = job_abandon_locked(j);
+	}
+	job_info(j, j->state, &ji);
+	pthread_mutex_unlock(&joblock);
+	job_discard(discard, arg);
+	job_notify(&ji);
+	return 0;
+}
+
+unsigned jobs_clear(void){
+	unsigned cleared = 0;
+	job **j, *tmp;
+
+	pthread_mutex_lock(&joblock);
+	for(j = &jobs ; *j ; ){
+		if((*j)->state != JOB_QUEUED && (*j)->state != JOB_RUNNING){
+			tmp = *j;
+			*j = tmp->next;
+			free(tmp);
+			++cleared;
+		}else{
+			j = &(*j)->next;
+		}
+	}
+	pthread_mutex_unlock(&joblock);
+	return cleared;
+}
+
+unsigned jobs_snapshot(jobinfo *jis, unsigned n){
+	unsigned idx = 0;
+	const job *j;
+
+	pthread_mutex_lock(&joblock);
+	for(j = jobs ; j && idx < n ; j = j->next){
+		job_info(j, j->state, &jis[idx++]);
+	}
+	pthread_mutex_unlock(&joblock);
+	return idx;
+}
+
+int jobs_running_on(const device *d){
+	const job *j;
+	int ret = 0;
+
+	pthread_mutex_lock(&joblock);
+	for(j = jobs ; j ; j = j->next){
+		if(j->state == JOB_RUNNING && (!strcmp(j->root, d->name) || !strcmp(j->dev, d->name))){
+			ret = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&joblock);
+	return ret;
+}
+
+int jobs_stop(void){
+	unsigned cancelled = 0;
+	job *j, *tmp;
+
+	pthread_mutex_lock(&joblock);
+	stopping = 1;
+	for(j = jobs ; j ; j = j->next){
+		if(j->state == JOB_RUNNING){
+			atomic_store(&j->cancelled, 1);
+			++cancelled;
+		}
+	}
+	// nothing new is queued once we're stopping, so this terminates
+	for( ; ; ){
+		jobdiscard discard;
+		void *arg;
+
+		for(j = jobs ; j ; j = j->next){
+			if(j->state == JOB_QUEUED){
+				break;
+			}
+		}
+		if(j == NULL){
+			break;
+		}
+		discard = j->discard;
+		arg = job_abandon_locked(j);
+		++cancelled;
+		pthread_mutex_unlock(&joblock);
+		job_discard(discard, arg);
+		pthread_mutex_lock(&joblock);
+	}
+	if(cancelled){
+		diag("Cancelled %u job%s\n", cancelled, cancelled == 1 ? "" : "s");
+	}
+	while(runners){
+		pthread_cond_wait(&jobcond, &joblock);
+	}
+	for(j = jobs ; j ; j = tmp){
+		tmp = j->next;
+		free(j);
+	}
+	jobs = NULL;
+	pthread_mutex_unlock(&joblock);
+	return 0;
+}
+
+int job_cancelled(void){
+	return curjob ? atomic_load(&curjob->cancelled) : 0;
+}
+
+void job_progress(uintmax_t done, uintmax_t total){
+	uint64_t now, last;
+	jobinfo ji;
+
+	if(curjob == NULL){
+		return;
+	}
+	atomic_store(&curjob->done, done);
+	atomic_store(&curjob->total, total);
+	now = aioq_nsec();
+	last = atomic_load(&curjob->lastnotify);
+	if(now - last < JOB_NOTIFY_NSEC){
+		return;
+	}
+	atomic_store(&curjob->lastnotify, now);
+	job_info(curjob, JOB_RUNNING, &ji);
+	job_notify(&ji);
+}
+
+struct wipeargs {
+	wipemethod method;
+	unsigned verify;
+};
+
+static int
+wipe_job(const char *dev, void *v){
+	const struct wipeargs *wa = v;
+
+	return wipe_blockdevs(&dev, 1, wa->method, wa->verify);
+}
+
+int job_wipe(device *d, wipemethod method, unsigned verify){
+	struct wipeargs wa = { .method = method, .verify = verify, };
+	char desc[64];
+
+	snprintf(desc, sizeof(desc), "wipe (%s)", wipemethod_str(method));
+	return job_submit(desc, d, wipe_job, &wa, sizeof(wa));
+}
+
+static int
+badblocks_job(const char *dev, void *v){
+	return badblock_scan(dev, *(const unsigned *)v);
+}
+
+int job_badblocks(device *d, unsigned rw){
+	return job_submit(rw ? "badblocks (rw)" : "badblocks", d, badblocks_job,
+				&rw, sizeof(rw));
+}
+
+static int
+benchmark_job_result(const benchresult *br, void *vdev){
+	const char *dev = vdev;
+
+	diag("%s %s %s %uB QD%u: %ju MiB/s %ju IOPS, µs p50 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+		dev, br->random ? "rand" : "seq", br->write ? "write" : "read",
+		br->bsize, br->qdepth, bench_bps(br) >> 20, bench_iops(br),
+		br->lat_p50 / 1000.0, br->lat_p99 / 1000.0, br->lat_p999 / 1000.0,
+		br->lat_max / 1000.0);
+	return 0;
+}
+
+static int
+benchmark_job(const char *dev, void *v){
+	(void)v;
+	return benchmark_blockdev(dev, 0, 1000, benchmark_job_result, (void *)dev);
+}
+
+int job_benchmark(device *d){
+	return job_submit("benchmark", d, benchmark_job, NULL, 0);
+}
+
+struct mkfsargs {
+	char fstype[32];
+	char name[FSLABELSIZ * 4]; // UTF-8
+	unsigned named;
+};
+
+static int
+mkfs_job(const char *dev, void *v){
+	const struct mkfsargs *ma = v;
+
+	return make_filesystem_unlocked(dev, ma->fstype, ma->named ? ma->name : NULL);
+}
+
+int job_mkfs(device *d, const char *fstype, const char *name){
+	struct mkfsargs ma;
+	char desc[64];
+
+	memset(&ma, 0, sizeof(ma));
+	if(strlen(fstype) >= sizeof(ma.fstype) || (name && strlen(name) >= sizeof(ma.name))){
+		diag("Bad filesystem type or name\n");
+		return -1;
+	}
+	strcpy(ma.fstype, fstype);
+	if(name){
+		strcpy(ma.name, name);
+		ma.named = 1;
+	}
+	snprintf(desc, sizeof(desc), "mkfs (%s)", fstype);
+	return job_submit(desc, d, mkfs_job, &ma, sizeof(ma));
+}
+
+static int
+ataerase_job(const char *dev, void *v){
+	(void)v;
+	return ata_secure_erase(dev);
+}
+
+int job_ataerase(device *d){
+	return job_submit("ATA secure erase", d, ataerase_job, NULL, 0);
+}
+
+static int
+secerase_job(const char *dev, void *v){
+	return secure_erase(&dev, 1, *(const secerase *)v);
+}
+
+int job_secure_erase(device *d, secerase method){
+	char desc[64];
+
+	snprintf(desc, sizeof(desc), "secure erase (%s)", secerase_str(method));
+	return job_submit(desc, d, secerase_job, &method, sizeof(method));
+}
+
+static int
+lbaf_job(const char *dev, void *v){
+	return nvme_reformat(dev, *(const int *)v);
+}
+
+int job_nvme_reformat(device *d, int lbaf){
+	char desc[64];
+
+	if(lbaf < 0){
+		snprintf(desc, sizeof(desc), "NVMe format (best LBA format)");
+	}else{
+		snprintf(desc, sizeof(desc), "NVMe format (LBA format %d)", lbaf);
+	}
+	return job_submit(desc, d, lbaf_job, &lbaf, sizeof(lbaf));
+}
+
+static int
+fstrim_job(const char *dev, void *v){
+	(void)v;
+	return fstrim_dev(dev, FSTRIM_THROTTLE_MSEC);
+}
+
+int job_fstrim(device *d){
+	return job_submit("trim", d, fstrim_job, NULL, 0);
+}
+
+// One job per filesystem, so that the scheduler spreads them across
+// controllers as it would any others.
+int job_fstrim_all(void){
+	const controller *c;
+	int n = 0;
+
+	lock_growlight();
+	for(c = get_controllers() ; c ; c = c->next){
+		device *d, *p;
+
+		for(d = c->blockdevs ; d ; d = d->next){
+			if(!fstrim_solid_state(d)){
+				continue;
+			}
+			if(d->mnt.count && job_fstrim(d) >= 0){
+				++n;
+			}
+			for(p = d->parts ; p ; p = p->next){
+				if(p->mnt.count && job_fstrim(p) >= 0){
+					++n;
+				}
+			}
+		}
+	}
+	unlock_growlight();
+	if(n == 0){
+		diag("No filesystems to trim\n");
+	}
+	return n;
+}
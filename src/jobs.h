@@ -0,0 +1,107 @@
+// copyright 2012–2021 nick black
+#ifndef GROWLIGHT_JOBS
+#define GROWLIGHT_JOBS
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "wipe.h"
+#include "secure.h"
+
+struct device;
+
+// Long-running device operations are run as jobs, each on its own thread.
+// Jobs against devices on the same controller are admitted only so long as
+// the transport bandwidth of those devices fits within the controller's
+// bandwidth (or, if either is unknown, up to JOBS_PER_CONTROLLER at a time).
+// Jobs touching the same device never run concurrently.
+#define JOBS_PER_CONTROLLER 4
+
+typedef enum {
+	JOB_QUEUED,
+	JOB_RUNNING,
+	JOB_DONE,
+	JOB_FAILED,
+	JOB_CANCELLED,
+} jobstate;
+
+// A copy of a job's state, safe to retain.
+typedef struct jobinfo {
+	unsigned id;
+	char desc[64];
+	char dev[NAME_MAX + 1];
+	jobstate state;
+	uintmax_t done, total;	// progress, in units of the job's choosing
+	time_t queued, started, finished;
+} jobinfo;
+
+const char *jobstate_str(jobstate);
+
+// Work functions are run without the growlight lock held, and must take it
+// themselves around any inspection or modification of shared state. They're
+// passed the device's name rather than the device, which can be rescanned
+// (and freed) whenever the lock is released; look it up with find_device()
+// after taking the lock, and copy out whatever's needed before dropping it.
+typedef int (*jobfxn)(const char *,void *);
+
+// Called in place of the work function for a job which will never run (it
+// was cancelled while queued, or its device went away), so that it can
+// release whatever its argument refers to. No locks are held.
+typedef void (*jobdiscard)(void *);
+
+// Queue fxn against the device, copying arglen bytes of arg for its use.
+// Returns the job id, or -1 on error.
+int job_submit(const char *,struct device *,jobfxn,const void *,size_t);
+
+// As job_submit(), registering a function to be called should fxn never be.
+int job_submit_discard(const char *,struct device *,jobfxn,jobdiscard,
+			const void *,size_t);
+
+// Cancel a job. Queued jobs are cancelled immediately (and discarded);
+// running jobs are cancelled at the work function's next check of
+// job_cancelled().
+int job_cancel(unsigned);
+
+// Forget finished jobs, returning the number forgotten.
+unsigned jobs_clear(void);
+
+// Copy up to n jobs, most recent first. Returns the number copied.
+unsigned jobs_snapshot(jobinfo *,unsigned);
+
+// Whether a job is running against the device or, if it's a whole disk, any
+// of its partitions.
+int jobs_running_on(const struct device *);
+
+// Cancel every job and wait for the running ones to return, after which no
+// more are accepted. Must be called without the growlight lock held, since
+// work functions take it.
+int jobs_stop(void);
+
+// For use by work functions; no-ops outside of a job.
+int job_cancelled(void);
+void job_progress(uintmax_t,uintmax_t);
+
+// Background versions of the long-running operations
+int job_wipe(struct device *,wipemethod,unsigned);
+int job_badblocks(struct device *,unsigned);
+int job_benchmark(struct device *);
+int job_mkfs(struct device *,const char *,const char *);
+int job_ataerase(struct device *);
+int job_secure_erase(struct device *,secerase);
+int job_nvme_reformat(struct device *,int);
+int job_fstrim(struct device *);
+// Submit job_fstrim() for every filesystem fstrim_all() would trim.
+// Returns the number of jobs submitted.
+int job_fstrim_all(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
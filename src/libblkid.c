@@ -1,11 +1,14 @@
 // copyright 2012–2021 nick black
 #include <assert.h>
+#include <fcntl.h>
 #include <wchar.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <blkid/blkid.h>
 
 #include "fs.h"
@@ -52,81 +55,160 @@ int close_blkid(void){
 	return blkid_exit(0);
 }
 
-#include <unistd.h>
-// Takes a /dev/ path, and examines the superblock therein for a valid
-// filesystem or raid superblock.
-int probe_blkid_superblock(const char *dev, blkid_probe *sbp, device *d){
-	char buf[PATH_MAX], *mnttype, *uuid, *label, *partuuid;
-	const char *val, *name;
-	unsigned parttype;
+// Most partitions of a disk probed at once
+#define BLKID_PROBE_THREADS 8
+
+// dev must be a /dev path. Unless quiet, retries are announced. On failure,
+// errno is set.
+static blkid_probe
+probe_by_name(const char *dev, unsigned quiet){
 	blkid_probe bp;
-	wchar_t *pname;
-	size_t len;
-	int n;
+	int i;
 
-	pname = NULL;
-	parttype = 0;
-	partuuid = uuid = label = mnttype = NULL;
-	if(strncmp(dev, "/dev/", 5)){
-		if(snprintf(buf, sizeof(buf), "/dev/%s", dev) >= (int)sizeof(buf)){
-			diag("Bad name: %s\n", dev);
-			return -1;
-		}
-		dev = buf;
-	}
 	// This will sometimes fail due to the device node not yet existing. To
 	// get here, however, we had to receive the name in a udev message, or
 	// via discovery -- we've verified a /sys block entry. Go ahead and
 	// loop a time or two, even though it's gross. I'd like a better way to
 	// deal with this, obviously. FIXME
-	{
-		int i;
-
-		for(i = 0 ; i < 3 ; ++i){
-			if((bp = blkid_new_probe_from_filename(dev)) == NULL){
-				if(errno == ENOMEDIUM){
-					verbf("Couldn't get blkid probe for %s (%s)\n", dev, strerror(errno));
-					return -1;
-				}
-				diag("Couldn't get blkid probe for %s (%s), retrying...\n", dev, strerror(errno));
-				sleep(1);
-			}else{
-				break;
-			}
+	for(i = 0 ; i < 3 ; ++i){
+		if( (bp = blkid_new_probe_from_filename(dev)) ){
+			return bp;
 		}
-		if(bp == NULL){
-			if((bp = blkid_new_probe_from_filename(dev)) == NULL){
-				if(errno != ENOMEDIUM){
-					diag("Couldn't get blkid probe for %s (%s), retrying...\n", dev, strerror(errno));
-					return -1;
-				}
-				return blkid_exit(-1);
-			}
+		if(errno == ENOMEDIUM){
+			return NULL;
+		}
+		if(!quiet){
+			diag("Couldn't get blkid probe for %s (%s), retrying...\n", dev, strerror(errno));
 		}
+		sleep(1);
+	}
+	return blkid_new_probe_from_filename(dev);
+}
+
+// Probe through an already-open descriptor of the whole disk, limited to the
+// extent of part if one is provided (blkid_partition_get_start() and
+// blkid_partition_get_size() are always in 512-byte units).
+static blkid_probe
+probe_by_fd(int fd, blkid_partition part){
+	blkid_loff_t off = 0, size = 0;
+	blkid_probe bp;
+	int err;
+
+	if((bp = blkid_new_probe()) == NULL){
+		return NULL;
+	}
+	if(part){
+		off = blkid_partition_get_start(part) * 512;
+		size = blkid_partition_get_size(part) * 512;
+	}
+	if(blkid_probe_set_device(bp, fd, off, size)){
+		err = errno;
+		blkid_free_probe(bp);
+		errno = err;
+		return NULL;
+	}
+	return bp;
+}
+
+// Set up and run a full probe of dev, through fd if it's non-negative. No
+// diagnostics are emitted, so that this can run on any thread; on failure,
+// *failed describes the step which failed, and errno is set.
+static blkid_probe
+full_probe(const char *dev, int fd, blkid_partition part, unsigned quiet,
+		const char **failed){
+	blkid_probe bp;
+	int err;
+
+	if(fd >= 0){
+		bp = probe_by_fd(fd, part);
+	}else{
+		bp = probe_by_name(dev, quiet);
+	}
+	if(bp == NULL){
+		*failed = "get blkid probe";
+		return NULL;
 	}
 	if(blkid_probe_enable_topology(bp, 1)){
-		diag("Couldn't enable blkid topology for %s (%s)\n", dev, strerror(errno));
-		return blkid_exit(-1);
+		*failed = "enable blkid topology";
+	}else if(!part && blkid_probe_enable_partitions(bp, 1)){
+		*failed = "enable blkid partitionprobe";
+	}else if(!part && blkid_probe_set_partitions_flags(bp, BLKID_PARTS_ENTRY_DETAILS)){
+		*failed = "set blkid partitionflags";
+	}else if(blkid_probe_enable_superblocks(bp, 1)){
+		*failed = "enable blkid superprobe";
+	}else if(blkid_probe_set_superblocks_flags(bp, BLKID_SUBLKS_DEFAULT | BLKID_SUBLKS_VERSION)){
+		*failed = "set blkid superflags";
+	}else if(blkid_do_fullprobe(bp)){
+		*failed = "run blkid fullprobe";
+	}else{
+		return bp;
 	}
-	if(blkid_probe_enable_partitions(bp, 1)){
-		diag("Couldn't enable blkid partitionprobe for %s (%s)\n", dev, strerror(errno));
-		goto err;
+	err = errno;
+	blkid_free_probe(bp);
+	errno = err;
+	return NULL;
+}
+
+// A missing medium is expected of removable devices, and not worth a
+// diagnostic. errno is left as err, for the caller's inspection.
+static void
+report_probe_failure(const char *dev, const char *failed, int err){
+	if(err == ENOMEDIUM){
+		verbf("Couldn't %s for %s (%s)\n", failed, dev, strerror(err));
+	}else{
+		diag("Couldn't %s for %s (%s)\n", failed, dev, strerror(err));
 	}
-	if(blkid_probe_set_partitions_flags(bp, BLKID_PARTS_ENTRY_DETAILS)){
-		diag("Couldn't set blkid partitionflags for %s (%s)\n", dev, strerror(errno));
-		goto err;
+	errno = err;
+}
+
+// The values blkid would report as PART_ENTRY_* when probing the partition
+// by its own device node.
+static int
+part_entry(blkid_partition part, unsigned *parttype, char **partuuid, wchar_t **pname){
+	const char *val;
+	char tbuf[16];
+
+	if((val = blkid_partition_get_type_string(part)) == NULL){
+		snprintf(tbuf, sizeof(tbuf), "0x%x", blkid_partition_get_type(part));
+		val = tbuf;
 	}
-	if(blkid_probe_enable_superblocks(bp, 1)){
-		diag("Couldn't enable blkid superprobe for %s (%s)\n", dev, strerror(errno));
-		goto err;
+	*parttype = get_str_code(val);
+	if( (val = blkid_partition_get_uuid(part)) ){
+		if((*partuuid = strdup(val)) == NULL){
+			return -1;
+		}
 	}
-	if(blkid_probe_set_superblocks_flags(bp, BLKID_SUBLKS_DEFAULT | BLKID_SUBLKS_VERSION)){
-		diag("Couldn't set blkid superflags for %s (%s)\n", dev, strerror(errno));
-		goto err;
+	if( (val = blkid_partition_get_name(part)) ){
+		mbstate_t ps;
+
+		if((*pname = malloc(sizeof(**pname) * (strlen(val) + 1))) == NULL){
+			return -1;
+		}
+		memset(&ps, 0, sizeof(ps));
+		mbsnrtowcs(*pname, &val, strlen(val) + 1, strlen(val) + 1, &ps);
 	}
-	if(blkid_do_fullprobe(bp)){
-		diag("Couldn't run blkid fullprobe for %s (%s)\n", dev, strerror(errno));
-		goto err;
+	return 0;
+}
+
+// Merge the results of a successful full_probe() into d, taking ownership of
+// bp (which is returned through sbp, if provided, and otherwise freed).
+static int
+apply_probe(const char *dev, blkid_probe bp, blkid_partition part,
+		blkid_probe *sbp, device *d){
+	char *mnttype, *uuid, *label, *partuuid;
+	const char *val, *name;
+	unsigned parttype;
+	wchar_t *pname;
+	size_t len;
+	int n;
+
+	pname = NULL;
+	parttype = 0;
+	partuuid = uuid = label = mnttype = NULL;
+	if(part){
+		if(part_entry(part, &parttype, &partuuid, &pname)){
+			goto err;
+		}
 	}
 	n = blkid_probe_numof_values(bp);
 	while(n--){
@@ -273,8 +355,134 @@ int probe_blkid_superblock(const char *dev, blkid_probe *sbp, device *d){
 
 err:
 	blkid_free_probe(bp);
+	free(partuuid);
+	free(pname);
 	free(mnttype);
 	free(label);
 	free(uuid);
 	return -1;
 }
+
+// Takes a /dev/ path, and examines the superblock therein for a valid
+// filesystem or raid superblock. If fd is non-negative, it is an open
+// descriptor for the whole disk, which is probed rather than reopening dev.
+// If part is provided, d is that partition of the disk: its entry is taken
+// from part rather than reprobed, and only its extent of fd is examined.
+int probe_blkid_superblock(const char *dev, int fd, blkid_partition part,
+				blkid_probe *sbp, device *d){
+	const char *failed;
+	char buf[PATH_MAX];
+	blkid_probe bp;
+
+	if(strncmp(dev, "/dev/", 5)){
+		if(snprintf(buf, sizeof(buf), "/dev/%s", dev) >= (int)sizeof(buf)){
+			diag("Bad name: %s\n", dev);
+			return -1;
+		}
+		dev = buf;
+	}
+	if((bp = full_probe(dev, fd, part, 0, &failed)) == NULL){
+		report_probe_failure(dev, failed, errno);
+		return blkid_exit(-1);
+	}
+	return apply_probe(dev, bp, part, sbp, d);
+}
+
+typedef struct partprobe {
+	char dev[PATH_MAX];
+	device *p;
+	blkid_partition part;
+	blkid_probe bp;		// NULL on failure
+	const char *failed;	// step which failed
+	int err;		// errno of the failure
+} partprobe;
+
+typedef struct probegroup {
+	partprobe *pps;
+	unsigned n;
+	_Atomic(unsigned) next;	// next partition to claim
+	const char *disk;
+	int fd;			// the caller's descriptor, or -1 to probe by name
+} probegroup;
+
+static void
+probe_worker(probegroup *g, int fd){
+	unsigned z;
+
+	while((z = atomic_fetch_add(&g->next, 1)) < g->n){
+		partprobe *pp = &g->pps[z];
+
+		if((pp->bp = full_probe(pp->dev, fd, pp->part, 1, &pp->failed)) == NULL){
+			pp->err = errno;
+		}
+	}
+}
+
+// libblkid seeks and then reads, so threads can't share a descriptor. Each
+// helper opens the disk once for itself, or probes by name if it can't.
+static void *
+probe_thread(void *vg){
+	probegroup *g = vg;
+	int fd = -1;
+
+	if(g->fd >= 0){
+		fd = openat(devfd, g->disk, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+	}
+	probe_worker(g, fd);
+	if(fd >= 0){
+		close(fd);
+	}
+	return NULL;
+}
+
+int probe_blkid_partitions(const device *d, int fd, device **ps,
+				blkid_partition *parts, unsigned n){
+	pthread_t tids[BLKID_PROBE_THREADS - 1];
+	unsigned z, nthreads = 0;
+	probegroup g;
+	int r, ret = 0;
+
+	if(n == 0){
+		return 0;
+	}
+	if((g.pps = calloc(n, sizeof(*g.pps))) == NULL){
+		diag("Couldn't allocate probes for %s (%s?)\n", d->name, strerror(errno));
+		return -1;
+	}
+	g.n = n;
+	g.disk = d->name;
+	g.fd = fd;
+	atomic_init(&g.next, 0);
+	for(z = 0 ; z < n ; ++z){
+		g.pps[z].p = ps[z];
+		g.pps[z].part = parts[z];
+		snprintf(g.pps[z].dev, sizeof(g.pps[z].dev), "/dev/%s", ps[z]->name);
+	}
+	// The calling thread works alongside its helpers, so a failure to launch
+	// them costs only parallelism.
+	while(nthreads < BLKID_PROBE_THREADS - 1 && nthreads + 1 < n){
+		if( (r = pthread_create(&tids[nthreads], NULL, probe_thread, &g)) ){
+			verbf("Couldn't launch probe thread (%s?)\n", strerror(r));
+			break;
+		}
+		++nthreads;
+	}
+	probe_worker(&g, fd);
+	while(nthreads--){
+		pthread_join(tids[nthreads], NULL);
+	}
+	lock_growlight();
+	for(z = 0 ; z < n ; ++z){
+		partprobe *pp = &g.pps[z];
+
+		if(pp->bp == NULL){
+			report_probe_failure(pp->dev, pp->failed, pp->err);
+			ret = -1;
+		}else if(apply_probe(pp->dev, pp->bp, pp->part, NULL, pp->p)){
+			ret = -1;
+		}
+	}
+	unlock_growlight();
+	free(g.pps);
+	return ret;
+}
@@ -10,7 +10,15 @@ extern "C" {
 
 struct device;
 
-int probe_blkid_superblock(const char *,blkid_probe *,struct device *);
+int probe_blkid_superblock(const char *,int,blkid_partition,blkid_probe *,struct device *);
+
+// Probe the superblocks of n partitions of the disk d, several at once, and
+// merge the results into them with the growlight lock held. parts are the
+// corresponding entries of d's blkid partition list. If fd is an open
+// descriptor for d, the partitions are probed as extents of the disk, rather
+// than being opened individually. Returns -1 if any couldn't be probed.
+int probe_blkid_partitions(const struct device *,int,struct device **,blkid_partition *,unsigned);
+
 int close_blkid(void);
 
 #ifdef __cplusplus
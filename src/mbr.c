@@ -8,39 +8,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/swap.h>
-#include <sys/mman.h>
 #include <nettle/sha1.h>
 
 #include "mbr.h"
 #include "sha.h"
+#include "blockio.h"
 #include "growlight.h"
 
 #define MBR_SIZE 512
 #define MBR_CODE_SIZE 440
 
-int mbrsha1(device *d, int fd, void *buf){
-	// We only check the first MBR_CODE_SIZE bytes, but must read in
-	// multiples of the sector size. This code might in fact be broken
-	// for 4k sector disks -- I'm unsure whether it's logical or physical.
-	// FIXME find out!
-	unsigned char mbr[MBR_SIZE];
-	ssize_t r;
+int mbrsha1(const blockcap *c, void *buf){
+	// The MBR is always the first 512 bytes of LBA 0, whatever the sector size.
+	const void *mbr;
 
-	if(lseek(fd, 0, SEEK_SET)){
-		int e = errno;
-		diag("Couldn't seek to first byte of %s (%s?)\n", d->name, strerror(errno));
-		errno = e;
+	if((mbr = blockcap_lba(c, 0, 1)) == NULL){
+		diag("MBR of %s wasn't captured\n", c->name);
 		return -1;
 	}
-	if((r = read(fd, mbr, sizeof(mbr))) < 0){
-		diag("Error reading %zu from %s (%s?)\n", sizeof(mbr), d->name, strerror(errno));
-		return -1;
-	}
-	if(r < (int)sizeof(mbr)){
-		diag("Short read %zd/%zu from %s\n", r, sizeof(mbr), d->name);
-		return -1;
-	}
-  sha1(mbr, MBR_CODE_SIZE, buf);
+	sha1(mbr, MBR_CODE_SIZE, buf);
 	return 0;
 }
 
@@ -50,61 +36,39 @@ int zerombrp(const void *buf){
 	return !memcmp(buf, z, 20);
 }
 
+// Zero bytes [wipe, wipeend) of the MBR via a read-modify-write of LBA 0.
 static inline int
 wipe_first_sector(device *d, size_t wipe, size_t wipeend){
-	static char buf[MBR_SIZE];
-	char dbuf[PATH_MAX];
-	int fd, pgsize;
-	void *map;
+	unsigned char *sector;
+	blockio b;
+	int r;
 
-	if((pgsize = getpagesize()) < 0){
-		diag("Couldn't get page size\n");
-		return -1;
-	}
-	if(wipeend > sizeof(buf) || wipe >= wipeend){
-		diag("Can't wipe %zu/%zu/%zu\n", wipe, wipeend, sizeof(buf));
+	if(wipeend > MBR_SIZE || wipe >= wipeend){
+		diag("Can't wipe %zu/%zu/%u\n", wipe, wipeend, MBR_SIZE);
 		return -1;
 	}
 	if(d->layout != LAYOUT_NONE){
 		diag("Will only wipe BIOS state for block devices\n");
 		return -1;
 	}
-	if(snprintf(dbuf, sizeof(dbuf), "/dev/%s", d->name) >= (int)sizeof(dbuf)){
-		diag("Bad device name: %s\n", d->name);
+	if(blockio_open(&b, d, O_RDWR)){
 		return -1;
 	}
-	if((fd = openat(devfd, d->name, O_RDWR|O_CLOEXEC|O_DIRECT)) < 0){
-		int e = errno;
-		diag("Couldn't open /dev/%s (%s?)\n", d->name, strerror(errno));
-		errno = e;
+	if((sector = blockio_alloc(&b, 1)) == NULL){
+		blockio_close(&b);
 		return -1;
 	}
-	map = mmap(NULL, pgsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_LOCKED, fd, 0);
-	if(map == MAP_FAILED){
-		int e = errno;
-		diag("Couldn't map %d from %d on %s (%s?)\n", pgsize, fd, dbuf, strerror(errno));
-		close(fd);
-		errno = e;
-		return -1;
+	if( (r = blockio_read(&b, sector, 0, 1)) == 0){
+		memset(sector + wipe, 0, wipeend - wipe);
+		if( (r = blockio_write(&b, sector, 0, 1)) == 0){
+			r = blockio_flush(&b);
+		}
 	}
-	memcpy((char *)map + wipe, buf, wipeend - wipe);
-	if(munmap(map, pgsize)){
-		int e = errno;
-		diag("Couldn't unmap %d from %d on %s (%s?)\n", pgsize, fd, dbuf, strerror(errno));
-		close(fd);
-		errno = e;
-		return -1;
+	if(r == 0){
+		sha1(sector, MBR_CODE_SIZE, d->blkdev.biossha1);
 	}
-	if(mbrsha1(d, fd, d->blkdev.biossha1)){
-		int e = errno;
-		close(fd);
-		errno = e;
-		return -1;
-	}
-	if(close(fd)){
-		int e = errno;
-		diag("Couldn't close %s (%s?)\n", dbuf, strerror(errno));
-		errno = e;
+	free(sector);
+	if(blockio_close(&b) || r){
 		return -1;
 	}
 	if(zerombrp(d->blkdev.biossha1)){
@@ -129,10 +93,3 @@ int wipe_dosmbr(device *d){
 	}
 	return 0;
 }
-
-int wipe_dos_ptable(device *d){
-	if(wipe_first_sector(d, MBR_CODE_SIZE, MBR_SIZE)){
-		return -1;
-	}
-	return 0;
-}
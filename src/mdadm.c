@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -13,22 +14,135 @@
 #include "growlight.h"
 #include "aggregate.h"
 
+// Idle arrays are checked for a newly-started sync every this many polls
+#define MD_SYNC_IDLE_POLLS 5
+
+// Limits of stripe_cache_size, and its default, in stripes
+#define MD_STRIPE_CACHE_MIN 17
+#define MD_STRIPE_CACHE_MAX 32768
+#define MD_STRIPE_CACHE_DEFAULT 256
+// Limit of group_thread_cnt
+#define MD_GROUP_THREADS_MAX 8192
+
+// Interpret the sync_speed_{min,max} nodes, "1000 (system)" or "5000 (local)".
+static int
+get_sync_limit(int dirfd,const char *node,unsigned long *val,unsigned *local){
+	char *str,*e;
+	int r = -1;
+
+	if((str = get_sysfs_string(dirfd,node)) == NULL){
+		return -1;
+	}
+	errno = 0;
+	*val = strtoul(str,&e,10);
+	if(e != str && errno == 0){
+		*local = strstr(e,"local") != NULL;
+		r = 0;
+	}
+	free(str);
+	return r;
+}
+
+// Lex the md/ directory's resync state: sync_completed is "none" when idle,
+// "delayed" while waiting on another array sharing disks, and otherwise
+// "done / total" in sectors. Returns 1 if anything the UI shows changed.
+static int
+read_md_sync(device *d,int dirfd,unsigned limits){
+	uintmax_t done = 0,total = 0;
+	unsigned long speed = 0;
+	unsigned resync,changed;
+	char *str,*action;
+
+	// Arrays without redundancy (linear, RAID0) lack the sync nodes
+	if((str = get_sysfs_string(dirfd,"sync_completed")) == NULL){
+		return -1;
+	}
+	if(strcmp(str,"none") == 0){
+		resync = 0;
+	}else{
+		resync = 1;
+		if(sscanf(str,"%ju / %ju",&done,&total) != 2 || done > total){
+			done = total = 0;
+		}
+	}
+	free(str);
+	// sync_speed is "none" until the first window completes
+	if(resync && (str = get_sysfs_string(dirfd,"sync_speed"))){
+		speed = strtoul(str,NULL,10);
+		free(str);
+	}
+	action = get_sysfs_string(dirfd,"sync_action");
+	changed = resync != d->mddev.resync || done != d->mddev.sync_done ||
+		total != d->mddev.sync_total || speed != d->mddev.sync_speed;
+	if(!action != !d->mddev.sync_action || (action && strcmp(action,d->mddev.sync_action))){
+		changed = 1;
+		limits = 1; // re-read the limits whenever a sync starts or stops
+	}
+	// Keep explore_md_sysfs()'s accounting of a resync as degraded
+	if(resync && !d->mddev.resync && !d->mddev.degraded){
+		d->mddev.degraded = 1;
+	}else if(!resync && d->mddev.resync){
+		get_sysfs_uint(dirfd,"degraded",&d->mddev.degraded);
+	}
+	free(d->mddev.sync_action);
+	d->mddev.sync_action = action;
+	d->mddev.resync = resync;
+	d->mddev.sync_done = done;
+	d->mddev.sync_total = total;
+	d->mddev.sync_speed = speed;
+	if(limits){
+		unsigned long min,max;
+		unsigned minl,maxl;
+
+		if(get_sync_limit(dirfd,"sync_speed_min",&min,&minl) == 0 &&
+				get_sync_limit(dirfd,"sync_speed_max",&max,&maxl) == 0){
+			changed |= min != d->mddev.sync_min || max != d->mddev.sync_max;
+			d->mddev.sync_min = min;
+			d->mddev.sync_max = max;
+			d->mddev.sync_min_local = minl;
+			d->mddev.sync_max_local = maxl;
+		}
+	}
+	return changed;
+}
+
+static void
+read_md_tunables(device *d,int dirfd){
+	unsigned long ul;
+	char *loc;
+
+	if(get_sysfs_uint(dirfd,"stripe_cache_size",&d->mddev.stripe_cache)){
+		d->mddev.stripe_cache = 0;
+	}
+	if(d->mddev.stripe_cache && get_sysfs_uint(dirfd,"group_thread_cnt",&ul) == 0){
+		d->mddev.group_threads = ul;
+	}else{
+		d->mddev.group_threads = -1;
+	}
+	d->mddev.bitmap_chunk = 0;
+	d->mddev.bitmap_file = 0;
+	// location is "none", "file", or a sector offset like "+8"
+	if( (loc = get_sysfs_string(dirfd,"bitmap/location")) ){
+		if(strcmp(loc,"none")){
+			d->mddev.bitmap_file = strcmp(loc,"file") == 0;
+			if(get_sysfs_uint(dirfd,"bitmap/chunksize",&ul) == 0){
+				d->mddev.bitmap_chunk = ul;
+			}
+		}
+		free(loc);
+	}
+}
+
 int explore_md_sysfs(device *d,int dirfd){
 	unsigned degraded = 0;
 	unsigned long rd;
 	mdslave **enqm;
-	char *syncpct;
 	char buf[30];
 
-	if((syncpct = get_sysfs_string(dirfd,"sync_completed")) == NULL){
+	if(read_md_sync(d,dirfd,1) < 0){
 		verbf("Warning: no 'sync_completed' content in mdadm device %s\n",d->name);
-	}else if(strcmp(syncpct,"none") == 0){
-		d->mddev.resync = 0;
-	}else{
-		// FIXME lex "%ju / %ju"
-		d->mddev.resync = 1;
 	}
-	free(syncpct);
+	read_md_tunables(d,dirfd);
 	// These files will be empty on incomplete arrays like the md0 that
 	// sometimes pops up.
 	if(get_sysfs_uint(dirfd,"raid_disks",&d->mddev.disks)){
@@ -167,6 +281,405 @@ int explore_md_sysfs(device *d,int dirfd){
 	return 0;
 }
 
+static int
+open_md_sysfs(const device *d){
+	char path[NAME_MAX + 4];
+
+	if(snprintf(path,sizeof(path),"%s/md",d->name) >= (int)sizeof(path)){
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return openat(sysfd,path,O_RDONLY|O_CLOEXEC|O_DIRECTORY);
+}
+
+int md_sync_refresh(device *d){
+	int fd,r;
+
+	if(d->layout != LAYOUT_MDADM){
+		diag("%s is not an MD device\n",d->name);
+		return -1;
+	}
+	if((fd = open_md_sysfs(d)) < 0){
+		diag("Couldn't open md sysfs for %s (%s?)\n",d->name,strerror(errno));
+		return -1;
+	}
+	r = read_md_sync(d,fd,1);
+	close(fd);
+	return r < 0 ? -1 : 0;
+}
+
+// Syncing arrays are read every poll; idle ones are only checked for a new
+// sync every MD_SYNC_IDLE_POLLS polls, and arrays without redundancy never.
+void md_sync_poll(void){
+	const glightui *gui = get_glightui();
+	static unsigned polls;
+	const controller *c;
+	unsigned idlepoll;
+
+	idlepoll = ++polls % MD_SYNC_IDLE_POLLS == 0;
+	for(c = get_controllers() ; c ; c = c->next){
+		device *d;
+
+		for(d = c->blockdevs ; d ; d = d->next){
+			int fd;
+
+			if(d->layout != LAYOUT_MDADM || !d->mddev.sync_action ||
+					(!d->mddev.resync && !idlepoll)){
+				continue;
+			}
+			if((fd = open_md_sysfs(d)) < 0){
+				continue;
+			}
+			if(read_md_sync(d,fd,0) > 0 && gui){
+				d->uistate = gui->block_event(d,d->uistate);
+			}
+			close(fd);
+		}
+	}
+}
+
+long md_sync_eta(const device *d){
+	uintmax_t left;
+
+	if(d->layout != LAYOUT_MDADM || !d->mddev.resync || !d->mddev.sync_total ||
+			!d->mddev.sync_speed){
+		return -1;
+	}
+	// sectors are 512 bytes, and the speed is in KiB/s
+	left = (d->mddev.sync_total - d->mddev.sync_done) / 2;
+	return left / d->mddev.sync_speed;
+}
+
+static int
+valid_sync_limit(const char *val,unsigned long *kbs){
+	char *e;
+
+	if(strcmp(val,"system") == 0){
+		*kbs = 0;
+		return 0;
+	}
+	errno = 0;
+	*kbs = strtoul(val,&e,10);
+	if(e == val || *e || errno || *kbs == 0 || *kbs > INT_MAX){
+		diag("Bad sync speed limit: %s (KiB/s or \"system\")\n",val);
+		return -1;
+	}
+	return 0;
+}
+
+int md_set_sync_speed(device *d,const char *min,const char *max){
+	unsigned long kmin = 0,kmax = 0;
+	int fd,r = 0;
+
+	if(d->layout != LAYOUT_MDADM){
+		diag("%s is not an MD device\n",d->name);
+		return -1;
+	}
+	if((min && valid_sync_limit(min,&kmin)) || (max && valid_sync_limit(max,&kmax))){
+		return -1;
+	}
+	if(kmin && kmax && kmin > kmax){
+		diag("Minimum sync speed %lu exceeds maximum %lu\n",kmin,kmax);
+		return -1;
+	}
+	if((fd = open_md_sysfs(d)) < 0){
+		diag("Couldn't open md sysfs for %s (%s?)\n",d->name,strerror(errno));
+		return -1;
+	}
+	// Lower the minimum before the maximum, and raise the maximum before
+	// the minimum, so the pair is never inverted in between.
+	if(max && kmax && kmax < d->mddev.sync_min){
+		if(min){
+			r |= writeat_sysfs(fd,"sync_speed_min",min);
+		}
+		r |= writeat_sysfs(fd,"sync_speed_max",max);
+	}else{
+		if(max){
+			r |= writeat_sysfs(fd,"sync_speed_max",max);
+		}
+		if(min){
+			r |= writeat_sysfs(fd,"sync_speed_min",min);
+		}
+	}
+	if(r){
+		diag("Couldn't set sync speed on %s (%s?)\n",d->name,strerror(errno));
+	}
+	read_md_sync(d,fd,1);
+	close(fd);
+	return r ? -1 : 0;
+}
+
+static const struct {
+	const char *name;
+	const char *desc;
+} mdtunables[MDTUNE_COUNT] = {
+	{ "stripe_cache_size", "stripes cached for parity calculation", },
+	{ "group_thread_cnt", "parity worker threads per NUMA group", },
+	{ "bitmap_chunk", "KiB covered by each write-intent bitmap bit", },
+};
+
+const char *mdtunable_str(mdtunable t){
+	return t < MDTUNE_COUNT ? mdtunables[t].name : NULL;
+}
+
+const char *mdtunable_desc(mdtunable t){
+	return t < MDTUNE_COUNT ? mdtunables[t].desc : NULL;
+}
+
+int mdtunable_parse(const char *name,mdtunable *t){
+	unsigned z;
+
+	for(z = 0 ; z < MDTUNE_COUNT ; ++z){
+		if(strcmp(name,mdtunables[z].name) == 0){
+			*t = z;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int md_tunable_value(const device *d,mdtunable t,char *buf,size_t len){
+	int r;
+
+	if(d->layout != LAYOUT_MDADM){
+		return -1;
+	}
+	switch(t){
+		case MDTUNE_STRIPE_CACHE:
+			if(d->mddev.stripe_cache == 0){
+				return -1;
+			}
+			r = snprintf(buf,len,"%lu",d->mddev.stripe_cache);
+			break;
+		case MDTUNE_GROUP_THREADS:
+			if(d->mddev.group_threads < 0){
+				return -1;
+			}
+			r = snprintf(buf,len,"%ld",d->mddev.group_threads);
+			break;
+		case MDTUNE_BITMAP_CHUNK:
+			if(d->mddev.bitmap_file){
+				r = snprintf(buf,len,"file");
+			}else if(d->mddev.bitmap_chunk == 0){
+				r = snprintf(buf,len,"none");
+			}else{
+				r = snprintf(buf,len,"%ju",d->mddev.bitmap_chunk / 1024);
+			}
+			break;
+		default:
+			return -1;
+	}
+	return r < 0 || (size_t)r >= len ? -1 : 0;
+}
+
+uintmax_t md_stripe_cache_bytes(const device *d,unsigned long stripes){
+	return (uintmax_t)stripes * sysconf(_SC_PAGESIZE) * d->mddev.disks;
+}
+
+// Whether every member is solid-state. Parity work keeps up with rotating
+// disks from the single raid5d thread.
+static int
+md_members_ssd(const device *d){
+	const mdslave *m;
+
+	for(m = d->mddev.slaves ; m ; m = m->next){
+		const device *s;
+
+		if((s = lookup_device(m->name)) == NULL){
+			return 0;
+		}
+		if(s->layout == LAYOUT_PARTITION){
+			s = s->partdev.parent;
+		}
+		if(s->layout != LAYOUT_NONE || s->blkdev.rotation != SSD_ROTATION){
+			return 0;
+		}
+	}
+	return d->mddev.slaves != NULL;
+}
+
+// Spend up to 1/64th of available memory on the stripe cache, rounded down
+// to a power of 2, and never less than the kernel's default.
+static unsigned long
+md_auto_stripe_cache(const device *d){
+	uintmax_t budget,per;
+	unsigned long stripes;
+	long avail;
+
+	if((avail = sysconf(_SC_AVPHYS_PAGES)) <= 0 || d->mddev.disks == 0){
+		return MD_STRIPE_CACHE_DEFAULT;
+	}
+	budget = (uintmax_t)avail * sysconf(_SC_PAGESIZE) / 64;
+	per = md_stripe_cache_bytes(d,1);
+	if(budget / per > MD_STRIPE_CACHE_MAX){
+		return MD_STRIPE_CACHE_MAX;
+	}
+	stripes = MD_STRIPE_CACHE_DEFAULT;
+	while(stripes * 2 <= budget / per){
+		stripes *= 2;
+	}
+	return stripes;
+}
+
+// A worker per two CPUs, no more than there are members, for arrays of
+// solid-state disks; none (parity is done by raid5d) otherwise.
+static unsigned long
+md_auto_group_threads(const device *d){
+	long cpus;
+
+	if(!md_members_ssd(d) || (cpus = sysconf(_SC_NPROCESSORS_ONLN)) < 4){
+		return 0;
+	}
+	cpus /= 2;
+	return (unsigned long)cpus < d->mddev.disks ? (unsigned long)cpus : d->mddev.disks;
+}
+
+static int
+md_parse_ulong(const char *val,unsigned long min,unsigned long max,unsigned long *ul){
+	char *e;
+
+	errno = 0;
+	*ul = strtoul(val,&e,10);
+	if(e == val || *e || errno || *ul < min || *ul > max){
+		diag("Bad value: %s (%lu–%lu)\n",val,min,max);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+md_refresh_tunables(device *d){
+	int fd;
+
+	if((fd = open_md_sysfs(d)) < 0){
+		diag("Couldn't open md sysfs for %s (%s?)\n",d->name,strerror(errno));
+		return -1;
+	}
+	read_md_tunables(d,fd);
+	close(fd);
+	return 0;
+}
+
+static int
+md_write_tunable(device *d,const char *node,unsigned long val){
+	char buf[32];
+	int fd,r;
+
+	if((fd = open_md_sysfs(d)) < 0){
+		diag("Couldn't open md sysfs for %s (%s?)\n",d->name,strerror(errno));
+		return -1;
+	}
+	snprintf(buf,sizeof(buf),"%lu",val);
+	if( (r = writeat_sysfs(fd,node,buf)) ){
+		diag("Couldn't set %s to %s on %s (%s?)\n",node,buf,d->name,strerror(errno));
+	}
+	read_md_tunables(d,fd);
+	close(fd);
+	return r;
+}
+
+// The bitmap's chunk size can't be changed in place; it's removed and added
+// anew, leaving the array briefly without one. The growlight lock is dropped
+// while mdadm runs, so the array is looked up anew afterwards.
+static int
+md_set_bitmap_chunk(device *d,const char *val){
+	char name[sizeof(d->name)];
+	unsigned long kib = 0;
+	int r = 0;
+
+	if(d->mddev.bitmap_file){
+		diag("%s has an external bitmap; use mdadm(8)\n",d->name);
+		return -1;
+	}
+	if(d->mddev.sync_action == NULL){
+		diag("%s has no redundancy to track\n",d->name);
+		return -1;
+	}
+	if(strcmp(val,"none")){
+		if(md_parse_ulong(val,4,1ul << 30,&kib)){
+			return -1;
+		}
+		if(kib & (kib - 1)){
+			diag("Bitmap chunk must be a power of 2: %lu\n",kib);
+			return -1;
+		}
+		if(d->mddev.bitmap_chunk == (uintmax_t)kib * 1024){
+			return 0;
+		}
+	}else if(d->mddev.bitmap_chunk == 0){
+		return 0;
+	}
+	strcpy(name,d->name);
+	if(d->mddev.bitmap_chunk && vspopen_drain("mdadm --grow /dev/%s --bitmap=none",name)){
+		r = -1;
+	}else if(strcmp(val,"none") && vspopen_drain("mdadm --grow /dev/%s --bitmap=internal --bitmap-chunk=%luK",
+				name,kib)){
+		r = -1;
+	}
+	if((d = find_device(name)) == NULL){
+		diag("Lost %s while changing its bitmap\n",name);
+		return -1;
+	}
+	if(md_refresh_tunables(d)){
+		return -1;
+	}
+	return r;
+}
+
+int md_tune(device *d,mdtunable t,const char *val){
+	unsigned long ul;
+
+	if(d->layout != LAYOUT_MDADM){
+		diag("%s is not an MD device\n",d->name);
+		return -1;
+	}
+	switch(t){
+		case MDTUNE_STRIPE_CACHE:
+			if(d->mddev.stripe_cache == 0){
+				diag("%s is not RAID4/5/6\n",d->name);
+				return -1;
+			}
+			if(strcmp(val,"auto") == 0){
+				ul = md_auto_stripe_cache(d);
+			}else if(md_parse_ulong(val,MD_STRIPE_CACHE_MIN,MD_STRIPE_CACHE_MAX,&ul)){
+				return -1;
+			}
+			if(md_write_tunable(d,"stripe_cache_size",ul)){
+				return -1;
+			}
+			diag("Stripe cache of %s: %lu stripes (%juKiB)\n",d->name,ul,
+				md_stripe_cache_bytes(d,ul) / 1024);
+			return 0;
+		case MDTUNE_GROUP_THREADS:
+			if(d->mddev.group_threads < 0){
+				diag("%s is not RAID4/5/6\n",d->name);
+				return -1;
+			}
+			if(strcmp(val,"auto") == 0){
+				ul = md_auto_group_threads(d);
+			}else if(md_parse_ulong(val,0,MD_GROUP_THREADS_MAX,&ul)){
+				return -1;
+			}
+			return md_write_tunable(d,"group_thread_cnt",ul);
+		case MDTUNE_BITMAP_CHUNK:
+			return md_set_bitmap_chunk(d,val);
+		default:
+			diag("Unknown md tunable %d\n",t);
+			return -1;
+	}
+}
+
+int md_autotune(device *d){
+	if(md_tune(d,MDTUNE_STRIPE_CACHE,"auto")){
+		return -1;
+	}
+	if(md_tune(d,MDTUNE_GROUP_THREADS,"auto")){
+		return -1;
+	}
+	diag("Worker threads of %s: %ld\n",d->name,d->mddev.group_threads);
+	return 0;
+}
+
 int destroy_mdadm(device *d){
 	if(d == NULL){
 		diag("Passed a NULL device\n");
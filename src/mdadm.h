@@ -6,13 +6,67 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+#include <stdint.h>
+
 struct device;
 
 // Wants a dirfd corresponding to the md/ sysfs directory for the node
 int explore_md_sysfs(struct device *,int);
 
+// Stop the array. The device will be gone (or going) once this returns.
 int destroy_mdadm(struct device *);
 
+// The remainder must be called with the growlight lock held.
+
+// Re-read an array's resync progress, action and speed limits.
+int md_sync_refresh(struct device *);
+
+// Update the resync progress of every array, calling block_event for those
+// which changed. Called once a second from the event thread.
+void md_sync_poll(void);
+
+// Seconds until the resync completes at its current speed, or -1 if there's
+// no sync running or its speed isn't yet known.
+long md_sync_eta(const struct device *);
+
+// Set the array's minimum and/or maximum resync speed, in KiB/s. "system"
+// reverts to /proc/sys/dev/raid/speed_limit_{min,max}; NULL leaves the limit
+// unchanged.
+int md_set_sync_speed(struct device *,const char *,const char *);
+
+// Performance tunables of md arrays. The stripe cache and worker threads
+// apply only to RAID4/5/6; the write-intent bitmap to any redundant array.
+typedef enum {
+	MDTUNE_STRIPE_CACHE,	// md/stripe_cache_size
+	MDTUNE_GROUP_THREADS,	// md/group_thread_cnt
+	MDTUNE_BITMAP_CHUNK,	// md/bitmap/chunksize, via mdadm --grow
+	MDTUNE_COUNT
+} mdtunable;
+
+const char *mdtunable_str(mdtunable);
+const char *mdtunable_desc(mdtunable);
+// Returns -1 if the name isn't an md tunable.
+int mdtunable_parse(const char *,mdtunable *);
+
+// Write the array's current value of the tunable. Returns -1 if the array
+// doesn't offer it, or it doesn't fit.
+int md_tunable_value(const struct device *,mdtunable,char *,size_t);
+
+// Memory consumed by a stripe cache of the given size on the array: one page
+// per member disk per stripe.
+uintmax_t md_stripe_cache_bytes(const struct device *,unsigned long);
+
+// Set the tunable. The stripe cache and thread count accept "auto", sizing
+// them from the member count and available memory; the bitmap chunk is in
+// KiB (a power of 2), or "none" to remove the bitmap. Call with the growlight
+// lock held; changing the bitmap chunk drops it while mdadm runs.
+int md_tune(struct device *,mdtunable,const char *);
+
+// Auto-size the stripe cache and worker threads, reporting via diag(). Call
+// with the growlight lock held.
+int md_autotune(struct device *);
+
 int make_mdraid0(const char *name,char * const *,int);
 int make_mdraid1(const char *name,char * const *,int);
 int make_mdraid4(const char *name,char * const *,int);
@@ -3,19 +3,20 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <iconv.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/mman.h>
 #include <sys/random.h>
 
 #include "mbr.h"
 #include "msdos.h"
 #include "ptypes.h"
 #include "ptable.h"
+#include "blockio.h"
 #include "growlight.h"
 
-#define LBA_SIZE 512u
-#define MBR_SIZE (LBA_SIZE - MBR_OFFSET)
+// The MBR lives in the first 512 bytes of LBA 0, whatever the block size
+#define MBR_SIZE (512u - MBR_OFFSET)
 #define DISKSIG_LEN 4
 #define MSDOS_ENTRIES 4
 
@@ -53,150 +54,92 @@ initialize_msdos(msdos_header *mh){
 	return 0;
 }
 
-// Write out a msdos partition map on the device represented by fd, using
-// lbasize-byte LBA. We will write to the first sector only. We can either zero
-// it all out, or create a new empty msdos. Set realdata not equal to 0 to
-// perform the latter.
+// Write out a msdos partition map to the first sector of the device,
+// preserving its boot code. We can either zero out the map (along with the
+// disk signature and boot signature), or create a new empty msdos. Set
+// realdata not equal to 0 to perform the latter.
 static int
-write_msdos(int fd, ssize_t lbasize, unsigned realdata){
-	int pgsize = getpagesize();
+write_msdos(blockio *b, unsigned realdata){
 	msdos_header *mhead;
-	size_t mapsize;
-	void *map;
+	int ret = -1;
 
-	assert(pgsize > 0 && pgsize % lbasize == 0);
-	mapsize = lbasize;
-	mapsize = ((mapsize / pgsize) + !!(mapsize % pgsize)) * pgsize;
-	assert(mapsize % pgsize == 0 && mapsize);
-	map = mmap(NULL, mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-	if(map == MAP_FAILED){
-		diag("Error mapping %zub at %d (%s?)\n", mapsize, fd, strerror(errno));
-		return -1;
-	}
-	mhead = (msdos_header *)map;
-	if(!realdata){
-		memset(mhead, 0, MBR_OFFSET + MBR_SIZE);
-	}else{
-		if(initialize_msdos(mhead)){
-			munmap(map, mapsize);
-			return -1;
-		}
-	}
-	if(msync(map, mapsize, MS_SYNC|MS_INVALIDATE)){
-		diag("Error syncing %d (%s?)\n", fd, strerror(errno));
-		munmap(map, mapsize);
+	if((mhead = blockio_alloc(b, 1)) == NULL){
 		return -1;
 	}
-	if(munmap(map, mapsize)){
-		diag("Error unmapping %d (%s?)\n", fd, strerror(errno));
-		return -1;
+	if(blockio_read(b, mhead, 0, 1) == 0){
+		if(!realdata){
+			memset((char *)mhead + MBR_OFFSET, 0, MBR_SIZE);
+		}
+		if(!realdata || initialize_msdos(mhead) == 0){
+			if(blockio_write(b, mhead, 0, 1) == 0){
+				ret = blockio_flush(b);
+			}
+		}
 	}
-	return 0;
+	free(mhead);
+	return ret;
 }
 
-int new_msdos(device *d){
-	int fd;
-
-	if(d->layout != LAYOUT_NONE){
-		diag("Won't create partition table on non-disk %s\n", d->name);
-		return -1;
-	}
-	if(d->size % LBA_SIZE){
-		diag("Won't create msdos on (%ju %% %u == %juB) disk %s\n",
-			d->size, LBA_SIZE, d->size % LBA_SIZE, d->name);
-		return -1;
-	}
-	if(d->size < LBA_SIZE){
-		diag("Won't create msdos on empty disk %s\n", d->name);
-		return -1;
-	}
-	if((fd = openat(devfd, d->name, O_RDWR|O_CLOEXEC|O_DIRECT)) < 0){
-		diag("Couldn't open %s (%s?)\n", d->name, strerror(errno));
-		return -1;
-	}
-	if(write_msdos(fd, LBA_SIZE, 1)){
-		diag("Couldn't write msdos on %s (%s?)\n", d->name, strerror(errno));
-		close(fd);
-		return -1;
-	}
-	if(fsync(fd)){
-		diag("Warning: error syncing %d for %s (%s?)\n", fd, d->name, strerror(errno));
-	}
-	if(close(fd)){
-		diag("Error closing %d for %s (%s?)\n", fd, d->name, strerror(errno));
+int new_msdos(blockio *b){
+	if(write_msdos(b, 1)){
+		diag("Couldn't write msdos on %s\n", b->name);
 		return -1;
 	}
 	return 0;
 }
 
-int zap_msdos(device *d){
-	if(d->layout != LAYOUT_NONE){
-		diag("Won't zap partition table on non-disk %s\n", d->name);
-		return -1;
-	}
-	if(d->blkdev.pttable == NULL || strcmp(d->blkdev.pttable, "dos")){
-		diag("No msdos on disk %s\n", d->name);
+int zap_msdos(blockio *b){
+	if(write_msdos(b, 0)){
+		diag("Couldn't zap msdos on %s\n", b->name);
 		return -1;
 	}
-	return wipe_dos_ptable(d);
+	return 0;
 }
 
-// Map the primary msdos header, its table, and the MBR boot sector.
-static void *
-map_msdos(device *d, size_t *mapsize, int *fd, size_t lbasize){
-	const int pgsize = getpagesize();
-	void *map;
-
-	if(pgsize < 0){
-		diag("Bad pgsize for msdos: %d\n", pgsize);
-		return MAP_FAILED;
-	}
-	if((*fd = openat(devfd, d->name, O_RDWR|O_CLOEXEC|O_DIRECT)) < 0){
-		diag("Couldn't open %s (%s?)\n", d->name, strerror(errno));
-		return MAP_FAILED;
-	}
-	*mapsize = lbasize;
-	*mapsize = ((*mapsize / pgsize) + !!(*mapsize % pgsize)) * pgsize;
-	assert(*mapsize % pgsize == 0);
-	map = mmap(NULL, *mapsize, PROT_READ|PROT_WRITE, MAP_SHARED, *fd, 0);
-	if(map == MAP_FAILED){
-		diag("Couldn't map msdos header (%s?)\n", strerror(errno));
-		close(*fd);
-		return map;
-	}
-	return map;
+// Read the MBR boot sector of a whole disk, returning its partition table.
+// The sector is left in *buf, to be written back with sync_msdos().
+static msdos_entry *
+read_msdos(blockio *b, const device *d, void **buf){
+	assert(d->layout == LAYOUT_NONE);
+	if(blockio_open(b, d, O_RDWR)){
+		return NULL;
+	}
+	if((*buf = blockio_alloc(b, 1)) == NULL){
+		blockio_close(b);
+		return NULL;
+	}
+	if(blockio_read(b, *buf, 0, 1)){
+		free(*buf);
+		blockio_close(b);
+		return NULL;
+	}
+	return (msdos_entry *)((char *)*buf + MBR_OFFSET + 6);
 }
 
-// Pass the return from map_msdos(), ie the MBR boot sector
+// Write back and flush the boot sector from read_msdos().
 static int
-unmap_msdos(const device *parent, void *map, size_t mapsize, int fd){
-	const int pgsize = getpagesize();
-
-	assert(parent->layout == LAYOUT_NONE);
-	if(pgsize < 0){
-		diag("Warning: bad pgsize for msdos: %d\n", pgsize);
-	}
-	if(munmap(map, mapsize)){
-		int e = errno;
-
-		diag("Error munmapping %s (%s?)\n", parent->name, strerror(errno));
-		close(fd);
-		errno = e;
+sync_msdos(blockio *b, const void *buf){
+	if(blockio_write(b, buf, 0, 1)){
 		return -1;
 	}
-	return 0;
+	return blockio_flush(b);
+}
+
+// Release the results of read_msdos().
+static int
+close_msdos(blockio *b, void *buf){
+	free(buf);
+	return blockio_close(b);
 }
 
 int add_msdos(device *d, const wchar_t *name, uintmax_t fsec, uintmax_t lsec, unsigned long long code){
 	static unsigned char zmpe[16] = "";
-	const size_t lbasize = LBA_SIZE;
 	unsigned z, partno;
 	msdos_entry *mpe;
 	unsigned mbrcode;
-	size_t mapsize;
-	uint64_t lbas;
-	void *map;
-	int fd, r;
+	blockio b;
+	void *buf;
+	int r;
 
 	if(name){
 		diag("msdos partitions don't support names\n");
@@ -222,24 +165,20 @@ int add_msdos(device *d, const wchar_t *name, uintmax_t fsec, uintmax_t lsec, un
 		diag("No msdos on disk %s\n", d->name);
 		return -1;
 	}
-	if(d->size % lbasize){
-		diag("Disk size is not a multiple of LBA size, aborting\n");
-		return -1;
-	}
-	lbas = d->size / lbasize;
 	// Align it properly
 	if(fsec % (d->physsec / d->logsec)){
 		fsec += (d->physsec / d->logsec) - (fsec % (d->physsec / d->logsec));
 		assert(fsec % (d->physsec / d->logsec) == 0);
 	}
-	if(lsec < fsec || lsec > last_usable_sector(d) || fsec < first_usable_sector(d)){
-		diag("Bad sector spec (%ju:%ju) on %ju disk\n", fsec, lsec, lbas);
+	if((mpe = read_msdos(&b, d, &buf)) == NULL){
 		return -1;
 	}
-	if((map = map_msdos(d, &mapsize, &fd, LBA_SIZE)) == MAP_FAILED){
+	if(lsec < fsec || lsec >= b.lbas || lsec > last_usable_sector(d) ||
+			fsec < first_usable_sector(d)){
+		diag("Bad sector spec (%ju:%ju) on %ju disk\n", fsec, lsec, (uintmax_t)b.lbas);
+		close_msdos(&b, buf);
 		return -1;
 	}
-	mpe = (msdos_entry *)((char *)map + MBR_OFFSET + 6);
 	// Determine the next available partition number, and verify that no
 	// existing partitions overlap with this one.
 	partno = MSDOS_ENTRIES;
@@ -259,33 +198,25 @@ int add_msdos(device *d, const wchar_t *name, uintmax_t fsec, uintmax_t lsec, un
 	}
 	if((z = partno) == MSDOS_ENTRIES){
 		diag("no entry for a new partition in %s\n", d->name);
-		munmap(map, mapsize);
-		close(fd);
+		close_msdos(&b, buf);
 		return -1;
 	}
 	diag("First sector: %ju last sector: %ju count: %ju size: %ju\n",
 			(uintmax_t)fsec,
 			(uintmax_t)lsec,
 			(uintmax_t)(lsec - fsec),
-			(uintmax_t)((lsec - fsec) * d->logsec));
+			(uintmax_t)((lsec - fsec) * b.lbasize));
 	memset(&mpe[z], 0, sizeof(*mpe));
 	mpe[z].ptype = mbrcode;
 	mpe[z].lbafirst = fsec;
 	mpe[z].lbasect = lsec - fsec + 1;
-	if(unmap_msdos(d, map, mapsize, fd)){
-		close(fd);
+	if(sync_msdos(&b, buf)){
+		close_msdos(&b, buf);
 		return -1;
 	}
-	if(fsync(fd)){
-		diag("Couldn't sync %d for %s\n", fd, d->name);
-	}
-	r = blkpg_add_partition(fd, fsec * LBA_SIZE,
-			(lsec - fsec + 1) * LBA_SIZE, z + 1, "");
-	if(close(fd)){
-		int e = errno;
-
-		diag("Error closing %s (%s?)\n", d->name, strerror(errno));
-		errno = e;
+	r = blkpg_add_partition(b.fd, fsec * b.lbasize,
+			(lsec - fsec + 1) * b.lbasize, z + 1, "");
+	if(close_msdos(&b, buf)){
 		return -1;
 	}
 	return r;
@@ -293,10 +224,10 @@ int add_msdos(device *d, const wchar_t *name, uintmax_t fsec, uintmax_t lsec, un
 
 int flags_msdos(device *d, uint64_t flags){
 	msdos_entry *mpe;
-	size_t mapsize;
+	blockio b;
 	unsigned g;
-	void *map;
-	int fd;
+	void *buf;
+	int r;
 
 	if(flags != 0x80 && flags != 0){
 		diag("Invalid flags for BIOS/MBR: 0x%016jx\n", (uintmax_t)flags);
@@ -312,28 +243,23 @@ int flags_msdos(device *d, uint64_t flags){
 		return -1;
 	}
 	g = d->partdev.pnumber - 1;
-	if((map = map_msdos(d->partdev.parent, &mapsize, &fd, LBA_SIZE)) == MAP_FAILED){
+	if((mpe = read_msdos(&b, d->partdev.parent, &buf)) == NULL){
 		return -1;
 	}
-	mpe = (msdos_entry *)((char *)map + MBR_OFFSET + 6);
 	mpe[g].flags = flags;
-	if(unmap_msdos(d->partdev.parent, map, mapsize, fd)){
-		close(fd);
+	r = sync_msdos(&b, buf);
+	if(close_msdos(&b, buf)){
 		return -1;
 	}
-	if(close(fd)){
-		diag("Error closing %s (%s?)\n", d->name, strerror(errno));
-		return -1;
-	}
-	return 0;
+	return r;
 }
 
 int flag_msdos(device *d, uint64_t flag, unsigned status){
 	msdos_entry *mpe;
-	size_t mapsize;
+	blockio b;
 	unsigned g;
-	void *map;
-	int fd;
+	void *buf;
+	int r;
 
 	if(flag != 0x80){
 		diag("Invalid flag for BIOS/MBR: 0x%016jx\n", (uintmax_t)flag);
@@ -349,33 +275,28 @@ int flag_msdos(device *d, uint64_t flag, unsigned status){
 		return -1;
 	}
 	g = d->partdev.pnumber - 1;
-	if((map = map_msdos(d->partdev.parent, &mapsize, &fd, LBA_SIZE)) == MAP_FAILED){
+	if((mpe = read_msdos(&b, d->partdev.parent, &buf)) == NULL){
 		return -1;
 	}
-	mpe = (msdos_entry *)((char *)map + MBR_OFFSET + 6);
 	if(status){
 		mpe[g].flags |= flag;
 	}else{
 		mpe[g].flags &= ~flag;
 	}
-	if(unmap_msdos(d->partdev.parent, map, mapsize, fd)){
-		close(fd);
+	r = sync_msdos(&b, buf);
+	if(close_msdos(&b, buf)){
 		return -1;
 	}
-	if(close(fd)){
-		diag("Error closing %s (%s?)\n", d->name, strerror(errno));
-		return -1;
-	}
-	return 0;
+	return r;
 }
 
 int code_msdos(device *d, unsigned long long code){
 	msdos_entry *mpe;
 	unsigned mbrcode;
-	size_t mapsize;
+	blockio b;
 	unsigned g;
-	void *map;
-	int fd;
+	void *buf;
+	int r;
 
 	if(get_mbr_code(code, &mbrcode)){
 		diag("Illegal code for DOS/BIOS/MBR: %llu\n", code);
@@ -387,34 +308,29 @@ int code_msdos(device *d, unsigned long long code){
 		return -1;
 	}
 	g = d->partdev.pnumber - 1;
-	if((map = map_msdos(d->partdev.parent, &mapsize, &fd, LBA_SIZE)) == MAP_FAILED){
+	if((mpe = read_msdos(&b, d->partdev.parent, &buf)) == NULL){
 		return -1;
 	}
-	mpe = (msdos_entry *)((char *)map + MBR_OFFSET + 6);
 	if(mpe[g].lbafirst == 0 || mpe[g].lbasect == 0){
 		diag("Not a valid msdos partition: %s\n", d->name);
-		unmap_msdos(d->partdev.parent, map, mapsize, fd);
-		close(fd);
+		close_msdos(&b, buf);
 		return -1;
 	}
 	mpe[g].ptype = mbrcode;
-	if(unmap_msdos(d->partdev.parent, map, mapsize, fd)){
-		close(fd);
-		return -1;
-	}
-	if(close(fd)){
-		diag("Error closing %s (%s?)\n", d->name, strerror(errno));
+	r = sync_msdos(&b, buf);
+	if(close_msdos(&b, buf)){
 		return -1;
 	}
-	return 0;
+	return r;
 }
 
 int del_msdos(const device *p){
+	uint64_t first, count;
 	msdos_entry *mpe;
-	size_t mapsize;
+	blockio b;
 	unsigned g;
-	void *map;
-	int fd, r;
+	void *buf;
+	int r;
 
 	assert(p->layout == LAYOUT_PARTITION);
 	if(p->partdev.pnumber == 0 || p->partdev.pnumber > MSDOS_ENTRIES){
@@ -422,32 +338,29 @@ int del_msdos(const device *p){
 		return -1;
 	}
 	g = p->partdev.pnumber - 1;
-	if((map = map_msdos(p->partdev.parent, &mapsize, &fd, LBA_SIZE)) == MAP_FAILED){
+	if((mpe = read_msdos(&b, p->partdev.parent, &buf)) == NULL){
 		return -1;
 	}
-	mpe = (msdos_entry *)((char *)map + MBR_OFFSET + 6);
+	first = mpe[g].lbafirst;
+	count = mpe[g].lbasect;
 	memset(&mpe[g], 0, sizeof(*mpe));
-	if(unmap_msdos(p->partdev.parent, map, mapsize, fd)){
-		close(fd);
+	if(sync_msdos(&b, buf)){
+		close_msdos(&b, buf);
 		return -1;
 	}
-	if(fsync(fd)){
-		diag("Couldn't sync %d for %s\n", fd, p->name);
-	}
-	r = blkpg_del_partition(fd, p->partdev.fsector * LBA_SIZE,
-				p->size, p->partdev.pnumber,
-				p->partdev.parent->name);
-	if(close(fd)){
-		diag("Couldn't close %s (%s?)\n", p->partdev.parent->name, strerror(errno));
+	r = blkpg_del_partition(b.fd, first * b.lbasize, count * b.lbasize,
+				p->partdev.pnumber, p->partdev.parent->name);
+	if(close_msdos(&b, buf)){
 		return -1;
 	}
 	return r;
 }
 
-uintmax_t first_msdos(const device *d __attribute__ ((unused))){
+uintmax_t first_msdos(const device *d __attribute__ ((unused)),
+			const blockcap *cap __attribute__ ((unused))){
 	return 1;
 }
 
-uintmax_t last_msdos(const device *d){
+uintmax_t last_msdos(const device *d, const blockcap *cap __attribute__ ((unused))){
 	return d->logsec && d->size ? d->size / d->logsec - 1 : 0;
 }
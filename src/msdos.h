@@ -10,10 +10,12 @@ extern "C" {
 #include <stdint.h>
 
 struct device;
+struct blockio;
+struct blockcap;
 
 // Pass the block device
-int new_msdos(struct device *);
-int zap_msdos(struct device *);
+int new_msdos(struct blockio *);
+int zap_msdos(struct blockio *);
 int add_msdos(struct device *,const wchar_t *,uintmax_t,uintmax_t,unsigned long long);
 
 // Pass the partition
@@ -22,8 +24,8 @@ int flag_msdos(struct device *,uint64_t,unsigned);
 int flags_msdos(struct device *,uint64_t);
 int code_msdos(struct device *,unsigned long long);
 
-uintmax_t first_msdos(const struct device *);
-uintmax_t last_msdos(const struct device *);
+uintmax_t first_msdos(const struct device *, const struct blockcap *);
+uintmax_t last_msdos(const struct device *, const struct blockcap *);
 
 #ifdef __cplusplus
 }
@@ -26,6 +26,11 @@ void raise_multiform(const char *,void (*)(const char *,char **,int,int),
 struct panel_state *show_splash(const wchar_t *);
 void kill_splash(struct panel_state *);
 
+// Bracket anything which runs an external tool (see popen.h). The first drops
+// this thread's holds on the UI lock, returning their count for the second.
+unsigned release_notcurses(void);
+void reacquire_notcurses(unsigned);
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <locale.h>
 #include <pthread.h>
 #include <atasmart.h>
@@ -12,9 +13,16 @@
 
 #include "fs.h"
 #include "mbr.h"
+#include "nvme.h"
 #include "zfs.h"
 #include "swap.h"
+#include "jobs.h"
+#include "wipe.h"
+#include "queue.h"
+#include "stack.h"
+#include "dmstats.h"
 #include "mdadm.h"
+#include "drivefeat.h"
 #include "health.h"
 #include "ptable.h"
 #include "ptypes.h"
@@ -26,6 +34,8 @@
 static void shutdown_cycle(void) __attribute__ ((noreturn));
 
 void locked_diag(const char *fmt,...) __attribute__ ((format (printf,1,2)));
+unsigned release_notcurses(void);
+void reacquire_notcurses(unsigned);
 
 // For the "standard" terminal, we can fit only 4 lines of explicative text
 // onto the screen, so make each glyph count. By default, 76 characters can be
@@ -88,7 +98,26 @@ static const char FSTYPE_TEXT[] =
 "not natively support it. I recommend use of ext4 or FAT16 for root and ZFS "
 "(in a redundant configuration) for other filesystems.";
 
+static const char QUEUE_TEXT[] =
+"Request queue parameters apply to the entire disk, and last until the disk "
+"is removed or the system reboots. Values outside the range shown are refused "
+"without changing anything.";
+
+static const char NVME_TEXT[] =
+"NVMe features last until the controller is reset. \"latency\" disables "
+"autonomous power state transitions and interrupt coalescing, and selects "
+"power state 0, on every NVMe controller. Changing the LBA format destroys "
+"all data on the namespace; the best-performing format is preselected.";
+
+static const char MD_TEXT[] =
+"Resync speed limits are in KiB/s; the kernel syncs at least at the minimum "
+"even while the member disks are busy, and never faster than the maximum "
+"(\"system\" reverts to /proc/sys/dev/raid). Each cached stripe costs a page "
+"per member. The bitmap chunk is in KiB, and changing it recreates the "
+"bitmap on the members. Other settings last until the array is stopped.";
+
 static pthread_mutex_t bfl; // recursive, initialized in main()
+static __thread unsigned bfldepth; // how many times this thread holds bfl
 
 struct panel_state {
   struct ncplane *n;
@@ -105,10 +134,14 @@ static struct panel_state maps = PANEL_STATE_INITIALIZER;
 static struct panel_state help = PANEL_STATE_INITIALIZER;
 static struct panel_state diags = PANEL_STATE_INITIALIZER;
 static struct panel_state details = PANEL_STATE_INITIALIZER;
+static struct panel_state jobs = PANEL_STATE_INITIALIZER;
+static struct panel_state heat = PANEL_STATE_INITIALIZER;
 
 static int helpstrs(struct ncplane* n);
 static int map_details(struct ncplane* n);
 static int update_details(struct ncplane* n);
+static int update_jobs(struct panel_state *ps);
+static int update_heat(struct panel_state *ps);
 
 static inline void
 update_details_cond(struct ncplane *n){
@@ -131,6 +164,20 @@ update_map_cond(struct ncplane* p){
   }
 }
 
+static inline void
+update_jobs_cond(struct panel_state *ps){
+  if(ps->n){
+    update_jobs(ps);
+  }
+}
+
+static inline void
+update_heat_cond(struct panel_state *ps){
+  if(ps->n){
+    update_heat(ps);
+  }
+}
+
 struct form_option {
   char *option;      // option key (the string passed to cb)
   char *desc;      // longer description
@@ -2319,16 +2366,23 @@ mountop_callback(const char *op, char **selarray, int selections, int scrollidx)
   }
   if(strcmp(op, "") == 0){
     unsigned mntos = 0;
+    device *d = NULL;
 
     while(selections--){
       mntos |= flag_for_mountop(selarray[selections]);
     }
     if(blockobj_unpartitionedp(b)){
-      mmount(b->d, forming_targ, mntos, NULL);
+      d = b->d;
     }else if(blockobj_emptyp(b)){
       locked_diag("Not a partition, aborting.\n");
     }else{
-      mmount(b->zone->p, forming_targ, mntos, NULL);
+      d = b->zone->p;
+    }
+    if(d){
+      unsigned held = release_notcurses(); // zfs mounts run zfs(8)
+
+      mmount(d, forming_targ, mntos, NULL);
+      reacquire_notcurses(held);
     }
     return;
   }
@@ -2476,13 +2530,16 @@ void kill_splash(struct panel_state *ps){
 static int
 fs_do_internal(device *d, const char *fst, const char *name){
   struct panel_state *ps;
+  unsigned held;
   int r;
 
   if(!mkfs_safe_p(d)){
     return -1;
   }
   ps = show_splash(L"Creating filesystem...");
+  held = release_notcurses();
   r = make_filesystem(d, fst, name);
+  reacquire_notcurses(held);
   if(ps){
     kill_splash(ps);
   }
@@ -3073,6 +3130,28 @@ detail_fs(struct ncplane* hw, const device* d, int row){
 
 // One must not call diag() from any function called by update_details(), or
 // else you will get one of a deadlock or a stack overflow due to corecursion.
+// How an aggregate's last interval of I/O fell upon the disks beneath it.
+static void
+detail_stack_io(struct ncplane* hw, const device *d){
+  const device *disks[16];
+  uintmax_t total = 0;
+  unsigned n, z;
+
+  n = stack_disks(d, disks, sizeof(disks) / sizeof(*disks));
+  for(z = 0 ; z < n ; ++z){
+    total += stack_io(disks[z]);
+  }
+  if(total == 0){
+    return;
+  }
+  ncplane_putstr(hw, " Disks:");
+  ncplane_off_styles(hw, NCSTYLE_BOLD);
+  for(z = 0 ; z < n ; ++z){
+    cwprintw(hw, " %s %ju%%", disks[z]->name, stack_io(disks[z]) * 100 / total);
+  }
+  ncplane_on_styles(hw, NCSTYLE_BOLD);
+}
+
 static int
 update_details(struct ncplane* hw){
   const controller* c = get_current_controller();
@@ -3142,6 +3221,40 @@ update_details(struct ncplane* hw){
         d->blkdev.rwverify == RWVERIFY_SUPPORTED_ON ? '+' :
         d->blkdev.rwverify == RWVERIFY_SUPPORTED_OFF ? '-' : 'x',
         d->roflag ? '+' : '-');
+    if(d->blkdev.ataid){
+      cwprintw(hw, " RLA%c",
+          d->blkdev.lookahead == RWVERIFY_SUPPORTED_ON ? '+' :
+          d->blkdev.lookahead == RWVERIFY_SUPPORTED_OFF ? '-' : 'x');
+      if(d->blkdev.apmsup){
+        if(d->blkdev.apm){
+          cwprintw(hw, " APM%u", d->blkdev.apm);
+        }else{
+          cwprintw(hw, " APM-");
+        }
+      }
+      if(d->blkdev.aamsup){
+        if(d->blkdev.aam){
+          cwprintw(hw, " AAM%u", d->blkdev.aam);
+        }else{
+          cwprintw(hw, " AAM-");
+        }
+      }
+      if(d->blkdev.caps.ncq){
+        cwprintw(hw, " NCQ%u", d->blkdev.caps.queue_depth);
+      }
+      if(d->blkdev.caps.trim){
+        cwprintw(hw, " TRIM%s", d->blkdev.caps.rzat ? "(Z)" : d->blkdev.caps.drat ? "(D)" : "");
+      }
+    }
+    if(d->blkdev.caps.zoned != ZONED_NONE){
+      cwprintw(hw, " SMR(%s)", zoned_str(d->blkdev.caps.zoned));
+    }
+    if(d->blkdev.transport == DIRECT_NVME){
+      cwprintw(hw, " APST%c PS%u",
+          d->blkdev.apst == RWVERIFY_SUPPORTED_ON ? '+' :
+          d->blkdev.apst == RWVERIFY_SUPPORTED_OFF ? '-' : 'x',
+          d->blkdev.powerstate);
+    }
     assert(d->physsec <= 4096);
     cmvwprintw(hw, 4, START_COL, "Sectors: ");
     ncplane_off_styles(hw, NCSTYLE_BOLD);
@@ -3157,8 +3270,8 @@ update_details(struct ncplane* hw){
     ncplane_on_styles(hw, NCSTYLE_BOLD);
     cwprintw(hw, "physical) %s",
     transport_str(d->blkdev.transport));
-    if(transport_bw(d->blkdev.transport)){
-      uintmax_t transbw = transport_bw(d->blkdev.transport);
+    if(device_bw(d)){
+      uintmax_t transbw = device_bw(d);
       cwprintw(hw, " (");
       ncplane_off_styles(hw, NCSTYLE_BOLD);
       // FIXME throws -Wformat-truncation on gcc9
@@ -3172,6 +3285,19 @@ update_details(struct ncplane* hw){
           d->revision ? d->revision : "n/a",
           ncbprefix(d->size, 1, buf, 1),
           d->roflag ? '+' : '-');
+    if(d->layout == LAYOUT_DM){
+      const dmtarget *dt;
+      unsigned n = 0;
+
+      for(dt = d->dmdev.targets ; dt ; dt = dt->next){
+        ++n;
+      }
+      cwprintw(hw, " Table: ");
+      ncplane_off_styles(hw, NCSTYLE_BOLD);
+      cwprintw(hw, "%s (%u target%s)", d->dmdev.level ? d->dmdev.level : "none",
+               n, n == 1 ? "" : "s");
+      ncplane_on_styles(hw, NCSTYLE_BOLD);
+    }
     if(d->layout == LAYOUT_MDADM){
       cwprintw(hw, " Stride: ");
       ncplane_off_styles(hw, NCSTYLE_BOLD);
@@ -3189,6 +3315,22 @@ update_details(struct ncplane* hw){
         cwprintw(hw, "%u", d->mddev.swidth);
       }
       ncplane_on_styles(hw, NCSTYLE_BOLD);
+      if(d->mddev.resync && d->mddev.sync_action){
+        long eta = md_sync_eta(d);
+
+        cwprintw(hw, " %s: ", d->mddev.sync_action);
+        ncplane_off_styles(hw, NCSTYLE_BOLD);
+        if(d->mddev.sync_total == 0){
+          ncplane_putstr(hw, "delayed");
+        }else{
+          cwprintw(hw, "%.1f%% %sB/s", d->mddev.sync_done * 100.0 / d->mddev.sync_total,
+                   ncbprefix(d->mddev.sync_speed * 1024ull, 1, buf, 1));
+          if(eta >= 0){
+            cwprintw(hw, " ETA %ld:%02ld:%02ld", eta / 3600, eta / 60 % 60, eta % 60);
+          }
+        }
+        ncplane_on_styles(hw, NCSTYLE_BOLD);
+      }
     }
     assert(d->physsec <= 4096);
     cmvwprintw(hw, 4, START_COL, "Sectors: ");
@@ -3204,6 +3346,23 @@ update_details(struct ncplane* hw){
     cwprintw(hw, "%uB ", d->physsec);
     ncplane_on_styles(hw, NCSTYLE_BOLD);
     cwprintw(hw, "physical)");
+    if(d->layout == LAYOUT_MDADM && d->mddev.stripe_cache){
+      cwprintw(hw, " SCache: ");
+      ncplane_off_styles(hw, NCSTYLE_BOLD);
+      cwprintw(hw, "%lu (%sB)", d->mddev.stripe_cache,
+               ncbprefix(md_stripe_cache_bytes(d, d->mddev.stripe_cache), 1, buf, 1));
+      ncplane_on_styles(hw, NCSTYLE_BOLD);
+      cwprintw(hw, " Threads: ");
+      ncplane_off_styles(hw, NCSTYLE_BOLD);
+      cwprintw(hw, "%ld", d->mddev.group_threads);
+      ncplane_on_styles(hw, NCSTYLE_BOLD);
+    }
+    if(d->layout == LAYOUT_MDADM && d->mddev.bitmap_chunk){
+      cwprintw(hw, " Bitmap: ");
+      ncplane_off_styles(hw, NCSTYLE_BOLD);
+      cwprintw(hw, "%sB", ncbprefix(d->mddev.bitmap_chunk, 1, buf, 1));
+      ncplane_on_styles(hw, NCSTYLE_BOLD);
+    }
   }
   cmvwprintw(hw, 5, START_COL, "Partitioning: ");
   ncplane_off_styles(hw, NCSTYLE_BOLD);
@@ -3217,6 +3376,9 @@ update_details(struct ncplane* hw){
   ncplane_off_styles(hw, NCSTYLE_BOLD);
   ncplane_putstr(hw, d->sched ? d->sched : "custom");
   ncplane_on_styles(hw, NCSTYLE_BOLD);
+  if(d->layout == LAYOUT_MDADM || d->layout == LAYOUT_DM){
+    detail_stack_io(hw, d);
+  }
   if(blockobj_unloadedp(b)){
     cmvwprintw(hw, 6, START_COL, "Media is not loaded");
     return 0;
@@ -3304,6 +3466,8 @@ static const wchar_t *helps[] = {
   L"'k'/↑: navigate up            'j'/↓: navigate down",
   L"PageUp: previous adapter      PageDown: next adapter",
   L"'/': search                   'p': configure loop device",
+  L"'J': view background jobs     'c': cancel jobs on selection",
+  L"'x': dm-stats latency heatmap",
   NULL
 };
 
@@ -3316,6 +3480,9 @@ static const wchar_t *helps_block[] = {
   L"'F': fsck filesystem          'w': wipe filesystem",
   L"'U': set filesystem UUID      'L': set filesystem label/name",
   L"'o': mount filesystem/swapon  'O': unmount filesystem/swapoff",
+  L"'S': benchmark block device   'X': wipe entire device",
+  L"'Q': tune request queue       'N': NVMe features",
+  L"'R': tune md RAID array",
   NULL
 };
 
@@ -3383,6 +3550,7 @@ static inline void
 lock_notcurses(void){
   lock_growlight();
   pthread_mutex_lock(&bfl);
+  ++bfldepth;
 }
 
 static inline void
@@ -3390,7 +3558,10 @@ unlock_notcurses(void){
   update_details_cond(details.n);
   update_help_cond(help.n);
   update_map_cond(maps.n);
+  update_jobs_cond(&jobs);
+  update_heat_cond(&heat);
   screen_update();
+  --bfldepth;
   pthread_mutex_unlock(&bfl);
   unlock_growlight();
 }
@@ -3400,6 +3571,7 @@ unlock_notcurses(void){
 static inline void
 lock_notcurses_growlight(void){
   pthread_mutex_lock(&bfl);
+  ++bfldepth;
 }
 
 static inline void
@@ -3407,10 +3579,34 @@ unlock_notcurses_growlight(void){
   update_details_cond(details.n);
   update_help_cond(help.n);
   update_map_cond(maps.n);
+  update_jobs_cond(&jobs);
+  update_heat_cond(&heat);
   screen_update();
+  --bfldepth;
   pthread_mutex_unlock(&bfl);
 }
 
+// External tools run without the growlight lock (see popen.h), and growlight
+// callbacks take bfl while holding it. Were we to keep bfl while the tool
+// runs, we'd deadlock against such a callback upon retaking the growlight
+// lock, so bfl is dropped first, and retaken once the growlight lock is back.
+unsigned release_notcurses(void){
+  unsigned held = bfldepth;
+
+  while(bfldepth){
+    --bfldepth;
+    pthread_mutex_unlock(&bfl);
+  }
+  return held;
+}
+
+void reacquire_notcurses(unsigned held){
+  while(held--){
+    pthread_mutex_lock(&bfl);
+    ++bfldepth;
+  }
+}
+
 static void
 use_prev_zone(blockobj* b){
   if(b->zone){
@@ -3475,7 +3671,6 @@ dump_diags(void){
   }
   for(r = 0 ; r < y ; ++r){
     fprintf(stderr, "%s", l[r].msg);
-    free(l[r].msg);
   }
   return 0;
 }
@@ -3500,7 +3695,7 @@ update_diags(struct panel_state *ps){
     size_t tb;
     int p;
 
-    if(l[r].msg == NULL){
+    if(l[r].msg[0] == '\0'){
       break;
     }
     if(localtime_r(&l[r].when, &tm) == NULL){
@@ -3523,7 +3718,6 @@ update_diags(struct panel_state *ps){
       *c = ' ';
     }
     cmvwprintw(ps->n, y - r, START_COL, "%-*.*s", x - 2, x - 2, tbuf);
-    free(l[r].msg);
   }
   return 0;
 }
@@ -3549,6 +3743,158 @@ err:
   return -1;
 }
 
+static const int JOBROWS = 10;
+
+static int
+update_jobs(struct panel_state *ps){
+  jobinfo ji[JOBROWS];
+  unsigned y, x, n, r;
+
+  ncplane_dim_yx(ps->n, &y, &x);
+  y -= 2;
+  if(y > sizeof(ji) / sizeof(*ji)){
+    y = sizeof(ji) / sizeof(*ji);
+  }
+  n = jobs_snapshot(ji, y);
+  ncplane_set_styles(ps->n, NCSTYLE_BOLD);
+  compat_set_fg(ps->n, SUBDISPLAY_COLOR);
+  for(r = 0 ; r < y ; ++r){
+    char pbuf[8];
+
+    if(r >= n){
+      cmvwprintw(ps->n, r + 1, START_COL, "%-*.*s", x - 2, x - 2, "");
+      continue;
+    }
+    if(ji[r].total){
+      snprintf(pbuf, sizeof(pbuf), "%5.1f%%", ji[r].done * 100.0 / ji[r].total);
+    }else{
+      snprintf(pbuf, sizeof(pbuf), "%6s", "-");
+    }
+    char line[x];
+    snprintf(line, sizeof(line), "%4u %-9.9s %-12.12s %s %s", ji[r].id,
+             jobstate_str(ji[r].state), ji[r].dev, pbuf, ji[r].desc);
+    cmvwprintw(ps->n, r + 1, START_COL, "%-*.*s", x - 2, x - 2, line);
+  }
+  return 0;
+}
+
+static int
+display_jobs(struct ncplane* mainw, struct panel_state* ps){
+  memset(ps, 0, sizeof(*ps));
+  if(new_display_panel(mainw, ps, JOBROWS, 0,
+                       "press 'J' to dismiss jobs", NULL,
+                       PBORDER_COLOR)){
+    goto err;
+  }
+  if(update_jobs(ps)){
+    goto err;
+  }
+  return 0;
+
+err:
+  if(ps->n){
+    ncplane_destroy(ps->n);
+  }
+  memset(ps, 0, sizeof(*ps));
+  return -1;
+}
+
+static const int HEATROWS = 18;
+// Width of each latency bin's column in the heatmap
+#define HEATBINCOLS 7
+
+// One row per area (or group of areas, when there are more areas than rows),
+// with its throughput and IOPS, then each latency bin shaded by its share of
+// the row's I/O.
+static int
+update_heat(struct panel_state *ps){
+  static const char *shades[] = { " ", "░", "▒", "▓", "█", };
+  char buf[NCBPREFIXSTRLEN + 1];
+  const dmstatmon *m;
+  unsigned y, x, r, z, b, per;
+  blockobj *bo;
+
+  ncplane_dim_yx(ps->n, &y, &x);
+  y -= 2;
+  ncplane_set_styles(ps->n, NCSTYLE_BOLD);
+  compat_set_fg(ps->n, SUBDISPLAY_COLOR);
+  for(r = 0 ; r < y ; ++r){
+    cmvwhline(ps->n, r + 1, START_COL, " ", x - 2);
+  }
+  if((bo = get_selected_blockobj()) == NULL || bo->d->layout != LAYOUT_DM){
+    cmvwprintw(ps->n, 1, START_COL, "Select a device-mapper device");
+    return 0;
+  }
+  if((m = bo->d->dmdev.stats) == NULL){
+    cmvwprintw(ps->n, 1, START_COL, "%s is not monitored; press 'x' twice to begin",
+               bo->d->name);
+    return 0;
+  }
+  cmvwprintw(ps->n, 1, START_COL, "%-12s %8s %8s %7s", "Sector", "Read/s", "Write/s", "IOPS");
+  for(b = 0 ; b < m->nbins && 38 + (b + 1) * HEATBINCOLS < x ; ++b){
+    dmstats_ns_str(m->bounds[b], buf, sizeof(buf));
+    cwprintw(ps->n, " %*s", HEATBINCOLS - 1, buf);
+  }
+  if(y < 2 || m->nareas == 0){
+    return 0;
+  }
+  per = (m->nareas + y - 2) / (y - 1);
+  ncplane_off_styles(ps->n, NCSTYLE_BOLD);
+  for(r = 0 ; r * per < m->nareas ; ++r){
+    uint64_t bins[m->nbins ? m->nbins : 1];
+    dmstatarea sum = { .bins = bins, };
+    double secs = m->interval > 0 ? m->interval : 1;
+
+    dmstats_sum_areas(m, r * per, per, &sum);
+    cmvwprintw(ps->n, r + 2, START_COL, "%-12ju", (uintmax_t)sum.start);
+    cwprintw(ps->n, " %7sB", ncbprefix((uintmax_t)(sum.rsectors * 512 / secs), 1, buf, 1));
+    cwprintw(ps->n, " %7sB", ncbprefix((uintmax_t)(sum.wsectors * 512 / secs), 1, buf, 1));
+    cwprintw(ps->n, " %7ju", (uintmax_t)(sum.ios / secs));
+    for(b = 0 ; b < m->nbins && 38 + (b + 1) * HEATBINCOLS < x ; ++b){
+      unsigned shade = sum.ios ? (bins[b] * 4 + sum.ios - 1) / sum.ios : 0;
+
+      // the histogram and I/O counts aren't read atomically together
+      if(shade >= sizeof(shades) / sizeof(*shades)){
+        shade = sizeof(shades) / sizeof(*shades) - 1;
+      }
+      ncplane_putstr(ps->n, " ");
+      for(z = 1 ; z < HEATBINCOLS ; ++z){
+        ncplane_putstr(ps->n, shades[shade]);
+      }
+    }
+  }
+  ncplane_on_styles(ps->n, NCSTYLE_BOLD);
+  return 0;
+}
+
+// Begin monitoring the selected dm device, if it isn't already, with an area
+// per row.
+static int
+display_heat(struct ncplane* mainw, struct panel_state* ps){
+  blockobj *bo;
+
+  memset(ps, 0, sizeof(*ps));
+  if(new_display_panel(mainw, ps, HEATROWS, 0, "press 'x' to dismiss heatmap",
+                       NULL, PBORDER_COLOR)){
+    goto err;
+  }
+  if((bo = get_selected_blockobj()) && bo->d->layout == LAYOUT_DM &&
+      bo->d->dmdev.stats == NULL){
+    dmstats_start(bo->d, HEATROWS - 1, DMSTATS_DEFAULT_BOUNDS);
+  }
+  if(update_heat(ps)){
+    goto err;
+  }
+  return 0;
+
+err:
+  if(ps->n){
+    ncplane_destroy(ps->n);
+  }
+  memset(ps, 0, sizeof(*ps));
+  return -1;
+}
+
 static const int DETAILROWS = 7; // FIXME make it dynamic based on selections
 
 static int
@@ -4146,8 +4492,11 @@ new_filesystem(void){
 static void
 kill_filesystem_confirm(const char *op){
   if(op && approvedp(op)){
+    unsigned held;
     blockobj *b;
     device *d;
+    char name[sizeof(d->name)];
+    int r;
 
     if((b = get_selected_blockobj()) == NULL){
       locked_diag("Filesystem wipe requires a selected block device");
@@ -4167,11 +4516,15 @@ kill_filesystem_confirm(const char *op){
       assert(selected_partitionp());
       d = b->zone->p;
     }
+    strcpy(name, d->name);
     // FIXME splash screen
-    if(wipe_filesystem(d)){
+    held = release_notcurses();
+    r = wipe_filesystem(d);
+    reacquire_notcurses(held);
+    if(r){
       return;
     }
-    locked_diag("Wiped filesystem on %s", d->name);
+    locked_diag("Wiped filesystem on %s", name);
     return;
   }
   locked_diag("filesystem wipe was cancelled");
@@ -4499,8 +4852,16 @@ fsck_partition(void){
     d = b->zone->p;
   }
   if(fsck_suitable_p(d)){
-    if(check_partition(d) == 0){
-      locked_diag("Validated filesystem on %s", d->name);
+    char name[sizeof(d->name)];
+    unsigned held;
+    int r;
+
+    strcpy(name, d->name);
+    held = release_notcurses();
+    r = check_partition(d);
+    reacquire_notcurses(held);
+    if(r == 0){
+      locked_diag("Validated filesystem on %s", name);
     }
   }
 }
@@ -4597,18 +4958,13 @@ wipe_mbr(void){
 
 static void
 badblock_do_internal(void){
-  struct panel_state *ps;
   blockobj *b;
 
   if((b = get_selected_blockobj()) == NULL){
     locked_diag("Block check requires selection of a block device");
     return;
   }
-  ps = show_splash(L"Performing block check...");
-  badblock_scan(b->d, 0); // FIXME allow destructive badblock check
-  if(ps){
-    kill_splash(ps);
-  }
+  job_badblocks(b->d, 0); // FIXME allow destructive badblock check
 }
 
 static void
@@ -4616,8 +4972,588 @@ badblock_check(void){
   badblock_do_internal();
 }
 
+static void
+wipe_device_confirm(const char *op){
+  blockobj *b;
+
+  if(!op || !approvedp(op)){
+    locked_diag("device wipe was cancelled");
+    return;
+  }
+  if((b = get_selected_blockobj()) == NULL){
+    locked_diag("Device wipe requires selection of a block device");
+    return;
+  }
+  job_wipe(b->d, WIPE_AUTO, 1);
+}
+
+static void
+wipe_device(void){
+  blockobj *b;
+
+  if((b = get_selected_blockobj()) == NULL){
+    locked_diag("Device wipe requires selection of a block device");
+    return;
+  }
+  if(blockobj_unloadedp(b)){
+    locked_diag("Media is unloaded on %s\n", b->d->name);
+    return;
+  }
+  confirm_operation("wipe the entire device", wipe_device_confirm);
+}
+
+static queueparam pending_queueparam;
+
+static void
+queue_value_callback(const char *val){
+  blockobj *b;
+
+  if(val == NULL){
+    locked_diag("Queue tuning cancelled by the user");
+    return;
+  }
+  if((b = get_selected_blockobj()) == NULL){
+    locked_diag("Queue tuning requires selection of a block device");
+    return;
+  }
+  if(queue_tune(&b->d, 1, pending_queueparam, val) == 0){
+    locked_diag("Set %s to %s on %s", queueparam_str(pending_queueparam),
+                val, b->d->name);
+  }
+}
+
+static void
+queue_param_callback(const char *param){
+  char cur[64], prompt[80];
+  queuetunables qt;
+  blockobj *b;
+
+  if(param == NULL){
+    locked_diag("Queue tuning cancelled by the user");
+    return;
+  }
+  if((b = get_selected_blockobj()) == NULL){
+    locked_diag("Queue tuning requires selection of a block device");
+    return;
+  }
+  if(queueparam_parse(param, &pending_queueparam)){
+    locked_diag("Unknown queue parameter %s", param);
+    return;
+  }
+  if(queue_tunables(b->d, &qt)){
+    return;
+  }
+  if(queue_tunable_str(&qt, pending_queueparam, cur, sizeof(cur))){
+    cur[0] = '\0';
+  }
+  queue_tunables_free(&qt);
+  snprintf(prompt, sizeof(prompt), "enter %s", param);
+  raise_str_form(prompt, queue_value_callback, cur, QUEUE_TEXT);
+}
+
+// Each option is a parameter the device supports, described by its current
+// value and the range the kernel accepts.
+static struct form_option *
+queue_table(const queuetunables *qt, int *count){
+  struct form_option *fo;
+  unsigned z;
+
+  *count = 0;
+  if((fo = malloc(sizeof(*fo) * QUEUE_PARAMS)) == NULL){
+    return NULL;
+  }
+  for(z = 0 ; z < QUEUE_PARAMS ; ++z){
+    char val[64], range[256], desc[384];
+
+    if(queue_tunable_str(qt, z, val, sizeof(val))){
+      continue;
+    }
+    if(queue_tunable_range(qt, z, range, sizeof(range))){
+      range[0] = '\0';
+    }
+    snprintf(desc, sizeof(desc), "%s [%s] %s", val, range, queueparam_desc(z));
+    if((fo[*count].option = strdup(queueparam_str(z))) == NULL){
+      goto err;
+    }
+    if((fo[*count].desc = strdup(desc)) == NULL){
+      free(fo[*count].option);
+      goto err;
+    }
+    ++*count;
+  }
+  return fo;
+
+err:
+  while(*count--){
+    free(fo[*count].option);
+    free(fo[*count].desc);
+  }
+  free(fo);
+  return NULL;
+}
+
+static void
+tune_queue(void){
+  struct form_option *ops;
+  queuetunables qt;
+  blockobj *b;
+  int count;
+
+  if((b = get_selected_blockobj()) == NULL){
+    locked_diag("Queue tuning requires selection of a block device");
+    return;
+  }
+  if(queue_tunables(b->d, &qt)){
+    return;
+  }
+  ops = queue_table(&qt, &count);
+  queue_tunables_free(&qt);
+  if(ops == NULL || count == 0){
+    free(ops);
+    locked_diag("Couldn't describe queue parameters of %s", b->d->name);
+    return;
+  }
+  raise_form("select a queue parameter", queue_param_callback, ops, count, 0,
+             QUEUE_TEXT);
+}
+
+static nvmefeature pending_nvmefeature;
+
+static void
+nvme_value_callback(const char *val){
+  blockobj *b;
+
+  if(val == NULL){
+    locked_diag("NVMe tuning cancelled by the user");
+    return;
+  }
+  if((b = get_selected_blockobj()) == NULL){
+    locked_diag("NVMe tuning requires selection of a block device");
+    return;
+  }
+  if(nvme_set_features(&b->d, 1, pending_nvmefeature, val) == 0){
+    locked_diag("Set %s to %s on %s", nvmefeature_str(pending_nvmefeature),
+                val, b->d->name);
+  }
+}
+
+static int pending_lbaf;
+
+static void
+lbaf_confirm(const char *op){
+  blockobj *b;
+
+  if(!op || !approvedp(op)){
+    locked_diag("NVMe format was cancelled");
+    return;
+  }
+  if((b = get_selected_blockobj()) == NULL){
+    locked_diag("NVMe format requires selection of a block device");
+    return;
+  }
+  job_nvme_reformat(b->d, pending_lbaf);
+}
+
+static void
+lbaf_callback(const char *lbaf){
+  char *end;
+  long l;
+
+  if(lbaf == NULL){
+    locked_diag("NVMe format cancelled by the user");
+    return;
+  }
+  l = strtol(lbaf, &end, 10);
+  if(*end || l < 0 || l >= NVME_LBAF_MAX){
+    locked_diag("Unknown LBA format %s", lbaf);
+    return;
+  }
+  pending_lbaf = l;
+  confirm_operation("format the namespace, destroying all data", lbaf_confirm);
+}
+
+// Each option is a usable LBA format, described by its data and metadata
+// sizes and Relative Performance. The best is selected by default.
+static struct form_option *
+lbaf_table(const nvmelbafs *lf, int *count, int *defidx){
+  static const char *rps[] = { "best", "better", "good", "degraded", };
+  int best = nvme_best_lbaf(lf, sysconf(_SC_PAGESIZE));
+  struct form_option *fo;
+  unsigned z;
+
+  *count = 0;
+  *defidx = 0;
+  if((fo = malloc(sizeof(*fo) * NVME_LBAF_MAX)) == NULL){
+    return NULL;
+  }
+  for(z = 0 ; z < lf->count ; ++z){
+    const nvmelbaf *l = &lf->lbaf[z];
+    char opt[8], desc[80];
+
+    if(l->lbads == 0){
+      continue;
+    }
+    snprintf(opt, sizeof(opt), "%u", z);
+    snprintf(desc, sizeof(desc), "%uB data %uB metadata RP %s%s", l->lbads,
+             l->ms, rps[l->rp], z == lf->current ? " (in use)" : "");
+    if((fo[*count].option = strdup(opt)) == NULL){
+      goto err;
+    }
+    if((fo[*count].desc = strdup(desc)) == NULL){
+      free(fo[*count].option);
+      goto err;
+    }
+    if((int)z == best){
+      *defidx = *count;
+    }
+    ++*count;
+  }
+  return fo;
+
+err:
+  while(*count--){
+    free(fo[*count].option);
+    free(fo[*count].desc);
+  }
+  free(fo);
+  return NULL;
+}
+
+static void
+select_lbaf(const device *d){
+  struct form_option *ops;
+  int count, defidx;
+  nvmelbafs lf;
+
+  if(nvme_device_lbafs(d, &lf)){
+    return;
+  }
+  if((ops = lbaf_table(&lf, &count, &defidx)) == NULL || count == 0){
+    free(ops);
+    locked_diag("Couldn't describe LBA formats of %s", d->name);
+    return;
+  }
+  raise_form("select an LBA format", lbaf_callback, ops, count, defidx,
+             NVME_TEXT);
+}
+
+static void
+nvme_feature_callback(const char *feat){
+  char cur[64], prompt[80];
+  nvmefeatures nf;
+  blockobj *b;
+
+  if(feat == NULL){
+    locked_diag("NVMe tuning cancelled by the user");
+    return;
+  }
+  if(strcmp(feat, "latency") == 0){
+    nvme_latency_preset();
+    return;
+  }
+  if((b = get_selected_blockobj()) == NULL){
+    locked_diag("NVMe tuning requires selection of a block device");
+    return;
+  }
+  if(strcmp(feat, "lbaf") == 0){
+    select_lbaf(b->d);
+    return;
+  }
+  if(nvmefeature_parse(feat, &pending_nvmefeature)){
+    locked_diag("Unknown NVMe feature %s", feat);
+    return;
+  }
+  if(nvme_device_features(b->d, &nf)){
+    return;
+  }
+  if(nvmefeature_value(&nf, pending_nvmefeature, cur, sizeof(cur))){
+    cur[0] = '\0';
+  }
+  snprintf(prompt, sizeof(prompt), "enter %s", feat);
+  raise_str_form(prompt, nvme_value_callback, cur, NVME_TEXT);
+}
+
+// Each option is a feature the controller supports, described by its current
+// value, followed by the latency preset and LBA format selection.
+static struct form_option *
+nvme_table(const nvmefeatures *nf, int *count){
+  struct form_option *fo;
+  unsigned z;
+
+  *count = 0;
+  if((fo = malloc(sizeof(*fo) * (NVMEFEAT_COUNT + 2))) == NULL){
+    return NULL;
+  }
+  for(z = 0 ; z <= NVMEFEAT_COUNT + 1 ; ++z){
+    const char *name = z < NVMEFEAT_COUNT ? nvmefeature_str(z) :
+                       z == NVMEFEAT_COUNT ? "latency" : "lbaf";
+    char val[64], desc[160];
+
+    if(z == NVMEFEAT_COUNT){
+      snprintf(desc, sizeof(desc), "favor latency over power on all NVMe");
+    }else if(z > NVMEFEAT_COUNT){
+      snprintf(desc, sizeof(desc), "reformat to another LBA format (destroys data)");
+    }else if(nvmefeature_value(nf, z, val, sizeof(val))){
+      continue;
+    }else{
+      snprintf(desc, sizeof(desc), "%s %s", val, nvmefeature_desc(z));
+    }
+    if((fo[*count].option = strdup(name)) == NULL){
+      goto err;
+    }
+    if((fo[*count].desc = strdup(desc)) == NULL){
+      free(fo[*count].option);
+      goto err;
+    }
+    ++*count;
+  }
+  return fo;
+
+err:
+  while(*count--){
+    free(fo[*count].option);
+    free(fo[*count].desc);
+  }
+  free(fo);
+  return NULL;
+}
+
+static void
+tune_nvme(void){
+  struct form_option *ops;
+  nvmefeatures nf;
+  blockobj *b;
+  int count;
+
+  if((b = get_selected_blockobj()) == NULL){
+    locked_diag("NVMe tuning requires selection of a block device");
+    return;
+  }
+  if(nvme_device_features(b->d, &nf)){
+    return;
+  }
+  if((ops = nvme_table(&nf, &count)) == NULL){
+    locked_diag("Couldn't describe NVMe features of %s", b->d->name);
+    return;
+  }
+  raise_form("select an NVMe feature", nvme_feature_callback, ops, count, 0,
+             NVME_TEXT);
+}
+
+// Set by md_option_callback: a resync limit ("min" or "max"), or a tunable.
+static char pending_mdlimit[4];
+static mdtunable pending_mdtunable;
+
+static void
+md_value_callback(const char *val){
+  blockobj *b;
+
+  if(val == NULL){
+    locked_diag("md tuning cancelled by the user");
+    return;
+  }
+  if((b = get_selected_blockobj()) == NULL || b->d->layout != LAYOUT_MDADM){
+    locked_diag("md tuning requires selection of an md array");
+    return;
+  }
+  if(pending_mdlimit[0]){
+    unsigned max = strcmp(pending_mdlimit, "max") == 0;
+
+    if(md_set_sync_speed(b->d, max ? NULL : val, max ? val : NULL) == 0){
+      locked_diag("Set sync_speed_%s to %s on %s", pending_mdlimit, val, b->d->name);
+    }
+  }else{
+    char name[sizeof(b->d->name)];
+    unsigned held;
+    int r;
+
+    strcpy(name, b->d->name);
+    held = release_notcurses();
+    r = md_tune(b->d, pending_mdtunable, val);
+    reacquire_notcurses(held);
+    if(r == 0){
+      locked_diag("Set %s to %s on %s", mdtunable_str(pending_mdtunable),
+                  val, name);
+    }
+  }
+}
+
+static void
+md_option_callback(const char *opt){
+  char cur[32], prompt[80];
+  blockobj *b;
+
+  if(opt == NULL){
+    locked_diag("md tuning cancelled by the user");
+    return;
+  }
+  if((b = get_selected_blockobj()) == NULL || b->d->layout != LAYOUT_MDADM){
+    locked_diag("md tuning requires selection of an md array");
+    return;
+  }
+  if(strcmp(opt, "auto") == 0){
+    md_autotune(b->d);
+    return;
+  }
+  if(strcmp(opt, "min") == 0 || strcmp(opt, "max") == 0){
+    snprintf(pending_mdlimit, sizeof(pending_mdlimit), "%s", opt);
+    snprintf(cur, sizeof(cur), "%lu", strcmp(opt, "max") ? b->d->mddev.sync_min :
+             b->d->mddev.sync_max);
+    snprintf(prompt, sizeof(prompt), "enter %s resync KiB/s", opt);
+  }else if(mdtunable_parse(opt, &pending_mdtunable) == 0){
+    pending_mdlimit[0] = '\0';
+    if(md_tunable_value(b->d, pending_mdtunable, cur, sizeof(cur))){
+      cur[0] = '\0';
+    }
+    snprintf(prompt, sizeof(prompt), "enter %s", opt);
+  }else{
+    locked_diag("Unknown md tunable %s", opt);
+    return;
+  }
+  raise_str_form(prompt, md_value_callback, cur, MD_TEXT);
+}
+
+// Each option is a resync limit or a tunable the array offers, described by
+// its current value, followed by auto-sizing for RAID4/5/6.
+static struct form_option *
+md_table(const device *d, int *count){
+  struct form_option *fo;
+  unsigned z;
+
+  *count = 0;
+  if((fo = malloc(sizeof(*fo) * (MDTUNE_COUNT + 3))) == NULL){
+    return NULL;
+  }
+  for(z = 0 ; z < MDTUNE_COUNT + 3 ; ++z){
+    const char *name;
+    char val[32], desc[160];
+
+    if(z < 2){
+      name = z ? "max" : "min";
+      snprintf(desc, sizeof(desc), "%lu KiB/s (%s) %s resync speed",
+               z ? d->mddev.sync_max : d->mddev.sync_min,
+               (z ? d->mddev.sync_max_local : d->mddev.sync_min_local) ?
+               "local" : "system", z ? "maximum" : "minimum");
+    }else if(z < MDTUNE_COUNT + 2){
+      name = mdtunable_str(z - 2);
+      if(md_tunable_value(d, z - 2, val, sizeof(val))){
+        continue;
+      }
+      if(z - 2 == MDTUNE_STRIPE_CACHE){
+        snprintf(desc, sizeof(desc), "%s %s (%juKiB)", val, mdtunable_desc(z - 2),
+                 md_stripe_cache_bytes(d, d->mddev.stripe_cache) / 1024);
+      }else{
+        snprintf(desc, sizeof(desc), "%s %s", val, mdtunable_desc(z - 2));
+      }
+    }else{
+      if(d->mddev.stripe_cache == 0){
+        continue;
+      }
+      name = "auto";
+      snprintf(desc, sizeof(desc), "size stripe cache and threads to members and memory");
+    }
+    if((fo[*count].option = strdup(name)) == NULL){
+      goto err;
+    }
+    if((fo[*count].desc = strdup(desc)) == NULL){
+      free(fo[*count].option);
+      goto err;
+    }
+    ++*count;
+  }
+  return fo;
+
+err:
+  while(*count--){
+    free(fo[*count].option);
+    free(fo[*count].desc);
+  }
+  free(fo);
+  return NULL;
+}
+
+static void
+tune_md(void){
+  struct form_option *ops;
+  blockobj *b;
+  int count;
+
+  if((b = get_selected_blockobj()) == NULL || b->d->layout != LAYOUT_MDADM){
+    locked_diag("md tuning requires selection of an md array");
+    return;
+  }
+  if(md_sync_refresh(b->d) || b->d->mddev.sync_action == NULL){
+    locked_diag("%s has no redundancy to tune", b->d->name);
+    return;
+  }
+  if((ops = md_table(b->d, &count)) == NULL){
+    locked_diag("Couldn't describe tunables of %s", b->d->name);
+    return;
+  }
+  raise_form("select an md tunable", md_option_callback, ops, count, 0, MD_TEXT);
+}
+
+// Reads only; the readline UI offers write benchmarks of unallocated space.
+static void
+benchmark_selected(void){
+  blockobj *b;
+
+  if((b = get_selected_blockobj()) == NULL){
+    locked_diag("Benchmarking requires selection of a block device");
+    return;
+  }
+  if(blockobj_unloadedp(b)){
+    locked_diag("Media is unloaded on %s\n", b->d->name);
+    return;
+  }
+  job_benchmark(b->d);
+}
+
+// Cancel every unfinished job on the selected device or its partitions.
+static void
+cancel_selected_jobs(void){
+  jobinfo ji[64];
+  unsigned n, z, cancelled = 0;
+  blockobj *b;
+
+  if((b = get_selected_blockobj()) == NULL){
+    locked_diag("Cancelling jobs requires selection of a block device");
+    return;
+  }
+  n = jobs_snapshot(ji, sizeof(ji) / sizeof(*ji));
+  for(z = 0 ; z < n ; ++z){
+    const device *d;
+
+    if(ji[z].state != JOB_QUEUED && ji[z].state != JOB_RUNNING){
+      continue;
+    }
+    if((d = lookup_device(ji[z].dev)) == NULL){
+      continue;
+    }
+    if(d == b->d || (d->layout == LAYOUT_PARTITION && d->partdev.parent == b->d)){
+      if(job_cancel(ji[z].id) == 0){
+        ++cancelled;
+      }
+    }
+  }
+  if(cancelled == 0){
+    locked_diag("No active jobs on %s", b->d->name);
+  }
+}
+
+// Called from job threads without the growlight lock held, so take it
+// before our own, as everywhere else.
+static void
+job_callback(const jobinfo *ji){
+  (void)ji;
+  lock_notcurses();
+  unlock_notcurses();
+}
+
 static void
 mountpoint_callback(const char *path){
+  unsigned held;
+  device *d;
   blockobj *b;
 
   if((b = get_selected_blockobj()) == NULL){
@@ -4633,11 +5569,14 @@ mountpoint_callback(const char *path){
     return;
   }
   if(selected_unpartitionedp()){
-    mmount(b->d, path, 0, NULL);
+    d = b->d;
   }else{
     assert(selected_partitionp());
-    mmount(b->zone->p, path, 0, NULL);
+    d = b->zone->p;
   }
+  held = release_notcurses();
+  mmount(d, path, 0, NULL);
+  reacquire_notcurses(held);
 }
 
 static void
@@ -5125,7 +6064,10 @@ destroy_aggregate_confirm(const char *op){
   }else if(b->d->layout == LAYOUT_ZPOOL){
     destroy_zpool(b->d);
   }else if(b->d->layout == LAYOUT_MDADM){
+    unsigned held = release_notcurses();
+
     destroy_mdadm(b->d);
+    reacquire_notcurses(held);
   }else if(b->d->layout == LAYOUT_DM){
     locked_diag("Not yet implemented FIXME"); // FIXME
   }else{
@@ -5357,6 +6299,24 @@ handle_input(struct ncplane* w){
         unlock_notcurses();
         break;
       }
+      case 'J':{
+        lock_notcurses();
+        toggle_panel(w, &jobs, display_jobs);
+        unlock_notcurses();
+        break;
+      }
+      case 'x':{
+        lock_notcurses();
+        toggle_panel(w, &heat, display_heat);
+        unlock_notcurses();
+        break;
+      }
+      case 'c':{
+        lock_notcurses();
+        cancel_selected_jobs();
+        unlock_notcurses();
+        break;
+      }
       case 'E':{
         lock_notcurses();
         toggle_panel(w, &maps, display_maps);
@@ -5451,6 +6411,36 @@ handle_input(struct ncplane* w){
         unlock_notcurses();
         break;
       }
+      case 'S':{
+        lock_notcurses();
+        benchmark_selected();
+        unlock_notcurses();
+        break;
+      }
+      case 'X':{
+        lock_notcurses();
+        wipe_device();
+        unlock_notcurses();
+        break;
+      }
+      case 'Q':{
+        lock_notcurses();
+        tune_queue();
+        unlock_notcurses();
+        break;
+      }
+      case 'N':{
+        lock_notcurses();
+        tune_nvme();
+        unlock_notcurses();
+        break;
+      }
+      case 'R':{
+        lock_notcurses();
+        tune_md();
+        unlock_notcurses();
+        break;
+      }
       case 'n':{
         lock_notcurses();
         new_partition();
@@ -6032,6 +7022,12 @@ create_menu(struct ncplane* n){
     { .desc = "Remove partition table", .shortcut = { .id = 'r', }, },
     { .desc = "Wipe MBR", .shortcut = { .id = 'W', }, },
     { .desc = "Bad block check", .shortcut = { .id = 'B', }, },
+    { .desc = "Benchmark", .shortcut = { .id = 'S', }, },
+    { .desc = "Wipe entire device", .shortcut = { .id = 'X', }, },
+    { .desc = "Tune request queue", .shortcut = { .id = 'Q', }, },
+    { .desc = "NVMe features", .shortcut = { .id = 'N', }, },
+    { .desc = "Tune md RAID array", .shortcut = { .id = 'R', }, },
+    { .desc = "Cancel jobs", .shortcut = { .id = 'c', }, },
     { .desc = "Create aggregate", .shortcut = { .id = 'A', }, },
     { .desc = "Modify aggregate", .shortcut = { .id = 'z', }, },
     { .desc = "Destroy aggregate", .shortcut = { .id = 'Z', }, },
@@ -6053,6 +7049,8 @@ create_menu(struct ncplane* n){
     { .desc = "View details", .shortcut = { .id = 'v', }, },
     { .desc = "Show mounts", .shortcut = { .id = 'E', }, },
     { .desc = "Diagnostics", .shortcut = { .id = 'D', }, },
+    { .desc = "Jobs", .shortcut = { .id = 'J', }, },
+    { .desc = "Heatmap", .shortcut = { .id = 'x', }, },
     { .desc = "Quit", .shortcut = { .id = 'q', }, },
   };
   struct ncmenu_item help_items[] = {
@@ -6091,6 +7089,7 @@ int main(int argc, char * const *argv){
     .block_event = block_callback,
     .adapter_free = adapter_free,
     .block_free = block_free,
+    .job_event = job_callback,
   };
   struct panel_state *ps;
   int showhelp = 1;
@@ -264,6 +264,7 @@ static void aggname_callback(const char *);
 static void
 do_agg(const aggregate_type *at,char * const *selarray,int selections){
 	struct panel_state *ps;
+	unsigned held;
 	int r;
 
 	if(at->makeagg == NULL){
@@ -272,7 +273,9 @@ do_agg(const aggregate_type *at,char * const *selarray,int selections){
 	}
 
 	ps = show_splash(L"Creating aggregate...");
+	held = release_notcurses();
 	r = at->makeagg(pending_aggname,selarray,selections);
+	reacquire_notcurses(held);
 	if(ps){
 		kill_splash(ps);
 	}
@@ -3,6 +3,10 @@
 #include "nvme.h"
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
 #include <atasmart.h>
 #include "growlight.h"
 #include <sys/ioctl.h>
@@ -126,39 +130,451 @@ struct nvme_smart_log {
         __u8                    rsvd232[280];
 };
 
+// Only the fields we use of the OCP Datacenter NVMe SSD SMART / Health log
+struct nvme_ocp_smart_log {
+        __u8                    physical_media_written[16];
+        __u8                    physical_media_read[16];
+        __u8                    rsvd32[464];
+        __u8                    guid[16];
+};
+
+// AFD514C9-7C6F-4F9C-A4F2-BFEA2810AFC5, as laid out in the log
+static const __u8 nvme_ocp_smart_guid[16] = {
+	0xc5, 0xaf, 0x10, 0x28, 0xea, 0xbf, 0xf2, 0xa4,
+	0x9c, 0x4f, 0x6f, 0x7c, 0xc9, 0x14, 0xd5, 0xaf,
+};
+
+struct nvme_lbaf {
+        __le16                  ms;
+        __u8                    ds;
+        __u8                    rp;
+};
+
+struct nvme_id_ns {
+        __le64                  nsze;
+        __le64                  ncap;
+        __le64                  nuse;
+        __u8                    nsfeat;
+        __u8                    nlbaf;
+        __u8                    flbas;
+        __u8                    mc;
+        __u8                    dpc;
+        __u8                    dps;
+        __u8                    nmic;
+        __u8                    rescap;
+        __u8                    fpi;
+        __u8                    dlfeat;
+        __le16                  nawun;
+        __le16                  nawupf;
+        __le16                  nacwu;
+        __le16                  nabsn;
+        __le16                  nabo;
+        __le16                  nabspf;
+        __le16                  noiob;
+        __u8                    nvmcap[16];
+        __le16                  npwg;
+        __le16                  npwa;
+        __le16                  npdg;
+        __le16                  npda;
+        __le16                  nows;
+        __u8                    rsvd74[18];
+        __le32                  anagrpid;
+        __u8                    rsvd96[3];
+        __u8                    nsattr;
+        __le16                  nvmsetid;
+        __le16                  endgid;
+        __u8                    nguid[16];
+        __u8                    eui64[8];
+        struct nvme_lbaf        lbaf[16];
+        __u8                    rsvd192[192];
+        __u8                    vs[3712];
+};
+
+struct nvme_sanitize_log {
+        __le16                  sprog;
+        __le16                  sstat;
+        __le32                  scdw10;
+        __le32                  eto;
+        __le32                  etbe;
+        __le32                  etce;
+        __le32                  etond;
+        __le32                  etbend;
+        __le32                  etcend;
+        __u8                    rsvd32[480];
+};
+
 #define NVME_LOG_SMART 2
+#define NVME_LOG_SANITIZE 0x81
+#define NVME_LOG_OCP_SMART 0xc0
 #define NVME_ADMIN_GET_LOG_PAGE 2
 #define NVME_ADMIN_IDENTIFY 6
+#define NVME_ADMIN_SET_FEATURES 9
+#define NVME_ADMIN_GET_FEATURES 0xa
+#define NVME_ADMIN_FORMAT_NVM 0x80
+#define NVME_ADMIN_SANITIZE 0x84
+#define NVME_ID_CNS_NS 0
+#define NVME_ID_CNS_CTRL 1
+#define NVME_CTRL_OACS_FORMAT 0x2
+#define NVME_CTRL_FNA_FORMAT_ALL 0x1
+#define NVME_CTRL_FNA_ERASE_ALL 0x2
+#define NVME_CTRL_FNA_CRYPTO 0x4
+#define NVME_CTRL_SANICAP_CRYPTO 0x1
+#define NVME_CTRL_SANICAP_BLOCK 0x2
+#define NVME_CTRL_SANICAP_OVERWRITE 0x4
+#define NVME_CTRL_VWC_PRESENT 0x1
+#define NVME_CTRL_APSTA 0x1
+#define NVME_APST_ENTRIES 32
+// Format and sanitize can run for hours; the kernel default is a minute
+#define NVME_ERASE_TIMEOUT_MS (12u * 3600 * 1000)
 
+// These are used from worker threads, so they don't diag(). Failures are
+// returned as -1, with errno set (NVMe status codes become EIO).
 static int
-nvme_smart_log(struct device *d, int fd){
+nvme_admin(int fd, struct nvme_admin_cmd *cmd){
+	int r;
+
+	if((r = ioctl(fd, NVME_IOCTL_ADMIN_CMD, cmd)) > 0){
+		errno = EIO;
+		return -1;
+	}
+	return r;
+}
+
+static int
+nvme_identify(int fd, unsigned cns, uint32_t nsid, void *buf, size_t len){
 	struct nvme_admin_cmd nvmeio;
-	struct nvme_smart_log smart;
 
-	memset(&smart, 0, sizeof(smart));
+	memset(&nvmeio, 0, sizeof(nvmeio));
+	nvmeio.opcode = NVME_ADMIN_IDENTIFY;
+	nvmeio.nsid = nsid;
+	nvmeio.addr = (uintptr_t)buf;
+	nvmeio.data_len = len;
+	nvmeio.cdw10 = cns;
+	return nvme_admin(fd, &nvmeio);
+}
+
+static int
+nvme_nsid(int fd){
+	int nsid;
+
+	if((nsid = ioctl(fd, NVME_IOCTL_ID)) <= 0){
+		if(nsid == 0){
+			errno = ENOTTY;
+		}
+		return -1;
+	}
+	return nsid;
+}
+
+int nvme_erase_caps(int fd, nvmeerasecaps *caps){
+	struct nvme_id_ctrl ctrl;
+
+	memset(caps, 0, sizeof(*caps));
+	if(nvme_identify(fd, NVME_ID_CNS_CTRL, 0, &ctrl, sizeof(ctrl))){
+		return -1;
+	}
+	caps->format = !!(ctrl.oacs & NVME_CTRL_OACS_FORMAT);
+	caps->cryptoformat = caps->format && (ctrl.fna & NVME_CTRL_FNA_CRYPTO);
+	caps->format_all = !!(ctrl.fna & NVME_CTRL_FNA_FORMAT_ALL);
+	caps->erase_all = !!(ctrl.fna & NVME_CTRL_FNA_ERASE_ALL);
+	caps->sanitize_crypto = !!(ctrl.sanicap & NVME_CTRL_SANICAP_CRYPTO);
+	caps->sanitize_block = !!(ctrl.sanicap & NVME_CTRL_SANICAP_BLOCK);
+	caps->sanitize_overwrite = !!(ctrl.sanicap & NVME_CTRL_SANICAP_OVERWRITE);
+	return 0;
+}
+
+int nvme_format(int fd, unsigned ses){
+	struct nvme_admin_cmd nvmeio;
+	struct nvme_id_ns ns;
+	int nsid;
+
+	if((nsid = nvme_nsid(fd)) < 0){
+		return -1;
+	}
+	if(nvme_identify(fd, NVME_ID_CNS_NS, nsid, &ns, sizeof(ns))){
+		return -1;
+	}
+	memset(&nvmeio, 0, sizeof(nvmeio));
+	nvmeio.opcode = NVME_ADMIN_FORMAT_NVM;
+	nvmeio.nsid = nsid;
+	// keep the current LBA format, metadata and protection settings
+	nvmeio.cdw10 = (ns.flbas & 0xf) | (ns.flbas & 0x10) | ((ns.dps & 0x7) << 5) |
+			((ns.dps & 0x8) << 5) | ((ses & 0x7) << 9);
+	nvmeio.timeout_ms = NVME_ERASE_TIMEOUT_MS;
+	return nvme_admin(fd, &nvmeio);
+}
+
+int nvme_lba_formats(int fd, nvmelbafs *lf){
+	struct nvme_id_ns ns;
+	unsigned z;
+	int nsid;
+
+	memset(lf, 0, sizeof(*lf));
+	if((nsid = nvme_nsid(fd)) < 0){
+		return -1;
+	}
+	if(nvme_identify(fd, NVME_ID_CNS_NS, nsid, &ns, sizeof(ns))){
+		return -1;
+	}
+	// nlbaf is 0's based; formats past the 16th live in a separate
+	// structure, and aren't considered.
+	lf->count = ns.nlbaf + 1u > NVME_LBAF_MAX ? NVME_LBAF_MAX : ns.nlbaf + 1u;
+	lf->current = ns.flbas & 0xf;
+	for(z = 0 ; z < lf->count ; ++z){
+		const struct nvme_lbaf *l = &ns.lbaf[z];
+
+		// an LBA data size of 0 marks an unsupported format
+		lf->lbaf[z].lbads = l->ds >= 9 && l->ds < 32 ? 1u << l->ds : 0;
+		lf->lbaf[z].ms = l->ms;
+		lf->lbaf[z].rp = l->rp & 0x3;
+	}
+	return 0;
+}
+
+int nvme_best_lbaf(const nvmelbafs *lf, unsigned maxlbads){
+	int best = -1;
+	unsigned z;
+
+	for(z = 0 ; z < lf->count ; ++z){
+		const nvmelbaf *l = &lf->lbaf[z];
+
+		if(l->lbads == 0 || l->lbads > maxlbads || l->ms){
+			continue;
+		}
+		if(best < 0 || l->rp < lf->lbaf[best].rp ||
+				(l->rp == lf->lbaf[best].rp && l->lbads > lf->lbaf[best].lbads)){
+			best = z;
+		}
+	}
+	return best;
+}
+
+int nvme_format_lbaf(int fd, unsigned lbaf){
+	struct nvme_admin_cmd nvmeio;
+	int nsid;
+
+	if(lbaf >= NVME_LBAF_MAX){
+		errno = EINVAL;
+		return -1;
+	}
+	if((nsid = nvme_nsid(fd)) < 0){
+		return -1;
+	}
+	memset(&nvmeio, 0, sizeof(nvmeio));
+	nvmeio.opcode = NVME_ADMIN_FORMAT_NVM;
+	nvmeio.nsid = nsid;
+	// no secure erase, metadata or protection information
+	nvmeio.cdw10 = lbaf;
+	nvmeio.timeout_ms = NVME_ERASE_TIMEOUT_MS;
+	return nvme_admin(fd, &nvmeio);
+}
+
+int nvme_format_progress(int fd){
+	struct nvme_id_ns ns;
+	int nsid;
+
+	if((nsid = nvme_nsid(fd)) < 0){
+		return -1;
+	}
+	if(nvme_identify(fd, NVME_ID_CNS_NS, nsid, &ns, sizeof(ns))){
+		return -1;
+	}
+	// bit 7: indicator supported; bits 6:0 percentage remaining
+	if(!(ns.fpi & 0x80)){
+		return -1;
+	}
+	return 100 - (ns.fpi & 0x7f);
+}
+
+int nvme_sanitize(int fd, unsigned sanact){
+	struct nvme_admin_cmd nvmeio;
+
+	memset(&nvmeio, 0, sizeof(nvmeio));
+	nvmeio.opcode = NVME_ADMIN_SANITIZE;
+	nvmeio.cdw10 = sanact & 0x7;
+	return nvme_admin(fd, &nvmeio);
+}
+
+int nvme_sanitize_status(int fd, unsigned *permille, unsigned *state){
+	struct nvme_admin_cmd nvmeio;
+	struct nvme_sanitize_log log;
+
+	memset(&log, 0, sizeof(log));
 	memset(&nvmeio, 0, sizeof(nvmeio));
 	nvmeio.opcode = NVME_ADMIN_GET_LOG_PAGE;
-	nvmeio.addr = (uintptr_t)&smart;
-	nvmeio.data_len = sizeof(smart);
-	// FIXME black magics stolen from nvme_get_log()
+	nvmeio.addr = (uintptr_t)&log;
+	nvmeio.data_len = sizeof(log);
 	nvmeio.nsid = 0xffffffffu;
-	uint32_t numd = (nvmeio.data_len >> 2) - 1;
-	uint16_t numdu = numd >> 16;
-	uint16_t numdl = numd & 0xffff;
-	nvmeio.cdw10 = NVME_LOG_SMART | (numdl << 16);
-	nvmeio.cdw11 = numdu;
-	if(ioctl(fd, NVME_IOCTL_ADMIN_CMD, &nvmeio)){
+	nvmeio.cdw10 = NVME_LOG_SANITIZE | ((((nvmeio.data_len >> 2) - 1) & 0xffff) << 16);
+	if(nvme_admin(fd, &nvmeio)){
+		return -1;
+	}
+	*state = log.sstat & 0x7;
+	// SPROG is the numerator of a fraction over 65536
+	*permille = *state == NVME_SANITIZE_RUNNING ? log.sprog * 1000u / 65536 : 1000;
+	return 0;
+}
+
+// 128-bit little-endian counters, saturated to 64 bits
+static uint64_t
+nvme_le128(const __u8 *v){
+	uint64_t r = 0;
+	int i;
+
+	for(i = 15 ; i >= 8 ; --i){
+		if(v[i]){
+			return UINT64_MAX;
+		}
+	}
+	for(i = 7 ; i >= 0 ; --i){
+		r = (r << 8) | v[i];
+	}
+	return r;
+}
+
+static int
+nvme_get_log(int fd, unsigned lid, void *buf, size_t len){
+	struct nvme_admin_cmd nvmeio;
+
+	memset(buf, 0, len);
+	memset(&nvmeio, 0, sizeof(nvmeio));
+	nvmeio.opcode = NVME_ADMIN_GET_LOG_PAGE;
+	nvmeio.addr = (uintptr_t)buf;
+	nvmeio.data_len = len;
+	nvmeio.nsid = 0xffffffffu;
+	nvmeio.cdw10 = lid | ((((len >> 2) - 1) & 0xffff) << 16);
+	nvmeio.cdw11 = ((len >> 2) - 1) >> 16;
+	return nvme_admin(fd, &nvmeio);
+}
+
+// The OCP datacenter SMART log is only trusted if it carries the OCP GUID;
+// other vendors use this log identifier for their own purposes.
+static uint64_t
+nvme_ocp_media_written(int fd){
+	struct nvme_ocp_smart_log ocp;
+
+	if(nvme_get_log(fd, NVME_LOG_OCP_SMART, &ocp, sizeof(ocp))){
+		return 0;
+	}
+	if(memcmp(ocp.guid, nvme_ocp_smart_guid, sizeof(ocp.guid))){
+		return 0;
+	}
+	return nvme_le128(ocp.physical_media_written);
+}
+
+int nvme_health(int fd, nvmehealth *h){
+	struct nvme_smart_log smart;
+
+	memset(h, 0, sizeof(*h));
+	if(nvme_get_log(fd, NVME_LOG_SMART, &smart, sizeof(smart))){
+		return -1;
+	}
+	h->critical_warning = smart.critical_warning;
+	// nvme smart reports temp in kelvin integer degrees, huh
+	h->celsius = ((smart.temperature[1] << 8) | smart.temperature[0]) - 273;
+	h->percent_used = smart.percent_used;
+	h->units_read = nvme_le128(smart.data_units_read);
+	h->units_written = nvme_le128(smart.data_units_written);
+	h->media_errors = nvme_le128(smart.media_errors);
+	h->throttle_secs = (uint64_t)smart.thm_temp1_total_time + smart.thm_temp2_total_time;
+	h->media_written = nvme_ocp_media_written(fd);
+	return 0;
+}
+
+static int
+nvme_get_feature(int fd, unsigned fid, uint32_t *result, void *buf, size_t len){
+	struct nvme_admin_cmd nvmeio;
+
+	memset(&nvmeio, 0, sizeof(nvmeio));
+	nvmeio.opcode = NVME_ADMIN_GET_FEATURES;
+	nvmeio.addr = (uintptr_t)buf;
+	nvmeio.data_len = len;
+	nvmeio.cdw10 = fid; // SEL 0: current value
+	if(nvme_admin(fd, &nvmeio)){
+		return -1;
+	}
+	*result = nvmeio.result;
+	return 0;
+}
+
+int nvme_features(int fd, nvmefeatures *nf){
+	struct nvme_id_ctrl ctrl;
+	uint32_t r;
+
+	memset(nf, 0, sizeof(*nf));
+	if(nvme_identify(fd, NVME_ID_CNS_CTRL, 0, &ctrl, sizeof(ctrl))){
+		return -1;
+	}
+	nf->npss = ctrl.npss;
+	nf->vwc_present = !!(ctrl.vwc & NVME_CTRL_VWC_PRESENT);
+	nf->apst_supported = !!(ctrl.apsta & NVME_CTRL_APSTA);
+	if(nf->vwc_present && nvme_get_feature(fd, NVME_FEAT_VOLATILE_WC, &r, NULL, 0) == 0){
+		nf->vwc = r & 0x1;
+	}
+	if(nf->apst_supported){
+		uint64_t table[NVME_APST_ENTRIES];
+
+		if(nvme_get_feature(fd, NVME_FEAT_AUTO_PST, &r, table, sizeof(table)) == 0){
+			nf->apst = r & 0x1;
+		}
+	}
+	if(nvme_get_feature(fd, NVME_FEAT_POWER_MGMT, &r, NULL, 0)){
+		return -1;
+	}
+	nf->power_state = r & 0x1f;
+	nf->workload = (r >> 5) & 0x7;
+	if(nvme_get_feature(fd, NVME_FEAT_ARBITRATION, &r, NULL, 0)){
+		return -1;
+	}
+	nf->arb_burst = r & 0x7;
+	nf->arb_low = (r >> 8) & 0xff;
+	nf->arb_medium = (r >> 16) & 0xff;
+	nf->arb_high = (r >> 24) & 0xff;
+	if(nvme_get_feature(fd, NVME_FEAT_IRQ_COALESCE, &r, NULL, 0)){
+		return -1;
+	}
+	nf->coalesce_threshold = r & 0xff;
+	nf->coalesce_time = (r >> 8) & 0xff;
+	return 0;
+}
+
+int nvme_set_feature(int fd, unsigned fid, uint32_t cdw11){
+	struct nvme_admin_cmd nvmeio;
+	uint64_t table[NVME_APST_ENTRIES];
+
+	memset(&nvmeio, 0, sizeof(nvmeio));
+	// APST's transition table travels with every Set Features; keep the
+	// one in place, changing only whether it's enabled.
+	if(fid == NVME_FEAT_AUTO_PST){
+		uint32_t r;
+
+		if(nvme_get_feature(fd, fid, &r, table, sizeof(table))){
+			return -1;
+		}
+		nvmeio.addr = (uintptr_t)table;
+		nvmeio.data_len = sizeof(table);
+	}
+	nvmeio.opcode = NVME_ADMIN_SET_FEATURES;
+	nvmeio.cdw10 = fid; // SV clear: not saved across power cycles
+	nvmeio.cdw11 = cdw11;
+	return nvme_admin(fd, &nvmeio);
+}
+
+static int
+nvme_smart_log(struct device *d, int fd){
+	nvmehealth h;
+
+	if(nvme_health(fd, &h)){
 		diag("Couldn't perform nvme_admin_get_log_page on %s:%d (%s?)\n",
 				d->name, fd, strerror(errno));
 		return -1;
 	}
-	if(smart.critical_warning){
+	if(h.critical_warning){
 		d->blkdev.smart = SK_SMART_OVERALL_BAD_STATUS;
 	}else{
 		d->blkdev.smart = SK_SMART_OVERALL_GOOD;
 	}
-	// nvme smart reports temp in kelvin integer degrees, huh
-	d->blkdev.celsius = ((smart.temperature[1] << 8) | smart.temperature[0]) - 273;
+	d->blkdev.celsius = h.celsius;
 	return 0;
 }
 
@@ -186,5 +602,108 @@ int nvme_interrogate(struct device *d, int fd){
 	d->blkdev.transport = DIRECT_NVME;
 	d->blkdev.rotation = -1; // non-rotating store
 	nvme_smart_log(d, fd);
+	nvme_refresh_features(d, fd);
+	return 0;
+}
+
+int nvme_refresh_features(struct device *d, int fd){
+	nvmefeatures nf;
+
+	if(nvme_features(fd, &nf)){
+		verbf("Couldn't get features of %s (%s?)\n", d->name, strerror(errno));
+		return -1;
+	}
+	d->blkdev.wcache = nf.vwc;
+	d->blkdev.apst = !nf.apst_supported ? RWVERIFY_UNSUPPORTED :
+		nf.apst ? RWVERIFY_SUPPORTED_ON : RWVERIFY_SUPPORTED_OFF;
+	d->blkdev.powerstate = nf.power_state;
+	return 0;
+}
+
+int nvme_controller_name(const char *ns, char *buf, size_t len){
+	char path[NAME_MAX + 8], lnk[PATH_MAX];
+	const char *base;
+	ssize_t r;
+
+	if(snprintf(path, sizeof(path), "%s/device", ns) >= (int)sizeof(path)){
+		return -1;
+	}
+	if((r = readlinkat(sysfd, path, lnk, sizeof(lnk) - 1)) < 0){
+		return -1;
+	}
+	lnk[r] = '\0';
+	base = (base = strrchr(lnk, '/')) ? base + 1 : lnk;
+	if(strlen(base) >= len){
+		return -1;
+	}
+	strcpy(buf, base);
+	return 0;
+}
+
+static int
+nvme_claim_skipped(const char *name, const char * const *skip, unsigned nskip){
+	while(nskip--){
+		if(strcmp(name, skip[nskip]) == 0){
+			return 1;
+		}
+	}
 	return 0;
 }
+
+int nvme_claim_namespaces(const char *ns, const char * const *skip, unsigned nskip,
+				nvmeclaim *claim){
+	char ctrl[NAME_MAX + 1], sctrl[NAME_MAX + 1];
+	const controller *c;
+	const device *d;
+
+	memset(claim, 0, sizeof(*claim));
+	if(nvme_controller_name(ns, ctrl, sizeof(ctrl))){
+		diag("Couldn't find the NVMe controller of %s\n", ns);
+		return -1;
+	}
+	lock_growlight();
+	for(c = get_controllers() ; c ; c = c->next){
+		for(d = c->blockdevs ; d ; d = d->next){
+			int fd;
+
+			if(d->layout != LAYOUT_NONE || d->blkdev.transport != DIRECT_NVME){
+				continue;
+			}
+			if(strcmp(d->name, ns) == 0 || nvme_claim_skipped(d->name, skip, nskip)){
+				continue;
+			}
+			if(nvme_controller_name(d->name, sctrl, sizeof(sctrl)) || strcmp(ctrl, sctrl)){
+				continue;
+			}
+			if(claim->n == NVME_CLAIM_MAX){
+				diag("Too many namespaces on %s\n", ctrl);
+				goto err;
+			}
+			if((fd = openat(devfd, d->name, O_RDONLY|O_EXCL|O_CLOEXEC)) < 0){
+				diag("%s shares controller %s with %s, and is in use (%s?)\n",
+					d->name, ctrl, ns, strerror(errno));
+				goto err;
+			}
+			claim->fds[claim->n] = fd;
+			strcpy(claim->names[claim->n++], d->name);
+		}
+	}
+	unlock_growlight();
+	return 0;
+
+err:
+	unlock_growlight();
+	nvme_release_namespaces(claim);
+	return -1;
+}
+
+void nvme_release_namespaces(nvmeclaim *claim){
+	unsigned z;
+
+	for(z = 0 ; z < claim->n ; ++z){
+		if(claim->fds[z] >= 0){
+			close(claim->fds[z]);
+			claim->fds[z] = -1;
+		}
+	}
+}
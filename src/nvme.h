@@ -6,10 +6,151 @@
 extern "C" {
 #endif
 
+#include <limits.h>
+#include <stdint.h>
+
 struct device;
 
 int nvme_interrogate(struct device *, int sd);
 
+// Secure erase support, from Identify Controller
+typedef struct nvmeerasecaps {
+	unsigned format: 1;		// Format NVM with User Data Erase
+	unsigned cryptoformat: 1;	// Format NVM with Cryptographic Erase
+	unsigned sanitize_crypto: 1;
+	unsigned sanitize_block: 1;
+	unsigned sanitize_overwrite: 1;
+	unsigned format_all: 1;		// FNA bit 0: any format hits every namespace
+	unsigned erase_all: 1;		// FNA bit 1: secure erase hits every namespace
+} nvmeerasecaps;
+
+// Secure Erase Settings for nvme_format()
+#define NVME_SES_USER_DATA 1
+#define NVME_SES_CRYPTO 2
+
+// Sanitize Actions for nvme_sanitize()
+#define NVME_SANACT_BLOCK 2
+#define NVME_SANACT_OVERWRITE 3
+#define NVME_SANACT_CRYPTO 4
+
+// Sanitize Status values from nvme_sanitize_status()
+#define NVME_SANITIZE_NEVER 0
+#define NVME_SANITIZE_DONE 1
+#define NVME_SANITIZE_RUNNING 2
+#define NVME_SANITIZE_FAILED 3
+#define NVME_SANITIZE_DONE_NODEALLOC 4
+
+// The following take an open file descriptor on the namespace's block device,
+// never call diag(), and return -1 with errno set on failure.
+int nvme_erase_caps(int, nvmeerasecaps *);
+
+// Format the namespace, retaining its LBA format. Blocks until complete.
+int nvme_format(int, unsigned ses);
+
+// LBA formats offered by a namespace, from Identify Namespace
+#define NVME_LBAF_MAX 16
+
+typedef struct nvmelbaf {
+	unsigned lbads;		// LBA data size in bytes, 0 if unusable
+	unsigned ms;		// metadata bytes per LBA
+	unsigned rp;		// Relative Performance: 0 (best) through 3
+} nvmelbaf;
+
+typedef struct nvmelbafs {
+	unsigned count;
+	unsigned current;	// index of the format in use
+	nvmelbaf lbaf[NVME_LBAF_MAX];
+} nvmelbafs;
+
+int nvme_lba_formats(int, nvmelbafs *);
+
+// Index of the best-performing format without metadata, no larger than
+// maxlbads bytes, preferring the larger of equally-rated formats. Returns -1
+// if there is none.
+int nvme_best_lbaf(const nvmelbafs *, unsigned maxlbads);
+
+// Format the namespace to the indexed LBA format, without metadata or
+// protection information. All data is lost. Blocks until complete. If the
+// controller sets FNA bit 0 (nvmeerasecaps.format_all), every namespace on
+// it is formatted; claim them first with nvme_claim_namespaces().
+int nvme_format_lbaf(int, unsigned lbaf);
+
+// Percentage of a format complete, or -1 if the controller doesn't say.
+int nvme_format_progress(int);
+
+// Start a sanitize. This affects every namespace on the controller, and
+// returns immediately; poll nvme_sanitize_status() for completion.
+int nvme_sanitize(int, unsigned sanact);
+int nvme_sanitize_status(int, unsigned *permille, unsigned *state);
+
+// Wear and health from the SMART / Health Information log. Counters are
+// lifetime totals; data units are thousands of 512-byte blocks.
+typedef struct nvmehealth {
+	unsigned critical_warning;
+	int celsius;
+	unsigned percent_used;		// vendor estimate of endurance consumed
+	uint64_t units_read, units_written;
+	uint64_t media_errors;
+	uint64_t throttle_secs;		// time in either thermal management state
+	uint64_t media_written;		// bytes written to the media, from the
+					//  OCP datacenter log; 0 if unavailable
+} nvmehealth;
+
+int nvme_health(int, nvmehealth *);
+
+// Feature Identifiers for nvme_set_feature()
+#define NVME_FEAT_ARBITRATION 0x01	// AB 2:0, LPW 15:8, MPW 23:16, HPW 31:24
+#define NVME_FEAT_POWER_MGMT 0x02	// PS 4:0, WH 7:5
+#define NVME_FEAT_VOLATILE_WC 0x06	// WCE 0
+#define NVME_FEAT_IRQ_COALESCE 0x08	// THR 7:0, TIME 15:8 (100µs units)
+#define NVME_FEAT_AUTO_PST 0x0c		// APSTE 0
+
+// Controller features, as returned by Get Features (current values).
+typedef struct nvmefeatures {
+	unsigned vwc_present: 1;	// has a volatile write cache
+	unsigned vwc: 1;		// ...which is enabled
+	unsigned apst_supported: 1;
+	unsigned apst: 1;		// autonomous power state transitions
+	unsigned npss;			// highest power state (0's based)
+	unsigned power_state;
+	unsigned workload;		// workload hint
+	unsigned arb_burst;		// log2 of the arbitration burst; 7 is unlimited
+	unsigned arb_low, arb_medium, arb_high; // weights (0's based)
+	unsigned coalesce_threshold;	// completions per interrupt (0's based)
+	unsigned coalesce_time;		// 100µs units; 0 disables coalescing
+} nvmefeatures;
+
+int nvme_features(int, nvmefeatures *);
+
+// Set Features with the given Dword 11. Settings aren't saved, and revert
+// when the controller is reset.
+int nvme_set_feature(int, unsigned fid, uint32_t cdw11);
+
+// Re-read features, updating the device's cached state. Calls verbf() on
+// failure.
+int nvme_refresh_features(struct device *, int);
+
+// The NVMe controller ("nvme0") of the named namespace's block device, from
+// its sysfs device link.
+int nvme_controller_name(const char *, char *, size_t);
+
+// Sanitize, and formats on controllers setting FNA bits 0 or 1, destroy every
+// namespace on the controller. Before issuing them, every other namespace on
+// the controller is opened O_EXCL, so that none is mounted or otherwise in
+// use while it's wiped. Namespaces named in skip (already held by the
+// caller) are passed over. Fails with diag() if any can't be claimed. Takes
+// the growlight lock. Releasing closes the descriptors, but keeps the names.
+#define NVME_CLAIM_MAX 64
+
+typedef struct nvmeclaim {
+	unsigned n;
+	int fds[NVME_CLAIM_MAX];
+	char names[NVME_CLAIM_MAX][NAME_MAX + 1];
+} nvmeclaim;
+
+int nvme_claim_namespaces(const char *, const char * const *, unsigned, nvmeclaim *);
+void nvme_release_namespaces(nvmeclaim *);
+
 #ifdef __cplusplus
 }
 #endif
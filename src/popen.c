@@ -1,129 +1,474 @@
 // copyright 2012–2021 nick black
-#include <assert.h>
+#include <poll.h>
+#include <spawn.h>
+#include <fcntl.h>
 #include <wchar.h>
 #include <errno.h>
 #include <stdio.h>
+#include <ctype.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <string.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
 
+#include "aio.h"
+#include "jobs.h"
 #include "popen.h"
 #include "growlight.h"
 
-#define REDIRECTERR " 2>&1 < /dev/null"
-static char *
-sanitize_cmd(const char *cmd){
-	char *tmp,*san = NULL;
-	size_t left,len = 0;
-	mbstate_t ps;
-	size_t conv;
-
-	memset(&ps,0,sizeof(ps));
-	left = strlen(cmd) + 1;
-	do{
-		unsigned escape;
-		wchar_t w;
-
-		if((conv = mbrtowc(&w,cmd,left,&ps)) == (size_t)-1){
-			diag("Error converting multibyte: %s\n",cmd);
-			free(san);
-			return NULL;
-		}
-		if(conv == (size_t)-2){
-			// FIXME ended unexpectedly...are we feeding bad data?
-			diag("Multibyte ended unexpectedly: %s\n",cmd);
-			break;
-		}
-		if(conv == 0){ // done!
-			break;
-		}
-		left -= conv;
-		if(w == L'(' || w == L')'){
-			escape = 1;
-		}else if(w == '$'){
-			escape = 1;
-		}else{
-			escape = 0;
-		}
-		if((tmp = realloc(san,sizeof(*san) * (len + conv + escape))) == NULL){
-			free(san);
-			return NULL;
-		}
-		san = tmp;
-		if(escape){
-			san[len] = '\\';
-			++len;
-		}
-		memcpy(san + len,cmd,conv);
-		len += conv;
-		cmd += conv;
-	}while(conv);
-	if((tmp = realloc(san,sizeof(*san) * (len + 1 + strlen(REDIRECTERR)))) == NULL){
-		free(san);
+// How long a cancelled child gets between SIGTERM and SIGKILL
+#define CHILD_KILL_NSEC 5000000000ull
+// Upper bound on our sleep, so that cancellations are noticed promptly, and
+// so that we needn't rely on pidfds to learn of exits
+#define CHILD_POLL_MSEC 250
+
+extern char **environ;
+
+char **split_cmd(const char *cmd){
+	size_t len = strlen(cmd),maxargs = len / 2 + 2;
+	unsigned argc = 0,inarg = 0;
+	char **argv,*out,quote = 0;
+	const char *c;
+
+	if((argv = malloc(sizeof(*argv) * maxargs + len + 1)) == NULL){
+		diag("Couldn't allocate argv (%s?)\n",strerror(errno));
 		return NULL;
 	}
-	san = tmp;
-	strcpy(san + len,REDIRECTERR);
-	return san;
+	out = (char *)(argv + maxargs);
+	for(c = cmd ; *c ; ++c){
+		if(quote){
+			if(*c == quote){
+				quote = 0;
+				continue;
+			}
+			if(quote == '"' && *c == '\\' && (c[1] == '"' || c[1] == '\\')){
+				++c;
+			}
+			*out++ = *c;
+			continue;
+		}
+		if(isspace((unsigned char)*c)){
+			if(inarg){
+				*out++ = '\0';
+				inarg = 0;
+			}
+			continue;
+		}
+		if(!inarg){
+			argv[argc++] = out;
+			inarg = 1;
+		}
+		if(*c == '"' || *c == '\''){
+			quote = *c;
+			continue;
+		}
+		if(*c == '\\' && c[1]){
+			++c;
+		}
+		*out++ = *c;
+	}
+	*out = '\0';
+	if(quote || argc == 0){
+		diag("Bad command: %s\n",cmd);
+		free(argv);
+		return NULL;
+	}
+	argv[argc] = NULL;
+	return argv;
 }
 
-int popen_drain(const char *cmd){
-	char buf[128],*safecmd;
-	FILE *fd;
+static int
+pidfd_open_compat(pid_t pid){
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open,pid,0);
+#else
+	(void)pid;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int
+child_start(childproc *c){
+	posix_spawn_file_actions_t fa;
+	int p[2],r;
 
-	if((safecmd = sanitize_cmd(cmd)) == NULL){
+	c->pid = -1;
+	c->pidfd = -1;
+	c->outfd = -1;
+	c->linelen = 0;
+	c->done = c->total = 0;
+	c->decile = 0;
+	c->killed = 0;
+	c->status = -1;
+	c->reaped = 0;
+	if(!c->nocancel && job_cancelled()){
+		diag("Not running %s (job was cancelled)\n",c->argv[0]);
 		return -1;
 	}
-	diag("Running \"%s\"...\n",safecmd);
-	if((fd = popen(safecmd,"re")) == NULL){
-		diag("Couldn't run %s (%s?)\n",safecmd,strerror(errno));
-		free(safecmd);
+	if(pipe2(p,O_CLOEXEC)){
+		diag("Couldn't create pipe (%s?)\n",strerror(errno));
 		return -1;
 	}
-	while(fgets(buf,sizeof(buf),fd)){
-		diag("%s",buf);
-	}
-	if(!feof(fd)){
-		diag("Error reading from '%s' (%s?)\n",safecmd,strerror(errno));
-		pclose(fd);
+	if( (r = posix_spawn_file_actions_init(&fa)) ){
+		diag("Couldn't prepare %s (%s?)\n",c->argv[0],strerror(r));
+		close(p[0]);
+		close(p[1]);
 		return -1;
 	}
-	if(pclose(fd)){
-		diag("Error running '%s'\n",safecmd);
+	if( (r = posix_spawn_file_actions_addopen(&fa,STDIN_FILENO,"/dev/null",O_RDONLY,0)) == 0 &&
+			(r = posix_spawn_file_actions_adddup2(&fa,p[1],STDOUT_FILENO)) == 0 &&
+			(r = posix_spawn_file_actions_adddup2(&fa,p[1],STDERR_FILENO)) == 0){
+		r = posix_spawnp(&c->pid,c->argv[0],&fa,NULL,c->argv,environ);
+	}
+	posix_spawn_file_actions_destroy(&fa);
+	close(p[1]);
+	if(r){
+		diag("Couldn't run %s (%s?)\n",c->argv[0],strerror(r));
+		close(p[0]);
 		return -1;
 	}
+	if(fcntl(p[0],F_SETFL,O_NONBLOCK)){
+		diag("Couldn't make pipe non-blocking (%s?)\n",strerror(errno));
+	}
+	c->outfd = p[0];
+	c->pidfd = pidfd_open_compat(c->pid);
 	return 0;
 }
 
-int vpopen_drain(const char *cmd,wchar_t * const *args){
+static void
+child_line(childproc *c){
+	uintmax_t done,total;
+
+	if(c->linelen == 0){
+		return;
+	}
+	c->line[c->linelen] = '\0';
+	c->linelen = 0;
+	if(c->parser && c->parser(c->line,&done,&total) && total && done <= total){
+		c->done = done;
+		c->total = total;
+		// outside of a job, nobody is polling progress; log it coarsely
+		if(done * 10 / total > c->decile){
+			c->decile = done * 10 / total;
+			diag("%s: %u0%%\n",c->argv[0],c->decile);
+		}
+		return;
+	}
+	diag("%s\n",c->line);
+}
+
+// Consume whatever output is available. Returns 1 on EOF.
+static int
+child_read(childproc *c){
 	char buf[BUFSIZ];
+	ssize_t r,z;
+
+	while((r = read(c->outfd,buf,sizeof(buf))) > 0){
+		for(z = 0 ; z < r ; ++z){
+			// mke2fs et al. redraw progress using carriage returns and
+			// backspaces; treat them as line breaks.
+			if(buf[z] == '\n' || buf[z] == '\r' || buf[z] == '\b'){
+				child_line(c);
+				continue;
+			}
+			if(c->linelen == sizeof(c->line) - 1){
+				child_line(c);
+			}
+			c->line[c->linelen++] = buf[z];
+		}
+	}
+	if(r == 0){
+		child_line(c);
+		return 1;
+	}
+	if(errno != EAGAIN && errno != EINTR){
+		diag("Error reading from %s (%s?)\n",c->argv[0],strerror(errno));
+		child_line(c);
+		return 1;
+	}
+	return 0;
+}
+
+static void
+child_close(childproc *c){
+	if(c->outfd >= 0){
+		close(c->outfd);
+		c->outfd = -1;
+	}
+	if(c->pidfd >= 0){
+		close(c->pidfd);
+		c->pidfd = -1;
+	}
+}
+
+static void
+log_cmd(char * const *argv){
+	char buf[BUFSIZ];
+	size_t off = 0;
+
+	buf[0] = '\0';
+	while(*argv && off < sizeof(buf)){
+		off += snprintf(buf + off,sizeof(buf) - off,"%s%s",off ? " " : "",*argv);
+		++argv;
+	}
+	diag("Running \"%s\"...\n",buf);
+}
+
+int spawn_children(childproc *cs,unsigned n){
+	struct pollfd pfds[n * 2];
+	unsigned z,live = 0;
+	int ret = 0;
+
+	if(n == 0){
+		return 0;
+	}
+	if(growlight_locked()){
+		diag("Won't run %s while holding the growlight lock\n",cs[0].argv[0]);
+		return -1;
+	}
+	for(z = 0 ; z < n ; ++z){
+		log_cmd(cs[z].argv);
+		if(child_start(&cs[z])){
+			cs[z].reaped = 1;
+			ret = -1;
+		}else{
+			++live;
+		}
+	}
+	while(live){
+		uintmax_t done = 0,total = 0;
+		uint64_t now = aioq_nsec();
+		int cancelled = job_cancelled();
+		unsigned nfds = 0;
+
+		for(z = 0 ; z < n ; ++z){
+			childproc *c = &cs[z];
+
+			if(c->total){
+				done += c->done * 1000 / c->total;
+				total += 1000;
+			}
+			if(c->reaped){
+				continue;
+			}
+			if(cancelled && !c->nocancel){
+				if(c->killed == 0){
+					kill(c->pid,SIGTERM);
+					c->killed = now;
+				}else if(now - c->killed >= CHILD_KILL_NSEC){
+					kill(c->pid,SIGKILL);
+				}
+			}
+			if(c->outfd >= 0){
+				pfds[nfds].fd = c->outfd;
+				pfds[nfds++].events = POLLIN;
+			}
+			if(c->pidfd >= 0){
+				pfds[nfds].fd = c->pidfd;
+				pfds[nfds++].events = POLLIN;
+			}
+		}
+		if(total){
+			job_progress(done,total);
+		}
+		if(poll(pfds,nfds,CHILD_POLL_MSEC) < 0 && errno != EINTR){
+			diag("Error polling children (%s?)\n",strerror(errno));
+		}
+		for(z = 0 ; z < n ; ++z){
+			childproc *c = &cs[z];
+
+			if(c->reaped){
+				continue;
+			}
+			if(c->outfd >= 0 && child_read(c)){
+				close(c->outfd);
+				c->outfd = -1;
+			}
+			if(waitpid(c->pid,&c->status,WNOHANG) != c->pid){
+				continue;
+			}
+			// anything it wrote is already in the pipe. don't wait on
+			// EOF, since a grandchild might still be holding it open.
+			if(c->outfd >= 0){
+				child_read(c);
+			}
+			child_close(c);
+			c->reaped = 1;
+			--live;
+			if(!WIFEXITED(c->status) || WEXITSTATUS(c->status)){
+				if(c->killed){
+					diag("Cancelled %s\n",c->argv[0]);
+				}else{
+					diag("Error running %s\n",c->argv[0]);
+				}
+				ret = -1;
+			}
+		}
+	}
+	return ret;
+}
+
+int spawn_drain(char * const *argv,progressparser parser){
+	unsigned held;
+	childproc c;
 	int r;
 
-	if((r = snprintf(buf,sizeof(buf),"%s ",cmd)) >= (int)sizeof(buf)){
+	memset(&c,0,sizeof(c));
+	c.argv = argv;
+	c.parser = parser;
+	held = release_growlight();
+	r = spawn_children(&c,1);
+	reacquire_growlight(held);
+	return r;
+}
+
+int popen_drain(const char *cmd){
+	char **argv;
+	int r;
+
+	if((argv = split_cmd(cmd)) == NULL){
 		return -1;
 	}
-	while(*args){
-		int rr;
+	r = spawn_drain(argv,NULL);
+	free(argv);
+	return r;
+}
+
+int vpopen_drain(const char *cmd,wchar_t * const *args){
+	unsigned argc = 0,z;
+	int r = -1;
 
-		if((rr = snprintf(buf + r,sizeof(buf) - r,"%ls ",*args)) >= (int)(sizeof(buf) - r)){
-			return -1;
+	while(args[argc]){
+		++argc;
+	}
+	char *argv[argc + 2];
+	memset(argv,0,sizeof(argv));
+	if((argv[0] = strdup(cmd)) == NULL){
+		return -1;
+	}
+	for(z = 0 ; z < argc ; ++z){
+		size_t len = wcslen(args[z]) * MB_CUR_MAX + 1;
+
+		if((argv[z + 1] = malloc(len)) == NULL){
+			goto done;
 		}
-		r += rr;
-		++args;
+		if(snprintf(argv[z + 1],len,"%ls",args[z]) < 0){
+			diag("Couldn't convert argument %u\n",z);
+			goto done;
+		}
+	}
+	r = spawn_drain(argv,NULL);
+
+done:
+	for(z = 0 ; z <= argc ; ++z){
+		free(argv[z]);
 	}
-	return popen_drain(buf);
+	return r;
 }
 
-int vspopen_drain(const char *fmt,...){
-	char buf[BUFSIZ];
-	va_list va;
+static int
+vspopen_vprogress(progressparser parser,const char *fmt,va_list va){
+	char buf[BUFSIZ],**argv;
+	int r;
 
-	va_start(va,fmt);
 	if(vsnprintf(buf,sizeof(buf),fmt,va) >= (int)sizeof(buf)){
-		va_end(va);
 		diag("Bad command: %s ...\n",fmt);
 		return -1;
 	}
+	if((argv = split_cmd(buf)) == NULL){
+		return -1;
+	}
+	r = spawn_drain(argv,parser);
+	free(argv);
+	return r;
+}
+
+int vspopen_drain(const char *fmt,...){
+	va_list va;
+	int r;
+
+	va_start(va,fmt);
+	r = vspopen_vprogress(NULL,fmt,va);
 	va_end(va);
-	return popen_drain(buf);
+	return r;
+}
+
+int vspopen_progress(progressparser parser,const char *fmt,...){
+	va_list va;
+	int r;
+
+	va_start(va,fmt);
+	r = vspopen_vprogress(parser,fmt,va);
+	va_end(va);
+	return r;
+}
+
+int progress_fraction(const char *line,uintmax_t *done,uintmax_t *total){
+	const char *s;
+
+	for(s = line ; (s = strchr(s,'/')) ; ++s){
+		const char *d = s;
+		char *e;
+
+		while(d > line && isdigit((unsigned char)d[-1])){
+			--d;
+		}
+		if(d == s || (d > line && isalpha((unsigned char)d[-1])) || !isdigit((unsigned char)s[1])){
+			continue;
+		}
+		*done = strtoumax(d,NULL,10);
+		*total = strtoumax(s + 1,&e,10);
+		if(*e == '\0' || isspace((unsigned char)*e)){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int progress_fsck(const char *line,uintmax_t *done,uintmax_t *total){
+	uintmax_t cur,max;
+	unsigned pass;
+	int off = 0;
+
+	if(sscanf(line,"%u %ju %ju %*s%n",&pass,&cur,&max,&off) != 3 || off == 0){
+		return 0;
+	}
+	if(pass == 0 || pass > 5 || max == 0 || cur > max){
+		return 0;
+	}
+	// e2fsck runs five passes, each with its own scale
+	*done = (pass - 1) * 1000 + cur * 1000 / max;
+	*total = 5000;
+	return 1;
+}
+
+int progress_percent(const char *line,uintmax_t *done,uintmax_t *total){
+	const char *s;
+
+	for(s = line ; *s ; ++s){
+		uintmax_t pct;
+		char *e;
+
+		if(!isdigit((unsigned char)*s) || (s > line && isalnum((unsigned char)s[-1]))){
+			continue;
+		}
+		pct = strtoumax(s,&e,10);
+		if(*e == '.'){
+			while(isdigit((unsigned char)*++e)){
+				;
+			}
+		}
+		if((*e == '%' || strncmp(e," percent",8) == 0) && pct <= 100){
+			*done = pct;
+			*total = 100;
+			return 1;
+		}
+		s = e - 1;
+	}
+	return 0;
 }
@@ -7,11 +7,75 @@ extern "C" {
 #endif
 
 #include <wchar.h>
+#include <stdint.h>
+#include <sys/types.h>
 
+// Commands are run directly via posix_spawnp(3), never through a shell. The
+// string forms are split on whitespace; double quotes, single quotes and
+// backslashes group and escape as they would in sh(1), but nothing is
+// expanded. stdin is /dev/null, and stdout and stderr are both captured.
+//
+// These all go through spawn_drain(), so the growlight lock is dropped while
+// the command runs. Device pointers held across them must be looked up again.
 int popen_drain(const char *);
 int vpopen_drain(const char *,wchar_t * const *);
 int vspopen_drain(const char *,...) __attribute__ ((format (printf,1,2)));
 
+// Split a command into an argv as above. The result is a single allocation,
+// to be released with free(). Returns NULL (having called diag()) on
+// unbalanced quotes or an empty command.
+char **split_cmd(const char *);
+
+// A progress parser is handed each line of a child's output. If it recognizes
+// a progress report, it fills in done and total and returns non-zero, and the
+// line is not logged.
+typedef int (*progressparser)(const char *,uintmax_t *,uintmax_t *);
+
+// "n/m", as printed by mke2fs while writing inode tables
+int progress_fraction(const char *,uintmax_t *,uintmax_t *);
+// "pass current max device", as written by e2fsck -C fd
+int progress_fsck(const char *,uintmax_t *,uintmax_t *);
+// "n%" or "n percent"
+int progress_percent(const char *,uintmax_t *,uintmax_t *);
+
+int vspopen_progress(progressparser,const char *,...)
+	__attribute__ ((format (printf,2,3)));
+
+#define CHILD_LINELEN 256
+
+typedef struct childproc {
+	char * const *argv;		// NULL-terminated; argv[0] is looked up in PATH
+	progressparser parser;		// may be NULL
+	unsigned nocancel;		// keep running even if our job is cancelled
+	// everything below is managed by spawn_children()
+	pid_t pid;
+	int pidfd;			// -1 if the kernel lacks pidfd_open(2)
+	int outfd;			// non-blocking read end of stdout+stderr
+	char line[CHILD_LINELEN];
+	size_t linelen;
+	uintmax_t done, total;		// most recent parsed progress
+	unsigned decile;		// last tenth of progress logged
+	uint64_t killed;		// when we sent SIGTERM, or 0
+	int status;			// wait(2) status once reaped
+	unsigned reaped;
+} childproc;
+
+// Run all n children concurrently, multiplexing their output and exits with
+// poll(2). Output is logged line by line, save what the parsers consume; the
+// aggregate progress is reported to the calling job. If the calling job is
+// cancelled, children are sent SIGTERM, and SIGKILL some seconds later.
+// Returns 0 if every child was started and exited with status 0.
+//
+// The caller blocks until every child has exited. It must not hold the
+// growlight lock (this fails with -1 if it does), lest the event thread
+// stall behind a long mkfs; see release_growlight() in growlight.h.
+int spawn_children(childproc *,unsigned);
+
+// Run one child to completion. Any holds the calling thread has on the
+// growlight lock are released while it runs, and retaken before returning;
+// argv mustn't point into anything the lock protects.
+int spawn_drain(char * const *,progressparser);
+
 #ifdef __cplusplus
 }
 #endif
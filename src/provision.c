@@ -0,0 +1,930 @@
+// copyright 2012–2021 nick black
+#include <wchar.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "fs.h"
+#include "gpt.h"
+#include "jobs.h"
+#include "crypt.h"
+#include "popen.h"
+#include "ptable.h"
+#include "blockio.h"
+#include "aggregate.h"
+#include "provision.h"
+#include "growlight.h"
+
+// Partitions are aligned to a multiple of this, and of the disk's I/O
+// granularities (see io_alignment())
+#define PROVISION_ALIGN (1024 * 1024)
+// msdos can't describe more than this many primary partitions
+#define PROVISION_MSDOS_PARTS 4
+// ...nor sectors beyond the reach of its 32-bit LBA fields
+#define PROVISION_MSDOS_SECTORS (1ull << 32)
+
+typedef struct provpart {
+	char *name;		// GPT partition name, and handle for aggregates
+	uintmax_t bytes;	// 0 for the remainder of the disk
+	unsigned code;		// partition type code
+	char *fs;		// filesystem, "luks", or NULL
+} provpart;
+
+typedef struct provagg {
+	char *type;
+	char *name;
+	unsigned member;	// index of the contributing partition
+} provagg;
+
+struct provspec {
+	_Atomic(unsigned) refs;		// outstanding jobs hold references
+	char *model, *controller;	// fnmatch(3) globs, or NULL
+	uintmax_t minsize, maxsize;	// bytes; 0 if unbounded
+	char *table;
+	provpart *parts;
+	unsigned pcount;
+	provagg *aggs;
+	unsigned acount;
+};
+
+// A disk to be provisioned, and where its partitions go. The disk is named
+// rather than pointed to, since it can be freed by a rescan while queued.
+typedef struct provtask {
+	struct provrun *run;
+	char dev[NAME_MAX + 1];
+	unsigned keep;			// already laid out as described
+	unsigned wipe;			// existing layout must be destroyed
+	uintmax_t (*ext)[2];		// first and last sector of each partition
+	char (*pnames)[NAME_MAX + 1];	// kernel names of created partitions
+} provtask;
+
+typedef struct provrun {
+	pthread_mutex_t lock;
+	provspec *p;
+	provtask *tasks;
+	unsigned ntasks;
+	unsigned pending;		// references outstanding
+	unsigned failed;
+} provrun;
+
+void provision_free(provspec *p){
+	unsigned z;
+
+	if(p == NULL || atomic_fetch_sub(&p->refs, 1) > 1){
+		return;
+	}
+	for(z = 0 ; z < p->pcount ; ++z){
+		free(p->parts[z].name);
+		free(p->parts[z].fs);
+	}
+	for(z = 0 ; z < p->acount ; ++z){
+		free(p->aggs[z].type);
+		free(p->aggs[z].name);
+	}
+	free(p->parts);
+	free(p->aggs);
+	free(p->model);
+	free(p->controller);
+	free(p->table);
+	free(p);
+}
+
+// Decimal (K, M, G, T, P) and binary (KiB..PiB) suffixes are accepted.
+int provision_parse_size(const char *s, uintmax_t *val){
+	static const char units[] = "KMGTP";
+	uintmax_t mult = 1, base;
+	const char *u;
+	char *e;
+
+	if(!isdigit(*s)){
+		return -1;
+	}
+	errno = 0;
+	*val = strtoumax(s, &e, 10);
+	if(errno == ERANGE){
+		return -1;
+	}
+	if(*e == '\0'){
+		return 0;
+	}
+	if((u = strchr(units, toupper(*e))) == NULL){
+		return -1;
+	}
+	base = strcmp(e + 1, "iB") == 0 ? 1024 : 1000;
+	if(e[1] && base == 1000){
+		return -1;
+	}
+	do{
+		mult *= base;
+	}while(u-- != units);
+	if(*val > UINTMAX_MAX / mult){
+		return -1;
+	}
+	*val *= mult;
+	return 0;
+}
+
+static int
+add_part(provspec *p, char * const *toks, unsigned n){
+	unsigned long code;
+	provpart *tmp;
+	uintmax_t bytes = 0;
+	char *e;
+
+	if(n < 4 || n > 5){
+		return -1;
+	}
+	if(p->pcount && p->parts[p->pcount - 1].bytes == 0){
+		diag("Only the final partition may take the rest of the disk\n");
+		return -1;
+	}
+	if(strcmp(toks[2], "rest") && (provision_parse_size(toks[2], &bytes) || bytes == 0)){
+		diag("Bad partition size: %s\n", toks[2]);
+		return -1;
+	}
+	code = strtoul(toks[3], &e, 16);
+	if(*e || code == 0 || code > 0xffff){
+		diag("Bad partition type code: %s\n", toks[3]);
+		return -1;
+	}
+	if((tmp = realloc(p->parts, sizeof(*tmp) * (p->pcount + 1))) == NULL){
+		return -1;
+	}
+	p->parts = tmp;
+	tmp += p->pcount;
+	memset(tmp, 0, sizeof(*tmp));
+	tmp->bytes = bytes;
+	tmp->code = code;
+	if((tmp->name = strdup(toks[1])) == NULL){
+		return -1;
+	}
+	if(n == 5 && strcmp(toks[4], "-") && (tmp->fs = strdup(toks[4])) == NULL){
+		free(tmp->name);
+		return -1;
+	}
+	++p->pcount;
+	return 0;
+}
+
+static int
+add_agg(provspec *p, char * const *toks, unsigned n){
+	const aggregate_type *at;
+	provagg *tmp;
+	unsigned z;
+
+	if(n != 4){
+		return -1;
+	}
+	if((at = get_aggregate(toks[1])) == NULL || at->makeagg == NULL){
+		diag("Can't create aggregates of type %s\n", toks[1]);
+		return -1;
+	}
+	for(z = 0 ; z < p->pcount ; ++z){
+		if(strcmp(p->parts[z].name, toks[3]) == 0){
+			break;
+		}
+	}
+	if(z == p->pcount){
+		diag("No partition %s has been described\n", toks[3]);
+		return -1;
+	}
+	if((tmp = realloc(p->aggs, sizeof(*tmp) * (p->acount + 1))) == NULL){
+		return -1;
+	}
+	p->aggs = tmp;
+	tmp += p->acount;
+	tmp->member = z;
+	if((tmp->type = strdup(toks[1])) == NULL){
+		return -1;
+	}
+	if((tmp->name = strdup(toks[2])) == NULL){
+		free(tmp->type);
+		return -1;
+	}
+	++p->acount;
+	return 0;
+}
+
+static int
+set_string(char **s, char * const *toks, unsigned n){
+	if(n != 2 || *s){
+		return -1;
+	}
+	return (*s = strdup(toks[1])) ? 0 : -1;
+}
+
+static int
+parse_line(provspec *p, char *line){
+	char *toks[6], *sep;
+	unsigned n = 0;
+
+	if( (sep = strchr(line, '#')) ){
+		*sep = '\0';
+	}
+	while( (sep = strtok(n ? NULL : line, " \t\r\n")) ){
+		if(n == sizeof(toks) / sizeof(*toks)){
+			return -1;
+		}
+		toks[n++] = sep;
+	}
+	if(n == 0){
+		return 0;
+	}
+	if(strcmp(toks[0], "model") == 0){
+		return set_string(&p->model, toks, n);
+	}else if(strcmp(toks[0], "controller") == 0){
+		return set_string(&p->controller, toks, n);
+	}else if(strcmp(toks[0], "table") == 0){
+		if(n != 2 || (strcmp(toks[1], "gpt") && strcmp(toks[1], "dos"))){
+			return -1;
+		}
+		return set_string(&p->table, toks, n);
+	}else if(strcmp(toks[0], "size") == 0){
+		if(n != 2){
+			return -1;
+		}
+		if( (sep = strchr(toks[1], '-')) ){
+			*sep++ = '\0';
+			if(provision_parse_size(sep, &p->maxsize)){
+				return -1;
+			}
+		}
+		return provision_parse_size(toks[1], &p->minsize);
+	}else if(strcmp(toks[0], "partition") == 0){
+		return add_part(p, toks, n);
+	}else if(strcmp(toks[0], "aggregate") == 0){
+		return add_agg(p, toks, n);
+	}
+	return -1;
+}
+
+provspec *provision_load(const char *fn){
+	unsigned lineno = 0;
+	char *line = NULL;
+	size_t len = 0;
+	provspec *p;
+	FILE *fp;
+
+	if((fp = fopen(fn, "re")) == NULL){
+		diag("Couldn't open %s (%s?)\n", fn, strerror(errno));
+		return NULL;
+	}
+	if((p = malloc(sizeof(*p))) == NULL){
+		diag("Couldn't allocate layout (%s?)\n", strerror(errno));
+		fclose(fp);
+		return NULL;
+	}
+	memset(p, 0, sizeof(*p));
+	atomic_init(&p->refs, 1);
+	while(getline(&line, &len, fp) >= 0){
+		++lineno;
+		if(parse_line(p, line)){
+			diag("Invalid layout at %s:%u\n", fn, lineno);
+			goto err;
+		}
+	}
+	if(ferror(fp)){
+		diag("Error reading %s (%s?)\n", fn, strerror(errno));
+		goto err;
+	}
+	if(p->table == NULL || p->pcount == 0){
+		diag("%s describes no partition table\n", fn);
+		goto err;
+	}
+	if(strcmp(p->table, "dos") == 0 && p->pcount > PROVISION_MSDOS_PARTS){
+		diag("msdos supports only %d partitions\n", PROVISION_MSDOS_PARTS);
+		goto err;
+	}
+	free(line);
+	fclose(fp);
+	return p;
+
+err:
+	free(line);
+	fclose(fp);
+	provision_free(p);
+	return NULL;
+}
+
+static inline unsigned
+sectsize(const device *d){
+	return d->logsec ? d->logsec : 512;
+}
+
+// Compute the extents of each partition on d. The usable area is that of
+// the table we'd create, so that identical disks get identical layouts.
+int provision_plan(const provspec *p, const device *d, uintmax_t (*ext)[2]){
+	const uintmax_t lbas = d->size / sectsize(d);
+	uintmax_t align, first, last, sec;
+	unsigned z;
+
+	align = io_alignment(d, PROVISION_ALIGN) / sectsize(d);
+	if(strcmp(p->table, "gpt") == 0){
+		const uintmax_t entlbas = (128 * 128 + sectsize(d) - 1) / sectsize(d);
+
+		first = 2 + entlbas;
+		last = lbas > 2 + entlbas ? lbas - 2 - entlbas : 0;
+	}else{
+		first = 1;
+		last = lbas ? lbas - 1 : 0;
+	}
+	sec = (first + align - 1) / align * align;
+	for(z = 0 ; z < p->pcount ; ++z){
+		const provpart *pp = &p->parts[z];
+		uintmax_t lsec;
+
+		if(pp->bytes){
+			lsec = sec + (pp->bytes + sectsize(d) - 1) / sectsize(d) - 1;
+		}else{
+			lsec = (last + 1) / align * align - 1;
+		}
+		if(sec > last || lsec > last || lsec < sec){
+			diag("%s doesn't fit on %s (%ju bytes)\n", pp->name, d->name, d->size);
+			return -1;
+		}
+		if(strcmp(p->table, "dos") == 0 && lsec >= PROVISION_MSDOS_SECTORS){
+			diag("%s would end at sector %ju of %s, beyond msdos's reach\n",
+				pp->name, lsec, d->name);
+			return -1;
+		}
+		ext[z][0] = sec;
+		ext[z][1] = lsec;
+		// the next partition begins at the next alignment boundary
+		sec = (lsec + align) / align * align;
+	}
+	return 0;
+}
+
+// Does the disk already carry exactly this layout? Partition extents are
+// reported by the kernel in 512-byte units.
+int provision_layout_matches(const provspec *p, const device *d, uintmax_t (*ext)[2]){
+	const device *part;
+	unsigned n = 0;
+
+	if(d->blkdev.pttable == NULL || strcmp(d->blkdev.pttable, p->table)){
+		return 0;
+	}
+	for(part = d->parts ; part ; part = part->next){
+		unsigned pno = part->partdev.pnumber;
+
+		if(pno == 0 || pno > p->pcount){
+			return 0;
+		}
+		if(part->partdev.fsector * 512 != ext[pno - 1][0] * sectsize(d) ||
+				(part->partdev.lsector + 1) * 512 != (ext[pno - 1][1] + 1) * sectsize(d)){
+			return 0;
+		}
+		++n;
+	}
+	return n == p->pcount;
+}
+
+static int
+device_busy_p(const device *d){
+	const device *p;
+
+	if(d->mnt.count || d->slave || d->swapprio >= SWAP_MAXPRIO){
+		return 1;
+	}
+	for(p = d->parts ; p ; p = p->next){
+		if(p->mnt.count || p->slave || p->swapprio >= SWAP_MAXPRIO){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int
+provision_matches(const provspec *p, const device *d){
+	if(d->layout != LAYOUT_NONE || d->blkdev.unloaded || d->roflag || d->size == 0){
+		return 0;
+	}
+	if(p->model && (d->model == NULL || fnmatch(p->model, d->model, 0))){
+		return 0;
+	}
+	if(p->controller){
+		if(d->c == NULL){
+			return 0;
+		}
+		if((d->c->ident == NULL || fnmatch(p->controller, d->c->ident, 0)) &&
+				(d->c->name == NULL || fnmatch(p->controller, d->c->name, 0))){
+			return 0;
+		}
+	}
+	if(d->size < p->minsize || (p->maxsize && d->size > p->maxsize)){
+		return 0;
+	}
+	return !device_busy_p(d);
+}
+
+static void
+free_run(provrun *r){
+	unsigned z;
+
+	for(z = 0 ; z < r->ntasks ; ++z){
+		free(r->tasks[z].ext);
+		free(r->tasks[z].pnames);
+	}
+	free(r->tasks);
+	provision_free(r->p);
+	pthread_mutex_destroy(&r->lock);
+	free(r);
+}
+
+static int
+add_task(provrun *r, const provspec *p, device *d, unsigned force){
+	provtask *tmp, *t;
+
+	if((tmp = realloc(r->tasks, sizeof(*tmp) * (r->ntasks + 1))) == NULL){
+		diag("Couldn't allocate layout plan (%s?)\n", strerror(errno));
+		return -1;
+	}
+	r->tasks = tmp;
+	t = &tmp[r->ntasks];
+	memset(t, 0, sizeof(*t));
+	t->run = r;
+	strcpy(t->dev, d->name);
+	if((t->ext = calloc(p->pcount, sizeof(*t->ext))) == NULL ||
+			(t->pnames = calloc(p->pcount, sizeof(*t->pnames))) == NULL){
+		free(t->ext);
+		diag("Couldn't allocate layout plan (%s?)\n", strerror(errno));
+		return -1;
+	}
+	++r->ntasks;
+	if(provision_plan(p, d, t->ext)){
+		return -1;
+	}
+	if(provision_layout_matches(p, d, t->ext)){
+		t->keep = 1;
+	}else if(d->blkdev.pttable || d->mnttype){
+		t->wipe = 1;
+		if(!force){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Build the plan, reporting conflicts without failing, so that a dry run
+// shows them all. Returns the number of conflicts, or -1 on error.
+static int
+plan_run(provrun *r, const provspec *p, device **ds, unsigned n, unsigned force){
+	unsigned z, conflicts = 0;
+	const controller *c;
+	int ret;
+
+	if(n){
+		for(z = 0 ; z < n ; ++z){
+			if(!provision_matches(p, ds[z])){
+				diag("%s doesn't match the layout, or is in use\n", ds[z]->name);
+				return -1;
+			}
+			if((ret = add_task(r, p, ds[z], force)) < 0){
+				return -1;
+			}
+			conflicts += ret;
+		}
+	}else{
+		for(c = get_controllers() ; c ; c = c->next){
+			device *d;
+
+			for(d = c->blockdevs ; d ; d = d->next){
+				if(!provision_matches(p, d)){
+					continue;
+				}
+				if((ret = add_task(r, p, d, force)) < 0){
+					return -1;
+				}
+				conflicts += ret;
+			}
+		}
+	}
+	if(r->ntasks == 0){
+		diag("No disks match the layout\n");
+		return -1;
+	}
+	for(z = 0 ; z < p->acount ; ++z){
+		const aggregate_type *at = get_aggregate(p->aggs[z].type);
+
+		if(r->ntasks < at->mindisks){
+			diag("%s %s needs %u disks, but only %u match\n", p->aggs[z].type,
+				p->aggs[z].name, at->mindisks, r->ntasks);
+			return -1;
+		}
+	}
+	return conflicts;
+}
+
+static provrun *
+new_run(const provspec *p){
+	provrun *r;
+
+	if((r = malloc(sizeof(*r))) == NULL){
+		diag("Couldn't allocate layout plan (%s?)\n", strerror(errno));
+		return NULL;
+	}
+	memset(r, 0, sizeof(*r));
+	pthread_mutex_init(&r->lock, NULL);
+	// the run holds a reference for the life of its jobs
+	r->p = (provspec *)p;
+	atomic_fetch_add(&r->p->refs, 1);
+	return r;
+}
+
+static int
+report_task(const provspec *p, const provtask *t, const device *d,
+		provisioncb cb, void *curry){
+	provchange pc;
+	const device *part;
+	unsigned z;
+
+	memset(&pc, 0, sizeof(pc));
+	pc.dev = d->name;
+	pc.sectsize = sectsize(d);
+	if(t->keep){
+		pc.op = PROVCHANGE_KEEP;
+		pc.what = p->table;
+		return cb(&pc, curry);
+	}
+	if(t->wipe){
+		for(part = d->parts ; part ; part = part->next){
+			pc.op = PROVCHANGE_DEL;
+			pc.what = part->name;
+			pc.fsec = part->partdev.fsector * 512 / pc.sectsize;
+			pc.lsec = (part->partdev.lsector + 1) * 512 / pc.sectsize - 1;
+			if(cb(&pc, curry)){
+				return -1;
+			}
+		}
+		pc.fsec = pc.lsec = 0;
+	}
+	pc.op = PROVCHANGE_TABLE;
+	pc.what = p->table;
+	if(cb(&pc, curry)){
+		return -1;
+	}
+	for(z = 0 ; z < p->pcount ; ++z){
+		pc.op = PROVCHANGE_ADD;
+		pc.what = p->parts[z].name;
+		pc.fsec = t->ext[z][0];
+		pc.lsec = t->ext[z][1];
+		pc.code = p->parts[z].code;
+		pc.fs = p->parts[z].fs;
+		if(cb(&pc, curry)){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Aggregates are only assembled from freshly-partitioned disks.
+static int
+check_aggregates(const provspec *p, const provrun *r, unsigned *modified){
+	unsigned z;
+
+	*modified = 0;
+	for(z = 0 ; z < r->ntasks ; ++z){
+		*modified += !r->tasks[z].keep;
+	}
+	if(p->acount && *modified && *modified != r->ntasks){
+		diag("Can't assemble aggregates from a mix of new and existing layouts\n");
+		return -1;
+	}
+	return 0;
+}
+
+int provision_diff(const provspec *p, device **ds, unsigned n, unsigned force,
+			provisioncb cb, void *curry){
+	unsigned z, modified, stop = 0;
+	int conflicts;
+	provrun *r;
+
+	if((r = new_run(p)) == NULL){
+		return -1;
+	}
+	if((conflicts = plan_run(r, p, ds, n, force)) < 0 ||
+			check_aggregates(p, r, &modified)){
+		free_run(r);
+		return -1;
+	}
+	for(z = 0 ; z < r->ntasks && !stop ; ++z){
+		const provtask *t = &r->tasks[z];
+		// the lock has been held since planning, so it's still there
+		const device *d = find_device(t->dev);
+
+		if(t->wipe && !force){
+			provchange pc = {
+				.op = PROVCHANGE_CONFLICT,
+				.dev = d->name,
+				.what = d->blkdev.pttable ? d->blkdev.pttable : d->mnttype,
+				.sectsize = sectsize(d),
+			};
+
+			stop = cb(&pc, curry) != 0;
+		}else{
+			stop = report_task(p, t, d, cb, curry) != 0;
+		}
+	}
+	for(z = 0 ; modified && z < p->acount && !stop ; ++z){
+		provchange pc = {
+			.op = PROVCHANGE_AGGREGATE,
+			.dev = p->aggs[z].type,
+			.what = p->aggs[z].name,
+			.members = r->ntasks,
+		};
+
+		stop = cb(&pc, curry) != 0;
+	}
+	free_run(r);
+	if(conflicts){
+		diag("%d disk%s already partitioned; force is required\n", conflicts,
+			conflicts == 1 ? " is" : "s are");
+		return -1;
+	}
+	return modified;
+}
+
+// Runs in the job of whichever disk finished last, if all succeeded.
+static int
+assemble_aggregates_run(provrun *r){
+	const provspec *p = r->p;
+	char *argv[r->ntasks];
+	unsigned z, a;
+	int ret = 0;
+
+	for(a = 0 ; a < p->acount ; ++a){
+		const aggregate_type *at = get_aggregate(p->aggs[a].type);
+
+		for(z = 0 ; z < r->ntasks ; ++z){
+			argv[z] = r->tasks[z].pnames[p->aggs[a].member];
+		}
+		lock_growlight();
+		if(at->makeagg(p->aggs[a].name, argv, r->ntasks)){
+			diag("Couldn't create %s %s\n", p->aggs[a].type, p->aggs[a].name);
+			ret = -1;
+		}
+		unlock_growlight();
+	}
+	return ret;
+}
+
+// Drop a reference to the run, having succeeded (r == 0) or failed.
+static int
+run_done(provrun *r, int ret){
+	unsigned last;
+
+	pthread_mutex_lock(&r->lock);
+	if(ret){
+		r->failed = 1;
+	}
+	last = --r->pending == 0;
+	pthread_mutex_unlock(&r->lock);
+	if(!last){
+		return ret;
+	}
+	if(r->failed){
+		if(r->p->acount){
+			diag("Not assembling aggregates due to earlier failures\n");
+		}
+	}else if(assemble_aggregates_run(r)){
+		ret = -1;
+	}
+	free_run(r);
+	return ret;
+}
+
+// The disk is looked up anew whenever the lock is taken, since it can be
+// rescanned (or removed) whenever it isn't. growlight must be locked.
+static device *
+task_disk(const provtask *t){
+	device *d;
+
+	if((d = find_device(t->dev)) == NULL){
+		diag("%s went away while it was being provisioned\n", t->dev);
+	}
+	return d;
+}
+
+static int
+task_rescan(const provtask *t){
+	device *d;
+	int r;
+
+	lock_growlight();
+	r = (d = task_disk(t)) == NULL || rescan_blockdev_blkrrpart(d);
+	unlock_growlight();
+	return r ? -1 : 0;
+}
+
+// Tables are written with the growlight lock released, so that other disks'
+// jobs and the UI needn't wait on our I/O. It's taken to validate the disk
+// beforehand, and to rescan it afterwards. Partitions are staged into a GPT
+// transaction under the lock, and committed without it; msdos partitions are
+// added one at a time, each a single sector's write, under the lock.
+static int
+partition_task(provtask *t){
+	const provspec *p = t->run->p;
+	const device *part;
+	const char *pty;
+	gpt_txn *txn;
+	unsigned z;
+	blockio b;
+	device *d;
+
+	if(t->wipe){
+		unsigned haspt, hasfs;
+
+		lock_growlight();
+		if((d = task_disk(t)) == NULL){
+			unlock_growlight();
+			return -1;
+		}
+		haspt = d->blkdev.pttable != NULL;
+		hasfs = d->mnttype != NULL;
+		if(hasfs && d->mnt.count){
+			diag("%s is in use (%ux) and cannot be wiped\n", d->name, d->mnt.count);
+			unlock_growlight();
+			return -1;
+		}
+		if(haspt && (pty = ptable_open(&b, d, NULL, 1)) == NULL){
+			unlock_growlight();
+			return -1;
+		}
+		unlock_growlight();
+		if(haspt && ptable_write(&b, pty, 1)){
+			return -1;
+		}
+		if(hasfs && vspopen_drain("wipefs -a /dev/%s", t->dev)){
+			return -1;
+		}
+		if((haspt || hasfs) && task_rescan(t)){
+			return -1;
+		}
+	}
+	lock_growlight();
+	if((d = task_disk(t)) == NULL || (pty = ptable_open(&b, d, p->table, 0)) == NULL){
+		unlock_growlight();
+		return -1;
+	}
+	unlock_growlight();
+	if(ptable_write(&b, pty, 0) || task_rescan(t)){
+		return -1;
+	}
+	lock_growlight();
+	if((d = task_disk(t)) == NULL){
+		goto err;
+	}
+	if(strcmp(p->table, "gpt") == 0){
+		if((txn = gpt_txn_begin(d)) == NULL){
+			goto err;
+		}
+		for(z = 0 ; z < p->pcount ; ++z){
+			wchar_t wname[NAME_MAX + 1];
+
+			swprintf(wname, sizeof(wname) / sizeof(*wname), L"%s", p->parts[z].name);
+			if(gpt_txn_add(txn, wname, t->ext[z][0], t->ext[z][1], p->parts[z].code) < 0){
+				gpt_txn_abort(txn);
+				goto err;
+			}
+		}
+		unlock_growlight();
+		if(gpt_txn_commit(txn) || task_rescan(t)){
+			return -1;
+		}
+		lock_growlight();
+		if((d = task_disk(t)) == NULL){
+			goto err;
+		}
+	}else{
+		for(z = 0 ; z < p->pcount ; ++z){
+			if(add_partition(d, NULL, t->ext[z][0], t->ext[z][1], p->parts[z].code)){
+				goto err;
+			}
+		}
+	}
+	for(part = d->parts ; part ; part = part->next){
+		if(part->partdev.pnumber && part->partdev.pnumber <= p->pcount){
+			strcpy(t->pnames[part->partdev.pnumber - 1], part->name);
+		}
+	}
+	for(z = 0 ; z < p->pcount ; ++z){
+		if(t->pnames[z][0] == '\0'){
+			diag("Partition %u didn't appear on %s\n", z + 1, d->name);
+			goto err;
+		}
+	}
+	unlock_growlight();
+	return 0;
+
+err:
+	unlock_growlight();
+	return -1;
+}
+
+static int
+format_task(provtask *t, unsigned z){
+	const provpart *pp = &t->run->p->parts[z];
+	device *part;
+	int ret;
+
+	if(strcmp(pp->fs, "luks")){
+		return make_filesystem_unlocked(t->pnames[z], pp->fs,
+				fstype_named_p(pp->fs) ? pp->name : NULL);
+	}
+	lock_growlight();
+	if((part = lookup_device(t->pnames[z])) == NULL){
+		unlock_growlight();
+		return -1;
+	}
+	ret = cryptondev(part);
+	unlock_growlight();
+	return ret;
+}
+
+// Devices are looked up anew whenever the lock is taken, since they can be
+// rescanned out from under us at any point after the job starts.
+static int
+provision_job(const char *dev, void *v){
+	provtask *t = *(provtask **)v;
+	const provspec *p = t->run->p;
+	unsigned z, steps = 1, done = 0;
+
+	(void)dev;
+	for(z = 0 ; z < p->pcount ; ++z){
+		steps += !!p->parts[z].fs;
+	}
+	job_progress(done, steps);
+	if(partition_task(t)){
+		return run_done(t->run, -1);
+	}
+	job_progress(++done, steps);
+	for(z = 0 ; z < p->pcount ; ++z){
+		if(p->parts[z].fs == NULL){
+			continue;
+		}
+		if(job_cancelled() || format_task(t, z)){
+			return run_done(t->run, -1);
+		}
+		job_progress(++done, steps);
+	}
+	return run_done(t->run, 0);
+}
+
+// A job that never runs fails its run, lest the run be leaked, or its
+// aggregates assembled from only those disks which were provisioned.
+static void
+provision_discard(void *v){
+	provtask *t = *(provtask **)v;
+
+	diag("%s wasn't provisioned\n", t->dev);
+	run_done(t->run, -1);
+}
+
+int provision_apply(const provspec *p, device **ds, unsigned n, unsigned force){
+	unsigned z, modified;
+	int submitted = 0;
+	provrun *r;
+
+	if((r = new_run(p)) == NULL){
+		return -1;
+	}
+	if(plan_run(r, p, ds, n, force) || check_aggregates(p, r, &modified)){
+		diag("Not applying layout; check it with a dry run\n");
+		free_run(r);
+		return -1;
+	}
+	if(modified == 0){
+		diag("All %u disk%s already match the layout\n", r->ntasks, r->ntasks == 1 ? "" : "s");
+		free_run(r);
+		return 0;
+	}
+	// We hold a reference until every job is submitted, lest the first to
+	// finish assemble aggregates without the rest. Jobs which never run drop
+	// theirs in provision_discard().
+	r->pending = 1;
+	for(z = 0 ; z < r->ntasks ; ++z){
+		provtask *t = &r->tasks[z];
+
+		if(t->keep){
+			continue;
+		}
+		pthread_mutex_lock(&r->lock);
+		++r->pending;
+		pthread_mutex_unlock(&r->lock);
+		if(job_submit_discard("provision", find_device(t->dev), provision_job,
+					provision_discard, &t, sizeof(t)) < 0){
+			run_done(r, -1);
+			continue;
+		}
+		++submitted;
+	}
+	run_done(r, submitted ? 0 : -1);
+	return submitted;
+}
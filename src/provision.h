@@ -0,0 +1,84 @@
+// copyright 2012–2021 nick black
+#ifndef GROWLIGHT_PROVISION
+#define GROWLIGHT_PROVISION
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+struct device;
+
+// A declarative layout, applied identically to any number of disks. The
+// description is line-oriented; '#' begins a comment. Sizes take decimal
+// (K, M, G, T) or binary (KiB, MiB, GiB, TiB) suffixes.
+//
+//   model <glob>                 match disks by model (fnmatch(3))
+//   controller <glob>            ...by controller ident or name
+//   size <min>[-<max>]           ...by capacity
+//   table gpt|dos                partition table to create
+//   partition <name> <size>|rest <code> [<fstype>|luks|-]
+//   aggregate <type> <name> <partition>
+//
+// Partitions are laid out in order, each aligned to the larger of 1MiB and
+// the disk's physical sector; "rest" takes what remains, and may only be
+// used last. An aggregate is assembled from the named partition of every
+// disk provisioned.
+typedef struct provspec provspec;
+
+// Returns NULL on error, having diagnosed it.
+provspec *provision_load(const char *);
+void provision_free(provspec *);
+
+// One line of the plan, passed to a provisioncb by provision_diff().
+typedef struct provchange {
+	enum {
+		PROVCHANGE_KEEP,	// disk already matches; left alone
+		PROVCHANGE_DEL,		// existing partition destroyed
+		PROVCHANGE_TABLE,	// partition table created
+		PROVCHANGE_ADD,		// partition created
+		PROVCHANGE_AGGREGATE,	// aggregate assembled
+		PROVCHANGE_CONFLICT,	// disk is partitioned, and needs force
+	} op;
+	const char *dev;	// disk name, or aggregate type
+	const char *what;	// table type, or partition/aggregate name
+	uintmax_t fsec, lsec;	// extent in logical sectors
+	unsigned sectsize;	// bytes per logical sector
+	unsigned code;		// partition type code
+	const char *fs;		// filesystem, "luks", or NULL
+	unsigned members;	// disks contributing to an aggregate
+} provchange;
+
+typedef int (*provisioncb)(const provchange *, void *);
+
+// Plan the layout against the n devices, or (if n is 0) every unused disk
+// matching the description. Each change is passed to the callback; a
+// non-zero return stops the walk. Returns the number of disks which would be
+// modified, or -1 if the layout can't be applied (the reasons having been
+// diagnosed). Partitioned disks which don't match the layout are conflicts,
+// unless force is set, in which case their tables are replaced. Call with
+// the growlight lock held.
+int provision_diff(const provspec *, struct device **, unsigned, unsigned,
+			provisioncb, void *);
+
+// Plan as above, and submit a job for each disk to be modified. The jobs
+// run concurrently, subject to the usual per-controller admission; the last
+// to finish assembles any aggregates, provided all succeeded. Returns the
+// number of jobs submitted, or -1 on error. Call with the growlight lock held.
+int provision_apply(const provspec *, struct device **, unsigned, unsigned);
+
+// The pieces of planning, exposed for testing. provision_parse_size() reads
+// a size as the description does. provision_plan() fills in the first and
+// last logical sector of each partition on the device, failing if they don't
+// fit (or, for dos, lie beyond 2^32 sectors). provision_layout_matches()
+// returns non-zero if the device already carries exactly those partitions.
+int provision_parse_size(const char *, uintmax_t *);
+int provision_plan(const provspec *, const struct device *, uintmax_t (*)[2]);
+int provision_layout_matches(const provspec *, const struct device *, uintmax_t (*)[2]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -6,7 +6,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <linux/blkpg.h>
 
@@ -18,11 +17,9 @@
 #include "msdos.h"
 #include "ptypes.h"
 #include "ptable.h"
+#include "blockio.h"
 #include "growlight.h"
 
-#define LBA_SIZE 512
-#define MBR_SIZE (LBA_SIZE - MBR_OFFSET)
-
 static inline const char *
 get_ptype(const device *d){
 	if(d->layout == LAYOUT_NONE){
@@ -51,8 +48,8 @@ get_ptype(const device *d){
 static const struct ptable {
 	const char *name;
 	const char *desc;
-	int (*make)(device *);				// Make partition table
-	int (*zap)(device *);				// Zap partition table
+	int (*make)(blockio *);				// Make partition table
+	int (*zap)(blockio *);				// Zap partition table
 	int (*add)(device *, const wchar_t *, uintmax_t, uintmax_t, unsigned long long);
 	int (*del)(const device *);			// Delete partition
 	int (*pname)(device *, const wchar_t *);		// Set partition name
@@ -60,8 +57,8 @@ static const struct ptable {
 	int (*flags)(device *, uint64_t);		// Reset partition flags
 	int (*flag)(device *, uint64_t, unsigned);	// Set a partition flag
 	int (*code)(device *, unsigned long long);	// Set partition code
-	uintmax_t (*first)(const device *);	// Get first usable sector
-	uintmax_t (*last)(const device *);	// Get last usable sector
+	uintmax_t (*first)(const device *, const blockcap *);	// Get first usable sector
+	uintmax_t (*last)(const device *, const blockcap *);	// Get last usable sector
 } ptables[] = {
 	{
 		.name = "gpt",
@@ -170,34 +167,96 @@ void free_ptable_types(pttable_type *pt, int count){
 	free(pt);
 }
 
-int make_partition_table(device *d, const char *pty){
+static const struct ptable *
+ptable_named(const char *pty){
 	const struct ptable *pt;
 
-	if(d->layout != LAYOUT_NONE){
-		diag("Will only create a partition table on raw block devices\n");
-		return -1;
-	}
-	if(d->blkdev.pttable){
-		diag("Partition table already exists on %s\n", d->name);
-		return -1;
-	}
-	if(d->mnttype){
-		diag("Filesystem exists on %s\n", d->name);
-		return -1;
-	}
 	for(pt = ptables ; pt->name ; ++pt){
 		if(strcmp(pt->name, pty) == 0){
-			if(pt->make(d)){
-				return -1;
+			return pt;
+		}
+	}
+	diag("Unsupported partition table type: %s\n", pty);
+	return NULL;
+}
+
+const char *ptable_open(blockio *b, const device *d, const char *pty, unsigned zap){
+	const struct ptable *pt;
+	const device *p;
+
+	if(d->layout != LAYOUT_NONE){
+		diag("Will only %s partition tables %s raw block devices\n",
+			zap ? "remove" : "create", zap ? "from" : "on");
+		return NULL;
+	}
+	if(zap){
+		if(d->mnt.count){
+			diag("%s is mounted on %s; not removing\n", d->mnt.list[0], d->name);
+			return NULL;
+		}
+		for(p = d->parts ; p ; p = p->next){
+			if(p->mnt.count){
+				diag("%s is mounted on %s; not removing\n", p->mnt.list[0], p->name);
+				return NULL;
 			}
-			if(rescan_blockdev_blkrrpart(d)){
-				return -1;
+		}
+		if(d->blkdev.pttable == NULL){
+			if(pty == NULL){
+				diag("No partition table detected on %s\n", d->name);
+				return NULL;
 			}
-			return 0;
+			diag("No partition table on %s; wiping anyway\n", d->name);
+		}else if(pty == NULL){
+			pty = d->blkdev.pttable;
+		}else if(strcmp(pty, d->blkdev.pttable)){
+			diag("Wiping %s table despite %s detection on %s\n", pty, d->blkdev.pttable, d->name);
+		}
+	}else{
+		if(d->blkdev.pttable){
+			diag("Partition table already exists on %s\n", d->name);
+			return NULL;
+		}
+		if(d->mnttype){
+			diag("Filesystem exists on %s\n", d->name);
+			return NULL;
 		}
 	}
-	diag("Unsupported partition table type: %s\n", pty);
-	return -1;
+	if((pt = ptable_named(pty)) == NULL){
+		return NULL;
+	}
+	if((zap ? pt->zap : pt->make) == NULL){
+		diag("Can't %s %s partition tables\n", zap ? "remove" : "create", pt->name);
+		return NULL;
+	}
+	if(blockio_open(b, d, O_RDWR)){
+		return NULL;
+	}
+	return pt->name;
+}
+
+int ptable_write(blockio *b, const char *pty, unsigned zap){
+	const struct ptable *pt;
+	int ret = -1;
+
+	if( (pt = ptable_named(pty)) ){
+		ret = zap ? pt->zap(b) : pt->make(b);
+	}
+	if(blockio_close(b)){
+		ret = -1;
+	}
+	return ret;
+}
+
+int make_partition_table(device *d, const char *pty){
+	blockio b;
+
+	if((pty = ptable_open(&b, d, pty, 0)) == NULL){
+		return -1;
+	}
+	if(ptable_write(&b, pty, 0)){
+		return -1;
+	}
+	return rescan_blockdev_blkrrpart(d);
 }
 
 // Wipe the partition table (make it unrecognizable, preferably by overwriting
@@ -207,48 +266,15 @@ int make_partition_table(device *d, const char *pty){
 // type is specified, the detected type, if it exists, is used. If no type is
 // specified and none is detected, nothing is done.
 int wipe_ptable(device *d, const char *pty){
-	const struct ptable *ptp;
-	const device *p;
-	const char *pt;
+	blockio b;
 
-	if(d->layout != LAYOUT_NONE){
-		diag("Will only remove partition tables from raw block devices\n");
+	if((pty = ptable_open(&b, d, pty, 1)) == NULL){
 		return -1;
 	}
-	if(d->mnt.count){
-		diag("%s is mounted on %s; not removing\n", d->mnt.list[0], d->name);
+	if(ptable_write(&b, pty, 1)){
 		return -1;
 	}
-	for(p = d->parts ; p ; p = p->next){
-		if(p->mnt.count){
-			diag("%s is mounted on %s; not removing\n", p->mnt.list[0], p->name);
-			return -1;
-		}
-	}
-	if( !(pt = d->blkdev.pttable) ){
-		if( (pt = pty) ){
-			diag("No partition table on %s; wiping anyway\n", d->name);
-		}else{
-			diag("No partition table detected on %s\n", d->name);
-			return -1;
-		}
-	}else if(pty && strcmp(pty, pt)){
-		diag("Wiping %s table despite %s detection on %s\n", pty, pt, d->name);
-		pt = pty;
-	}
-	for(ptp = ptables ; ptp->name ; ++ptp){
-		if(strcmp(ptp->name, pt) == 0){
-			if(ptp->zap(d)){
-				return -1;
-			}
-			if(rescan_blockdev_blkrrpart(d)){
-				return -1;
-			}
-			return 0;
-		}
-	}
-	diag("Unsupported partition table type: %s\n", d->blkdev.pttable);
-	return -1;
+	return rescan_blockdev_blkrrpart(d);
 }
 
 int add_partition(device *d, const wchar_t *name, uintmax_t fsec, uintmax_t lsec, unsigned long long code){
@@ -393,7 +419,7 @@ int check_partition(device *d){
 		return -1;
 	}
 	// FIXME not every filesystem supports -y
-	if(vspopen_drain("fsck.%s -y -C 0 /dev/%s", d->mnttype, d->name)){
+	if(vspopen_progress(progress_fsck, "fsck.%s -y -C 1 /dev/%s", d->mnttype, d->name)){
 		return -1;
 	}
 	return 0;
@@ -479,7 +505,7 @@ int partition_set_code(device *d, unsigned long long code){
 
 // both of these functions smell, and might be broken for partition tables with
 // empty space at the beginning or ending see #61 FIXME
-uintmax_t lookup_first_usable_sector(const device *d){
+uintmax_t lookup_first_usable_sector(const device *d, const blockcap *cap){
 	/*
 	if(d->logsec == 0){
 		return 0;
@@ -492,13 +518,14 @@ uintmax_t lookup_first_usable_sector(const device *d){
 	}
 	for(pt = ptables ; pt->name ; ++pt){
 		if(strcmp(pt->name, d->blkdev.pttable) == 0){
-			return pt->first(d);
+			return pt->first(d, cap);
 		}
 	}
 	return 0;
 }
 
-uintmax_t lookup_last_usable_sector(const device *d){
+uintmax_t lookup_last_usable_sector(const device *d,
+				const blockcap *cap __attribute__ ((unused))){
 	if(d->logsec == 0){
 		return 0;
 	}
@@ -513,12 +540,56 @@ uintmax_t lookup_last_usable_sector(const device *d){
 	const struct ptable *pt;
 	for(pt = ptables ; pt->name ; ++pt){
 		if(strcmp(pt->name, d->blkdev.pttable) == 0){
-			return pt->last(d);
+			return pt->last(d, cap);
 		}
 	}*/
 	return 0;
 }
 
+// Larger I/O units are assumed bogus (some devices report their maximum
+// transfer as the optimal one).
+#define ALIGN_MAX (64ull * 1024 * 1024)
+
+static uintmax_t
+gcd(uintmax_t a, uintmax_t b){
+	while(b){
+		uintmax_t t = a % b;
+
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+uintmax_t io_alignment(const device *d, uintmax_t floor){
+	uintmax_t align = floor ? floor : 1;
+	uintmax_t units[4];
+	unsigned z;
+
+	if(d->layout == LAYOUT_PARTITION && d->partdev.parent){
+		d = d->partdev.parent;
+	}
+	memset(units, 0, sizeof(units));
+	units[0] = d->physsec;
+	if(d->layout == LAYOUT_NONE){
+		units[1] = d->blkdev.caps.optxfergran;
+		units[2] = d->blkdev.caps.optxfer;
+		units[3] = d->blkdev.caps.unmapgran;
+	}
+	for(z = 0 ; z < sizeof(units) / sizeof(*units) ; ++z){
+		uintmax_t lcm;
+
+		if(units[z] == 0 || units[z] > ALIGN_MAX){
+			continue;
+		}
+		lcm = align / gcd(align, units[z]) * units[z];
+		if(lcm <= ALIGN_MAX){
+			align = lcm;
+		}
+	}
+	return align;
+}
+
 // Uses the BLKPG ioctl to notify the kernel that a partition has been added
 int blkpg_add_partition(int fd, long long start, long long len, int pno, const char *name){
 	struct blkpg_partition data;
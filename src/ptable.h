@@ -9,6 +9,8 @@ extern "C" {
 #include <stdint.h>
 
 struct device;
+struct blockio;
+struct blockcap;
 
 #define MBR_OFFSET 440u
 
@@ -22,18 +24,35 @@ int make_partition_table(struct device *,const char *);
 // type is specified, the detected type, if it exists, is used.
 int wipe_ptable(struct device *,const char *);
 
+// The two halves of make_partition_table() (zap == 0) and wipe_ptable() (zap
+// != 0), for callers which would write without the growlight lock held.
+// ptable_open() validates the device as those functions do, and opens it
+// into the blockio, returning the type of table to write (or zap), or NULL on
+// failure. It must be called with the growlight lock held. ptable_write()
+// needn't be, and closes the blockio; the device ought then be rescanned via
+// rescan_blockdev_blkrrpart().
+const char *ptable_open(struct blockio *,const struct device *,const char *,unsigned);
+int ptable_write(struct blockio *,const char *,unsigned);
+
 int add_partition(struct device *,const wchar_t *,uintmax_t,uintmax_t,unsigned long long);
 int wipe_partition(const struct device *);
 int name_partition(struct device *,const wchar_t *);
 int uuid_partition(struct device *,const void *);
+// fsck the filesystem, without the growlight lock while it runs
 int check_partition(struct device *);
 int partition_set_flags(struct device *,uint64_t);
 int partition_set_flag(struct device *,uint64_t,unsigned);
 int partition_set_code(struct device *,unsigned long long);
 int partitions_named_p(const struct device *);
 
-uintmax_t lookup_first_usable_sector(const struct device *);
-uintmax_t lookup_last_usable_sector(const struct device *);
+// The capture, if non-NULL, is consulted before reading from the device.
+uintmax_t lookup_first_usable_sector(const struct device *, const struct blockcap *);
+uintmax_t lookup_last_usable_sector(const struct device *, const struct blockcap *);
+
+// Preferred partition alignment in bytes: the least multiple of floor which
+// is also a multiple of the physical sector and of the optimal transfer and
+// unmap granularities the disk reports.
+uintmax_t io_alignment(const struct device *, uintmax_t);
 
 // Interface to kernel's BLKPG ioctl
 int blkpg_add_partition(int,long long,long long,int,const char *);
@@ -0,0 +1,580 @@
+// copyright 2012–2021 nick black
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "queue.h"
+#include "sysfs.h"
+#include "growlight.h"
+
+// Longest value we'll write, and remember for rollback
+#define QUEUE_VALUE_MAX 64
+
+static const struct {
+	const char *name;
+	const char *node;	// relative to the device's sysfs directory
+	const char *desc;
+} qparams[QUEUE_PARAMS] = {
+	{ "scheduler", "queue/scheduler", "I/O scheduler", },
+	{ "nr_requests", "queue/nr_requests", "Requests allocated per queue", },
+	{ "read_ahead_kb", "queue/read_ahead_kb", "Readahead (KiB)", },
+	{ "max_sectors_kb", "queue/max_sectors_kb", "Largest request (KiB)", },
+	{ "rq_affinity", "queue/rq_affinity", "Complete on submitting CPU group (1) or CPU (2)", },
+	{ "nomerges", "queue/nomerges", "Disable merging: simple (1) or all (2)", },
+	{ "io_poll", "queue/io_poll", "Poll for completions", },
+	{ "wbt_lat_usec", "queue/wbt_lat_usec", "Writeback throttling target latency (µs)", },
+	{ "queue_depth", "device/queue_depth", "Commands outstanding to the SCSI device", },
+};
+
+const char *queueparam_str(queueparam p){
+	return p < QUEUE_PARAMS ? qparams[p].name : NULL;
+}
+
+const char *queueparam_desc(queueparam p){
+	return p < QUEUE_PARAMS ? qparams[p].desc : NULL;
+}
+
+int queueparam_parse(const char *name, queueparam *p){
+	unsigned z;
+
+	for(z = 0 ; z < QUEUE_PARAMS ; ++z){
+		if(strcmp(name, qparams[z].name) == 0){
+			*p = z;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+void queue_tunables_free(queuetunables *qt){
+	unsigned z;
+
+	for(z = 0 ; z < qt->nschedulers ; ++z){
+		free(qt->schedulers[z]);
+	}
+	free(qt->schedulers);
+	free(qt->scheduler);
+	memset(qt, 0, sizeof(*qt));
+}
+
+// "mq-deadline kyber [bfq] none": the bracketed scheduler is active. Older
+// kernels, and stacked devices, may offer only "none", without brackets.
+static int
+parse_schedulers(queuetunables *qt, char *s){
+	char *tok, *save;
+
+	for(tok = strtok_r(s, " ", &save) ; tok ; tok = strtok_r(NULL, " ", &save)){
+		size_t len = strlen(tok);
+		unsigned active = 0;
+		char **tmp;
+
+		if(len > 2 && tok[0] == '[' && tok[len - 1] == ']'){
+			tok[len - 1] = '\0';
+			++tok;
+			active = 1;
+		}
+		if((tmp = realloc(qt->schedulers, sizeof(*tmp) * (qt->nschedulers + 1))) == NULL){
+			return -1;
+		}
+		qt->schedulers = tmp;
+		if((qt->schedulers[qt->nschedulers] = strdup(tok)) == NULL){
+			return -1;
+		}
+		++qt->nschedulers;
+		if(active && (qt->scheduler = strdup(tok)) == NULL){
+			return -1;
+		}
+	}
+	if(qt->scheduler == NULL && qt->nschedulers == 1){
+		if((qt->scheduler = strdup(qt->schedulers[0])) == NULL){
+			return -1;
+		}
+	}
+	return qt->scheduler ? 0 : -1;
+}
+
+static int
+open_queue_dir(const device *d){
+	int fd;
+
+	if(d->layout == LAYOUT_PARTITION){
+		diag("Queue parameters belong to %s, not %s\n",
+			d->partdev.parent->name, d->name);
+		return -1;
+	}
+	if((fd = openat(sysfd, d->name, O_RDONLY|O_CLOEXEC|O_DIRECTORY)) < 0){
+		diag("Couldn't open sysfs for %s (%s?)\n", d->name, strerror(errno));
+		return -1;
+	}
+	return fd;
+}
+
+static int
+read_tunables(int fd, queuetunables *qt){
+	unsigned long *ulongs[QUEUE_PARAMS] = {
+		[QUEUE_NR_REQUESTS] = &qt->nr_requests,
+		[QUEUE_READ_AHEAD_KB] = &qt->read_ahead_kb,
+		[QUEUE_MAX_SECTORS_KB] = &qt->max_sectors_kb,
+		[QUEUE_RQ_AFFINITY] = &qt->rq_affinity,
+		[QUEUE_NOMERGES] = &qt->nomerges,
+		[QUEUE_IO_POLL] = &qt->io_poll,
+		[QUEUE_DEPTH] = &qt->queue_depth,
+	};
+	char *sched;
+	unsigned z;
+	int wbt;
+
+	memset(qt, 0, sizeof(*qt));
+	if( (sched = get_sysfs_string(fd, qparams[QUEUE_SCHEDULER].node)) ){
+		int r = parse_schedulers(qt, sched);
+
+		free(sched);
+		if(r){
+			queue_tunables_free(qt);
+			return -1;
+		}
+		qt->valid |= 1u << QUEUE_SCHEDULER;
+	}
+	for(z = 0 ; z < QUEUE_PARAMS ; ++z){
+		if(ulongs[z] && get_sysfs_uint(fd, qparams[z].node, ulongs[z]) == 0){
+			qt->valid |= 1u << z;
+		}
+	}
+	if(get_sysfs_int(fd, qparams[QUEUE_WBT_LAT_USEC].node, &wbt) == 0){
+		qt->wbt_lat_usec = wbt;
+		qt->valid |= 1u << QUEUE_WBT_LAT_USEC;
+	}
+	if(get_sysfs_uint(fd, "queue/max_hw_sectors_kb", &qt->max_hw_sectors_kb)){
+		qt->max_hw_sectors_kb = 0;
+	}
+	return 0;
+}
+
+int queue_tunables(const device *d, queuetunables *qt){
+	int fd, r;
+
+	if((fd = open_queue_dir(d)) < 0){
+		return -1;
+	}
+	r = read_tunables(fd, qt);
+	close(fd);
+	if(r){
+		diag("Couldn't read queue parameters for %s\n", d->name);
+		return -1;
+	}
+	if(qt->valid == 0){
+		diag("%s has no request queue\n", d->name);
+		queue_tunables_free(qt);
+		return -1;
+	}
+	return 0;
+}
+
+int queue_tunable_str(const queuetunables *qt, queueparam p, char *buf, size_t len){
+	int r;
+
+	if(p >= QUEUE_PARAMS || !(qt->valid & (1u << p))){
+		return -1;
+	}
+	switch(p){
+		case QUEUE_SCHEDULER: r = snprintf(buf, len, "%s", qt->scheduler); break;
+		case QUEUE_NR_REQUESTS: r = snprintf(buf, len, "%lu", qt->nr_requests); break;
+		case QUEUE_READ_AHEAD_KB: r = snprintf(buf, len, "%lu", qt->read_ahead_kb); break;
+		case QUEUE_MAX_SECTORS_KB: r = snprintf(buf, len, "%lu", qt->max_sectors_kb); break;
+		case QUEUE_RQ_AFFINITY: r = snprintf(buf, len, "%lu", qt->rq_affinity); break;
+		case QUEUE_NOMERGES: r = snprintf(buf, len, "%lu", qt->nomerges); break;
+		case QUEUE_IO_POLL: r = snprintf(buf, len, "%lu", qt->io_poll); break;
+		case QUEUE_WBT_LAT_USEC: r = snprintf(buf, len, "%ld", qt->wbt_lat_usec); break;
+		case QUEUE_DEPTH: r = snprintf(buf, len, "%lu", qt->queue_depth); break;
+		default: return -1;
+	}
+	return r < 0 || (size_t)r >= len ? -1 : 0;
+}
+
+static unsigned long
+page_kb(void){
+	long ps = sysconf(_SC_PAGESIZE);
+
+	return ps > 1024 ? (unsigned long)ps / 1024 : 4;
+}
+
+// The kernel's bounds for each parameter. A max of 0 means unbounded.
+static void
+tunable_bounds(const queuetunables *qt, queueparam p, long *min, unsigned long *max){
+	*min = 0;
+	*max = 0;
+	switch(p){
+		case QUEUE_NR_REQUESTS: *min = 4; break; // BLKDEV_MIN_RQ
+		case QUEUE_MAX_SECTORS_KB:
+			*min = page_kb();
+			*max = qt->max_hw_sectors_kb;
+			break;
+		case QUEUE_RQ_AFFINITY: case QUEUE_NOMERGES: *max = 2; break;
+		case QUEUE_IO_POLL: *max = 1; break;
+		case QUEUE_WBT_LAT_USEC: *min = -1; break; // -1 restores the default
+		case QUEUE_DEPTH: *min = 1; break;
+		default: break;
+	}
+}
+
+int queue_tunable_range(const queuetunables *qt, queueparam p, char *buf, size_t len){
+	unsigned long max;
+	size_t used = 0;
+	unsigned z;
+	long min;
+	int r;
+
+	if(p >= QUEUE_PARAMS || !(qt->valid & (1u << p))){
+		return -1;
+	}
+	if(p == QUEUE_SCHEDULER){
+		if(len){
+			buf[0] = '\0';
+		}
+		for(z = 0 ; z < qt->nschedulers ; ++z){
+			r = snprintf(buf + used, len - used, "%s%s", z ? " " : "", qt->schedulers[z]);
+			if(r < 0 || (size_t)r >= len - used){
+				return -1;
+			}
+			used += r;
+		}
+		return 0;
+	}
+	tunable_bounds(qt, p, &min, &max);
+	if(max){
+		r = snprintf(buf, len, "%ld-%lu", min, max);
+	}else{
+		r = snprintf(buf, len, "%ld+", min);
+	}
+	return r < 0 || (size_t)r >= len ? -1 : 0;
+}
+
+static int
+validate_tunable(const device *d, const queuetunables *qt, queueparam p, const char *val){
+	unsigned long max;
+	char *end;
+	unsigned z;
+	long min;
+	long long v;
+
+	if(!(qt->valid & (1u << p))){
+		diag("%s doesn't support %s\n", d->name, qparams[p].name);
+		return -1;
+	}
+	if(p == QUEUE_SCHEDULER){
+		for(z = 0 ; z < qt->nschedulers ; ++z){
+			if(strcmp(qt->schedulers[z], val) == 0){
+				return 0;
+			}
+		}
+		diag("%s doesn't offer scheduler %s\n", d->name, val);
+		return -1;
+	}
+	errno = 0;
+	v = strtoll(val, &end, 0);
+	if(errno || end == val || *end){
+		diag("Invalid %s: %s\n", qparams[p].name, val);
+		return -1;
+	}
+	tunable_bounds(qt, p, &min, &max);
+	if(v < min || (max && v > (long long)max) || v > LONG_MAX){
+		char range[QUEUE_VALUE_MAX];
+
+		queue_tunable_range(qt, p, range, sizeof(range));
+		diag("%s on %s must be %s\n", qparams[p].name, d->name, range);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+write_tunable(const device *d, queueparam p, const char *val){
+	char buf[QUEUE_VALUE_MAX + 2];
+	int fd, r;
+
+	if(snprintf(buf, sizeof(buf), "%s\n", val) >= (int)sizeof(buf)){
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if((fd = openat(sysfd, d->name, O_RDONLY|O_CLOEXEC|O_DIRECTORY)) < 0){
+		return -1;
+	}
+	r = writeat_sysfs(fd, qparams[p].node, buf);
+	if(r){
+		int e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+// Refresh what we cache of the device's queue, and let the UI know.
+static void
+tuned(device *d, unsigned schedchanged){
+	const glightui *gui = get_glightui();
+
+	if(schedchanged){
+		char *sched, path[PATH_MAX];
+
+		if(snprintf(path, sizeof(path), "%s/%s", d->name,
+				qparams[QUEUE_SCHEDULER].node) < (int)sizeof(path) &&
+				(sched = get_sysfs_string(sysfd, path))){
+			free(d->sched);
+			d->sched = sched;
+		}
+	}
+	if(gui){
+		d->uistate = gui->block_event(d, d->uistate);
+	}
+}
+
+int queue_tune(device **ds, unsigned n, queueparam p, const char *val){
+	char old[n ? n : 1][QUEUE_VALUE_MAX];
+	unsigned z, y, changed[n ? n : 1];
+
+	if(p >= QUEUE_PARAMS){
+		diag("Invalid queue parameter %d\n", p);
+		return -1;
+	}
+	if(strlen(val) >= QUEUE_VALUE_MAX){
+		diag("Invalid %s: %s\n", qparams[p].name, val);
+		return -1;
+	}
+	// Check every device before touching any of them
+	for(z = 0 ; z < n ; ++z){
+		queuetunables qt;
+		int r;
+
+		changed[z] = 0;
+		if(queue_tunables(ds[z], &qt)){
+			return -1;
+		}
+		r = validate_tunable(ds[z], &qt, p, val);
+		if(r == 0 && queue_tunable_str(&qt, p, old[z], sizeof(old[z]))){
+			diag("Couldn't record %s of %s\n", qparams[p].name, ds[z]->name);
+			r = -1;
+		}
+		queue_tunables_free(&qt);
+		if(r){
+			return -1;
+		}
+	}
+	for(z = 0 ; z < n ; ++z){
+		for(y = 0 ; y < z ; ++y){
+			if(ds[y] == ds[z]){
+				break;
+			}
+		}
+		if(y < z || strcmp(old[z], val) == 0){
+			continue; // listed twice, or already set
+		}
+		if(write_tunable(ds[z], p, val)){
+			diag("Couldn't set %s to %s on %s (%s?)\n", qparams[p].name,
+				val, ds[z]->name, strerror(errno));
+			while(z--){
+				if(changed[z] && write_tunable(ds[z], p, old[z])){
+					diag("Couldn't restore %s to %s on %s (%s?)\n", qparams[p].name,
+						old[z], ds[z]->name, strerror(errno));
+				}
+			}
+			return -1;
+		}
+		changed[z] = 1;
+	}
+	for(z = 0 ; z < n ; ++z){
+		if(changed[z]){
+			verbf("Set %s to %s on %s (was %s)\n", qparams[p].name, val,
+				ds[z]->name, old[z]);
+			tuned(ds[z], p == QUEUE_SCHEDULER);
+		}
+	}
+	return 0;
+}
+
+typedef struct queuesetting {
+	queueparam param;
+	const char *val;	// alternatives separated by '|'; first offered wins
+	unsigned ceiling;	// only ever lower the current value
+} queuesetting;
+
+struct queueprofile {
+	const char *name;
+	const char *desc;
+	queuesetting settings[4];	// terminated by a NULL val
+};
+
+static const queueprofile qprofiles[] = {
+	{
+		.name = "nvme",
+		.desc = "NVMe: no scheduler, polled completions where offered",
+		.settings = {
+			{ QUEUE_SCHEDULER, "none", 0, },
+			{ QUEUE_IO_POLL, "1", 0, },
+			{ QUEUE_PARAMS, NULL, 0, },
+		},
+	}, {
+		.name = "ssd",
+		.desc = "SATA/SAS SSD: mq-deadline, low readahead",
+		.settings = {
+			{ QUEUE_SCHEDULER, "mq-deadline|none", 0, },
+			{ QUEUE_READ_AHEAD_KB, "64", 0, },
+			{ QUEUE_PARAMS, NULL, 0, },
+		},
+	}, {
+		.name = "hdd",
+		.desc = "Rotating disk: bfq or mq-deadline, large readahead",
+		.settings = {
+			{ QUEUE_SCHEDULER, "bfq|mq-deadline", 0, },
+			{ QUEUE_READ_AHEAD_KB, "4096", 0, },
+			{ QUEUE_PARAMS, NULL, 0, },
+		},
+	}, {
+		.name = "usb",
+		.desc = "USB: mq-deadline, moderate readahead, requests of at most 512KiB",
+		.settings = {
+			{ QUEUE_SCHEDULER, "mq-deadline|bfq", 0, },
+			{ QUEUE_READ_AHEAD_KB, "512", 0, },
+			// many bridges mishandle large transfers
+			{ QUEUE_MAX_SECTORS_KB, "512", 1, },
+			{ QUEUE_PARAMS, NULL, 0, },
+		},
+	},
+};
+
+const queueprofile *queue_profile(unsigned idx){
+	if(idx >= sizeof(qprofiles) / sizeof(*qprofiles)){
+		return NULL;
+	}
+	return &qprofiles[idx];
+}
+
+const char *queue_profile_name(const queueprofile *qp){
+	return qp->name;
+}
+
+const char *queue_profile_desc(const queueprofile *qp){
+	return qp->desc;
+}
+
+const queueprofile *queue_profile_lookup(const char *name){
+	const queueprofile *qp;
+	unsigned z;
+
+	for(z = 0 ; (qp = queue_profile(z)) ; ++z){
+		if(strcmp(qp->name, name) == 0){
+			return qp;
+		}
+	}
+	return NULL;
+}
+
+const queueprofile *queue_profile_for(const device *d){
+	if(d->layout != LAYOUT_NONE || !d->blkdev.realdev || !d->c ||
+			d->c->bus == BUS_VIRTUAL){
+		return NULL;
+	}
+	switch(d->blkdev.transport){
+		case SERIAL_USB: case SERIAL_USB2: case SERIAL_USB3:
+			return queue_profile_lookup("usb");
+		case DIRECT_NVME:
+			return queue_profile_lookup("nvme");
+		default:
+			break;
+	}
+	if(d->c->transport == TRANSPORT_NVME){
+		return queue_profile_lookup("nvme");
+	}else if(d->c->transport != TRANSPORT_ATA){
+		return queue_profile_lookup("usb");
+	}
+	return queue_profile_lookup(d->blkdev.rotation < 0 ? "ssd" : "hdd");
+}
+
+// The first alternative the device offers. Only schedulers have more than one.
+static int
+resolve_setting(const queuetunables *qt, const queuesetting *s, char *buf, size_t len){
+	const char *alt = s->val, *bar;
+	unsigned z;
+
+	do{
+		size_t alen;
+
+		bar = strchr(alt, '|');
+		alen = bar ? (size_t)(bar - alt) : strlen(alt);
+		if(alen >= len){
+			return -1;
+		}
+		memcpy(buf, alt, alen);
+		buf[alen] = '\0';
+		if(s->param != QUEUE_SCHEDULER){
+			return 0;
+		}
+		for(z = 0 ; z < qt->nschedulers ; ++z){
+			if(strcmp(qt->schedulers[z], buf) == 0){
+				return 0;
+			}
+		}
+		alt = bar + 1;
+	}while(bar);
+	return -1;
+}
+
+int queue_profile_apply(device *d, const queueprofile *qp){
+	const queuesetting *s;
+	char report[BUFSIZ];
+	unsigned schedchanged = 0;
+	queuetunables qt;
+	size_t used = 0;
+	int changed = 0;
+
+	if(queue_tunables(d, &qt)){
+		return -1;
+	}
+	report[0] = '\0';
+	for(s = qp->settings ; s->val ; ++s){
+		char cur[QUEUE_VALUE_MAX], want[QUEUE_VALUE_MAX];
+		const char *pname = qparams[s->param].name;
+		int r;
+
+		if(queue_tunable_str(&qt, s->param, cur, sizeof(cur))){
+			verbf("%s has no %s\n", d->name, pname);
+			continue;
+		}
+		if(resolve_setting(&qt, s, want, sizeof(want))){
+			verbf("%s offers no %s among %s\n", d->name, pname, s->val);
+			continue;
+		}
+		if(strcmp(cur, want) == 0){
+			continue;
+		}
+		if(s->ceiling && strtoul(cur, NULL, 0) <= strtoul(want, NULL, 0)){
+			continue;
+		}
+		if(write_tunable(d, s->param, want)){
+			verbf("%s refused %s %s (%s?)\n", d->name, pname, want, strerror(errno));
+			continue;
+		}
+		r = snprintf(report + used, sizeof(report) - used, "%s%s %s->%s",
+				changed ? ", " : "", pname, cur, want);
+		if(r > 0 && (size_t)r < sizeof(report) - used){
+			used += r;
+		}
+		if(s->param == QUEUE_SCHEDULER){
+			schedchanged = 1;
+		}
+		++changed;
+	}
+	queue_tunables_free(&qt);
+	if(changed){
+		diag("%s: applied %s profile (%s)\n", d->name, qp->name, report);
+		tuned(d, schedchanged);
+	}else{
+		verbf("%s: already matches %s profile\n", d->name, qp->name);
+	}
+	return changed;
+}
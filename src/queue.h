@@ -0,0 +1,89 @@
+// copyright 2012–2021 nick black
+#ifndef GROWLIGHT_QUEUE
+#define GROWLIGHT_QUEUE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+struct device;
+
+// Request queue parameters, from /sys/block/X/queue (and, for queue_depth,
+// the SCSI device). These belong to whole disks, not partitions.
+typedef enum {
+	QUEUE_SCHEDULER,	// queue/scheduler
+	QUEUE_NR_REQUESTS,	// queue/nr_requests
+	QUEUE_READ_AHEAD_KB,	// queue/read_ahead_kb
+	QUEUE_MAX_SECTORS_KB,	// queue/max_sectors_kb
+	QUEUE_RQ_AFFINITY,	// queue/rq_affinity
+	QUEUE_NOMERGES,		// queue/nomerges
+	QUEUE_IO_POLL,		// queue/io_poll
+	QUEUE_WBT_LAT_USEC,	// queue/wbt_lat_usec
+	QUEUE_DEPTH,		// device/queue_depth
+	QUEUE_PARAMS
+} queueparam;
+
+const char *queueparam_str(queueparam);
+const char *queueparam_desc(queueparam);
+// Returns -1 if the name isn't a queue parameter.
+int queueparam_parse(const char *, queueparam *);
+
+typedef struct queuetunables {
+	unsigned valid;			// bit (1u << param) set for each present
+	char *scheduler;		// active scheduler
+	char **schedulers;		// all schedulers the kernel offers
+	unsigned nschedulers;
+	unsigned long nr_requests;
+	unsigned long read_ahead_kb;
+	unsigned long max_sectors_kb;
+	unsigned long max_hw_sectors_kb; // upper bound on max_sectors_kb
+	unsigned long rq_affinity;
+	unsigned long nomerges;
+	unsigned long io_poll;
+	long wbt_lat_usec;
+	unsigned long queue_depth;
+} queuetunables;
+
+// Read the device's current parameters. Returns -1 if it has no request
+// queue; missing parameters are simply left out of valid.
+int queue_tunables(const struct device *, queuetunables *);
+void queue_tunables_free(queuetunables *);
+
+// Write a parameter's value as accepted by sysfs. Returns -1 if it's not
+// valid, or doesn't fit.
+int queue_tunable_str(const queuetunables *, queueparam, char *, size_t);
+
+// Describe the values the kernel accepts for the parameter on this device.
+int queue_tunable_range(const queuetunables *, queueparam, char *, size_t);
+
+// Set the parameter on each of n devices. The value is checked against every
+// device's limits before anything is written, and should any write fail, the
+// devices already changed are restored. Call with the growlight lock held.
+int queue_tune(struct device **, unsigned, queueparam, const char *);
+
+// Named tuning profiles for classes of device: "nvme", "ssd", "hdd", "usb".
+typedef struct queueprofile queueprofile;
+
+// Profiles by index, NULL past the last.
+const queueprofile *queue_profile(unsigned);
+const queueprofile *queue_profile_lookup(const char *);
+const char *queue_profile_name(const queueprofile *);
+const char *queue_profile_desc(const queueprofile *);
+
+// The profile suiting the device's transport and rotation, or NULL if none
+// does (partitions, aggregates, virtual devices).
+const queueprofile *queue_profile_for(const struct device *);
+
+// Apply what the device supports of the profile, skipping settings it
+// doesn't offer or refuses, and report what changed via diag(). Returns the
+// number of parameters changed, or -1 on error. Call with the growlight lock
+// held.
+int queue_profile_apply(struct device *, const queueprofile *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -13,17 +13,30 @@
 
 #include "fs.h"
 #include "mbr.h"
+#include "ssd.h"
 #include "zfs.h"
 #include "swap.h"
+#include "jobs.h"
+#include "wipe.h"
+#include "bench.h"
 #include "stats.h"
+#include "stack.h"
+#include "dmstats.h"
+#include "mdadm.h"
 #include "sysfs.h"
 #include "popen.h"
 #include "ptypes.h"
+#include "queue.h"
+#include "nvme.h"
+#include "drivefeat.h"
 #include "mounts.h"
 #include "target.h"
 #include "secure.h"
 #include "ptable.h"
 #include "health.h"
+#include "healthmon.h"
+#include "provision.h"
+#include "bandwidth.h"
 #include "growlight.h"
 
 #define U64STRLEN 20    // Does not include a '\0' (18,446,744,073,709,551,616)
@@ -189,6 +202,38 @@ lookup_wdevice(const wchar_t *dev){
   return lookup_device(sdev);
 }
 
+// An LBA format index, or "best" (-1)
+static int
+parse_lbaf(const wchar_t *wl, int *lbaf){
+  uintmax_t idx;
+
+  if(wcscmp(wl, L"best") == 0){
+    *lbaf = -1;
+    return 0;
+  }
+  if(wstrtoull(wl, &idx) || idx >= NVME_LBAF_MAX){
+    return -1;
+  }
+  *lbaf = idx;
+  return 0;
+}
+
+static int
+parse_secerase(const wchar_t *wm, secerase *method){
+  secerase m;
+
+  for(m = SECERASE_AUTO ; m <= SECERASE_NVME_CRYPTO_SANITIZE ; ++m){
+    wchar_t ws[16];
+
+    swprintf(ws, sizeof(ws) / sizeof(*ws), L"%s", secerase_str(m));
+    if(wcscmp(wm, ws) == 0){
+      *method = m;
+      return 0;
+    }
+  }
+  return -1;
+}
+
 static int
 make_partition_wtable(device *d, const wchar_t *tbl){
   char stbl[NAME_MAX];
@@ -952,6 +997,254 @@ blockdev_dump(int descend){
   return 0;
 }
 
+static int
+print_health(const healthlog *h){
+  char buf[NCBPREFIXSTRLEN + 1];
+  int tmin, tmax;
+  double wa;
+
+  if(h->interval){
+    printf("\nHealth polled every %us", h->interval);
+  }else{
+    printf("\nHealth polling disabled");
+  }
+  if(h->failures){
+    printf(" (%u consecutive failures)", h->failures);
+  }
+  printf("\n");
+  if(h->polls == 0){
+    return 0;
+  }
+  if(healthmon_temperature_range(h, &tmin, &tmax) == 0){
+    printf("Temperature: %d°C (%d–%d°C over %u samples)\n",
+           h->last.celsius, tmin, tmax, h->nsamples);
+  }
+  if(h->last.percent_used){
+    printf("Endurance used: %u%%\n", h->last.percent_used);
+  }
+  printf("Media errors: %ju\n", (uintmax_t)h->last.media_errors);
+  if(h->last.throttle_secs){
+    printf("Thermally throttled: %jus\n", (uintmax_t)h->last.throttle_secs);
+  }
+  if(h->last.bytes_read){
+    printf("Read: %sB", ncbprefix(h->last.bytes_read, 1, buf, 1));
+    printf(" Written: %sB\n", ncbprefix(h->last.bytes_written, 1, buf, 1));
+  }
+  if((wa = healthmon_write_amp(h)) >= 0){
+    printf("Write amplification: %.2f\n", wa);
+  }
+  return 0;
+}
+
+static int
+print_queue(const device *d){
+  char val[64], range[BUFSIZ];
+  queuetunables qt;
+  unsigned z;
+
+  if(queue_tunables(d, &qt)){
+    return -1;
+  }
+  use_terminfo_color(COLOR_WHITE, 1);
+  printf("%s:\n", d->name);
+  for(z = 0 ; z < QUEUE_PARAMS ; ++z){
+    if(queue_tunable_str(&qt, z, val, sizeof(val))){
+      continue;
+    }
+    if(queue_tunable_range(&qt, z, range, sizeof(range))){
+      range[0] = '\0';
+    }
+    use_terminfo_color(COLOR_GREEN, 1);
+    printf("  %-15s %-12s", queueparam_str(z), val);
+    use_terminfo_color(COLOR_WHITE, 0);
+    printf(" [%s] %s\n", range, queueparam_desc(z));
+  }
+  queue_tunables_free(&qt);
+  return 0;
+}
+
+static void
+print_disk_caps(const diskcaps *dc){
+  printf("NCQ: ");
+  if(dc->ncq){
+    printf("%u", dc->queue_depth);
+  }else{
+    printf("n/a");
+  }
+  printf(" TRIM: %s", !dc->trim ? "n/a" : dc->rzat ? "RZAT" : dc->drat ? "DRAT" : "yes");
+  if(dc->satamax){
+    printf(" SATA: %juGbps", dc->satamax / 1000000000);
+    if(dc->satacur){
+      printf(" (at %.1fGbps)", dc->satacur / 1000000000.0);
+    }
+  }
+  printf(" Zoned: %s\n", zoned_str(dc->zoned));
+  if(dc->optxfer || dc->optxfergran || dc->unmapgran || dc->formfactor){
+    printf("Optimal transfer: %u (granularity %u) Unmap granularity: %u Form factor: %s\n",
+           dc->optxfer, dc->optxfergran, dc->unmapgran, formfactor_str(dc->formfactor));
+  }
+}
+
+static void
+print_ata_features(const device *d){
+  printf("Write cache: %s Read look-ahead: %s",
+         d->blkdev.wcache ? "on" : "off",
+         d->blkdev.lookahead == RWVERIFY_SUPPORTED_ON ? "on" :
+         d->blkdev.lookahead == RWVERIFY_SUPPORTED_OFF ? "off" : "n/a");
+  if(!d->blkdev.apmsup){
+    printf(" APM: n/a");
+  }else if(d->blkdev.apm){
+    printf(" APM: %u", d->blkdev.apm);
+  }else{
+    printf(" APM: off");
+  }
+  if(!d->blkdev.aamsup){
+    printf(" AAM: n/a\n");
+  }else if(d->blkdev.aam){
+    printf(" AAM: %u\n", d->blkdev.aam);
+  }else{
+    printf(" AAM: off\n");
+  }
+}
+
+static void
+print_nvme_features(const nvmefeatures *nf){
+  printf("Write cache: %s APST: %s Power state: %u/%u Workload: %u\n",
+         !nf->vwc_present ? "n/a" : nf->vwc ? "on" : "off",
+         !nf->apst_supported ? "n/a" : nf->apst ? "on" : "off",
+         nf->power_state, nf->npss, nf->workload);
+  printf("Arbitration: burst %u weights %u/%u/%u Coalescing: ",
+         nf->arb_burst, nf->arb_low + 1, nf->arb_medium + 1, nf->arb_high + 1);
+  if(nf->coalesce_time){
+    printf("%u completions/%uus\n", nf->coalesce_threshold + 1, nf->coalesce_time * 100);
+  }else{
+    printf("off\n");
+  }
+}
+
+static void
+print_md_sync(const device *d){
+  long eta;
+
+  if(d->mddev.sync_action == NULL){
+    return;
+  }
+  printf("Sync action: %s", d->mddev.sync_action);
+  if(d->mddev.resync){
+    if(d->mddev.sync_total){
+      printf(" %ju/%ju sectors (%.1f%%)", d->mddev.sync_done, d->mddev.sync_total,
+             d->mddev.sync_done * 100.0 / d->mddev.sync_total);
+    }else{
+      printf(" (delayed)");
+    }
+    if(d->mddev.sync_speed){
+      printf(" at %lu KiB/s", d->mddev.sync_speed);
+    }
+    if((eta = md_sync_eta(d)) >= 0){
+      printf(", %ld:%02ld:%02ld remaining", eta / 3600, eta / 60 % 60, eta % 60);
+    }
+  }
+  printf("\nSync speed limits: %lu KiB/s (%s) – %lu KiB/s (%s)\n",
+         d->mddev.sync_min, d->mddev.sync_min_local ? "local" : "system",
+         d->mddev.sync_max, d->mddev.sync_max_local ? "local" : "system");
+}
+
+static void
+print_md_tunables(const device *d){
+  char val[32];
+  unsigned z;
+
+  for(z = 0 ; z < MDTUNE_COUNT ; ++z){
+    if(md_tunable_value(d, z, val, sizeof(val))){
+      continue;
+    }
+    printf("%-18s %-8s %s", mdtunable_str(z), val, mdtunable_desc(z));
+    if(z == MDTUNE_STRIPE_CACHE){
+      printf(" (%juKiB)", md_stripe_cache_bytes(d, d->mddev.stripe_cache) / 1024);
+    }
+    printf("\n");
+  }
+}
+
+// Each area's throughput and IOPS over the last interval, and the share of
+// its I/O falling into each latency bin.
+static void
+print_dmstats(const device *d){
+  const dmstatmon *m = d->dmdev.stats;
+  char buf[NCBPREFIXSTRLEN + 1];
+  unsigned z, b;
+
+  if(m == NULL){
+    printf("%s is not monitored with dm-stats\n", d->name);
+    return;
+  }
+  printf("%-12s %-10s %9s %9s %7s", "Start", "Sectors", "Read/s", "Write/s", "IOPS");
+  for(b = 0 ; b < m->nbins ; ++b){
+    dmstats_ns_str(m->bounds[b], buf, sizeof(buf));
+    printf(" %6s", buf);
+  }
+  printf("\n");
+  for(z = 0 ; z < m->nareas ; ++z){
+    const dmstatarea *a = &m->areas[z];
+    double secs = m->interval > 0 ? m->interval : 1;
+
+    printf("%-12ju %-10ju", (uintmax_t)a->start, (uintmax_t)a->len);
+    printf(" %8sB", ncbprefix((uintmax_t)(a->rsectors * 512 / secs), 1, buf, 1));
+    printf(" %8sB", ncbprefix((uintmax_t)(a->wsectors * 512 / secs), 1, buf, 1));
+    printf(" %7ju", (uintmax_t)(a->ios / secs));
+    for(b = 0 ; b < m->nbins ; ++b){
+      if(a->ios){
+        printf(" %5.1f%%", a->bins[b] * 100.0 / a->ios);
+      }else{
+        printf(" %6s", "-");
+      }
+    }
+    printf("\n");
+  }
+}
+
+static void
+print_lbafs(const nvmelbafs *lf){
+  static const char *rps[] = { "best", "better", "good", "degraded", };
+  int best = nvme_best_lbaf(lf, sysconf(_SC_PAGESIZE));
+  unsigned z;
+
+  for(z = 0 ; z < lf->count ; ++z){
+    const nvmelbaf *l = &lf->lbaf[z];
+
+    if(l->lbads == 0){
+      continue;
+    }
+    printf("  LBA format %2u: %5uB data %3uB metadata RP %-8s%s%s\n", z, l->lbads,
+           l->ms, rps[l->rp], z == lf->current ? " (in use)" : "",
+           (int)z == best ? " (best)" : "");
+  }
+}
+
+static int
+query_nvme_features(const device *d){
+  nvmefeatures nf;
+
+  if(nvme_device_features(d, &nf)){
+    return -1;
+  }
+  print_nvme_features(&nf);
+  return 0;
+}
+
+static int
+print_queue_profiles(void){
+  const queueprofile *qp;
+  unsigned z;
+
+  for(z = 0 ; (qp = queue_profile(z)) ; ++z){
+    if(printf("%-6s %s\n", queue_profile_name(qp), queue_profile_desc(qp)) < 0){
+      return -1;
+    }
+  }
+  return 0;
+}
+
 static inline int
 blockdev_details(const device *d){
   char buf[BUFSIZ];
@@ -982,6 +1275,23 @@ blockdev_details(const device *d){
     }
     printf("Serial number: %s\n", d->blkdev.serial ? d->blkdev.serial : "n/a");
     printf("Transport: %s\n", transport_str(d->blkdev.transport));
+    if(d->blkdev.ataid){
+      print_ata_features(d);
+    }
+    if(d->c && d->c->transport == TRANSPORT_ATA){
+      print_disk_caps(&d->blkdev.caps);
+    }
+    if(d->blkdev.transport == DIRECT_NVME){
+      nvmelbafs lf;
+
+      query_nvme_features(d);
+      if(nvme_device_lbafs(d, &lf) == 0){
+        print_lbafs(&lf);
+      }
+    }
+    if(d->blkdev.health){
+      print_health(d->blkdev.health);
+    }
     if(d->blkdev.transport == DIRECT_NVME){
       if(snprintf(buf, sizeof(buf), "nvme id-ctrl /dev/%s", d->name) >= (int)sizeof(buf)){
         return -1;
@@ -992,10 +1302,18 @@ blockdev_details(const device *d){
       }
     }
   }else if(d->layout == LAYOUT_MDADM){
+    print_md_sync(d);
+    print_md_tunables(d);
     if(snprintf(buf, sizeof(buf), "mdadm --detail /dev/%s", d->name) >= (int)sizeof(buf)){
       return -1;
     }
   }else if(d->layout == LAYOUT_DM){
+    const dmtarget *dt;
+
+    for(dt = d->dmdev.targets ; dt ; dt = dt->next){
+      printf("Sectors %ju+%ju: %s %s\n", (uintmax_t)dt->start, (uintmax_t)dt->length,
+             dt->type, *dt->devs ? dt->devs : "(no devices)");
+    }
     if(snprintf(buf, sizeof(buf), "dmsetup info /dev/%s", d->name) >= (int)sizeof(buf)){
       return -1;
     }
@@ -1027,10 +1345,19 @@ blockdev(wchar_t * const *args, const char *arghelp){
         return -1;
       }
       return 0;
+    }else if(wcscmp(args[1], L"profile") == 0){
+      return print_queue_profiles();
     }
     usage(args, arghelp);
     return -1;
   }
+  if(wcscmp(args[1], L"nvme") == 0 && wcscmp(args[2], L"latency") == 0){
+    if(args[3]){
+      usage(args, arghelp);
+      return -1;
+    }
+    return nvme_latency_preset() < 0 ? -1 : 0;
+  }
   // Everything else has a required device argument
   if((d = lookup_wdevice(args[2])) == NULL){
     return -1;
@@ -1045,16 +1372,55 @@ blockdev(wchar_t * const *args, const char *arghelp){
     }
     return 0;
   }else if(wcscmp(args[1], L"badblocks") == 0){
-    unsigned rw = 0;
+    unsigned rw = 0, n = 0, z;
 
-    if(args[3]){
-      if(args[4] || wcscmp(args[3], L"rw")){
-        usage(args, arghelp);
+    while(args[n + 2]){
+      ++n;
+    }
+    if(wcscmp(args[n + 1], L"rw") == 0){
+      rw = 1;
+      --n;
+    }
+    const char *names[n];
+    names[0] = d->name;
+    for(z = 1 ; z < n ; ++z){
+      if((d = lookup_wdevice(args[z + 2])) == NULL){
         return -1;
       }
-      rw = 1;
+      names[z] = d->name;
     }
-    return badblock_scan(d, rw);
+    return badblock_scan_multi(names, n, rw);
+  }else if(wcscmp(args[1], L"wipe") == 0){
+    wipemethod method = WIPE_AUTO;
+    unsigned verify = 0, n = 0, z;
+    wipemethod m;
+
+    while(args[n + 2]){
+      ++n;
+    }
+    if(wcscmp(args[n + 1], L"verify") == 0){
+      verify = 1;
+      --n;
+    }
+    for(m = WIPE_AUTO ; m <= WIPE_WRITE ; ++m){
+      wchar_t wm[16];
+
+      swprintf(wm, sizeof(wm) / sizeof(*wm), L"%s", wipemethod_str(m));
+      if(n > 1 && wcscmp(args[n + 1], wm) == 0){
+        method = m;
+        --n;
+        break;
+      }
+    }
+    const char *names[n];
+    names[0] = d->name;
+    for(z = 1 ; z < n ; ++z){
+      if((d = lookup_wdevice(args[z + 2])) == NULL){
+        return -1;
+      }
+      names[z] = d->name;
+    }
+    return wipe_blockdevs(names, n, method, verify);
   }else if(wcscmp(args[1], L"rmtable") == 0){
     if(args[3]){
       usage(args, arghelp);
@@ -1078,13 +1444,304 @@ blockdev(wchar_t * const *args, const char *arghelp){
       usage(args, arghelp);
       return -1;
     }
-    return ata_secure_erase(d);
+    return ata_secure_erase(d->name);
+  }else if(wcscmp(args[1], L"secerase") == 0){
+    secerase method = SECERASE_AUTO;
+    unsigned n = 0, z;
+
+    while(args[n + 2]){
+      ++n;
+    }
+    if(n > 1 && parse_secerase(args[n + 1], &method) == 0){
+      --n;
+    }
+    const char *names[n];
+    names[0] = d->name;
+    for(z = 1 ; z < n ; ++z){
+      if((d = lookup_wdevice(args[z + 2])) == NULL){
+        return -1;
+      }
+      names[z] = d->name;
+    }
+    return secure_erase(names, n, method);
   }else if(wcscmp(args[1], L"detail") == 0){
     if(args[3]){
       usage(args, arghelp);
       return -1;
     }
     return blockdev_details(d);
+  }else if(wcscmp(args[1], L"queue") == 0){
+    char pname[64], val[64];
+    unsigned n = 1, z;
+    queueparam qp;
+
+    while(args[n + 2]){
+      ++n;
+    }
+    // A trailing parameter and value set it on every device listed
+    if(n >= 3 && snprintf(pname, sizeof(pname), "%ls", args[n]) < (int)sizeof(pname)
+        && queueparam_parse(pname, &qp) == 0){
+      if(snprintf(val, sizeof(val), "%ls", args[n + 1]) >= (int)sizeof(val)){
+        fprintf(stderr, "Bad value: %ls\n", args[n + 1]);
+        return -1;
+      }
+      n -= 2;
+    }else{
+      val[0] = '\0';
+    }
+    device *ds[n];
+    ds[0] = d;
+    for(z = 1 ; z < n ; ++z){
+      if((ds[z] = lookup_wdevice(args[z + 2])) == NULL){
+        return -1;
+      }
+    }
+    if(val[0]){
+      return queue_tune(ds, n, qp, val);
+    }
+    for(z = 0 ; z < n ; ++z){
+      if(print_queue(ds[z])){
+        return -1;
+      }
+    }
+    return 0;
+  }else if(wcscmp(args[1], L"ata") == 0){
+    char fname[64], val[64];
+    unsigned n = 1, z;
+    atafeature af;
+
+    while(args[n + 2]){
+      ++n;
+    }
+    // A trailing feature and value set it on every device listed
+    if(n >= 3 && snprintf(fname, sizeof(fname), "%ls", args[n]) < (int)sizeof(fname)
+        && atafeature_parse(fname, &af) == 0){
+      if(snprintf(val, sizeof(val), "%ls", args[n + 1]) >= (int)sizeof(val)){
+        fprintf(stderr, "Bad value: %ls\n", args[n + 1]);
+        return -1;
+      }
+      n -= 2;
+    }else{
+      val[0] = '\0';
+    }
+    device *ds[n];
+    ds[0] = d;
+    for(z = 1 ; z < n ; ++z){
+      if((ds[z] = lookup_wdevice(args[z + 2])) == NULL){
+        return -1;
+      }
+    }
+    if(val[0]){
+      return ata_set_feature(ds, n, af, val);
+    }
+    for(z = 0 ; z < n ; ++z){
+      if(ds[z]->layout != LAYOUT_NONE || !ds[z]->blkdev.ataid){
+        fprintf(stderr, "%s is not an ATA device\n", ds[z]->name);
+        return -1;
+      }
+      printf("%s: ", ds[z]->name);
+      print_ata_features(ds[z]);
+    }
+    return 0;
+  }else if(wcscmp(args[1], L"nvme") == 0){
+    char fname[64], val[64];
+    unsigned n = 1, z;
+    nvmefeature nf;
+
+    while(args[n + 2]){
+      ++n;
+    }
+    // A trailing feature and value set it on every device listed
+    if(n >= 3 && snprintf(fname, sizeof(fname), "%ls", args[n]) < (int)sizeof(fname)
+        && nvmefeature_parse(fname, &nf) == 0){
+      if(snprintf(val, sizeof(val), "%ls", args[n + 1]) >= (int)sizeof(val)){
+        fprintf(stderr, "Bad value: %ls\n", args[n + 1]);
+        return -1;
+      }
+      n -= 2;
+    }else{
+      val[0] = '\0';
+    }
+    device *ds[n];
+    ds[0] = d;
+    for(z = 1 ; z < n ; ++z){
+      if((ds[z] = lookup_wdevice(args[z + 2])) == NULL){
+        return -1;
+      }
+    }
+    if(val[0]){
+      return nvme_set_features(ds, n, nf, val);
+    }
+    for(z = 0 ; z < n ; ++z){
+      nvmefeatures feats;
+
+      if(nvme_device_features(ds[z], &feats)){
+        return -1;
+      }
+      printf("%s: ", ds[z]->name);
+      print_nvme_features(&feats);
+    }
+    return 0;
+  }else if(wcscmp(args[1], L"lbaf") == 0){
+    nvmelbafs lf;
+    int lbaf, id;
+
+    if(args[3] == NULL){
+      if(nvme_device_lbafs(d, &lf)){
+        return -1;
+      }
+      print_lbafs(&lf);
+      return 0;
+    }
+    if(parse_lbaf(args[3], &lbaf) || (args[4] && (args[5] || wcscmp(args[4], L"force")))){
+      usage(args, arghelp);
+      return -1;
+    }
+    if(args[4] == NULL){
+      fprintf(stderr, "Formatting %s destroys all of its data; add \"force\" to proceed\n", d->name);
+      return -1;
+    }
+    // Formats can take minutes, so they're run in the background
+    if((id = job_nvme_reformat(d, lbaf)) < 0){
+      return -1;
+    }
+    printf("Submitted job %d\n", id);
+    return 0;
+  }else if(wcscmp(args[1], L"profile") == 0){
+    const queueprofile *qp = NULL;
+    char pname[64];
+    unsigned n = 1, z;
+
+    while(args[n + 2]){
+      ++n;
+    }
+    // A trailing profile name overrides each device's own class
+    if(n > 1 && snprintf(pname, sizeof(pname), "%ls", args[n + 1]) < (int)sizeof(pname)
+        && (qp = queue_profile_lookup(pname))){
+      --n;
+    }
+    device *ds[n];
+    ds[0] = d;
+    for(z = 1 ; z < n ; ++z){
+      if((ds[z] = lookup_wdevice(args[z + 2])) == NULL){
+        return -1;
+      }
+    }
+    for(z = 0 ; z < n ; ++z){
+      const queueprofile *dqp = qp ? qp : queue_profile_for(ds[z]);
+
+      if(dqp == NULL){
+        fprintf(stderr, "No profile suits %s\n", ds[z]->name);
+        return -1;
+      }
+      if(queue_profile_apply(ds[z], dqp) < 0){
+        return -1;
+      }
+    }
+    return 0;
+  }else if(wcscmp(args[1], L"mdsync") == 0){
+    char val[32];
+
+    if(args[3] && (args[4] == NULL || args[5])){
+      usage(args, arghelp);
+      return -1;
+    }
+    if(d->layout != LAYOUT_MDADM){
+      fprintf(stderr, "%s is not an MD device\n", d->name);
+      return -1;
+    }
+    if(args[3] == NULL){
+      if(md_sync_refresh(d)){
+        return -1;
+      }
+      print_md_sync(d);
+      return 0;
+    }
+    if(snprintf(val, sizeof(val), "%ls", args[4]) >= (int)sizeof(val)){
+      fprintf(stderr, "Bad value: %ls\n", args[4]);
+      return -1;
+    }
+    if(wcscmp(args[3], L"min") == 0){
+      return md_set_sync_speed(d, val, NULL);
+    }else if(wcscmp(args[3], L"max") == 0){
+      return md_set_sync_speed(d, NULL, val);
+    }
+    usage(args, arghelp);
+    return -1;
+  }else if(wcscmp(args[1], L"mdtune") == 0){
+    char pname[32], val[32];
+    mdtunable t;
+
+    if(d->layout != LAYOUT_MDADM){
+      fprintf(stderr, "%s is not an MD device\n", d->name);
+      return -1;
+    }
+    if(args[3] == NULL){
+      print_md_tunables(d);
+      return 0;
+    }
+    if(wcscmp(args[3], L"auto") == 0 && args[4] == NULL){
+      return md_autotune(d);
+    }
+    if(args[4] == NULL || args[5]){
+      usage(args, arghelp);
+      return -1;
+    }
+    if(snprintf(pname, sizeof(pname), "%ls", args[3]) >= (int)sizeof(pname)
+        || mdtunable_parse(pname, &t)){
+      fprintf(stderr, "Unknown md tunable: %ls\n", args[3]);
+      return -1;
+    }
+    if(snprintf(val, sizeof(val), "%ls", args[4]) >= (int)sizeof(val)){
+      fprintf(stderr, "Bad value: %ls\n", args[4]);
+      return -1;
+    }
+    return md_tune(d, t, val);
+  }else if(wcscmp(args[1], L"dmstats") == 0){
+    char bounds[128];
+    uintmax_t areas;
+
+    if(d->layout != LAYOUT_DM){
+      fprintf(stderr, "%s is not a device-mapper device\n", d->name);
+      return -1;
+    }
+    if(args[3] == NULL){
+      print_dmstats(d);
+      return 0;
+    }
+    if(args[4] && args[5]){
+      usage(args, arghelp);
+      return -1;
+    }
+    if(wcscmp(args[3], L"off") == 0 && args[4] == NULL){
+      return dmstats_stop(d);
+    }
+    if(wstrtoull(args[3], &areas) || areas > DMSTATS_MAX_AREAS){
+      fprintf(stderr, "Bad area count: %ls\n", args[3]);
+      return -1;
+    }
+    if(args[4] == NULL){
+      snprintf(bounds, sizeof(bounds), "%s", DMSTATS_DEFAULT_BOUNDS);
+    }else if(snprintf(bounds, sizeof(bounds), "%ls", args[4]) >= (int)sizeof(bounds)){
+      fprintf(stderr, "Bad histogram bounds: %ls\n", args[4]);
+      return -1;
+    }
+    return dmstats_start(d, areas, bounds);
+  }else if(wcscmp(args[1], L"monitor") == 0){
+    uintmax_t secs;
+
+    if(args[3] == NULL || args[4]){
+      usage(args, arghelp);
+      return -1;
+    }
+    if(wstrtoull(args[3], &secs)){
+      return -1;
+    }
+    if(secs > UINT_MAX){
+      fprintf(stderr, "Bad interval: %ls\n", args[3]);
+      return -1;
+    }
+    return healthmon_set_interval(d, secs);
   }else if(wcscmp(args[1], L"mktable") == 0){
     if(args[3] == NULL || args[4]){
       usage(args, arghelp);
@@ -1465,6 +2122,8 @@ fs(wchar_t * const *args, const char *arghelp){
         return -1;
       }
       return 0;
+    }else if(wcscmp(args[1], L"trim") == 0){
+      return fstrim_all(0);
     }
     usage(args, arghelp);
     return -1;
@@ -1473,7 +2132,13 @@ fs(wchar_t * const *args, const char *arghelp){
   if((d = lookup_wdevice(args[2])) == NULL){
     return -1;
   }
-  if(wcscmp(args[1], L"mkfs") == 0){
+  if(wcscmp(args[1], L"trim") == 0){
+    if(args[3]){
+      usage(args, arghelp);
+      return -1;
+    }
+    return fstrim_dev(d->name, 0);
+  }else if(wcscmp(args[1], L"mkfs") == 0){
     if(!args[3] || !args[4] || args[5]){
       usage(args, arghelp);
       return -1;
@@ -1574,32 +2239,337 @@ swap(wchar_t * const *args, const char *arghelp){
   return 0;
 }
 
+// Milliseconds spent on each point of the benchmark sweep
+#define BENCHMARK_MSEC 2000
+
+static int
+print_benchresult(const benchresult *br, void *v){
+  char bbuf[NCBPREFIXSTRLEN + 1], qbuf[NCPREFIXSTRLEN + 1];
+
+  (void)v;
+  ncbprefix(br->bsize, 1, bbuf, 1);
+  ncqprefix(bench_bps(br), 1, qbuf, 1);
+  printf("%-5.5s %-4.4s %*sB %3u %*sB/s %9ju %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+         br->write ? "write" : "read", br->random ? "rand" : "seq",
+         NCBPREFIXFMT(bbuf), br->qdepth, NCPREFIXFMT(qbuf), bench_iops(br),
+         br->lat_mean / 1000.0, br->lat_p50 / 1000.0, br->lat_p90 / 1000.0,
+         br->lat_p99 / 1000.0, br->lat_p999 / 1000.0, br->lat_max / 1000.0);
+  fflush(stdout);
+  return 0;
+}
+
 static int
 benchmark(wchar_t * const *args, const char *arghelp){
+  unsigned writes = 0;
   device *d;
 
-  ONE_ARG_CHECK(args, arghelp);
+  if(args[1] == NULL || (args[2] && (args[3] || wcscmp(args[2], L"rw")))){
+    usage(args, arghelp);
+    return -1;
+  }
+  if(args[2]){
+    writes = 1;
+  }
   if((d = lookup_wdevice(args[1])) == NULL){
     return -1;
   }
-  if(benchmark_blockdev(d)){
+  use_terminfo_color(COLOR_WHITE, 1);
+  printf("Op    Pat     Block  QD  Bandwidth      IOPS  Mean µs   p50 µs   p90 µs   p99 µs p99.9 µs   Max µs\n");
+  use_terminfo_color(COLOR_BLUE, 1);
+  if(benchmark_blockdev(d->name, writes, BENCHMARK_MSEC, print_benchresult, NULL)){
+    return -1;
+  }
+  return 0;
+}
+
+static int
+print_jobs(void){
+  jobinfo jis[64];
+  unsigned n, z;
+
+  n = jobs_snapshot(jis, sizeof(jis) / sizeof(*jis));
+  use_terminfo_color(COLOR_WHITE, 1);
+  printf("%-5.5s %-9.9s %-16.16s %8s %s\n", "ID", "State", "Device", "Progress", "Task");
+  use_terminfo_color(COLOR_BLUE, 1);
+  for(z = 0 ; z < n ; ++z){
+    const jobinfo *ji = &jis[z];
+
+    printf("%-5u %-9.9s %-16.16s ", ji->id, jobstate_str(ji->state), ji->dev);
+    if(ji->total){
+      printf("%7.1f%% ", ji->done * 100.0 / ji->total);
+    }else{
+      printf("%8s ", "-");
+    }
+    printf("%s\n", ji->desc);
+  }
+  fflush(stdout);
+  return 0;
+}
+
+static int
+jobs(wchar_t * const *args, const char *arghelp){
+  device *d;
+  int id;
+
+  if(args[1] == NULL){
+    return print_jobs();
+  }
+  if(wcscmp(args[1], L"clear") == 0){
+    if(args[2]){
+      usage(args, arghelp);
+      return -1;
+    }
+    unsigned cleared = jobs_clear();
+
+    printf("Cleared %u job%s\n", cleared, cleared == 1 ? "" : "s");
+    return 0;
+  }
+  if(wcscmp(args[1], L"trim") == 0 && args[2] == NULL){
+    int n = job_fstrim_all();
+
+    printf("Submitted %d trim job%s\n", n, n == 1 ? "" : "s");
+    return 0;
+  }
+  if(args[2] == NULL){
+    usage(args, arghelp);
+    return -1;
+  }
+  if(wcscmp(args[1], L"cancel") == 0){
+    uintmax_t ull;
+
+    if(args[3] || wstrtoull(args[2], &ull) || ull > UINT_MAX){
+      usage(args, arghelp);
+      return -1;
+    }
+    return job_cancel(ull);
+  }
+  // Everything else has a required device argument
+  if((d = lookup_wdevice(args[2])) == NULL){
+    return -1;
+  }
+  if(wcscmp(args[1], L"wipe") == 0){
+    wipemethod method = WIPE_AUTO, m;
+    unsigned verify = 0, z = 3;
+
+    if(args[z]){
+      for(m = WIPE_AUTO ; m <= WIPE_WRITE ; ++m){
+        wchar_t wm[16];
+
+        swprintf(wm, sizeof(wm) / sizeof(*wm), L"%s", wipemethod_str(m));
+        if(wcscmp(args[z], wm) == 0){
+          method = m;
+          ++z;
+          break;
+        }
+      }
+    }
+    if(args[z] && wcscmp(args[z], L"verify") == 0){
+      verify = 1;
+      ++z;
+    }
+    if(args[z]){
+      usage(args, arghelp);
+      return -1;
+    }
+    id = job_wipe(d, method, verify);
+  }else if(wcscmp(args[1], L"badblocks") == 0){
+    if(args[3] && (args[4] || wcscmp(args[3], L"rw"))){
+      usage(args, arghelp);
+      return -1;
+    }
+    id = job_badblocks(d, !!args[3]);
+  }else if(wcscmp(args[1], L"benchmark") == 0){
+    if(args[3]){
+      usage(args, arghelp);
+      return -1;
+    }
+    id = job_benchmark(d);
+  }else if(wcscmp(args[1], L"ataerase") == 0){
+    if(args[3]){
+      usage(args, arghelp);
+      return -1;
+    }
+    id = job_ataerase(d);
+  }else if(wcscmp(args[1], L"secerase") == 0){
+    secerase method = SECERASE_AUTO;
+
+    if(args[3] && (args[4] || parse_secerase(args[3], &method))){
+      usage(args, arghelp);
+      return -1;
+    }
+    id = job_secure_erase(d, method);
+  }else if(wcscmp(args[1], L"lbaf") == 0){
+    int lbaf;
+
+    if(!args[3] || parse_lbaf(args[3], &lbaf) || (args[4] && (args[5] || wcscmp(args[4], L"force")))){
+      usage(args, arghelp);
+      return -1;
+    }
+    if(args[4] == NULL){
+      fprintf(stderr, "Formatting %s destroys all of its data; add \"force\" to proceed\n", d->name);
+      return -1;
+    }
+    id = job_nvme_reformat(d, lbaf);
+  }else if(wcscmp(args[1], L"trim") == 0){
+    if(args[3]){
+      usage(args, arghelp);
+      return -1;
+    }
+    id = job_fstrim(d);
+  }else if(wcscmp(args[1], L"mkfs") == 0){
+    char sfs[NAME_MAX], label[NAME_MAX];
+
+    if(!args[3] || !args[4] || args[5]){
+      usage(args, arghelp);
+      return -1;
+    }
+    if(snprintf(sfs, sizeof(sfs), "%ls", args[3]) >= (int)sizeof(sfs) ||
+        snprintf(label, sizeof(label), "%ls", args[4]) >= (int)sizeof(label)){
+      fprintf(stderr, "Bad filesystem type or label\n");
+      return -1;
+    }
+    id = job_mkfs(d, sfs, label);
+  }else{
+    usage(args, arghelp);
+    return -1;
+  }
+  if(id < 0){
     return -1;
   }
+  printf("Submitted job %d\n", id);
+  return 0;
+}
+
+static int
+print_oversub(const oversub *o, void *v){
+  char sbuf[NCPREFIXSTRLEN + 1], dbuf[NCPREFIXSTRLEN + 1];
+  const char *bottleneck = strrchr(o->bottleneck, '/');
+
+  (void)v;
+  printf("%s %s is oversubscribed: %u %s demand%s %sbps, %sbps available",
+         o->level == OVERSUB_CONTROLLER ? "Controller" : "PCIe root port",
+         o->name, o->members,
+         o->level == OVERSUB_CONTROLLER ? (o->members == 1 ? "device" : "devices") :
+          "controllers", o->members == 1 ? "s" : "",
+         ncqprefix(o->demand, 1, dbuf, 1), ncqprefix(o->supply, 1, sbuf, 1));
+  if(bottleneck && bottleneck[1]){
+    printf(" (limited by %s)", bottleneck + 1);
+  }
+  printf("\n");
   return 0;
 }
 
 static int
 troubleshoot(wchar_t * const *args, const char *arghelp){
+  int found;
+
   ZERO_ARG_CHECK(args, arghelp);
-  fprintf(stderr, "Sorry, not yet implemented\n");
+  if((found = find_oversubscription(print_oversub, NULL)) < 0){
+    return -1;
+  }
+  if(found == 0){
+    printf("No oversubscribed links\n");
+  }
   // FIXME things to do:
-  // FIXME check PCIe bandwidth against SATA bandwidth
   // FIXME check for proper alignment of partitions
   // FIXME check for msdos, apm or bsd partition tables
   // FIXME check for filesystems without noatime
   // FIXME check for SSD erase block size alignment
   // FIXME check for GPT partition table validity
-  return -1;
+  return 0;
+}
+
+static int
+print_provchange(const provchange *pc, void *v){
+  char buf[NCBPREFIXSTRLEN + 1];
+
+  (void)v;
+  switch(pc->op){
+    case PROVCHANGE_KEEP:
+      use_terminfo_color(COLOR_GREEN, 1);
+      printf("  %s: already laid out\n", pc->dev);
+      break;
+    case PROVCHANGE_CONFLICT:
+      use_terminfo_color(COLOR_RED, 1);
+      printf("! %s: in use (%s)\n", pc->dev, pc->what ? pc->what : "unknown");
+      break;
+    case PROVCHANGE_DEL:
+      use_terminfo_color(COLOR_RED, 1);
+      printf("- %s: %-12s %ju:%ju (%s)\n", pc->dev, pc->what, pc->fsec, pc->lsec,
+             ncbprefix((pc->lsec - pc->fsec + 1) * pc->sectsize, 1, buf, 1));
+      break;
+    case PROVCHANGE_TABLE:
+      use_terminfo_color(COLOR_YELLOW, 1);
+      printf("+ %s: %s table\n", pc->dev, pc->what);
+      break;
+    case PROVCHANGE_ADD:
+      use_terminfo_color(COLOR_YELLOW, 1);
+      printf("+ %s: %-12s %ju:%ju (%s) %04x %s\n", pc->dev, pc->what,
+             pc->fsec, pc->lsec,
+             ncbprefix((pc->lsec - pc->fsec + 1) * pc->sectsize, 1, buf, 1),
+             pc->code, pc->fs ? pc->fs : "-");
+      break;
+    case PROVCHANGE_AGGREGATE:
+      use_terminfo_color(COLOR_YELLOW, 1);
+      printf("+ %s %s from %u disk%s\n", pc->dev, pc->what, pc->members,
+             pc->members == 1 ? "" : "s");
+      break;
+  }
+  return 0;
+}
+
+static int
+provision(wchar_t * const *args, const char *arghelp){
+  char path[PATH_MAX + 1];
+  unsigned force = 0, n = 0, z;
+  int apply, ret = -1;
+  provspec *p;
+
+  if(args[1] == NULL || args[2] == NULL){
+    usage(args, arghelp);
+    return -1;
+  }
+  if(wcscmp(args[1], L"apply") == 0){
+    apply = 1;
+  }else if(wcscmp(args[1], L"diff") == 0){
+    apply = 0;
+  }else{
+    usage(args, arghelp);
+    return -1;
+  }
+  if(snprintf(path, sizeof(path), "%ls", args[2]) >= (int)sizeof(path)){
+    fprintf(stderr, "Bad path: %ls\n", args[2]);
+    return -1;
+  }
+  z = 3;
+  if(args[z] && wcscmp(args[z], L"force") == 0){
+    force = 1;
+    ++z;
+  }
+  while(args[z + n]){
+    ++n;
+  }
+  device *ds[n ? n : 1];
+  for(n = 0 ; args[z + n] ; ++n){
+    if((ds[n] = lookup_wdevice(args[z + n])) == NULL){
+      return -1;
+    }
+  }
+  if((p = provision_load(path)) == NULL){
+    return -1;
+  }
+  // Always show the plan; apply only once it's been shown to be feasible.
+  if((ret = provision_diff(p, ds, n, force, print_provchange, NULL)) > 0 && apply){
+    if((ret = provision_apply(p, ds, n, force)) >= 0){
+      use_terminfo_color(COLOR_WHITE, 1);
+      printf("Submitted %d job%s\n", ret, ret == 1 ? "" : "s");
+    }
+  }else if(ret == 0){
+    use_terminfo_color(COLOR_WHITE, 1);
+    printf("Nothing to do\n");
+  }
+  provision_free(p);
+  return ret < 0 ? -1 : 0;
 }
 
 static device *
@@ -1881,11 +2851,11 @@ target(wchar_t * const *args, const char *arghelp){
 
 static int
 diags(wchar_t * const *args, const char *arghelp){
-  logent logs[MAXIMUM_LOG_ENTRIES];
+  logent *logs;
   unsigned idx;
   int z;
 
-  idx = sizeof(logs) / sizeof(*logs);
+  idx = MAXIMUM_LOG_ENTRIES;
   if(args[1]){
     if(!args[2]){
       uintmax_t ull;
@@ -1904,7 +2874,13 @@ diags(wchar_t * const *args, const char *arghelp){
       return -1;
     }
   }
+  // a full ring is ~270KB, too much for the stacks we might be called on
+  if((logs = malloc(sizeof(*logs) * idx)) == NULL){
+    fprintf(stderr, "Couldn't allocate %u log records\n", idx);
+    return -1;
+  }
   if((z = get_logs(idx, logs)) < 0){
+    free(logs);
     return -1;
   }
   while(z--){
@@ -1916,9 +2892,71 @@ diags(wchar_t * const *args, const char *arghelp){
       tbuf[strlen(tbuf) - 1] = ' '; // kill newline
       printf("%s%s", tbuf, logs[z].msg);
     }
-    free(logs[z].msg);
   }
   fflush(stdout);
+  free(logs);
+  return 0;
+}
+
+// Bytes per second over the last statistics interval
+static double
+stack_rate(const device *d){
+  double secs = d->statq.tv_sec + d->statq.tv_usec / 1000000.0;
+
+  return secs > 0 ? stack_io(d) / secs : 0;
+}
+
+static int
+print_stack_layer(const device *d, unsigned depth, void *v){
+  char buf[NCBPREFIXSTRLEN + 1];
+  (void)v;
+
+  printf("%*s%-*s %-8.8s %sB/s\n", depth * 2, "", 16 - depth * 2, d->name,
+         d->layout == LAYOUT_DM ? (d->dmdev.level ? d->dmdev.level : "dm") :
+         d->layout == LAYOUT_MDADM ? (d->mddev.level ? d->mddev.level : "md") :
+         d->layout == LAYOUT_PARTITION ? "part" : "disk",
+         ncbprefix((uintmax_t)stack_rate(d), 1, buf, 1));
+  return 0;
+}
+
+// The device's stack down to its disks, what's built upon it, and how its
+// disks share the I/O.
+static int
+print_stack_stats(const device *d){
+  char buf[NCBPREFIXSTRLEN + 1];
+  const device *ds[128];
+  unsigned n, z;
+  double total;
+
+  use_terminfo_color(COLOR_WHITE, 1);
+  printf("Stack beneath %s:\n", d->name);
+  use_terminfo_color(COLOR_BLUE, 1);
+  stack_walk(d, print_stack_layer, NULL);
+  if( (n = stack_above(d, ds, sizeof(ds) / sizeof(*ds))) ){
+    use_terminfo_color(COLOR_WHITE, 1);
+    printf("Built upon %s:\n", d->name);
+    use_terminfo_color(COLOR_BLUE, 1);
+    for(z = 0 ; z < n ; ++z){
+      print_stack_layer(ds[z], 1, NULL);
+    }
+  }
+  n = stack_disks(d, ds, sizeof(ds) / sizeof(*ds));
+  total = 0;
+  for(z = 0 ; z < n ; ++z){
+    total += stack_rate(ds[z]);
+  }
+  if(n == 0 || (n == 1 && ds[0] == d)){
+    return 0;
+  }
+  use_terminfo_color(COLOR_WHITE, 1);
+  printf("Disks beneath %s:\n", d->name);
+  use_terminfo_color(COLOR_BLUE, 1);
+  for(z = 0 ; z < n ; ++z){
+    double r = stack_rate(ds[z]);
+
+    printf("  %-14s %sB/s (%.0f%%)\n", ds[z]->name, ncbprefix((uintmax_t)r, 1, buf, 1),
+           total > 0 ? r * 100 / total : 0.0);
+  }
   return 0;
 }
 
@@ -1926,6 +2964,14 @@ static int
 stats(wchar_t * const *args, const char *arghelp){
   const controller *c;
 
+  if(args[1] && !args[2]){
+    const device *d;
+
+    if((d = lookup_wdevice(args[1])) == NULL){
+      return -1;
+    }
+    return print_stack_stats(d);
+  }
   ZERO_ARG_CHECK(args, arghelp);
   use_terminfo_color(COLOR_WHITE, 1);
   printf("Device         Sectors read          SRead Δ  Sectors written       SWritten Δ\n");
@@ -1960,14 +3006,44 @@ static const struct fxn {
       "                 | [ \"detail\" adapter ]\n"
       "                 | [ -v ] no arguments to list all host bus adapters"),
   FXN(blockdev, "[ \"rescan\" blockdev ]\n"
-      "                 | [ \"badblocks\" blockdev [ \"rw\" ] ]\n"
+      "                 | [ \"badblocks\" blockdev [ blockdev... ] [ \"rw\" ] ]\n"
+      "                 | [ \"wipe\" blockdev [ blockdev... ] [ method ] [ \"verify\" ] ]\n"
       "                 | [ \"wipebiosboot\" blockdev ]\n"
       "                 | [ \"wipedosmbr\" blockdev ]\n"
       "                 | [ \"ataerase\" blockdev ]\n"
+      "                 | [ \"secerase\" blockdev [ blockdev... ] [ method ] ]\n"
+      "                    method: auto, ata, ata-enhanced, format, crypto-format,\n"
+      "                            sanitize, crypto-sanitize\n"
       "                 | [ \"rmtable\" blockdev ]\n"
       "                 | [ \"mktable\" [ blockdev tabletype ] ]\n"
       "                    | no arguments to list supported table types\n"
       "                 | [ \"detail\" blockdev ]\n"
+      "                 | [ \"queue\" blockdev [ blockdev... ] [ param value ] ]\n"
+      "                    param: scheduler, nr_requests, read_ahead_kb,\n"
+      "                           max_sectors_kb, rq_affinity, nomerges,\n"
+      "                           io_poll, wbt_lat_usec, queue_depth\n"
+      "                 | [ \"ata\" blockdev [ blockdev... ] [ feature value ] ]\n"
+      "                    feature: wcache, lookahead (on/off), apm (1-254/off),\n"
+      "                             aam (128-254/off), standby (0-255)\n"
+      "                 | [ \"nvme\" blockdev [ blockdev... ] [ feature value ] ]\n"
+      "                    feature: apst, wcache (on/off), power (state),\n"
+      "                             arbitration (burst,low,medium,high),\n"
+      "                             coalesce (threshold,time)\n"
+      "                 | [ \"nvme\" \"latency\" ] favor latency on all NVMe\n"
+      "                 | [ \"lbaf\" blockdev [ index | \"best\" \"force\" ] ]\n"
+      "                    | no index to list LBA formats; formatting\n"
+      "                      destroys all data on the namespace\n"
+      "                 | [ \"profile\" [ blockdev [ blockdev... ] [ profile ] ] ]\n"
+      "                    | no arguments to list tuning profiles\n"
+      "                 | [ \"mdsync\" mdblockdev [ \"min\"|\"max\" KiB/s|\"system\" ] ]\n"
+      "                    | no limit to show resync progress\n"
+      "                 | [ \"mdtune\" mdblockdev [ tunable value | \"auto\" ] ]\n"
+      "                    tunable: stripe_cache_size, group_thread_cnt (or \"auto\"),\n"
+      "                             bitmap_chunk (KiB or \"none\")\n"
+      "                 | [ \"dmstats\" dmblockdev [ areas [ bounds ] | \"off\" ] ]\n"
+      "                    | no areas to show per-area I/O and latency\n"
+      "                 | [ \"monitor\" blockdev seconds ]\n"
+      "                    0 seconds disables health polling\n"
       "                 | [ -v ] no arguments to list all blockdevs"),
   FXN(partition, "[ \"del\" partition ]\n"
       "                 | [ \"add\" blockdev size/range name type ]\n"
@@ -1983,6 +3059,8 @@ static const struct fxn {
   FXN(fs, "[ \"mkfs\" [ partition fstype name ] ]\n"
       "                 | no arguments to list supported fs types\n"
       "                 | [ \"fsck\" ks ]\n"
+      "                 | [ \"trim\" [ fs ] ]\n"
+      "                    | no arguments to trim all SSD-backed filesystems\n"
       "                 | [ \"wipefs\" fs ]\n"
       "                 | [ \"setuuid\" fs uuid ]\n"
       "                 | [ \"setlabel\" fs label ]\n"
@@ -2006,13 +3084,26 @@ static const struct fxn {
   FXN(map, "[ mountdev mountpoint options ]\n"
       "                 | no arguments prints target fstab"),
   FXN(unmap, "mountpoint"),
-  FXN(stats, ""),
+  FXN(stats, "[ blockdev ]"),
   FXN(mounts, ""),
   FXN(uefiboot, "root fs map must be defined in GPT partition"),
   FXN(biosboot, "root fs map must be defined in GPT/MBR partition"),
   FXN(diags, "[ count ]"),
   FXN(grubmap, ""),
-  FXN(benchmark, "blockdev"),
+  FXN(benchmark, "blockdev [ \"rw\" ]"),
+  FXN(jobs, "[ \"cancel\" id ]\n"
+      "                 | [ \"clear\" ] to forget finished jobs\n"
+      "                 | [ \"wipe\" blockdev [ method ] [ \"verify\" ] ]\n"
+      "                 | [ \"badblocks\" blockdev [ \"rw\" ] ]\n"
+      "                 | [ \"benchmark\" blockdev ]\n"
+      "                 | [ \"mkfs\" partition fstype name ]\n"
+      "                 | [ \"ataerase\" blockdev ]\n"
+      "                 | [ \"secerase\" blockdev [ method ] ]\n"
+      "                 | [ \"lbaf\" blockdev index | \"best\" \"force\" ]\n"
+      "                 | [ \"trim\" [ fs ] ] throttled to spare foreground I/O\n"
+      "                 | no arguments to list all jobs"),
+  FXN(provision, "\"diff\"|\"apply\" layoutfile [ \"force\" ] [ blockdev... ]\n"
+      "                    no blockdevs to match all unused disks"),
   FXN(troubleshoot, ""),
   FXN(version, ""),
   FXN(help, "[ command ]"),
@@ -2138,6 +3229,17 @@ block_event(device *d, void *v){
   return v;
 }
 
+// Only completions are reported; progress is available from "jobs"
+static void
+job_event(const jobinfo *ji){
+  if(ji->state == JOB_QUEUED || ji->state == JOB_RUNNING){
+    return;
+  }
+  fprintf(stderr, "Job %u (%s on %s) %s\n", ji->id, ji->desc, ji->dev,
+          jobstate_str(ji->state));
+  raise(SIGWINCH); // get prompt reprinted
+}
+
 static void *new_adapter(controller *c, void *v){ (void)c; return v; }
 static void adapter_free(void *cv){ (void)cv; }
 static void block_free(void *cv, void *bv){ (void)cv; (void)bv; }
@@ -2161,6 +3263,7 @@ int main(int argc, char * const *argv){
     .block_event = block_event,
     .adapter_free = adapter_free,
     .block_free = block_free,
+    .job_event = job_event,
   };
 
   if(setlocale(LC_ALL, "") == NULL){
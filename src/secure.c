@@ -1,25 +1,475 @@
 // copyright 2012–2021 nick black
-#include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
-#include "popen.h"
+#include "sg.h"
+#include "aio.h"
+#include "nvme.h"
+#include "jobs.h"
 #include "secure.h"
 #include "growlight.h"
 
-int ata_secure_erase(device *d){
+// Progress is reported at this interval
+#define SECERASE_PROGRESS_SEC 10
+// Without an estimate from the drive, give an ATA erase this long
+#define SECERASE_ATA_TIMEOUT_MIN (12 * 60)
+
+typedef struct erasejob {
+	// copied from the device, which can be rescanned out from under us
+	char name[NAME_MAX + 1];
+	unsigned ata;			// ATA rather than NVMe transport
+	int fd;
+	secerase method;
+	char ctrl[NAME_MAX + 1];	// NVMe controller, if the erase covers it all
+	struct erasejob *primary;	// another job's erase covers this one
+	nvmeclaim *claim;		// its other namespaces, held while erasing
+	uint64_t start, end;
+	uint64_t estimate;		// expected duration in ns, or 0
+	unsigned timeout_ms;		// for ATA erase
+	pthread_t tid;
+	unsigned launched;
+	_Atomic(unsigned) running;
+	_Atomic(unsigned) permille;	// sanitize progress, from the worker
+	int err;			// valid once !running
+} erasejob;
+
+const char *secerase_str(secerase s){
+	switch(s){
+		case SECERASE_AUTO: return "auto";
+		case SECERASE_ATA: return "ata";
+		case SECERASE_ATA_ENHANCED: return "ata-enhanced";
+		case SECERASE_NVME_FORMAT: return "format";
+		case SECERASE_NVME_CRYPTO_FORMAT: return "crypto-format";
+		case SECERASE_NVME_SANITIZE: return "sanitize";
+		case SECERASE_NVME_CRYPTO_SANITIZE: return "crypto-sanitize";
+	}
+	return "unknown";
+}
+
+static int
+ata_transport_p(const device *d){
+	switch(d->blkdev.transport){
+		case PARALLEL_ATA: case SERIAL_UNKNOWN: case SERIAL_ATA8:
+		case SERIAL_ATAI: case SERIAL_ATAII: case SERIAL_ATAIII:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// Runs on its own thread; no diag() here.
+static void *
+erase_thread(void *vj){
+	const struct timespec ts = { .tv_sec = 1, .tv_nsec = 0, };
+	erasejob *j = vj;
+	unsigned state, permille;
+	int r = 0;
+
+	switch(j->method){
+		case SECERASE_ATA: case SECERASE_ATA_ENHANCED:
+			r = sg_security_erase(j->fd, j->method == SECERASE_ATA_ENHANCED, j->timeout_ms);
+			break;
+		case SECERASE_NVME_FORMAT: case SECERASE_NVME_CRYPTO_FORMAT:
+			r = nvme_format(j->fd, j->method == SECERASE_NVME_CRYPTO_FORMAT ?
+					NVME_SES_CRYPTO : NVME_SES_USER_DATA);
+			break;
+		case SECERASE_NVME_SANITIZE: case SECERASE_NVME_CRYPTO_SANITIZE:
+			if( (r = nvme_sanitize(j->fd, j->method == SECERASE_NVME_CRYPTO_SANITIZE ?
+					NVME_SANACT_CRYPTO : NVME_SANACT_BLOCK)) ){
+				break;
+			}
+			do{
+				nanosleep(&ts, NULL);
+				if( (r = nvme_sanitize_status(j->fd, &permille, &state)) ){
+					break;
+				}
+				atomic_store(&j->permille, permille);
+			}while(state == NVME_SANITIZE_RUNNING);
+			if(r == 0 && state == NVME_SANITIZE_FAILED){
+				errno = EIO;
+				r = -1;
+			}
+			break;
+		case SECERASE_AUTO:
+			errno = EINVAL;
+			r = -1;
+			break;
+	}
+	j->err = r ? errno : 0;
+	j->end = aioq_nsec();
+	atomic_store(&j->running, 0);
+	return NULL;
+}
+
+static int
+resolve_ata(erasejob *j, secerase method){
+	unsigned minutes;
+	atasecurity as;
+
+	if(sg_security_status(j->fd, &as)){
+		diag("Couldn't read ATA security state of %s (%s?)\n", j->name, strerror(errno));
+		return -1;
+	}
+	if(!as.supported){
+		diag("%s doesn't support the ATA security feature set\n", j->name);
+		return -1;
+	}
+	if(as.frozen){
+		diag("%s security is frozen; suspend and resume the machine, or hotplug the disk\n",
+			j->name);
+		return -1;
+	}
+	if(as.locked || as.enabled || as.expired){
+		diag("%s already has a security password set\n", j->name);
+		return -1;
+	}
+	if(method == SECERASE_AUTO){
+		method = as.enhanced ? SECERASE_ATA_ENHANCED : SECERASE_ATA;
+	}else if(method == SECERASE_ATA_ENHANCED && !as.enhanced){
+		diag("%s doesn't support enhanced erase\n", j->name);
+		return -1;
+	}
+	j->method = method;
+	minutes = method == SECERASE_ATA_ENHANCED ? as.enhanced_min : as.erase_min;
+	j->estimate = minutes * 60ull * 1000000000ull;
+	// allow twice the drive's estimate before the kernel gives up
+	if(minutes == 0 || minutes > UINT_MAX / 120000u){
+		minutes = SECERASE_ATA_TIMEOUT_MIN / 2;
+	}
+	j->timeout_ms = minutes * 120000u;
+	return 0;
+}
+
+static int
+resolve_nvme(erasejob *j, secerase method){
+	nvmeerasecaps caps;
+	int ok;
+
+	if(nvme_erase_caps(j->fd, &caps)){
+		diag("Couldn't identify NVMe controller of %s (%s?)\n", j->name, strerror(errno));
+		return -1;
+	}
+	if(method == SECERASE_AUTO){
+		method = caps.sanitize_crypto ? SECERASE_NVME_CRYPTO_SANITIZE :
+			caps.sanitize_block ? SECERASE_NVME_SANITIZE :
+			caps.cryptoformat ? SECERASE_NVME_CRYPTO_FORMAT :
+			SECERASE_NVME_FORMAT;
+	}
+	switch(method){
+		case SECERASE_NVME_FORMAT: ok = caps.format; break;
+		case SECERASE_NVME_CRYPTO_FORMAT: ok = caps.cryptoformat; break;
+		case SECERASE_NVME_SANITIZE: ok = caps.sanitize_block; break;
+		case SECERASE_NVME_CRYPTO_SANITIZE: ok = caps.sanitize_crypto; break;
+		default: ok = 0; break;
+	}
+	if(!ok){
+		diag("%s doesn't support %s\n", j->name, secerase_str(method));
+		return -1;
+	}
+	// Sanitize always acts upon the whole controller; formats do if FNA says so
+	if(method == SECERASE_NVME_SANITIZE || method == SECERASE_NVME_CRYPTO_SANITIZE ||
+			caps.format_all || caps.erase_all){
+		if(nvme_controller_name(j->name, j->ctrl, sizeof(j->ctrl))){
+			diag("Couldn't find the NVMe controller of %s\n", j->name);
+			return -1;
+		}
+		verbf("%s of %s will erase all namespaces on %s\n", secerase_str(method),
+			j->name, j->ctrl);
+	}
+	j->method = method;
+	return 0;
+}
+
+static int
+erase_init(erasejob *j, const char *name, secerase method){
+	const device *d;
+	int ata, nvme;
+
+	memset(j, 0, sizeof(*j));
+	j->fd = -1;
+	lock_growlight();
+	if((d = find_device(name)) == NULL){
+		diag("Couldn't find device %s\n", name);
+		unlock_growlight();
+		return -1;
+	}
 	if(d->layout != LAYOUT_NONE){
-		diag("Can only run ATA Erase on ATA-connected blockdevs\n");
+		diag("Secure erase applies only to whole disks (%s)\n", d->name);
+		unlock_growlight();
+		return -1;
+	}
+	nvme = d->blkdev.transport == DIRECT_NVME;
+	ata = ata_transport_p(d);
+	unlock_growlight();
+	snprintf(j->name, sizeof(j->name), "%s", name);
+	j->ata = ata;
+	if(!nvme && !ata){
+		diag("%s is neither an ATA nor an NVMe disk\n", j->name);
+		return -1;
+	}
+	if(nvme ? method == SECERASE_ATA || method == SECERASE_ATA_ENHANCED :
+			method > SECERASE_ATA_ENHANCED){
+		diag("%s can't be erased via %s\n", j->name, secerase_str(method));
 		return -1;
 	}
-	if(vspopen_drain("hdparm --user-master u --security-set-pass erasepw /dev/%s", d->name)){
-		diag("Couldn't set ATA user password\n");
+	// O_EXCL refuses devices which are mounted or otherwise claimed
+	if((j->fd = openat(devfd, j->name, O_RDWR|O_EXCL|O_CLOEXEC)) < 0){
+		diag("Couldn't open %s exclusively (%s?)\n", j->name, strerror(errno));
 		return -1;
 	}
-	if(vspopen_drain("hdparm --user-master u --security-erase erasepw /dev/%s", d->name)){
-		diag("Couldn't perform ATA Secure Erase\n");
+	if(nvme ? resolve_nvme(j, method) : resolve_ata(j, method)){
+		close(j->fd);
+		j->fd = -1;
 		return -1;
 	}
+	verbf("Erasing %s via %s\n", j->name, secerase_str(j->method));
 	return 0;
 }
+
+// A controller-wide erase is issued once per controller, by the first job
+// on it, while every other namespace there is held exclusively. Namespaces
+// we were asked to erase are already held by their own jobs.
+static int
+erase_claim(erasejob *jobs, unsigned n, unsigned z){
+	erasejob *j = &jobs[z];
+	const char *skip[n];
+	unsigned y;
+
+	if(j->ctrl[0] == '\0'){
+		return 0;
+	}
+	for(y = 0 ; y < z ; ++y){
+		if(strcmp(jobs[y].ctrl, j->ctrl) == 0){
+			j->primary = &jobs[y];
+			verbf("%s will be erased along with %s\n", j->name, jobs[y].name);
+			return 0;
+		}
+	}
+	for(y = 0 ; y < n ; ++y){
+		skip[y] = jobs[y].name;
+	}
+	if((j->claim = malloc(sizeof(*j->claim))) == NULL){
+		diag("Couldn't allocate erase state (%s?)\n", strerror(errno));
+		return -1;
+	}
+	if(nvme_claim_namespaces(j->name, skip, n, j->claim)){
+		free(j->claim);
+		j->claim = NULL;
+		diag("Won't erase %s: all namespaces on %s would be lost\n", j->name, j->ctrl);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+erase_release(erasejob *j){
+	if(j->claim){
+		nvme_release_namespaces(j->claim);
+	}
+}
+
+static void
+erase_free(erasejob *jobs, unsigned n){
+	unsigned z;
+
+	for(z = 0 ; z < n ; ++z){
+		if(jobs[z].fd >= 0){
+			close(jobs[z].fd);
+		}
+		erase_release(&jobs[z]);
+		free(jobs[z].claim);
+	}
+	free(jobs);
+}
+
+// Tenths of a percent complete. Sanitize reports its own; an NVMe format
+// might publish its progress in Identify Namespace; ATA drives provide only
+// an up-front estimate.
+static unsigned
+erase_progress(erasejob *j, uint64_t now){
+	int pct;
+
+	switch(j->method){
+		case SECERASE_NVME_SANITIZE: case SECERASE_NVME_CRYPTO_SANITIZE:
+			return atomic_load(&j->permille);
+		case SECERASE_NVME_FORMAT: case SECERASE_NVME_CRYPTO_FORMAT:
+			if((pct = nvme_format_progress(j->fd)) >= 0){
+				return pct * 10;
+			}
+			return 0;
+		default:
+			if(j->estimate == 0){
+				return 0;
+			}
+			if(now - j->start >= j->estimate){
+				return 999;
+			}
+			return (now - j->start) * 1000 / j->estimate;
+	}
+}
+
+int secure_erase(const char * const *names, unsigned n, secerase method){
+	const struct timespec ts = { .tv_sec = 0, .tv_nsec = 250000000, };
+	uint64_t lastprog;
+	unsigned z, running;
+	erasejob *jobs;
+	int ret = 0;
+
+	if(n == 0){
+		return 0;
+	}
+	if((jobs = calloc(n, sizeof(*jobs))) == NULL){
+		diag("Couldn't allocate erase state (%s?)\n", strerror(errno));
+		return -1;
+	}
+	for(z = 0 ; z < n ; ++z){
+		jobs[z].fd = -1;
+	}
+	for(z = 0 ; z < n ; ++z){
+		if(erase_init(&jobs[z], names[z], method)){
+			erase_free(jobs, n);
+			return -1;
+		}
+	}
+	for(z = 0 ; z < n ; ++z){
+		if(erase_claim(jobs, n, z)){
+			erase_free(jobs, n);
+			return -1;
+		}
+	}
+	lastprog = aioq_nsec();
+	for(z = 0 ; z < n && !job_cancelled() ; ++z){
+		erasejob *j = &jobs[z];
+		int r;
+
+		if(j->primary){
+			continue;
+		}
+		j->start = aioq_nsec();
+		atomic_store(&j->running, 1);
+		if( (r = pthread_create(&j->tid, NULL, erase_thread, j)) ){
+			atomic_store(&j->running, 0);
+			diag("Couldn't launch erase thread for %s (%s?)\n", j->name, strerror(r));
+			ret = -1;
+			break;
+		}
+		j->launched = 1;
+		diag("Started %s of %s\n", secerase_str(j->method), j->name);
+	}
+	do{
+		uintmax_t done = 0;
+		uint64_t now;
+		int report;
+
+		nanosleep(&ts, NULL);
+		now = aioq_nsec();
+		report = now - lastprog >= SECERASE_PROGRESS_SEC * 1000000000ull;
+		running = 0;
+		for(z = 0 ; z < n ; ++z){
+			erasejob *j = jobs[z].primary ? jobs[z].primary : &jobs[z];
+			unsigned pm;
+
+			if(!j->launched){
+				continue;
+			}
+			if(!atomic_load(&j->running)){
+				done += 1000;
+				continue;
+			}
+			pm = erase_progress(j, now);
+			done += pm;
+			if(jobs[z].primary){
+				continue;
+			}
+			++running;
+			if(report){
+				diag("%s: %s %.1f%% complete after %jus\n", j->name,
+					secerase_str(j->method), pm / 10.0,
+					(uintmax_t)((now - j->start) / 1000000000ull));
+			}
+		}
+		if(report){
+			lastprog = now;
+		}
+		job_progress(done, n * 1000ull);
+	}while(running);
+	for(z = 0 ; z < n ; ++z){
+		erasejob *j = &jobs[z];
+
+		if(j->primary){
+			if(!j->primary->launched || j->primary->err){
+				diag("%s wasn't erased (see %s)\n", j->name, j->primary->name);
+				ret = -1;
+			}else{
+				diag("%s was erased along with %s\n", j->name, j->primary->name);
+			}
+		}else if(j->launched){
+			pthread_join(j->tid, NULL);
+			if(j->err){
+				diag("%s of %s failed (%s?)\n", secerase_str(j->method),
+					j->name, strerror(j->err));
+				if(j->ata){
+					diag("%s might be left with user password \"%s\"\n",
+						j->name, SG_ERASE_PASSWORD);
+				}
+				ret = -1;
+			}else{
+				diag("%s of %s completed in %jus\n", secerase_str(j->method), j->name,
+					(uintmax_t)((j->end - j->start) / 1000000000ull));
+			}
+		}else{
+			diag("Didn't start %s of %s\n", secerase_str(j->method), j->name);
+			ret = -1;
+		}
+		close(j->fd);
+		j->fd = -1;
+		erase_release(j);
+	}
+	// Rescan only once every descriptor is closed
+	for(z = 0 ; z < n ; ++z){
+		const erasejob *j = jobs[z].primary ? jobs[z].primary : &jobs[z];
+		device *d;
+		unsigned s;
+
+		if(!j->launched || j->err){
+			continue;
+		}
+		lock_growlight();
+		if((d = find_device(jobs[z].name)) == NULL || rescan_blockdev_blkrrpart(d)){
+			ret = -1;
+		}
+		// the other namespaces on the controller were wiped too
+		for(s = 0 ; jobs[z].claim && s < jobs[z].claim->n ; ++s){
+			device *sib;
+
+			if((sib = find_device(jobs[z].claim->names[s])) && rescan_blockdev_blkrrpart(sib)){
+				ret = -1;
+			}
+		}
+		unlock_growlight();
+	}
+	erase_free(jobs, n);
+	return ret;
+}
+
+int ata_secure_erase(const char *name){
+	const device *d;
+	int ata;
+
+	lock_growlight();
+	ata = (d = find_device(name)) && d->layout == LAYOUT_NONE && ata_transport_p(d);
+	unlock_growlight();
+	if(!ata){
+		diag("Can only run ATA Erase on ATA-connected blockdevs\n");
+		return -1;
+	}
+	return secure_erase(&name, 1, SECERASE_AUTO);
+}
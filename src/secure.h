@@ -6,9 +6,30 @@
 extern "C" {
 #endif
 
-struct device;
+// Erasures carried out by the device itself, covering blocks the host can't
+// reach (spares, overprovisioning, caches).
+typedef enum {
+	SECERASE_AUTO,			// the strongest the device supports
+	SECERASE_ATA,			// ATA SECURITY ERASE UNIT
+	SECERASE_ATA_ENHANCED,		// ...in enhanced mode
+	SECERASE_NVME_FORMAT,		// Format NVM, User Data Erase
+	SECERASE_NVME_CRYPTO_FORMAT,	// Format NVM, Cryptographic Erase
+	SECERASE_NVME_SANITIZE,		// Sanitize, Block Erase
+	SECERASE_NVME_CRYPTO_SANITIZE,	// Sanitize, Crypto Erase
+} secerase;
 
-int ata_secure_erase(struct device *);
+const char *secerase_str(secerase);
+
+// Securely erase n whole disks concurrently. None may be in use. These
+// operations can't be interrupted once begun; a cancelled job will stop only
+// those which haven't yet been started. NVMe erases which act upon the whole
+// controller require every namespace on it to be unused, and are issued only
+// once per controller. Disks are looked up by name, and the growlight lock
+// is released while erasing.
+int secure_erase(const char * const *, unsigned, secerase);
+
+// secure_erase() of a single ATA disk.
+int ata_secure_erase(const char *);
 
 #ifdef __cplusplus
 }
@@ -7,10 +7,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <scsi/sg.h>
 #include <arpa/inet.h>
 #include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <linux/hdreg.h>
 
 #include "sg.h"
@@ -30,13 +32,14 @@
 // Mark Lord (mlord@pobox.com)
 static const int SG_ATA_16 = 0x85; // 16-byte ATA pass-though command
 #define SG_ATA_16_LEN	16
+static const int SG_ATA_PROTO_NON_DATA = 3;
 static const int SG_ATA_PROTO_PIO_IN = 4;
+static const int SG_ATA_PROTO_PIO_OUT = 5;
 #define SG_CHECK_CONDITION	0x02
 #define SG_DRIVER_SENSE		0x08
 #define START_SERIAL            10  // ASCII serial number
 #define LENGTH_SERIAL           20
 #define CMDS_SUPP_0             82  // command/feature set(s) supported
-#define FEATURE_WRITE_CACHE     16  // use with CMDS_SUPP_1
 #define CMDS_SUPP_1             83
 #define CMDS_SUPP_2             84
 #define CMDS_SUPP_3             119
@@ -63,6 +66,11 @@ enum {
 enum {
         ATA_OP_PIDENTIFY                = 0xa1,
         ATA_OP_IDENTIFY                 = 0xec,
+        ATA_OP_SECURITY_SET_PASS        = 0xf1,
+        ATA_OP_SECURITY_ERASE_PREPARE   = 0xf3,
+        ATA_OP_SECURITY_ERASE_UNIT      = 0xf4,
+        ATA_OP_SETIDLE                  = 0xe3,
+        ATA_OP_SET_FEATURES             = 0xef,
 };
 
 struct scsi_sg_io_hdr {
@@ -91,15 +99,216 @@ struct scsi_sg_io_hdr {
 };
 // Material taken from hdparm ends here
 
+#define CMDS_SUPP_VALID(w)	(((w) & 0xc000) == 0x4000) // words 83, 84
+#define CMDS_SUPP_PRESENT(w)	((w) != 0 && (w) != 0xffff) // word 82
+#define SUPP0_WCACHE		0x0020	// words 82 and 85
+#define SUPP0_LOOKAHEAD		0x0040
+#define SUPP1_APM		0x0008	// words 83 and 86
+#define SUPP1_AAM		0x0200
+#define APM_LEVEL		91
+#define AAM_LEVEL		94
+
+#define QUEUE_DEPTH		75	// bits 4:0: maximum queue depth - 1
+#define SATA_CAPS		76	// bits 3:1: Gen1-Gen3 supported
+#define SATA_CAPS_NCQ		0x0100
+#define SATA_CAPS_CUR		77	// bits 3:1: current signaling speed
+#define ADD_SUPPORTED		69
+#define ADD_DRAT		0x4000
+#define ADD_RZAT		0x0020
+#define ADD_ZONED		0x0003	// 1: host-aware, 2: drive-managed
+#define DSM			169
+#define DSM_TRIM		0x0001
+
+// Adds to whatever the VPD pages told us.
+void ata_decode_caps(const uint16_t *buf, diskcaps *dc){
+	static const uintmax_t gens[] = { 0, 1500000000, 3000000000, 6000000000, };
+	unsigned z;
+
+	if(CMDS_SUPP_PRESENT(buf[SATA_CAPS])){
+		if(buf[SATA_CAPS] & SATA_CAPS_NCQ){
+			dc->ncq = 1;
+			dc->queue_depth = (buf[QUEUE_DEPTH] & 0x1f) + 1;
+		}
+		for(z = 1 ; z < sizeof(gens) / sizeof(*gens) ; ++z){
+			if(buf[SATA_CAPS] & (1u << z)){
+				dc->satamax = gens[z];
+			}
+		}
+		if(CMDS_SUPP_PRESENT(buf[SATA_CAPS_CUR])){
+			z = (buf[SATA_CAPS_CUR] >> 1u) & 0x7;
+			if(z < sizeof(gens) / sizeof(*gens)){
+				dc->satacur = gens[z];
+			}
+		}
+	}
+	if(CMDS_SUPP_PRESENT(buf[DSM]) && (buf[DSM] & DSM_TRIM)){
+		dc->trim = 1;
+		dc->drat = !!(buf[ADD_SUPPORTED] & ADD_DRAT);
+		dc->rzat = dc->drat && (buf[ADD_SUPPORTED] & ADD_RZAT);
+	}
+	if(CMDS_SUPP_PRESENT(buf[ADD_SUPPORTED]) && dc->zoned == ZONED_NONE){
+		switch(buf[ADD_SUPPORTED] & ADD_ZONED){
+			case 1: dc->zoned = ZONED_HOSTAWARE; break;
+			case 2: dc->zoned = ZONED_DRIVE; break;
+		}
+	}
+}
+
+#define SG_INQUIRY		0x12
+#define SG_INQUIRY_EVPD		0x01
+#define VPD_BLOCK_LIMITS	0xb0
+#define VPD_BLOCK_CHARS		0xb1
+#define VPD_TIMEOUT_MS		5000
+
+// Fetch a page of Vital Product Data. libata translates the Block Limits and
+// Block Device Characteristics pages for ATA disks. Returns -1 with errno set
+// if the device doesn't supply the page.
+static int
+sg_inquiry_vpd(int fd, unsigned char page, unsigned char *buf, unsigned len){
+	unsigned char cdb[6], sb[32];
+	struct scsi_sg_io_hdr io;
+
+	memset(buf, 0, len);
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = SG_INQUIRY;
+	cdb[1] = SG_INQUIRY_EVPD;
+	cdb[2] = page;
+	cdb[3] = len >> 8u;
+	cdb[4] = len & 0xffu;
+	memset(&io, 0, sizeof(io));
+	io.interface_id = 'S';
+	io.mx_sb_len = sizeof(sb);
+	io.dxfer_direction = SG_DXFER_FROM_DEV;
+	io.dxfer_len = len;
+	io.dxferp = buf;
+	io.cmdp = cdb;
+	io.sbp = sb;
+	io.cmd_len = sizeof(cdb);
+	io.timeout = VPD_TIMEOUT_MS;
+	if(ioctl(fd, SG_IO, &io)){
+		return -1;
+	}
+	if(io.status || io.host_status || (io.driver_status & ~SG_DRIVER_SENSE)
+			|| buf[1] != page){
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+static uint32_t
+vpd_be32(const unsigned char *b){
+	return ((uint32_t)b[0] << 24u) | ((uint32_t)b[1] << 16u) | ((uint32_t)b[2] << 8u) | b[3];
+}
+
+// Lengths in the page are in logical blocks.
+int vpd_decode_block_limits(const unsigned char *buf, unsigned logsec, diskcaps *dc){
+	if(((buf[2] << 8u) | buf[3]) < 0x3c){
+		return -1;
+	}
+	dc->optxfergran = ((buf[6] << 8u) | buf[7]) * logsec;
+	dc->optxfer = vpd_be32(buf + 12) * (uint64_t)logsec > UINT32_MAX ?
+			0 : vpd_be32(buf + 12) * logsec;
+	dc->trim = vpd_be32(buf + 20) != 0; // MAXIMUM UNMAP LBA COUNT
+	dc->unmapgran = dc->trim ? vpd_be32(buf + 28) * logsec : 0;
+	return 0;
+}
+
+int vpd_decode_block_chars(const unsigned char *buf, diskcaps *dc){
+	unsigned rate = (buf[4] << 8u) | buf[5];
+
+	dc->formfactor = buf[7] & 0xfu;
+	switch((buf[8] >> 4u) & 0x3u){
+		case 1: dc->zoned = ZONED_HOSTAWARE; break;
+		case 2: dc->zoned = ZONED_DRIVE; break;
+	}
+	if(rate == 1){
+		return SSD_ROTATION;
+	}
+	return rate >= 0x401 && rate < 0xffff ? (int)rate : 0;
+}
+
+// Decode the Block Limits and Block Device Characteristics VPD pages, and
+// the kernel's view of zoning.
+static void
+sg_block_caps(device *d, int fd){
+	diskcaps *dc = &d->blkdev.caps;
+	unsigned char buf[64];
+	char path[NAME_MAX + 16];
+	int logsec, rate;
+	char *zoned;
+
+	if(ioctl(fd, BLKSSZGET, &logsec) || logsec <= 0){
+		logsec = 512;
+	}
+	if(sg_inquiry_vpd(fd, VPD_BLOCK_LIMITS, buf, sizeof(buf)) == 0 &&
+			vpd_decode_block_limits(buf, logsec, dc) == 0){
+		verbf("\t%s optimal transfer: %u granularity: %u unmap: %u\n", d->name,
+				dc->optxfer, dc->optxfergran, dc->unmapgran);
+	}
+	if(sg_inquiry_vpd(fd, VPD_BLOCK_CHARS, buf, sizeof(buf)) == 0 &&
+			(rate = vpd_decode_block_chars(buf, dc))){
+		d->blkdev.rotation = rate;
+	}
+	// host-managed disks identify only through the kernel
+	snprintf(path, sizeof(path), "%s/queue/zoned", d->name);
+	if( (zoned = get_sysfs_string(sysfd, path)) ){
+		if(strcmp(zoned, "host-managed") == 0){
+			dc->zoned = ZONED_HOSTMANAGED;
+		}else if(strcmp(zoned, "host-aware") == 0){
+			dc->zoned = ZONED_HOSTAWARE;
+		}
+		free(zoned);
+	}
+}
+
+// Decode the SET FEATURES-controlled state from IDENTIFY DEVICE data.
+static void
+ata_decode_features(const uint16_t *buf, atafeatures *af){
+	memset(af, 0, sizeof(*af));
+	if(CMDS_SUPP_PRESENT(buf[CMDS_SUPP_0])){
+		af->wcache_supported = !!(buf[CMDS_SUPP_0] & SUPP0_WCACHE);
+		af->wcache = !!(buf[CMDS_EN_0] & SUPP0_WCACHE);
+		af->lookahead_supported = !!(buf[CMDS_SUPP_0] & SUPP0_LOOKAHEAD);
+		af->lookahead = !!(buf[CMDS_EN_0] & SUPP0_LOOKAHEAD);
+	}
+	if(CMDS_SUPP_VALID(buf[CMDS_SUPP_1])){
+		af->apm_supported = !!(buf[CMDS_SUPP_1] & SUPP1_APM);
+		if(buf[CMDS_EN_1] & SUPP1_APM){
+			af->apm = buf[APM_LEVEL] & 0xff;
+		}
+		af->aam_supported = !!(buf[CMDS_SUPP_1] & SUPP1_AAM);
+		if(buf[CMDS_EN_1] & SUPP1_AAM){
+			af->aam = buf[AAM_LEVEL] & 0xff;
+		}
+		af->aam_recommended = buf[AAM_LEVEL] >> 8u;
+	}
+}
+
+// Record the decoded features in the device.
+static void
+ata_store_features(device *d, const atafeatures *af){
+	d->blkdev.wcache = af->wcache;
+	d->blkdev.lookahead = !af->lookahead_supported ? RWVERIFY_UNSUPPORTED :
+		af->lookahead ? RWVERIFY_SUPPORTED_ON : RWVERIFY_SUPPORTED_OFF;
+	d->blkdev.apmsup = af->apm_supported;
+	d->blkdev.apm = af->apm;
+	d->blkdev.aamsup = af->aam_supported;
+	d->blkdev.aam = af->aam;
+}
+
 int sg_interrogate(device *d, int fd){
 #define IDSECTORS 1
 	unsigned char cdb[SG_ATA_16_LEN];
 	uint16_t buf[512 / 2], maj, min; // FIXME
 	struct scsi_sg_io_hdr io;
+	atafeatures af;
 	char sb[32];
 	unsigned n;
 
 	assert(d->layout == LAYOUT_NONE);
+	memset(&d->blkdev.caps, 0, sizeof(d->blkdev.caps));
+	sg_block_caps(d, fd);
 	memset(buf, 0, sizeof(buf));
 	memset(cdb, 0, sizeof(cdb));
 	cdb[0] = SG_ATA_16;
@@ -170,10 +379,19 @@ int sg_interrogate(device *d, int fd){
 	}else if(d->blkdev.rotation <= 0x401){
 		d->blkdev.rotation = 0; // unknown rate
 	}
-	if(ntohs(buf[CMDS_SUPP_0]) & FEATURE_WRITE_CACHE){
-		d->blkdev.wcache = !!(ntohs(buf[CMDS_EN_0]) & FEATURE_WRITE_CACHE);
-		verbf("\t%s write-cache: %s\n", d->name, d->blkdev.wcache ? "Enabled" : "Disabled/not present");
-	}
+	ata_decode_features(buf, &af);
+	ata_store_features(d, &af);
+	ata_decode_caps(buf, &d->blkdev.caps);
+	d->blkdev.ataid = 1;
+	verbf("\t%s NCQ: %u TRIM: %s SATA: %ju/%juMbps zoned: %s\n", d->name,
+			d->blkdev.caps.queue_depth,
+			!d->blkdev.caps.trim ? "no" : d->blkdev.caps.rzat ? "RZAT" :
+			d->blkdev.caps.drat ? "DRAT" : "yes",
+			d->blkdev.caps.satacur / 1000000, d->blkdev.caps.satamax / 1000000,
+			zoned_str(d->blkdev.caps.zoned));
+	verbf("\t%s write-cache: %s read look-ahead: %s\n", d->name,
+			d->blkdev.wcache ? "Enabled" : "Disabled/not present",
+			af.lookahead ? "Enabled" : "Disabled/not present");
 	if(ntohs(buf[CMDS_SUPP_2]) & WWN_SUP){
 		free(d->blkdev.wwn);
 		if((d->blkdev.wwn = malloc(17)) == NULL){
@@ -204,6 +422,151 @@ int sg_interrogate(device *d, int fd){
 	return 0;
 }
 
+#define ERASE_TIME_NORMAL	89  // security erase time, 2-minute units
+#define ERASE_TIME_ENHANCED	90
+#define SECURITY_STATUS		128
+
+// Issue an ATA command via 16-byte pass-through. buf, if non-NULL, is a single
+// 512-byte sector moved in the direction implied by proto. Returns -1 with
+// errno set on failure, without calling diag() (we run in worker threads).
+static int
+sg_ata_regs(int fd, unsigned char cmd, unsigned char feature, unsigned char count,
+		int proto, void *buf, unsigned timeout_ms){
+	unsigned char cdb[SG_ATA_16_LEN], sb[32];
+	struct scsi_sg_io_hdr io;
+
+	memset(cdb, 0, sizeof(cdb));
+	memset(sb, 0, sizeof(sb));
+	cdb[0] = SG_ATA_16;
+	cdb[1] = proto << 1u;
+	if(proto != SG_ATA_PROTO_NON_DATA){
+		cdb[2] = SG_CDB2_TLEN_NSECT | SG_CDB2_TLEN_SECTORS;
+		if(proto == SG_ATA_PROTO_PIO_IN){
+			cdb[2] |= SG_CDB2_TDIR_FROM_DEV;
+		}
+	}
+	cdb[4] = feature;
+	cdb[6] = count;
+	cdb[14] = cmd;
+	memset(&io, 0, sizeof(io));
+	io.interface_id = 'S';
+	io.mx_sb_len = sizeof(sb);
+	io.dxfer_direction = proto == SG_ATA_PROTO_PIO_IN ? SG_DXFER_FROM_DEV :
+				proto == SG_ATA_PROTO_PIO_OUT ? SG_DXFER_TO_DEV : SG_DXFER_NONE;
+	io.dxfer_len = buf ? 512 : 0;
+	io.dxferp = buf;
+	io.cmdp = cdb;
+	io.sbp = sb;
+	io.cmd_len = sizeof(cdb);
+	io.timeout = timeout_ms;
+	if(ioctl(fd, SG_IO, &io)){
+		return -1;
+	}
+	if(io.host_status || (io.driver_status && io.driver_status != SG_DRIVER_SENSE)){
+		errno = EIO;
+		return -1;
+	}
+	if(io.status == 0){
+		return 0;
+	}
+	// a check condition is only benign if it carries an ATA Status Return
+	// descriptor without the ERR bit
+	if(io.status == SG_CHECK_CONDITION && (sb[0] & 0x7f) == 0x72 &&
+			sb[8] == 0x09 && !(sb[8 + 13] & 0x01)){
+		return 0;
+	}
+	errno = EIO;
+	return -1;
+}
+
+static int
+sg_ata_cmd(int fd, unsigned char cmd, int proto, void *buf, unsigned timeout_ms){
+	return sg_ata_regs(fd, cmd, 0, proto == SG_ATA_PROTO_NON_DATA ? 0 : 1,
+				proto, buf, timeout_ms);
+}
+
+// Erase times are in units of two minutes. Word 89/90 bit 15 selects the
+// 15-bit format; the maximum value means "longer than we can say".
+static unsigned
+ata_erase_minutes(uint16_t w){
+	unsigned t = (w & 0x8000) ? (w & 0x7fff) : (w & 0xff);
+
+	return t * 2;
+}
+
+int sg_security_status(int fd, atasecurity *as){
+	uint16_t buf[512 / 2];
+
+	memset(as, 0, sizeof(*as));
+	if(sg_ata_cmd(fd, ATA_OP_IDENTIFY, SG_ATA_PROTO_PIO_IN, buf, 0)){
+		return -1;
+	}
+	as->supported = !!(buf[SECURITY_STATUS] & 0x1);
+	as->enabled = !!(buf[SECURITY_STATUS] & 0x2);
+	as->locked = !!(buf[SECURITY_STATUS] & 0x4);
+	as->frozen = !!(buf[SECURITY_STATUS] & 0x8);
+	as->expired = !!(buf[SECURITY_STATUS] & 0x10);
+	as->enhanced = !!(buf[SECURITY_STATUS] & 0x20);
+	as->erase_min = ata_erase_minutes(buf[ERASE_TIME_NORMAL]);
+	as->enhanced_min = ata_erase_minutes(buf[ERASE_TIME_ENHANCED]);
+	return 0;
+}
+
+// Words 1..16 of the SECURITY command sector hold the password.
+static void
+ata_security_sector(uint16_t *buf, uint16_t control){
+	static const char pw[] = SG_ERASE_PASSWORD;
+
+	memset(buf, 0, 512);
+	buf[0] = control;
+	memcpy(buf + 1, pw, strlen(pw));
+}
+
+int sg_security_erase(int fd, unsigned enhanced, unsigned timeout_ms){
+	uint16_t buf[512 / 2];
+
+	// control word bit 0 clear: user password; bit 8 clear: high security
+	ata_security_sector(buf, 0);
+	if(sg_ata_cmd(fd, ATA_OP_SECURITY_SET_PASS, SG_ATA_PROTO_PIO_OUT, buf, 0)){
+		return -1;
+	}
+	if(sg_ata_cmd(fd, ATA_OP_SECURITY_ERASE_PREPARE, SG_ATA_PROTO_NON_DATA, NULL, 0)){
+		return -1;
+	}
+	// control word bit 1: enhanced erase
+	ata_security_sector(buf, enhanced ? 0x2 : 0);
+	return sg_ata_cmd(fd, ATA_OP_SECURITY_ERASE_UNIT, SG_ATA_PROTO_PIO_OUT, buf, timeout_ms);
+}
+
+int sg_ata_features(int fd, atafeatures *af){
+	uint16_t buf[512 / 2];
+
+	if(sg_ata_cmd(fd, ATA_OP_IDENTIFY, SG_ATA_PROTO_PIO_IN, buf, 0)){
+		return -1;
+	}
+	ata_decode_features(buf, af);
+	return 0;
+}
+
+int sg_refresh_features(device *d, int fd){
+	atafeatures af;
+
+	if(sg_ata_features(fd, &af)){
+		return -1;
+	}
+	ata_store_features(d, &af);
+	return 0;
+}
+
+int sg_set_features(int fd, unsigned char subcmd, unsigned char count){
+	return sg_ata_regs(fd, ATA_OP_SET_FEATURES, subcmd, count,
+				SG_ATA_PROTO_NON_DATA, NULL, 0);
+}
+
+int sg_set_standby(int fd, unsigned char timer){
+	return sg_ata_regs(fd, ATA_OP_SETIDLE, 0, timer, SG_ATA_PROTO_NON_DATA, NULL, 0);
+}
+
 // Serial numbers with weird whitespace are surprisingly common. Clean 'em up.
 void *cleanup_serial(const void *vserial, size_t snmax) {
 	char *clean;
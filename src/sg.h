@@ -7,12 +7,80 @@ extern "C" {
 #endif
 
 #include <stddef.h>
+#include <stdint.h>
 
 struct device;
 
 // Takes an open file descriptor on the device node
 int sg_interrogate(struct device *, int);
 
+// ATA security feature set state, from IDENTIFY DEVICE
+typedef struct atasecurity {
+	unsigned supported: 1;
+	unsigned enabled: 1;		// a user password is set
+	unsigned locked: 1;
+	unsigned frozen: 1;		// commands refused until power cycle
+	unsigned expired: 1;		// unlock attempts exhausted
+	unsigned enhanced: 1;		// enhanced erase supported
+	unsigned erase_min;		// drive's estimate, or 0 if unknown
+	unsigned enhanced_min;
+} atasecurity;
+
+// Password set immediately before the erase, which clears it again
+#define SG_ERASE_PASSWORD "erasepw"
+
+// These take an open file descriptor on the device node, never call diag(),
+// and return -1 with errno set on failure.
+int sg_security_status(int, atasecurity *);
+
+// Set the user password, then SECURITY ERASE PREPARE and SECURITY ERASE UNIT.
+// Blocks until the erase completes or the timeout (in ms) expires.
+int sg_security_erase(int, unsigned enhanced, unsigned timeout_ms);
+
+// Features controlled by SET FEATURES, from IDENTIFY DEVICE
+typedef struct atafeatures {
+	unsigned wcache_supported: 1;
+	unsigned wcache: 1;		// volatile write cache enabled
+	unsigned lookahead_supported: 1;
+	unsigned lookahead: 1;		// read look-ahead enabled
+	unsigned apm_supported: 1;
+	unsigned aam_supported: 1;
+	unsigned apm;			// APM level 1..254, 0 if disabled
+	unsigned aam;			// AAM level 128..254, 0 if disabled
+	unsigned aam_recommended;	// vendor's recommended AAM level
+} atafeatures;
+
+// SET FEATURES subcommands
+#define ATA_SF_WCACHE_ON	0x02
+#define ATA_SF_WCACHE_OFF	0x82
+#define ATA_SF_APM_ON		0x05	// count is the level
+#define ATA_SF_APM_OFF		0x85
+#define ATA_SF_AAM_ON		0x42	// count is the level
+#define ATA_SF_AAM_OFF		0xc2
+#define ATA_SF_LOOKAHEAD_ON	0xaa
+#define ATA_SF_LOOKAHEAD_OFF	0x55
+
+int sg_ata_features(int, atafeatures *);
+int sg_set_features(int, unsigned char subcmd, unsigned char count);
+// IDLE with a count sets the standby timer (0 disables it)
+int sg_set_standby(int, unsigned char);
+
+// Re-read IDENTIFY DEVICE, updating the device's cached feature state.
+int sg_refresh_features(struct device *, int);
+
+// Decode queueing, TRIM, link and zoning capabilities from the 256 words of
+// IDENTIFY DEVICE data.
+struct diskcaps;
+void ata_decode_caps(const uint16_t *, struct diskcaps *);
+
+// Decode the 64-byte Block Limits VPD page (B0h) of a device with the given
+// logical sector size. Returns -1 if the page is too short to be used.
+int vpd_decode_block_limits(const unsigned char *, unsigned, struct diskcaps *);
+
+// Decode the Block Device Characteristics VPD page (B1h). Returns the
+// rotation rate in RPM, SSD_ROTATION for solid state, or 0 if not reported.
+int vpd_decode_block_chars(const unsigned char *, struct diskcaps *);
+
 // Take the incoming serial number and trim leading, repeated, or trailing
 // whitespace. The serial number may or may not be NUL-terminated (don't blame
 // me; it's how the ioctls work). A NUL-terminator must be respected, but if
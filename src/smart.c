@@ -67,3 +67,79 @@ int probe_smart(device *d){
 	sk_disk_free(sk);
 	return 0;
 }
+
+// SMART attribute raw values are 48-bit little-endian
+static uint64_t
+smart_raw(const SkSmartAttributeParsedData *a){
+	uint64_t r = 0;
+	int i;
+
+	for(i = 5 ; i >= 0 ; --i){
+		r = (r << 8) | a->raw[i];
+	}
+	return r;
+}
+
+static void
+smart_attribute(SkDisk *sk, const SkSmartAttributeParsedData *a, void *vh){
+	atahealth *h = vh;
+
+	(void)sk;
+	switch(a->id){
+		case 187: h->uncorrectable = smart_raw(a); break;
+		case 241: h->lbas_written = smart_raw(a); break;
+		case 242: h->lbas_read = smart_raw(a); break;
+		case 247: h->host_pages = smart_raw(a); break;
+		case 248: h->ftl_pages = smart_raw(a); break;
+	}
+}
+
+int smart_health(const char *name, atahealth *h){
+	char path[PATH_MAX];
+	SkBool avail, awake, good;
+	SkSmartOverall overall;
+	uint64_t kelvin;
+	int ret = -1, err;
+	SkDisk *sk;
+
+	memset(h, 0, sizeof(*h));
+	h->celsius = -1;
+	if(snprintf(path, sizeof(path), "/dev/%s", name) >= (int)sizeof(path)){
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if(sk_disk_open(path, &sk)){
+		return -1;
+	}
+	if(sk_disk_smart_is_available(sk, &avail)){
+		goto done;
+	}
+	if(!avail){
+		errno = ENOTSUP;
+		goto done;
+	}
+	// Reading SMART data would spin up a sleeping disk.
+	if(sk_disk_check_sleep_mode(sk, &awake) == 0 && !awake){
+		ret = 1;
+		goto done;
+	}
+	if(sk_disk_smart_read_data(sk) || sk_disk_smart_status(sk, &good)){
+		goto done;
+	}
+	if(sk_disk_smart_get_overall(sk, &overall)){
+		h->overall = good ? SK_SMART_OVERALL_GOOD : SK_SMART_OVERALL_BAD_STATUS;
+	}else{
+		h->overall = overall;
+	}
+	if(sk_disk_smart_get_temperature(sk, &kelvin) == 0){
+		h->celsius = (int)((kelvin - 273150) / 1000);
+	}
+	sk_disk_smart_parse_attributes(sk, smart_attribute, h);
+	ret = 0;
+
+done:
+	err = errno;
+	sk_disk_free(sk);
+	errno = err;
+	return ret;
+}
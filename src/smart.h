@@ -6,10 +6,29 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+
 struct device;
 
 int probe_smart(struct device *d);
 
+// SMART health and wear, as read by smart_health(). Attribute-derived values
+// are 0 if the disk doesn't report them.
+typedef struct atahealth {
+	int overall;		// SkSmartOverall value
+	int celsius;		// -1 if unknown
+	uint64_t lbas_read;	// attribute 242 (Total LBAs Read)
+	uint64_t lbas_written;	// attribute 241 (Total LBAs Written)
+	uint64_t uncorrectable;	// attribute 187 (Reported Uncorrectable)
+	uint64_t host_pages;	// attribute 247 (Host Program Page Count)
+	uint64_t ftl_pages;	// attribute 248 (FTL Program Page Count)
+} atahealth;
+
+// Poll the named disk's SMART data. Safe to call from any thread; nothing is
+// diag()ed. Returns -1 with errno set on failure, and 1 (having read
+// nothing) if the disk is in standby, so as not to spin it up.
+int smart_health(const char *, atahealth *);
+
 #ifdef __cplusplus
 }
 #endif
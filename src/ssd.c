@@ -1,27 +1,323 @@
 // copyright 2012–2021 nick black
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/statvfs.h>
+
 #include "ssd.h"
-#include "popen.h"
+#include "aio.h"
+#include "jobs.h"
+#include "stack.h"
 #include "growlight.h"
 
-int fstrim(const char *mnt){
-	return vspopen_drain("fstrim -v %s",mnt);
+typedef struct trimtarget {
+	char *mnt;
+	char *dev;			// name of the mounted device
+	// whole disk, or NULL if unknown. It's only ever compared, never
+	// dereferenced, since it can be rescanned away while we trim.
+	const device *root;
+	_Atomic(uintmax_t) size;	// filesystem address space, once known
+	_Atomic(uintmax_t) off;		// progress through it
+	uintmax_t trimmed;		// bytes the kernel reported discarding
+	uint64_t nsec;
+	int err;
+} trimtarget;
+
+// All targets sharing a root disk, and the threads working through them.
+typedef struct trimgroup {
+	trimtarget *targets;
+	unsigned n;
+	_Atomic(unsigned) next;
+	unsigned throttle;
+	_Atomic(unsigned) *cancel;
+	_Atomic(unsigned) *running;
+	pthread_t tids[FSTRIM_PER_DEVICE];
+	unsigned nthreads;
+} trimgroup;
+
+static void
+trim_target(trimtarget *t, unsigned throttle, _Atomic(unsigned) *cancel){
+	struct timespec ts = { .tv_sec = throttle / 1000, .tv_nsec = throttle % 1000 * 1000000, };
+	uint64_t start = aioq_nsec();
+	struct statvfs vfs;
+	uintmax_t off, size = 0;
+	int fd;
+
+	if((fd = open(t->mnt, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0){
+		t->err = errno;
+		return;
+	}
+	if(fstatvfs(fd, &vfs) == 0){
+		size = (uintmax_t)vfs.f_blocks * vfs.f_frsize;
+		atomic_store(&t->size, size);
+	}
+	for(off = 0 ; ; off += FSTRIM_CHUNK){
+		struct fstrim_range range = { .start = off, .len = FSTRIM_CHUNK, .minlen = 0, };
+		// statfs(2) can understate the filesystem's address space (it
+		// omits metadata), so the final range runs through the end.
+		int last = off + FSTRIM_CHUNK >= size;
+
+		if(last){
+			range.len = UINT64_MAX - off;
+		}
+		if(atomic_load(cancel)){
+			t->err = ECANCELED;
+			break;
+		}
+		if(ioctl(fd, FITRIM, &range)){
+			t->err = errno;
+			break;
+		}
+		t->trimmed += range.len;
+		atomic_store(&t->off, last ? size : off + FSTRIM_CHUNK);
+		if(last){
+			break;
+		}
+		if(throttle){
+			nanosleep(&ts, NULL);
+		}
+	}
+	close(fd);
+	t->nsec = aioq_nsec() - start;
+}
+
+static void *
+trim_thread(void *vg){
+	trimgroup *g = vg;
+	unsigned idx;
+
+	while((idx = atomic_fetch_add(&g->next, 1)) < g->n){
+		trim_target(&g->targets[idx], g->throttle, g->cancel);
+	}
+	atomic_fetch_sub(g->running, 1);
+	return NULL;
+}
+
+static int
+target_cmp(const void *va, const void *vb){
+	const trimtarget *a = va, *b = vb;
+
+	return (uintptr_t)a->root < (uintptr_t)b->root ? -1 :
+		(uintptr_t)a->root > (uintptr_t)b->root;
 }
 
-int fstrim_dev(device *d){
+static void
+free_targets(trimtarget *ts, unsigned n){
 	unsigned z;
-	int ret;
 
-	if(!d->mnttype){
-		diag("No filesystem on %s\n",d->name);
-		return -1;
+	for(z = 0 ; z < n ; ++z){
+		free(ts[z].mnt);
+		free(ts[z].dev);
 	}
-	if(d->mnt.count){
-		diag("%s is in use (%ux) and cannot be wiped\n",d->name,d->mnt.count);
+	free(ts);
+}
+
+// Takes ownership of ts. Worker threads never call diag(): the UI might hold
+// its locks while we wait on them. Everything is reported from here.
+static int
+trim_targets(trimtarget *ts, unsigned n, unsigned throttle){
+	const struct timespec tick = { .tv_sec = 0, .tv_nsec = 250000000, };
+	_Atomic(unsigned) cancel = 0, running = 0;
+	uintmax_t total = 0;
+	unsigned z, ngroups = 0;
+	trimgroup *gs;
+	int ret = 0;
+
+	if(n == 0){
+		diag("No filesystems to trim\n");
+		free(ts);
+		return 0;
+	}
+	qsort(ts, n, sizeof(*ts), target_cmp);
+	if((gs = calloc(n, sizeof(*gs))) == NULL){
+		diag("Couldn't allocate trim state (%s?)\n", strerror(errno));
+		free_targets(ts, n);
 		return -1;
 	}
-	ret = 0;
-	for(z = 0 ; z < d->mnt.count ; ++z){
-		ret |= fstrim(d->mnt.list[z]);
+	for(z = 0 ; z < n ; ++z){
+		if(z == 0 || ts[z].root != ts[z - 1].root){
+			gs[ngroups].targets = &ts[z];
+			gs[ngroups].throttle = throttle;
+			gs[ngroups].cancel = &cancel;
+			gs[ngroups].running = &running;
+			++ngroups;
+		}
+		++gs[ngroups - 1].n;
 	}
+	for(z = 0 ; z < ngroups ; ++z){
+		trimgroup *g = &gs[z];
+
+		while(g->nthreads < FSTRIM_PER_DEVICE && g->nthreads < g->n){
+			int r;
+
+			atomic_fetch_add(&running, 1);
+			if( (r = pthread_create(&g->tids[g->nthreads], NULL, trim_thread, g)) ){
+				atomic_fetch_sub(&running, 1);
+				diag("Couldn't launch trim thread (%s?)\n", strerror(r));
+				break;
+			}
+			++g->nthreads;
+		}
+		if(g->nthreads == 0){
+			// nobody will ever claim these
+			atomic_store(&g->next, g->n);
+			ret = -1;
+		}
+	}
+	while(atomic_load(&running)){
+		uintmax_t done = 0, size = 0;
+
+		nanosleep(&tick, NULL);
+		if(job_cancelled()){
+			atomic_store(&cancel, 1);
+		}
+		for(z = 0 ; z < n ; ++z){
+			done += atomic_load(&ts[z].off);
+			size += atomic_load(&ts[z].size);
+		}
+		job_progress(done, size);
+	}
+	for(z = 0 ; z < ngroups ; ++z){
+		while(gs[z].nthreads--){
+			pthread_join(gs[z].tids[gs[z].nthreads], NULL);
+		}
+	}
+	free(gs);
+	for(z = 0 ; z < n ; ++z){
+		const trimtarget *t = &ts[z];
+
+		if(t->err == EOPNOTSUPP){
+			diag("%s (%s) doesn't support discard\n", t->mnt, t->dev);
+		}else if(t->err){
+			diag("Couldn't trim %s (%s) (%s?)\n", t->mnt, t->dev, strerror(t->err));
+			ret = -1;
+		}else{
+			diag("Trimmed %ju MiB from %s (%s) in %.1fs\n", t->trimmed >> 20,
+				t->mnt, t->dev, t->nsec / 1000000000.0);
+			total += t->trimmed;
+		}
+	}
+	if(n > 1){
+		diag("Trimmed %ju MiB from %u filesystems\n", total >> 20, n);
+	}
+	free_targets(ts, n);
 	return ret;
 }
+
+static int
+add_target(trimtarget **ts, unsigned *n, const char *mnt, const char *dev,
+		const device *root){
+	trimtarget *tmp;
+
+	if((tmp = realloc(*ts, sizeof(**ts) * (*n + 1))) == NULL){
+		diag("Couldn't allocate trim target (%s?)\n", strerror(errno));
+		return -1;
+	}
+	*ts = tmp;
+	tmp += *n;
+	memset(tmp, 0, sizeof(*tmp));
+	tmp->root = root;
+	if((tmp->mnt = strdup(mnt)) == NULL || (tmp->dev = strdup(dev)) == NULL){
+		free(tmp->mnt);
+		return -1;
+	}
+	++*n;
+	return 0;
+}
+
+int fstrim(const char *mnt, unsigned throttle){
+	trimtarget *ts = NULL;
+	unsigned n = 0;
+
+	if(add_target(&ts, &n, mnt, mnt, NULL)){
+		free(ts);
+		return -1;
+	}
+	return trim_targets(ts, n, throttle);
+}
+
+// Bind mounts of a filesystem all lead to the same place; one will do.
+int fstrim_dev(const char *name, unsigned throttle){
+	trimtarget *ts = NULL;
+	const device *d;
+	unsigned n = 0;
+	int r;
+
+	lock_growlight();
+	if((d = find_device(name)) == NULL){
+		diag("Couldn't find device %s\n", name);
+		unlock_growlight();
+		return -1;
+	}
+	if(d->mnt.count == 0){
+		diag("%s is not mounted\n", d->name);
+		unlock_growlight();
+		return -1;
+	}
+	r = add_target(&ts, &n, d->mnt.list[0], d->name,
+			d->layout == LAYOUT_PARTITION ? d->partdev.parent : d);
+	unlock_growlight();
+	if(r){
+		free(ts);
+		return -1;
+	}
+	return trim_targets(ts, n, throttle);
+}
+
+int fstrim_solid_state(const device *d){
+	const device *disks[64];
+	unsigned n;
+
+	if((n = stack_disks(d, disks, sizeof(disks) / sizeof(*disks))) == 0){
+		return 0;
+	}
+	while(n--){
+		if(disks[n]->blkdev.rotation != SSD_ROTATION){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Devices with rotating (or unknown) disks beneath them are skipped.
+// FITRIM will tell us whether aggregates can pass discards down.
+int fstrim_all(unsigned throttle){
+	trimtarget *ts = NULL;
+	const controller *c;
+	unsigned n = 0;
+
+	lock_growlight();
+	for(c = get_controllers() ; c ; c = c->next){
+		const device *d, *p;
+
+		for(d = c->blockdevs ; d ; d = d->next){
+			if(!fstrim_solid_state(d)){
+				continue;
+			}
+			if(d->mnt.count && add_target(&ts, &n, d->mnt.list[0], d->name, d)){
+				goto err;
+			}
+			for(p = d->parts ; p ; p = p->next){
+				if(p->mnt.count && add_target(&ts, &n, p->mnt.list[0], p->name, d)){
+					goto err;
+				}
+			}
+		}
+	}
+	unlock_growlight();
+	return trim_targets(ts, n, throttle);
+
+err:
+	unlock_growlight();
+	free_targets(ts, n);
+	return -1;
+}
@@ -8,11 +8,30 @@ extern "C" {
 
 struct device;
 
-// Run the fstrim(8) command on a mounted filesystem
-int fstrim(const char *);
+// Mounted filesystems are trimmed via FITRIM, FSTRIM_CHUNK bytes of their
+// address space at a time, so that no one discard monopolizes the device.
+#define FSTRIM_CHUNK (1ull << 30)
+// No more than this many filesystems on one disk are trimmed at once
+#define FSTRIM_PER_DEVICE 2
+// Pause between chunks used by background (job) trims
+#define FSTRIM_THROTTLE_MSEC 100
 
-// Run fstrim() on all a device's mounts.
-int fstrim_dev(struct device *);
+// Trim the filesystem mounted at the path, sleeping the specified number of
+// milliseconds between chunks.
+int fstrim(const char *, unsigned);
+
+// Trim the filesystem on the named mounted device. growlight is locked only
+// while looking it up, so this can be run as a job.
+int fstrim_dev(const char *, unsigned);
+
+// Whether every disk at the bottom of the device's stack is solid state.
+// growlight must be locked.
+int fstrim_solid_state(const struct device *);
+
+// Trim every mounted filesystem on a disk or aggregate for which
+// fstrim_solid_state() holds, in parallel across disks. Bytes trimmed and
+// time taken are reported for each.
+int fstrim_all(unsigned);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,141 @@
+// copyright 2012–2021 nick black
+#include <string.h>
+
+#include "stack.h"
+#include "growlight.h"
+
+static int
+present(const device **ds, unsigned n, const device *d){
+	while(n--){
+		if(ds[n] == d){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+uintmax_t stack_io(const device *d){
+	// diskstats always counts 512-byte sectors
+	return (d->statdelta.sectors_read + d->statdelta.sectors_written) * 512;
+}
+
+unsigned stack_below(const device *d, const device **below, unsigned max){
+	const mdslave *m = NULL;
+	unsigned n = 0;
+
+	switch(d->layout){
+		case LAYOUT_PARTITION:
+			if(max && d->partdev.parent){
+				below[n++] = d->partdev.parent;
+			}
+			return n;
+		case LAYOUT_MDADM:
+			m = d->mddev.slaves;
+			break;
+		case LAYOUT_DM:
+			m = d->dmdev.slaves;
+			break;
+		default:
+			return 0;
+	}
+	for( ; m && n < max ; m = m->next){
+		const device *s;
+
+		if((s = find_device(m->name)) && !present(below, n, s)){
+			below[n++] = s;
+		}
+	}
+	return n;
+}
+
+static unsigned
+stack_disks_depth(const device *d, const device **disks, unsigned n,
+		unsigned max, unsigned depth){
+	const device *below[64];
+	unsigned b, z;
+
+	if(d->layout == LAYOUT_NONE){
+		if(n < max && !present(disks, n, d)){
+			disks[n++] = d;
+		}
+		return n;
+	}
+	if(depth >= STACK_MAX_DEPTH){
+		return n;
+	}
+	b = stack_below(d, below, sizeof(below) / sizeof(*below));
+	for(z = 0 ; z < b ; ++z){
+		n = stack_disks_depth(below[z], disks, n, max, depth + 1);
+	}
+	return n;
+}
+
+unsigned stack_disks(const device *d, const device **disks, unsigned max){
+	return stack_disks_depth(d, disks, 0, max, 0);
+}
+
+// Is d immediately beneath upper?
+static int
+directly_beneath(const device *upper, const device *d){
+	const device *below[64];
+	unsigned b;
+
+	b = stack_below(upper, below, sizeof(below) / sizeof(*below));
+	return present(below, b, d);
+}
+
+// Breadth-first, using the output as the queue: everything directly upon the
+// device, then everything directly upon those, and so on. No device is
+// queued twice, so even a malformed (cyclic) stack terminates.
+unsigned stack_above(const device *d, const device **above, unsigned max){
+	const device *cur = d;
+	unsigned n = 0, head = 0;
+
+	while(cur){
+		const controller *c;
+
+		for(c = get_controllers() ; c ; c = c->next){
+			const device *u;
+
+			for(u = c->blockdevs ; u ; u = u->next){
+				const device *p;
+
+				if(n < max && u != d && !present(above, n, u) && directly_beneath(u, cur)){
+					above[n++] = u;
+				}
+				for(p = u->parts ; p ; p = p->next){
+					if(n < max && p != d && !present(above, n, p) && directly_beneath(p, cur)){
+						above[n++] = p;
+					}
+				}
+			}
+		}
+		cur = head < n ? above[head++] : NULL;
+	}
+	return n;
+}
+
+static int
+stack_walk_depth(const device *d, stackcb cb, void *arg, unsigned depth){
+	const device *below[64];
+	unsigned b, z;
+	int r;
+
+	if( (r = cb(d, depth, arg)) ){
+		return r;
+	}
+	if(depth >= STACK_MAX_DEPTH){
+		return 0;
+	}
+	b = stack_below(d, below, sizeof(below) / sizeof(*below));
+	for(z = 0 ; z < b ; ++z){
+		if( (r = stack_walk_depth(below[z], cb, arg, depth + 1)) ){
+			return r;
+		}
+	}
+	return 0;
+}
+
+int stack_walk(const device *d, stackcb cb, void *arg){
+	return stack_walk_depth(d, cb, arg, 0);
+}
@@ -0,0 +1,44 @@
+// copyright 2012–2021 nick black
+#ifndef GROWLIGHT_STACK
+#define GROWLIGHT_STACK
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+struct device;
+
+// Block devices are built upon one another: partitions upon disks, and md
+// and dm devices upon partitions, disks and each other. These walk the stack
+// in either direction, so that I/O seen at one layer can be attributed to the
+// layers above and beneath it. Walks down a stack stop STACK_MAX_DEPTH
+// levels beneath the device. All must be called with the growlight lock held.
+#define STACK_MAX_DEPTH 16
+
+// Bytes transferred during the last statistics interval.
+uintmax_t stack_io(const struct device *);
+
+// The devices immediately beneath: md or dm components, or the disk holding
+// a partition. Writes at most max, and returns the number written.
+unsigned stack_below(const struct device *, const struct device **, unsigned);
+
+// Whole disks at the bottom of the stack, each once (the device itself, if
+// it is a whole disk).
+unsigned stack_disks(const struct device *, const struct device **, unsigned);
+
+// Devices built upon this one, at any height, the nearest first.
+unsigned stack_above(const struct device *, const struct device **, unsigned);
+
+// Call back for the device and everything beneath it, depth-first, with each
+// device's depth (0 for the device itself). A non-zero return stops the walk
+// and is returned.
+typedef int (*stackcb)(const struct device *, unsigned, void *);
+int stack_walk(const struct device *, stackcb, void *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -29,11 +29,17 @@ int mkswap(device *d){
 
 // Create swap on the device, and use it
 int swapondev(device *d){
-  char fn[PATH_MAX], *mt;
+  char fn[PATH_MAX], name[sizeof(d->name)], *mt;
 
+  strcpy(name, d->name);
   if(mkswap(d)){
     return -1;
   }
+  // mkswap(8) ran without the growlight lock
+  if((d = find_device(name)) == NULL){
+    diag("Lost %s while making swap\n", name);
+    return -1;
+  }
   snprintf(fn, sizeof(fn), "/dev/%s", d->name);
   if((mt = strdup("swap")) == NULL){
     return -1;
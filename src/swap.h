@@ -9,7 +9,8 @@ extern "C" {
 struct device;
 struct growlight_ui;
 
-// Create swap on the device, and use it
+// Create swap on the device, and use it. The growlight lock is dropped while
+// mkswap(8) runs, so the caller can't rely on the device afterwards.
 int swapondev(struct device *);
 
 // Deactive the swap on this partition (if applicable)
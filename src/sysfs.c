@@ -187,3 +187,20 @@ int write_sysfs(const char *name,const char *str){
 	close(fd);
 	return 0;
 }
+
+int writeat_sysfs(int dirfd,const char *node,const char *str){
+	ssize_t w;
+	int fd;
+
+	if((fd = openat(dirfd,node,O_WRONLY|O_NONBLOCK|O_CLOEXEC)) < 0){
+		return -1;
+	}
+	if((w = write(fd,str,strlen(str))) <= 0 || w < (int)strlen(str)){
+		int e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
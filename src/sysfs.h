@@ -15,6 +15,7 @@ int get_sysfs_bool(int,const char *,unsigned *);
 int get_sysfs_int(int,const char *,int *);
 int get_sysfs_uint(int,const char *,unsigned long *);
 int write_sysfs(const char *,const char *);
+int writeat_sysfs(int,const char *,const char *);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,411 @@
+// copyright 2012–2021 nick black
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+
+#include "aio.h"
+#include "jobs.h"
+#include "wipe.h"
+#include "sysfs.h"
+#include "growlight.h"
+
+#define WIPE_RANGES 8			// concurrent ranges per device
+#define WIPE_ALIGN (1024 * 1024)	// range boundaries
+#define WIPE_IOCTL_CHUNK (1ull << 30)	// per discard/zeroout ioctl
+#define WIPE_WRITE_CHUNK (8 * 1024 * 1024)
+#define WIPE_VERIFY_SAMPLES 256
+#define WIPE_PROGRESS_SEC 5
+
+struct wipejob;
+
+typedef struct wiperange {
+	struct wipejob *job;
+	uintmax_t off, len;
+	pthread_t tid;
+} wiperange;
+
+// Workers only touch the atomics; all reporting is done from the thread which
+// called wipe_blockdevs(), so diag() never blocks a worker against the UI.
+typedef struct wipejob {
+	// copied from the device, which can be rescanned out from under us
+	char name[NAME_MAX + 1];
+	char qname[NAME_MAX + 1];	// whole disk, whose queue limits apply
+	unsigned logsec;
+	unsigned rawdev;		// partition table reread afterwards
+	int fd;
+	wipemethod method;
+	uintmax_t size;
+	_Atomic(uintmax_t) done;	// bytes wiped
+	_Atomic(int) err;		// errno of first failure
+	_Atomic(unsigned) running;	// live workers
+	unsigned nranges;
+	wiperange ranges[WIPE_RANGES];
+	uint64_t start, lastprog;
+} wipejob;
+
+static const void *zeroes;	// WIPE_WRITE_CHUNK aligned zero bytes
+
+const char *wipemethod_str(wipemethod m){
+	switch(m){
+		case WIPE_AUTO: return "auto";
+		case WIPE_SECDISCARD: return "secdiscard";
+		case WIPE_DISCARD: return "discard";
+		case WIPE_ZEROOUT: return "zeroout";
+		case WIPE_WRITE: return "write";
+	}
+	return "unknown";
+}
+
+static int
+wipe_chunk(const wipejob *j, uintmax_t off, uintmax_t len){
+	uint64_t range[2] = { off, len };
+
+	switch(j->method){
+		case WIPE_SECDISCARD:
+			return ioctl(j->fd, BLKSECDISCARD, range);
+		case WIPE_DISCARD:
+			return ioctl(j->fd, BLKDISCARD, range);
+		case WIPE_ZEROOUT:
+			return ioctl(j->fd, BLKZEROOUT, range);
+		case WIPE_WRITE:{
+			ssize_t w = pwrite(j->fd, zeroes, len, off);
+
+			if(w < 0){
+				return -1;
+			}else if(w != (ssize_t)len){
+				errno = EIO;
+				return -1;
+			}
+			return 0;
+		}
+		case WIPE_AUTO:
+			break;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+static void *
+wipe_range_thread(void *vr){
+	wiperange *r = vr;
+	wipejob *j = r->job;
+	uintmax_t chunk, off, end;
+
+	chunk = j->method == WIPE_WRITE ? WIPE_WRITE_CHUNK : WIPE_IOCTL_CHUNK;
+	end = r->off + r->len;
+	for(off = r->off ; off < end && !atomic_load(&j->err) ; off += chunk){
+		uintmax_t len = end - off < chunk ? end - off : chunk;
+
+		if(wipe_chunk(j, off, len)){
+			int expected = 0;
+
+			atomic_compare_exchange_strong(&j->err, &expected, errno);
+			break;
+		}
+		atomic_fetch_add(&j->done, len);
+	}
+	atomic_fetch_sub(&j->running, 1);
+	return NULL;
+}
+
+// Discard capabilities are properties of the whole disk's request queue.
+static int
+queue_limit(const wipejob *j, const char *node, unsigned long *val){
+	char path[PATH_MAX];
+	int fd, r;
+
+	*val = 0;
+	if(snprintf(path, sizeof(path), "%s/queue", j->qname) >= (int)sizeof(path)){
+		return -1;
+	}
+	if((fd = openat(sysfd, path, O_RDONLY|O_CLOEXEC|O_DIRECTORY)) < 0){
+		return -1;
+	}
+	r = get_sysfs_uint(fd, node, val);
+	close(fd);
+	return r;
+}
+
+// Secure discard isn't advertised in sysfs; the only way to know is to try.
+static wipemethod
+resolve_method(const wipejob *j){
+	unsigned long maxdiscard, maxzeroes;
+	uint64_t range[2] = { 0, j->size < WIPE_ALIGN ? j->size : WIPE_ALIGN };
+
+	if(ioctl(j->fd, BLKSECDISCARD, range) == 0){
+		return WIPE_SECDISCARD;
+	}
+	queue_limit(j, "write_zeroes_max_bytes", &maxzeroes);
+	if(maxzeroes){
+		return WIPE_ZEROOUT;
+	}
+	queue_limit(j, "discard_max_bytes", &maxdiscard);
+	if(maxdiscard){
+		return WIPE_DISCARD;
+	}
+	return WIPE_WRITE;
+}
+
+static int
+wipe_start(wipejob *j){
+	uintmax_t per, off;
+	unsigned z;
+
+	per = j->size / WIPE_RANGES / WIPE_ALIGN * WIPE_ALIGN;
+	j->nranges = per ? WIPE_RANGES : 1;
+	off = 0;
+	for(z = 0 ; z < j->nranges ; ++z){
+		wiperange *r = &j->ranges[z];
+
+		r->job = j;
+		r->off = off;
+		r->len = z + 1 == j->nranges ? j->size - off : per;
+		off += r->len;
+	}
+	j->start = j->lastprog = aioq_nsec();
+	for(z = 0 ; z < j->nranges ; ++z){
+		int r;
+
+		atomic_fetch_add(&j->running, 1);
+		if( (r = pthread_create(&j->ranges[z].tid, NULL, wipe_range_thread, &j->ranges[z])) ){
+			int expected = 0;
+
+			atomic_fetch_sub(&j->running, 1);
+			atomic_compare_exchange_strong(&j->err, &expected, r);
+			j->nranges = z;
+			diag("Couldn't launch wipe thread for %s (%s?)\n", j->name, strerror(r));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+wipe_progress(const wipejob *j, uint64_t now){
+	uintmax_t done = atomic_load(&j->done);
+	uintmax_t bps = now > j->start ? done * 1000000000ull / (now - j->start) : 0;
+
+	diag("%s: %ju/%ju MiB wiped (%.1f%%) via %s at %ju MiB/s\n",
+		j->name, done >> 20, j->size >> 20, done * 100.0 / j->size,
+		wipemethod_str(j->method), bps >> 20);
+}
+
+// Read back a random sample of sectors. Zeroing methods must yield zeroes;
+// discarded blocks needn't, so for those we only note what we found.
+static int
+wipe_verify(const wipejob *j){
+	unsigned z, nonzero = 0, bsize = j->logsec;
+	uint64_t seed = aioq_nsec() | 1;
+	unsigned char *buf;
+	void *vbuf;
+	int r;
+
+	if(bsize < 4096 && j->size >= 4096){
+		bsize = 4096;
+	}
+	if( (r = posix_memalign(&vbuf, 4096, bsize)) ){
+		diag("Couldn't allocate %u aligned bytes (%s?)\n", bsize, strerror(r));
+		return -1;
+	}
+	buf = vbuf;
+	for(z = 0 ; z < WIPE_VERIFY_SAMPLES ; ++z){
+		uintmax_t off;
+		unsigned i;
+
+		seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+		off = seed % (j->size / bsize) * bsize;
+		if(pread(j->fd, buf, bsize, off) != (ssize_t)bsize){
+			diag("Couldn't verify %s at %ju (%s?)\n", j->name, off, strerror(errno));
+			free(buf);
+			return -1;
+		}
+		for(i = 0 ; i < bsize ; ++i){
+			if(buf[i]){
+				++nonzero;
+				break;
+			}
+		}
+	}
+	free(buf);
+	if(nonzero){
+		if(j->method == WIPE_ZEROOUT || j->method == WIPE_WRITE){
+			diag("%s: %u of %u sampled blocks were not zeroed!\n",
+				j->name, nonzero, WIPE_VERIFY_SAMPLES);
+			return -1;
+		}
+		diag("%s: %u of %u sampled blocks read back non-zero after %s\n",
+			j->name, nonzero, WIPE_VERIFY_SAMPLES, wipemethod_str(j->method));
+	}else{
+		diag("%s: all %u sampled blocks read back as zeroes\n",
+			j->name, WIPE_VERIFY_SAMPLES);
+	}
+	return 0;
+}
+
+static int
+wipe_init(wipejob *j, const char *name, wipemethod method){
+	const device *d;
+
+	memset(j, 0, sizeof(*j));
+	j->fd = -1;
+	lock_growlight();
+	if((d = find_device(name)) == NULL){
+		diag("Couldn't find device %s\n", name);
+		unlock_growlight();
+		return -1;
+	}
+	if(d->logsec == 0 || d->size == 0){
+		diag("No media in %s\n", d->name);
+		unlock_growlight();
+		return -1;
+	}
+	if(d->roflag){
+		diag("%s is read-only\n", d->name);
+		unlock_growlight();
+		return -1;
+	}
+	snprintf(j->name, sizeof(j->name), "%s", d->name);
+	snprintf(j->qname, sizeof(j->qname), "%s",
+		d->layout == LAYOUT_PARTITION ? d->partdev.parent->name : d->name);
+	j->logsec = d->logsec;
+	j->rawdev = d->layout == LAYOUT_NONE;
+	j->size = d->size / d->logsec * d->logsec;
+	unlock_growlight();
+	// O_EXCL refuses devices which are mounted or otherwise claimed
+	if((j->fd = openat(devfd, j->name, O_RDWR|O_EXCL|O_CLOEXEC|O_DIRECT)) < 0){
+		diag("Couldn't open %s exclusively (%s?)\n", j->name, strerror(errno));
+		return -1;
+	}
+	j->method = method;
+	return 0;
+}
+
+int wipe_blockdevs(const char * const *names, unsigned n, wipemethod method, unsigned verify){
+	unsigned z, running;
+	wipejob *jobs;
+	void *zbuf;
+	int ret = 0;
+
+	if(n == 0){
+		return 0;
+	}
+	if((jobs = calloc(n, sizeof(*jobs))) == NULL){
+		diag("Couldn't allocate wipe state (%s?)\n", strerror(errno));
+		return -1;
+	}
+	// Every device is validated and claimed before any is touched; probing
+	// for secure discard already destroys data.
+	for(z = 0 ; z < n ; ++z){
+		if(wipe_init(&jobs[z], names[z], method)){
+			while(z--){
+				close(jobs[z].fd);
+			}
+			free(jobs);
+			return -1;
+		}
+	}
+	if(zeroes == NULL){
+		int r;
+
+		if( (r = posix_memalign(&zbuf, 4096, WIPE_WRITE_CHUNK)) ){
+			diag("Couldn't allocate %d aligned bytes (%s?)\n", WIPE_WRITE_CHUNK, strerror(r));
+			for(z = 0 ; z < n ; ++z){
+				close(jobs[z].fd);
+			}
+			free(jobs);
+			return -1;
+		}
+		memset(zbuf, 0, WIPE_WRITE_CHUNK);
+		zeroes = zbuf;
+	}
+	for(z = 0 ; z < n ; ++z){
+		if(jobs[z].method == WIPE_AUTO){
+			jobs[z].method = resolve_method(&jobs[z]);
+		}
+		verbf("Wiping %s via %s\n", jobs[z].name, wipemethod_str(jobs[z].method));
+	}
+	for(z = 0 ; z < n ; ++z){
+		if(wipe_start(&jobs[z])){
+			break;
+		}
+	}
+	do{
+		const struct timespec ts = { .tv_sec = 0, .tv_nsec = 250000000, };
+		uint64_t now;
+
+		uintmax_t done = 0, total = 0;
+
+		nanosleep(&ts, NULL);
+		now = aioq_nsec();
+		running = 0;
+		for(z = 0 ; z < n ; ++z){
+			wipejob *j = &jobs[z];
+
+			done += atomic_load(&j->done);
+			total += j->size;
+			if(atomic_load(&j->running)){
+				++running;
+				if(job_cancelled()){
+					int expected = 0;
+
+					atomic_compare_exchange_strong(&j->err, &expected, ECANCELED);
+				}
+				if(now - j->lastprog >= WIPE_PROGRESS_SEC * 1000000000ull){
+					wipe_progress(j, now);
+					j->lastprog = now;
+				}
+			}
+		}
+		job_progress(done, total);
+	}while(running);
+	for(z = 0 ; z < n ; ++z){
+		wipejob *j = &jobs[z];
+		unsigned r;
+		int e;
+
+		for(r = 0 ; r < j->nranges ; ++r){
+			pthread_join(j->ranges[r].tid, NULL);
+		}
+		if(j->start == 0){ // an earlier device's workers couldn't launch
+			diag("Didn't start wiping %s\n", j->name);
+			ret = -1;
+		}else if( (e = atomic_load(&j->err)) ){
+			diag("Error wiping %s via %s (%s?)\n", j->name,
+				wipemethod_str(j->method), strerror(e));
+			ret = -1;
+		}else{
+			uint64_t ns = aioq_nsec() - j->start;
+
+			diag("Wiped %ju MiB of %s via %s in %ju.%03jus\n", j->size >> 20,
+				j->name, wipemethod_str(j->method), (uintmax_t)(ns / 1000000000ull),
+				(uintmax_t)(ns % 1000000000ull / 1000000));
+			if(verify && wipe_verify(j)){
+				ret = -1;
+			}
+		}
+		if(close(j->fd)){
+			diag("Error closing %s (%s?)\n", j->name, strerror(errno));
+			ret = -1;
+		}
+		if(j->rawdev){
+			device *d;
+
+			lock_growlight();
+			if((d = find_device(j->name)) == NULL || rescan_blockdev_blkrrpart(d)){
+				ret = -1;
+			}
+			unlock_growlight();
+		}
+	}
+	free(jobs);
+	return ret;
+}
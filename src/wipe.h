@@ -0,0 +1,31 @@
+// copyright 2012–2021 nick black
+#ifndef GROWLIGHT_WIPE
+#define GROWLIGHT_WIPE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	WIPE_AUTO,		// best method the device supports
+	WIPE_SECDISCARD,	// BLKSECDISCARD
+	WIPE_DISCARD,		// BLKDISCARD
+	WIPE_ZEROOUT,		// BLKZEROOUT
+	WIPE_WRITE,		// O_DIRECT writes of zeroes
+} wipemethod;
+
+const char *wipemethod_str(wipemethod);
+
+// Wipe the entirety of each of n devices, concurrently, splitting each into
+// ranges which are themselves wiped concurrently. WIPE_AUTO prefers secure
+// discard, then offloaded zeroing, then discard, falling back to writing
+// zeroes. If verify is non-zero, a sample of sectors is read back afterwards.
+// Devices must not be in use. Each is looked up by name under the growlight
+// lock, which isn't held while wiping; raw devices are rescanned afterwards.
+int wipe_blockdevs(const char * const *,unsigned,wipemethod,unsigned);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
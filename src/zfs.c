@@ -388,14 +388,17 @@ int make_zfs(const char *dev, const struct mkfsmarshal *mkm){
 
 // Remount a zfs
 int mount_zfs(device *d, const char *targ, unsigned mntops, const void *data){
+	char name[sizeof(d->name)];
+
 	if(mntops || data){
 		diag("Invalid arguments to zfs mount: %u %p\n", mntops, data);
 		return -1;
 	}
-	vspopen_drain("zfs unmount %s", d->name); // FIXME
-	if(vspopen_drain("zfs set mountpoint=%s %s", targ, d->name)){
-		vspopen_drain("zfs mount %s", d->name);
+	strcpy(name, d->name); // d needn't survive the first zfs(8)
+	vspopen_drain("zfs unmount %s", name); // FIXME
+	if(vspopen_drain("zfs set mountpoint=%s %s", targ, name)){
+		vspopen_drain("zfs mount %s", name);
 		return -1;
 	}
-	return vspopen_drain("zfs mount %s", d->name);
+	return vspopen_drain("zfs mount %s", name);
 }
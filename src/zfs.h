@@ -26,7 +26,8 @@ int make_raidz3(const char *,char * const *,int);
 // Make a zpool from a single device (not recommended)
 int make_zfs(const char *,const struct mkfsmarshal *);
 
-// Remount a zfs
+// Remount a zfs. zfs(8) runs without the growlight lock, so the device
+// mightn't survive this.
 int mount_zfs(device *,const char *,unsigned,const void *);
 
 #ifdef __cplusplus
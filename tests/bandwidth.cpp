@@ -0,0 +1,79 @@
+#include "main.h"
+#include "growlight.h"
+#include "bandwidth.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+// A stand-in for a PCI device's sysfs directory
+struct linkdir {
+  char dir[32];
+
+  linkdir(const char* speed, const char* width){
+    strcpy(dir, "/tmp/growlight-pcie-XXXXXX");
+    if(mkdtemp(dir)){
+      put("current_link_speed", speed);
+      put("current_link_width", width);
+    }
+  }
+
+  ~linkdir(){
+    unlink((std::string(dir) + "/current_link_speed").c_str());
+    unlink((std::string(dir) + "/current_link_width").c_str());
+    rmdir(dir);
+  }
+
+  void put(const char* attr, const char* val){
+    if(val){
+      FILE* fp = fopen((std::string(dir) + "/" + attr).c_str(), "w");
+      if(fp){
+        fprintf(fp, "%s\n", val);
+        fclose(fp);
+      }
+    }
+  }
+};
+
+TEST_CASE("PCIeLink") {
+
+  // Both the modern "8.0 GT/s PCIe" and the older "8 GT/s" forms
+  SUBCASE("Speeds") {
+    unsigned gen = 0, lanes = 0;
+    linkdir gen3("8.0 GT/s PCIe", "4");
+    CHECK(pcie_lane_bw(3) * 4 == pcie_link_bw(gen3.dir, &gen, &lanes));
+    CHECK(3 == gen);
+    CHECK(4 == lanes);
+    linkdir gen1("2.5 GT/s", "1");
+    CHECK(2000000000ull == pcie_link_bw(gen1.dir, &gen, &lanes));
+    CHECK(1 == gen);
+    linkdir gen5("32.0 GT/s PCIe", "16");
+    CHECK(pcie_lane_bw(5) * 16 == pcie_link_bw(gen5.dir, &gen, nullptr));
+    CHECK(5 == gen);
+    linkdir gen6("64.0 GT/s PCIe", "2");
+    CHECK(pcie_lane_bw(6) * 2 == pcie_link_bw(gen6.dir, nullptr, nullptr));
+  }
+
+  // An unknown link leaves gen and lanes untouched
+  SUBCASE("Unknown") {
+    unsigned gen = 9, lanes = 9;
+    linkdir unknown("Unknown", "4");
+    CHECK(0 == pcie_link_bw(unknown.dir, &gen, &lanes));
+    linkdir nowidth("8.0 GT/s PCIe", nullptr);
+    CHECK(0 == pcie_link_bw(nowidth.dir, &gen, &lanes));
+    linkdir zero("8.0 GT/s PCIe", "0");
+    CHECK(0 == pcie_link_bw(zero.dir, &gen, &lanes));
+    CHECK(0 == pcie_link_bw("/nonexistent", &gen, &lanes));
+    CHECK(9 == gen);
+    CHECK(9 == lanes);
+  }
+
+}
+
+TEST_CASE("PCIeLane") {
+  CHECK(0 == pcie_lane_bw(0));
+  CHECK(4000000000ull == pcie_lane_bw(2));
+  CHECK(15753846153ull == pcie_lane_bw(4));
+  CHECK(0 == pcie_lane_bw(7));
+}
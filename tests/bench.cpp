@@ -0,0 +1,79 @@
+#include "main.h"
+#include "growlight.h"
+#include "bench.h"
+#include <cstring>
+
+#define MIB (1024ull * 1024)
+
+static void
+setdisk(device* d, unsigned logsec, uintmax_t bytes, const char* pttable,
+        uint64_t first, uint64_t last, device* parts){
+  test_disk(d, logsec, bytes);
+  d->blkdev.pttable = const_cast<char*>(pttable);
+  d->blkdev.first_usable = first;
+  d->blkdev.last_usable = last;
+  d->parts = parts;
+}
+
+TEST_CASE("BenchWriteExtent") {
+
+  // A single 512MiB partition at 1MiB on a 1GiB 4Kn disk. The free space
+  // follows the partition at 513MiB, not eight times further in.
+  SUBCASE("4KnGPT") {
+    device p1, d;
+    uintmax_t off, len;
+    test_partition(&p1, 2048, 2048 + 512 * 2048 - 1, nullptr);
+    setdisk(&d, 4096, 1024 * MIB, "gpt", 6, 1024 * MIB / 4096 - 6, &p1);
+    CHECK(0 == bench_write_extent(&d, &off, &len));
+    CHECK(513 * MIB == off);
+    CHECK(510 * MIB == len);
+    CHECK(0 == off % 4096);
+  }
+
+  // The same layout on a 512e disk.
+  SUBCASE("512GPT") {
+    device p1, d;
+    uintmax_t off, len;
+    test_partition(&p1, 2048, 2048 + 512 * 2048 - 1, nullptr);
+    setdisk(&d, 512, 1024 * MIB, "gpt", 34, 1024 * MIB / 512 - 34, &p1);
+    CHECK(0 == bench_write_extent(&d, &off, &len));
+    CHECK(513 * MIB == off);
+    CHECK(510 * MIB == len);
+  }
+
+  // The 20MiB gap between two logical partitions holds the second one's
+  // EBR, and must not be chosen over the 7MiB at the end of the disk.
+  SUBCASE("MsdosEBR") {
+    device p1, ext, l5, l6, d;
+    uintmax_t off, len;
+    test_partition(&l6, 454656, 454656 + 204800 - 1, nullptr);
+    l6.partdev.ptstate.logical = 1;
+    test_partition(&l5, 208896, 208896 + 204800 - 1, &l6);
+    l5.partdev.ptstate.logical = 1;
+    test_partition(&ext, 206848, 206849, &l5);
+    ext.partdev.ptstate.extended = 1;
+    test_partition(&p1, 2048, 206847, &ext);
+    setdisk(&d, 512, 329 * MIB, "dos", 2048, 329 * 2048 - 1, &p1);
+    CHECK(0 == bench_write_extent(&d, &off, &len));
+    CHECK(322 * MIB == off);
+    CHECK(7 * MIB == len);
+  }
+
+  // Nothing free once aligned to 1MiB
+  SUBCASE("Full") {
+    device p1, d;
+    uintmax_t off, len;
+    test_partition(&p1, 2048, 1024 * 2048 - 40, nullptr);
+    setdisk(&d, 4096, 1024 * MIB, "gpt", 6, 1024 * MIB / 4096 - 6, &p1);
+    CHECK(0 != bench_write_extent(&d, &off, &len));
+  }
+
+  SUBCASE("Mounted") {
+    device d;
+    uintmax_t off, len;
+    setdisk(&d, 4096, 1024 * MIB, "gpt", 6, 1024 * MIB / 4096 - 6, nullptr);
+    d.mnttype = const_cast<char*>("ext4");
+    CHECK(0 != bench_write_extent(&d, &off, &len));
+  }
+
+}
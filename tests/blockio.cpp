@@ -0,0 +1,82 @@
+#include "main.h"
+#include "growlight.h"
+#include "blockio.h"
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+// 1000 512-byte blocks, of which the first and last 128 were captured
+static void
+setcap(blockcap* c, unsigned char* buf){
+  memset(c, 0, sizeof(*c));
+  c->name = "sdz";
+  c->lbasize = 512;
+  c->lbas = 1000;
+  c->headlbas = 128;
+  c->taillbas = 128;
+  c->head = buf;
+  c->tail = buf + 128 * 512;
+}
+
+TEST_CASE("BlockCapture") {
+  static unsigned char buf[256 * 512];
+
+  SUBCASE("Head") {
+    blockcap c;
+    setcap(&c, buf);
+    CHECK(buf == blockcap_lba(&c, 0, 1));
+    CHECK(buf + 1 * 512 == blockcap_lba(&c, 1, 33));
+    CHECK(buf + 127 * 512 == blockcap_lba(&c, 127, 1));
+  }
+
+  // The backup GPT header is the disk's last block
+  SUBCASE("Tail") {
+    blockcap c;
+    setcap(&c, buf);
+    CHECK(buf + 255 * 512 == blockcap_lba(&c, 999, 1));
+    CHECK(buf + 128 * 512 == blockcap_lba(&c, 872, 128));
+    CHECK(buf + 223 * 512 == blockcap_lba(&c, 967, 32));
+  }
+
+  // Nothing between the two, across either boundary, or beyond the disk
+  SUBCASE("Uncaptured") {
+    blockcap c;
+    setcap(&c, buf);
+    CHECK(nullptr == blockcap_lba(&c, 500, 1));
+    CHECK(nullptr == blockcap_lba(&c, 127, 2));
+    CHECK(nullptr == blockcap_lba(&c, 871, 2));
+    CHECK(nullptr == blockcap_lba(&c, 999, 2));
+    CHECK(nullptr == blockcap_lba(&c, 1000, 1));
+    CHECK(nullptr == blockcap_lba(&c, 0, 0));
+    CHECK(nullptr == blockcap_lba(&c, 1, UINT64_MAX));
+  }
+
+  // A small disk is captured whole, as head alone
+  SUBCASE("Small") {
+    blockcap c;
+    setcap(&c, buf);
+    c.lbas = 200;
+    c.headlbas = 200;
+    c.taillbas = 0;
+    CHECK(buf + 199 * 512 == blockcap_lba(&c, 199, 1));
+    CHECK(buf == blockcap_lba(&c, 0, 200));
+    CHECK(nullptr == blockcap_lba(&c, 199, 2));
+  }
+
+  // A failed capture answers nothing
+  SUBCASE("Failed") {
+    char fn[] = "/tmp/growlight-blockcap-XXXXXX";
+    int fd = mkstemp(fn);
+    REQUIRE(0 <= fd);
+    unlink(fn);
+    device d;
+    test_disk(&d, 512, 0);
+    blockcap c;
+    CHECK(0 != blockcap_read(&c, &d, fd));
+    CHECK(nullptr == blockcap_lba(&c, 0, 1));
+    blockcap_free(&c);
+    close(fd);
+  }
+
+}
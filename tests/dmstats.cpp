@@ -0,0 +1,140 @@
+#include "main.h"
+#include "growlight.h"
+#include "dmstats.h"
+#include <cstring>
+
+TEST_CASE("DmstatsUpdate") {
+
+  // The first read's changes are the totals since the region was created
+  SUBCASE("Deltas") {
+    uint64_t bins[3] = {}, lastbins[3] = {};
+    dmstatarea a;
+    memset(&a, 0, sizeof(a));
+    a.bins = bins;
+    a.lastbins = lastbins;
+    const uint64_t first[3] = { 5, 10, 1 };
+    dmstats_area_update(&a, 3, 100, 40, 16, first);
+    CHECK(100 == a.rsectors);
+    CHECK(40 == a.wsectors);
+    CHECK(16 == a.ios);
+    CHECK(10 == a.bins[1]);
+    const uint64_t second[3] = { 7, 10, 4 };
+    dmstats_area_update(&a, 3, 164, 40, 21, second);
+    CHECK(64 == a.rsectors);
+    CHECK(0 == a.wsectors);
+    CHECK(5 == a.ios);
+    CHECK(2 == a.bins[0]);
+    CHECK(0 == a.bins[1]);
+    CHECK(3 == a.bins[2]);
+    CHECK(4 == a.lastbins[2]);
+  }
+
+  // Without histograms, only the counters are kept
+  SUBCASE("NoBins") {
+    dmstatarea a;
+    memset(&a, 0, sizeof(a));
+    dmstats_area_update(&a, 0, 8, 8, 2, nullptr);
+    dmstats_area_update(&a, 0, 24, 8, 3, nullptr);
+    CHECK(16 == a.rsectors);
+    CHECK(1 == a.ios);
+  }
+
+}
+
+TEST_CASE("DmstatsSum") {
+  uint64_t bins[5][2] = { { 1, 0 }, { 2, 1 }, { 0, 3 }, { 4, 4 }, { 1, 1 }, };
+  dmstatarea areas[5];
+  dmstatmon m;
+  memset(&m, 0, sizeof(m));
+  memset(areas, 0, sizeof(areas));
+  for(unsigned z = 0 ; z < 5 ; ++z){
+    areas[z].start = z * 1000;
+    areas[z].len = 1000;
+    areas[z].rsectors = z;
+    areas[z].wsectors = 10 * z;
+    areas[z].ios = bins[z][0] + bins[z][1];
+    areas[z].bins = bins[z];
+  }
+  m.areas = areas;
+  m.nareas = 5;
+  m.nbins = 2;
+
+  SUBCASE("Group") {
+    uint64_t sbins[2];
+    dmstatarea sum = {};
+    sum.bins = sbins;
+    CHECK(2 == dmstats_sum_areas(&m, 2, 2, &sum));
+    CHECK(2000 == sum.start);
+    CHECK(2000 == sum.len);
+    CHECK(5 == sum.rsectors);
+    CHECK(50 == sum.wsectors);
+    CHECK(11 == sum.ios);
+    CHECK(4 == sbins[0]);
+    CHECK(7 == sbins[1]);
+  }
+
+  // The last group holds whatever areas remain
+  SUBCASE("Short") {
+    uint64_t sbins[2];
+    dmstatarea sum = {};
+    sum.bins = sbins;
+    CHECK(1 == dmstats_sum_areas(&m, 4, 2, &sum));
+    CHECK(4000 == sum.start);
+    CHECK(1000 == sum.len);
+    CHECK(2 == sum.ios);
+  }
+
+  SUBCASE("Past") {
+    uint64_t sbins[2] = { 9, 9 };
+    dmstatarea sum = {};
+    sum.bins = sbins;
+    CHECK(0 == dmstats_sum_areas(&m, 5, 2, &sum));
+    CHECK(0 == sum.ios);
+    CHECK(0 == sbins[0]);
+  }
+}
+
+TEST_CASE("DmstatsBounds") {
+  char buf[32];
+
+  SUBCASE("Units") {
+    dmstats_ns_str(250000, buf, sizeof(buf));
+    CHECK(0 == strcmp(buf, "250us"));
+    dmstats_ns_str(10000000, buf, sizeof(buf));
+    CHECK(0 == strcmp(buf, "10ms"));
+    dmstats_ns_str(2000000000, buf, sizeof(buf));
+    CHECK(0 == strcmp(buf, "2s"));
+    dmstats_ns_str(1500, buf, sizeof(buf));
+    CHECK(0 == strcmp(buf, "1500ns"));
+    dmstats_ns_str(0, buf, sizeof(buf));
+    CHECK(0 == strcmp(buf, "0ns"));
+  }
+
+}
+
+// A monitor set aside during a rescan returns to the rediscovered device
+TEST_CASE("DmstatsRescan") {
+  char name[] = "vg-root", uuid[] = "LVM-abc", other[] = "vg-swap";
+  dmstatmon m;
+  device d, e;
+  memset(&m, 0, sizeof(m));
+  m.dmname = name;
+  m.dmuuid = uuid;
+  memset(&d, 0, sizeof(d));
+  d.layout = LAYOUT_DM;
+  d.dmdev.dmname = name;
+  d.dmdev.uuid = uuid;
+  d.dmdev.stats = &m;
+  memset(&e, 0, sizeof(e));
+  e.layout = LAYOUT_DM;
+  e.dmdev.dmname = other;
+
+  dmstats_detach(&d);
+  CHECK(nullptr == d.dmdev.stats);
+  dmstats_reattach(&e);
+  CHECK(nullptr == e.dmdev.stats);
+  dmstats_reattach(&d);
+  CHECK(&m == d.dmdev.stats);
+  CHECK(nullptr == m.next);
+  d.dmdev.stats = nullptr;
+}
@@ -0,0 +1,138 @@
+#include "main.h"
+#include "sg.h"
+#include "nvme.h"
+#include "drivefeat.h"
+#include <cstring>
+
+TEST_CASE("ATAFeatures") {
+
+  SUBCASE("Names") {
+    atafeature f;
+    for(unsigned z = 0 ; z < ATAFEAT_COUNT ; ++z){
+      REQUIRE(nullptr != atafeature_str(static_cast<atafeature>(z)));
+      CHECK(0 == atafeature_parse(atafeature_str(static_cast<atafeature>(z)), &f));
+      CHECK(z == f);
+    }
+    CHECK(-1 == atafeature_parse("apst", &f));
+  }
+
+  SUBCASE("Toggles") {
+    atasetting as;
+    CHECK(0 == atafeature_resolve(ATAFEAT_WCACHE, "on", &as));
+    CHECK(ATA_SF_WCACHE_ON == as.subcmd);
+    CHECK(0 == atafeature_resolve(ATAFEAT_WCACHE, "0", &as));
+    CHECK(ATA_SF_WCACHE_OFF == as.subcmd);
+    CHECK(0 == atafeature_resolve(ATAFEAT_LOOKAHEAD, "1", &as));
+    CHECK(ATA_SF_LOOKAHEAD_ON == as.subcmd);
+    CHECK(0 == as.standby);
+    CHECK(-1 == atafeature_resolve(ATAFEAT_WCACHE, "yes", &as));
+  }
+
+  // hdparm's 255 disables APM; AAM levels start at 128
+  SUBCASE("Levels") {
+    atasetting as;
+    CHECK(0 == atafeature_resolve(ATAFEAT_APM, "128", &as));
+    CHECK(ATA_SF_APM_ON == as.subcmd);
+    CHECK(128 == as.count);
+    CHECK(0 == atafeature_resolve(ATAFEAT_APM, "255", &as));
+    CHECK(ATA_SF_APM_OFF == as.subcmd);
+    CHECK(-1 == atafeature_resolve(ATAFEAT_APM, "0", &as));
+    CHECK(0 == atafeature_resolve(ATAFEAT_AAM, "0xfe", &as));
+    CHECK(ATA_SF_AAM_ON == as.subcmd);
+    CHECK(254 == as.count);
+    CHECK(-1 == atafeature_resolve(ATAFEAT_AAM, "127", &as));
+    CHECK(0 == atafeature_resolve(ATAFEAT_AAM, "off", &as));
+    CHECK(ATA_SF_AAM_OFF == as.subcmd);
+  }
+
+  // The standby timer is set by IDLE; 254 is reserved
+  SUBCASE("Standby") {
+    atasetting as;
+    CHECK(0 == atafeature_resolve(ATAFEAT_STANDBY, "off", &as));
+    CHECK(1 == as.standby);
+    CHECK(0 == as.count);
+    CHECK(0 == atafeature_resolve(ATAFEAT_STANDBY, "241", &as));
+    CHECK(241 == as.count);
+    CHECK(-1 == atafeature_resolve(ATAFEAT_STANDBY, "254", &as));
+    CHECK(-1 == atafeature_resolve(ATAFEAT_STANDBY, "256", &as));
+    CHECK(-1 == atafeature_resolve(ATAFEAT_STANDBY, "12x", &as));
+  }
+
+}
+
+TEST_CASE("NVMeFeatures") {
+
+  SUBCASE("Names") {
+    nvmefeature f;
+    for(unsigned z = 0 ; z < NVMEFEAT_COUNT ; ++z){
+      REQUIRE(nullptr != nvmefeature_str(static_cast<nvmefeature>(z)));
+      CHECK(nullptr != nvmefeature_desc(static_cast<nvmefeature>(z)));
+      CHECK(0 == nvmefeature_parse(nvmefeature_str(static_cast<nvmefeature>(z)), &f));
+      CHECK(z == f);
+    }
+    CHECK(-1 == nvmefeature_parse("standby", &f));
+  }
+
+  // Weights and thresholds are 0's based on the wire
+  SUBCASE("Resolve") {
+    unsigned fid;
+    uint32_t cdw11;
+    CHECK(0 == nvmefeature_resolve(NVMEFEAT_APST, "off", &fid, &cdw11));
+    CHECK(NVME_FEAT_AUTO_PST == fid);
+    CHECK(0 == cdw11);
+    CHECK(0 == nvmefeature_resolve(NVMEFEAT_WCACHE, "on", &fid, &cdw11));
+    CHECK(NVME_FEAT_VOLATILE_WC == fid);
+    CHECK(1 == cdw11);
+    CHECK(0 == nvmefeature_resolve(NVMEFEAT_POWER, "3", &fid, &cdw11));
+    CHECK(NVME_FEAT_POWER_MGMT == fid);
+    CHECK(3 == cdw11);
+    CHECK(0 == nvmefeature_resolve(NVMEFEAT_ARBITRATION, "7,1,2,256", &fid, &cdw11));
+    CHECK(NVME_FEAT_ARBITRATION == fid);
+    CHECK(0xff010007u == cdw11);
+    CHECK(0 == nvmefeature_resolve(NVMEFEAT_COALESCE, "256,10", &fid, &cdw11));
+    CHECK(NVME_FEAT_IRQ_COALESCE == fid);
+    CHECK(0x0aff == cdw11);
+  }
+
+  SUBCASE("Invalid") {
+    unsigned fid;
+    uint32_t cdw11;
+    CHECK(-1 == nvmefeature_resolve(NVMEFEAT_APST, "2", &fid, &cdw11));
+    CHECK(-1 == nvmefeature_resolve(NVMEFEAT_POWER, "32", &fid, &cdw11));
+    CHECK(-1 == nvmefeature_resolve(NVMEFEAT_ARBITRATION, "8,1,1,1", &fid, &cdw11));
+    CHECK(-1 == nvmefeature_resolve(NVMEFEAT_ARBITRATION, "0,0,1,1", &fid, &cdw11));
+    CHECK(-1 == nvmefeature_resolve(NVMEFEAT_ARBITRATION, "0,1,1", &fid, &cdw11));
+    CHECK(-1 == nvmefeature_resolve(NVMEFEAT_ARBITRATION, "0,1,1,1,", &fid, &cdw11));
+    CHECK(-1 == nvmefeature_resolve(NVMEFEAT_COALESCE, "0,10", &fid, &cdw11));
+    CHECK(-1 == nvmefeature_resolve(NVMEFEAT_COALESCE, "1,256", &fid, &cdw11));
+  }
+
+  // Current values are written as they'd be set
+  SUBCASE("Value") {
+    nvmefeatures nf;
+    char buf[32];
+    unsigned fid;
+    uint32_t cdw11;
+    memset(&nf, 0, sizeof(nf));
+    CHECK(-1 == nvmefeature_value(&nf, NVMEFEAT_APST, buf, sizeof(buf)));
+    CHECK(-1 == nvmefeature_value(&nf, NVMEFEAT_WCACHE, buf, sizeof(buf)));
+    nf.vwc_present = 1;
+    nf.vwc = 1;
+    CHECK(0 == nvmefeature_value(&nf, NVMEFEAT_WCACHE, buf, sizeof(buf)));
+    CHECK(0 == strcmp(buf, "on"));
+    nf.arb_burst = 3;
+    nf.arb_low = 0;
+    nf.arb_medium = 7;
+    nf.arb_high = 255;
+    CHECK(0 == nvmefeature_value(&nf, NVMEFEAT_ARBITRATION, buf, sizeof(buf)));
+    CHECK(0 == strcmp(buf, "3,1,8,256"));
+    CHECK(0 == nvmefeature_resolve(NVMEFEAT_ARBITRATION, buf, &fid, &cdw11));
+    CHECK(0xff070003u == cdw11);
+    nf.coalesce_threshold = 0;
+    nf.coalesce_time = 0;
+    CHECK(0 == nvmefeature_value(&nf, NVMEFEAT_COALESCE, buf, sizeof(buf)));
+    CHECK(0 == strcmp(buf, "1,0"));
+    CHECK(-1 == nvmefeature_value(&nf, NVMEFEAT_ARBITRATION, buf, 8));
+  }
+
+}
@@ -101,4 +101,88 @@ TEST_CASE("GPT") {
     }
   }
 
+  // Used entries must lie within [first_usable, last_usable] and not overlap
+  SUBCASE("Overlap") {
+    gpt_header head;
+    CHECK(0 == initialize_gpt(&head, 512, 100000, 34, UUID));
+    auto partcount = head.partcount;
+    auto entries = new gpt_entry[partcount];
+    memset(entries, 0, sizeof(*entries) * partcount);
+    entries[0].type_guid[0] = 1;
+    entries[0].first_lba = 2048;
+    entries[0].last_lba = 4095;
+    entries[5].type_guid[0] = 1;
+    entries[5].first_lba = 4096;
+    entries[5].last_lba = 8191;
+    CHECK(0 == gpt_check_entries(&head, entries));
+    entries[5].first_lba = 4095;
+    CHECK(0 != gpt_check_entries(&head, entries));
+    entries[5].first_lba = 4096;
+    entries[5].last_lba = 99999;
+    CHECK(0 != gpt_check_entries(&head, entries));
+    delete[] entries;
+  }
+
+  // Overlaps are found regardless of the entries' order, and even when one
+  // partition lies entirely within another
+  SUBCASE("OverlapUnsorted") {
+    gpt_header head;
+    CHECK(0 == initialize_gpt(&head, 512, 100000, 34, UUID));
+    auto partcount = head.partcount;
+    auto entries = new gpt_entry[partcount];
+    memset(entries, 0, sizeof(*entries) * partcount);
+    entries[0].type_guid[0] = 1;
+    entries[0].first_lba = 20480;
+    entries[0].last_lba = 40959;
+    entries[1].type_guid[0] = 1;
+    entries[1].first_lba = 2048;
+    entries[1].last_lba = 20479;
+    entries[100].type_guid[0] = 1;
+    entries[100].first_lba = 40960;
+    entries[100].last_lba = 50000;
+    CHECK(0 == gpt_check_entries(&head, entries));
+    entries[100].first_lba = 4096;
+    entries[100].last_lba = 8191;
+    CHECK(0 != gpt_check_entries(&head, entries));
+    delete[] entries;
+  }
+
+  // Partitions must lie within the usable area, and end after they begin
+  SUBCASE("Bounds") {
+    gpt_header head;
+    CHECK(0 == initialize_gpt(&head, 512, 100000, 34, UUID));
+    auto partcount = head.partcount;
+    auto entries = new gpt_entry[partcount];
+    memset(entries, 0, sizeof(*entries) * partcount);
+    entries[0].type_guid[0] = 1;
+    entries[0].first_lba = 34;
+    entries[0].last_lba = 34;
+    CHECK(0 == gpt_check_entries(&head, entries));
+    entries[0].first_lba = 33;
+    CHECK(0 != gpt_check_entries(&head, entries));
+    entries[0].first_lba = 2048;
+    entries[0].last_lba = 2047;
+    CHECK(0 != gpt_check_entries(&head, entries));
+    entries[0].last_lba = head.last_usable;
+    CHECK(0 == gpt_check_entries(&head, entries));
+    delete[] entries;
+  }
+
+  // Entries with zero type and partition GUIDs are unused, whatever their
+  // extents say
+  SUBCASE("Unused") {
+    gpt_header head;
+    CHECK(0 == initialize_gpt(&head, 512, 100000, 34, UUID));
+    auto partcount = head.partcount;
+    auto entries = new gpt_entry[partcount];
+    memset(entries, 0, sizeof(*entries) * partcount);
+    entries[0].type_guid[0] = 1;
+    entries[0].first_lba = 2048;
+    entries[0].last_lba = 4095;
+    entries[1].first_lba = 0;
+    entries[1].last_lba = 1000000;
+    CHECK(0 == gpt_check_entries(&head, entries));
+    delete[] entries;
+  }
+
 }
@@ -0,0 +1,88 @@
+#include "main.h"
+#include "healthmon.h"
+#include <cstring>
+
+static void
+record(healthlog* h, int celsius, uint64_t host, uint64_t media){
+  healthsample* s = &h->samples[h->head];
+  s->when = h->polls++;
+  s->celsius = celsius;
+  s->wa_host = host;
+  s->wa_media = media;
+  h->head = (h->head + 1) % HEALTH_HISTORY;
+  if(h->nsamples < HEALTH_HISTORY){
+    ++h->nsamples;
+  }
+}
+
+TEST_CASE("HealthmonHistory") {
+
+  SUBCASE("Empty") {
+    healthlog h;
+    int min, max;
+    memset(&h, 0, sizeof(h));
+    CHECK(nullptr == healthmon_sample(&h, 0));
+    CHECK(-1 == healthmon_temperature_range(&h, &min, &max));
+    CHECK(0 > healthmon_write_amp(&h));
+  }
+
+  // Once full, the oldest sample is overwritten
+  SUBCASE("Wrap") {
+    healthlog h;
+    memset(&h, 0, sizeof(h));
+    for(unsigned z = 0 ; z < HEALTH_HISTORY + 3 ; ++z){
+      record(&h, 30, 0, 0);
+    }
+    CHECK(HEALTH_HISTORY == h.nsamples);
+    REQUIRE(nullptr != healthmon_sample(&h, 0));
+    CHECK(3 == healthmon_sample(&h, 0)->when);
+    CHECK(HEALTH_HISTORY + 2 == healthmon_sample(&h, HEALTH_HISTORY - 1)->when);
+    CHECK(nullptr == healthmon_sample(&h, HEALTH_HISTORY));
+  }
+
+  // Unknown temperatures are skipped
+  SUBCASE("Temperature") {
+    healthlog h;
+    int min, max;
+    memset(&h, 0, sizeof(h));
+    record(&h, -1, 0, 0);
+    CHECK(-1 == healthmon_temperature_range(&h, &min, &max));
+    record(&h, 41, 0, 0);
+    record(&h, 35, 0, 0);
+    record(&h, -1, 0, 0);
+    record(&h, 52, 0, 0);
+    CHECK(0 == healthmon_temperature_range(&h, &min, &max));
+    CHECK(35 == min);
+    CHECK(52 == max);
+  }
+
+}
+
+TEST_CASE("HealthmonWriteAmp") {
+
+  // Measured over the history, not the device's life
+  SUBCASE("History") {
+    healthlog h;
+    memset(&h, 0, sizeof(h));
+    record(&h, -1, 1000, 1500);
+    record(&h, -1, 1100, 1800);
+    CHECK(3.0 == healthmon_write_amp(&h));
+  }
+
+  // Without writes during the history, the lifetime ratio is used
+  SUBCASE("Lifetime") {
+    healthlog h;
+    memset(&h, 0, sizeof(h));
+    record(&h, -1, 1000, 1500);
+    record(&h, -1, 1000, 1500);
+    CHECK(1.5 == healthmon_write_amp(&h));
+  }
+
+  SUBCASE("Unsupported") {
+    healthlog h;
+    memset(&h, 0, sizeof(h));
+    record(&h, -1, 0, 0);
+    CHECK(0 > healthmon_write_amp(&h));
+  }
+
+}
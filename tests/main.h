@@ -2,5 +2,29 @@
 #define GROWLIGHT_TESTS_MAIN
 
 #include <doctest/doctest.h>
+#include "growlight.h"
+#include <cstring>
+
+// A bare whole disk "sdz" with the given logical (and physical) sector size.
+static inline void
+test_disk(device* d, unsigned logsec, uintmax_t bytes){
+  memset(d, 0, sizeof(*d));
+  strcpy(d->name, "sdz");
+  d->layout = LAYOUT_NONE;
+  d->logsec = logsec;
+  d->physsec = logsec;
+  d->size = bytes;
+}
+
+// A partition whose extent is in 512-byte units regardless of the disk's
+// logical sector size, as sysfs reports them.
+static inline void
+test_partition(device* p, uint64_t fsector, uint64_t lsector, device* next){
+  memset(p, 0, sizeof(*p));
+  p->layout = LAYOUT_PARTITION;
+  p->partdev.fsector = fsector;
+  p->partdev.lsector = lsector;
+  p->next = next;
+}
 
 #endif
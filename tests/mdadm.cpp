@@ -0,0 +1,90 @@
+#include "main.h"
+#include "growlight.h"
+#include "mdadm.h"
+#include <cstring>
+#include <unistd.h>
+
+static void
+setmd(device* d){
+  memset(d, 0, sizeof(*d));
+  strcpy(d->name, "md127");
+  d->layout = LAYOUT_MDADM;
+  d->mddev.disks = 4;
+  d->mddev.group_threads = -1;
+}
+
+TEST_CASE("MdSyncEta") {
+
+  // Sectors are 512 bytes, and the speed is in KiB/s
+  SUBCASE("Running") {
+    device d;
+    setmd(&d);
+    d.mddev.resync = 1;
+    d.mddev.sync_total = 2000000;
+    d.mddev.sync_done = 800000;
+    d.mddev.sync_speed = 1000;
+    CHECK(600 == md_sync_eta(&d));
+    d.mddev.sync_done = d.mddev.sync_total;
+    CHECK(0 == md_sync_eta(&d));
+  }
+
+  SUBCASE("Unknown") {
+    device d;
+    setmd(&d);
+    CHECK(-1 == md_sync_eta(&d));
+    d.mddev.resync = 1;
+    d.mddev.sync_total = 2000000;
+    CHECK(-1 == md_sync_eta(&d));
+    d.mddev.sync_speed = 1000;
+    d.mddev.sync_total = 0;
+    CHECK(-1 == md_sync_eta(&d));
+    d.mddev.sync_total = 2000000;
+    d.layout = LAYOUT_NONE;
+    CHECK(-1 == md_sync_eta(&d));
+  }
+
+}
+
+TEST_CASE("MdTunables") {
+
+  SUBCASE("Names") {
+    mdtunable t;
+    for(unsigned z = 0 ; z < MDTUNE_COUNT ; ++z){
+      REQUIRE(nullptr != mdtunable_str(static_cast<mdtunable>(z)));
+      CHECK(0 == mdtunable_parse(mdtunable_str(static_cast<mdtunable>(z)), &t));
+      CHECK(z == t);
+    }
+    CHECK(-1 == mdtunable_parse("stripe_cache", &t));
+    CHECK(nullptr == mdtunable_str(MDTUNE_COUNT));
+  }
+
+  // Tunables the array doesn't offer have no value
+  SUBCASE("Values") {
+    device d;
+    char buf[32];
+    setmd(&d);
+    CHECK(-1 == md_tunable_value(&d, MDTUNE_STRIPE_CACHE, buf, sizeof(buf)));
+    CHECK(-1 == md_tunable_value(&d, MDTUNE_GROUP_THREADS, buf, sizeof(buf)));
+    CHECK(0 == md_tunable_value(&d, MDTUNE_BITMAP_CHUNK, buf, sizeof(buf)));
+    CHECK(0 == strcmp(buf, "none"));
+    d.mddev.stripe_cache = 4096;
+    d.mddev.group_threads = 0;
+    d.mddev.bitmap_chunk = 64 * 1024 * 1024;
+    CHECK(0 == md_tunable_value(&d, MDTUNE_STRIPE_CACHE, buf, sizeof(buf)));
+    CHECK(0 == strcmp(buf, "4096"));
+    CHECK(0 == md_tunable_value(&d, MDTUNE_GROUP_THREADS, buf, sizeof(buf)));
+    CHECK(0 == strcmp(buf, "0"));
+    CHECK(0 == md_tunable_value(&d, MDTUNE_BITMAP_CHUNK, buf, sizeof(buf)));
+    CHECK(0 == strcmp(buf, "65536"));
+    CHECK(-1 == md_tunable_value(&d, MDTUNE_BITMAP_CHUNK, buf, 5));
+  }
+
+  // One page per member disk per stripe
+  SUBCASE("StripeBytes") {
+    device d;
+    setmd(&d);
+    CHECK(4096ull * 4 * sysconf(_SC_PAGESIZE) == md_stripe_cache_bytes(&d, 4096));
+    CHECK(0 == md_stripe_cache_bytes(&d, 0));
+  }
+
+}
@@ -0,0 +1,72 @@
+#include "main.h"
+#include "nvme.h"
+#include <cstring>
+
+static void
+setlbaf(nvmelbafs* lf, unsigned z, unsigned lbads, unsigned ms, unsigned rp){
+  lf->lbaf[z].lbads = lbads;
+  lf->lbaf[z].ms = ms;
+  lf->lbaf[z].rp = rp;
+  if(z >= lf->count){
+    lf->count = z + 1;
+  }
+}
+
+TEST_CASE("NVMeBestLBAF") {
+
+  SUBCASE("None") {
+    nvmelbafs lf;
+    memset(&lf, 0, sizeof(lf));
+    CHECK(-1 == nvme_best_lbaf(&lf, 4096));
+  }
+
+  // A better Relative Performance wins over a larger sector
+  SUBCASE("Performance") {
+    nvmelbafs lf;
+    memset(&lf, 0, sizeof(lf));
+    setlbaf(&lf, 0, 512, 0, 2);
+    setlbaf(&lf, 1, 4096, 0, 2);
+    setlbaf(&lf, 2, 512, 0, 0);
+    CHECK(2 == nvme_best_lbaf(&lf, 4096));
+  }
+
+  // Among equally-rated formats, the larger sector wins
+  SUBCASE("Larger") {
+    nvmelbafs lf;
+    memset(&lf, 0, sizeof(lf));
+    setlbaf(&lf, 0, 512, 0, 1);
+    setlbaf(&lf, 1, 4096, 0, 1);
+    CHECK(1 == nvme_best_lbaf(&lf, 4096));
+  }
+
+  // Formats carrying metadata aren't usable
+  SUBCASE("Metadata") {
+    nvmelbafs lf;
+    memset(&lf, 0, sizeof(lf));
+    setlbaf(&lf, 0, 512, 0, 2);
+    setlbaf(&lf, 1, 4096, 8, 0);
+    CHECK(0 == nvme_best_lbaf(&lf, 4096));
+  }
+
+  // ...nor are those larger than the page size, nor unsupported ones
+  SUBCASE("TooLarge") {
+    nvmelbafs lf;
+    memset(&lf, 0, sizeof(lf));
+    setlbaf(&lf, 0, 0, 0, 0);
+    setlbaf(&lf, 1, 512, 0, 3);
+    setlbaf(&lf, 2, 16384, 0, 0);
+    CHECK(1 == nvme_best_lbaf(&lf, 4096));
+    CHECK(2 == nvme_best_lbaf(&lf, 16384));
+  }
+
+  // Only the first count formats are considered
+  SUBCASE("Count") {
+    nvmelbafs lf;
+    memset(&lf, 0, sizeof(lf));
+    setlbaf(&lf, 0, 512, 0, 2);
+    setlbaf(&lf, 1, 4096, 0, 0);
+    lf.count = 1;
+    CHECK(0 == nvme_best_lbaf(&lf, 4096));
+  }
+
+}
@@ -0,0 +1,133 @@
+#include "main.h"
+#include "popen.h"
+#include "growlight.h"
+#include <cstdlib>
+#include <cstring>
+
+static unsigned
+argc(char** argv){
+  unsigned n = 0;
+  while(argv[n]){
+    ++n;
+  }
+  return n;
+}
+
+TEST_CASE("SplitCmd") {
+
+  SUBCASE("Whitespace") {
+    char** argv = split_cmd("  mkfs.ext4\t-q   /dev/sdz1 ");
+    REQUIRE(nullptr != argv);
+    CHECK(3 == argc(argv));
+    CHECK(0 == strcmp(argv[0], "mkfs.ext4"));
+    CHECK(0 == strcmp(argv[1], "-q"));
+    CHECK(0 == strcmp(argv[2], "/dev/sdz1"));
+    free(argv);
+  }
+
+  // Quotes group, and nothing within them is expanded
+  SUBCASE("Quotes") {
+    char** argv = split_cmd("mkfs.vfat -n \"EFI boot\" 'a $HOME \"b\"' x\"y z\"");
+    REQUIRE(nullptr != argv);
+    CHECK(5 == argc(argv));
+    CHECK(0 == strcmp(argv[2], "EFI boot"));
+    CHECK(0 == strcmp(argv[3], "a $HOME \"b\""));
+    CHECK(0 == strcmp(argv[4], "xy z"));
+    free(argv);
+  }
+
+  // Within double quotes, only \" and \\ are escapes
+  SUBCASE("Backslashes") {
+    char** argv = split_cmd("a\\ b \"c\\\"d\\\\e\\n\" 'f\\g'");
+    REQUIRE(nullptr != argv);
+    CHECK(3 == argc(argv));
+    CHECK(0 == strcmp(argv[0], "a b"));
+    CHECK(0 == strcmp(argv[1], "c\"d\\e\\n"));
+    CHECK(0 == strcmp(argv[2], "f\\g"));
+    free(argv);
+  }
+
+  SUBCASE("EmptyQuotes") {
+    char** argv = split_cmd("wipefs -o '' x");
+    REQUIRE(nullptr != argv);
+    CHECK(4 == argc(argv));
+    CHECK(0 == strcmp(argv[2], ""));
+    free(argv);
+  }
+
+  SUBCASE("Bad") {
+    CHECK(nullptr == split_cmd(""));
+    CHECK(nullptr == split_cmd("   "));
+    CHECK(nullptr == split_cmd("mkfs \"unterminated"));
+    CHECK(nullptr == split_cmd("mkfs 'unterminated"));
+  }
+
+}
+
+TEST_CASE("ProgressParsers") {
+
+  SUBCASE("Fraction") {
+    uintmax_t done = 0, total = 0;
+    CHECK(0 != progress_fraction("Writing inode tables: 12/128", &done, &total));
+    CHECK(12 == done);
+    CHECK(128 == total);
+    CHECK(0 != progress_fraction("   7/64 ", &done, &total));
+    CHECK(7 == done);
+    CHECK(0 == progress_fraction("Creating filesystem with 262144 4k blocks", &done, &total));
+    CHECK(0 == progress_fraction("see /dev/sdz1", &done, &total));
+    CHECK(0 == progress_fraction("x12/128", &done, &total));
+    CHECK(0 == progress_fraction("12/128MB", &done, &total));
+  }
+
+  // e2fsck's five passes each count for a fifth
+  SUBCASE("Fsck") {
+    uintmax_t done = 0, total = 0;
+    CHECK(0 != progress_fsck("1 50 100 /dev/sdz1", &done, &total));
+    CHECK(500 == done);
+    CHECK(5000 == total);
+    CHECK(0 != progress_fsck("3 1 4 /dev/sdz1", &done, &total));
+    CHECK(2250 == done);
+    CHECK(0 == progress_fsck("6 1 4 /dev/sdz1", &done, &total));
+    CHECK(0 == progress_fsck("1 5 4 /dev/sdz1", &done, &total));
+    CHECK(0 == progress_fsck("1 0 0 /dev/sdz1", &done, &total));
+    CHECK(0 == progress_fsck("Pass 1: Checking inodes", &done, &total));
+  }
+
+  SUBCASE("Percent") {
+    uintmax_t done = 0, total = 0;
+    CHECK(0 != progress_percent("discarding: 42%", &done, &total));
+    CHECK(42 == done);
+    CHECK(100 == total);
+    CHECK(0 != progress_percent("17.5% done", &done, &total));
+    CHECK(17 == done);
+    CHECK(0 != progress_percent("completed 99 percent", &done, &total));
+    CHECK(99 == done);
+    CHECK(0 == progress_percent("101%", &done, &total));
+    CHECK(0 == progress_percent("raid5 4 disks", &done, &total));
+    CHECK(0 == progress_percent("md127%", &done, &total));
+  }
+
+}
+
+// The event thread needs the growlight lock, so it's never held across a child
+TEST_CASE("SpawnLocking") {
+
+  SUBCASE("Refused") {
+    char* argv[] = { const_cast<char*>("true"), nullptr };
+    childproc c;
+    memset(&c, 0, sizeof(c));
+    c.argv = argv;
+    lock_growlight();
+    CHECK(0 != spawn_children(&c, 1));
+    unlock_growlight();
+  }
+
+  SUBCASE("Dropped") {
+    lock_growlight();
+    CHECK(0 == popen_drain("true"));
+    CHECK(1 == growlight_locked());
+    unlock_growlight();
+    CHECK(0 == growlight_locked());
+  }
+
+}
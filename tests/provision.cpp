@@ -0,0 +1,214 @@
+#include "main.h"
+#include "growlight.h"
+#include "provision.h"
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+#define MIB (1024ull * 1024)
+
+static provspec*
+loadspec(const char* desc){
+  char fn[] = "/tmp/growlight-provision-XXXXXX";
+  int fd = mkstemp(fn);
+  if(fd < 0){
+    return nullptr;
+  }
+  FILE* fp = fdopen(fd, "w");
+  fputs(desc, fp);
+  fclose(fp);
+  provspec* p = provision_load(fn);
+  unlink(fn);
+  return p;
+}
+
+static void
+setdisk(device* d, unsigned logsec, uintmax_t bytes, const char* pttable){
+  test_disk(d, logsec, bytes);
+  d->blkdev.pttable = const_cast<char*>(pttable);
+}
+
+// Build the partition as sysfs would report it, in 512-byte units.
+static void
+setpart(device* p, const device* d, unsigned pno, const uintmax_t* ext, device* next){
+  test_partition(p, ext[0] * (d->logsec / 512),
+                 (ext[1] + 1) * (d->logsec / 512) - 1, next);
+  p->partdev.pnumber = pno;
+}
+
+TEST_CASE("ProvisionSize") {
+
+  SUBCASE("Bare") {
+    uintmax_t v;
+    CHECK(0 == provision_parse_size("12", &v));
+    CHECK(12 == v);
+  }
+
+  SUBCASE("Decimal") {
+    uintmax_t v;
+    CHECK(0 == provision_parse_size("4K", &v));
+    CHECK(4000 == v);
+    CHECK(0 == provision_parse_size("3g", &v));
+    CHECK(3000000000ull == v);
+  }
+
+  SUBCASE("Binary") {
+    uintmax_t v;
+    CHECK(0 == provision_parse_size("4KiB", &v));
+    CHECK(4096 == v);
+    CHECK(0 == provision_parse_size("512MiB", &v));
+    CHECK(512 * MIB == v);
+    CHECK(0 == provision_parse_size("2TiB", &v));
+    CHECK(2 * 1024 * 1024 * MIB == v);
+  }
+
+  SUBCASE("Malformed") {
+    uintmax_t v;
+    CHECK(0 != provision_parse_size("K", &v));
+    CHECK(0 != provision_parse_size("-1", &v));
+    CHECK(0 != provision_parse_size("1X", &v));
+    CHECK(0 != provision_parse_size("1KB", &v));
+    CHECK(0 != provision_parse_size("1Ki", &v));
+    CHECK(0 != provision_parse_size("16777216PiB", &v));
+  }
+
+}
+
+TEST_CASE("ProvisionPlan") {
+
+  // "rest" may only be used for the final partition
+  SUBCASE("RestLast") {
+    CHECK(nullptr == loadspec("table gpt\npartition a rest 8300\npartition b 1GiB 8300\n"));
+  }
+
+  // The remainder ends on an alignment boundary, short of the backup GPT.
+  SUBCASE("GPT512") {
+    provspec* p = loadspec("table gpt\npartition boot 512MiB ef00 vfat\npartition root rest 8300 ext4\n");
+    REQUIRE(nullptr != p);
+    device d;
+    uintmax_t ext[2][2];
+    setdisk(&d, 512, 1024 * MIB, nullptr);
+    CHECK(0 == provision_plan(p, &d, ext));
+    CHECK(2048 == ext[0][0]);
+    CHECK(2048 + 512 * 2048 - 1 == ext[0][1]);
+    CHECK(2048 + 512 * 2048 == ext[1][0]);
+    CHECK(1023 * 2048 - 1 == ext[1][1]);
+    provision_free(p);
+  }
+
+  SUBCASE("GPT4Kn") {
+    provspec* p = loadspec("table gpt\npartition boot 512MiB ef00 vfat\npartition root rest 8300 ext4\n");
+    REQUIRE(nullptr != p);
+    device d;
+    uintmax_t ext[2][2];
+    setdisk(&d, 4096, 1024 * MIB, nullptr);
+    CHECK(0 == provision_plan(p, &d, ext));
+    CHECK(256 == ext[0][0]);
+    CHECK(256 + 512 * 256 - 1 == ext[0][1]);
+    CHECK(256 + 512 * 256 == ext[1][0]);
+    CHECK(1023 * 256 - 1 == ext[1][1]);
+    provision_free(p);
+  }
+
+  // A 3MiB optimal transfer size makes for 3MiB alignment
+  SUBCASE("OptimalIO") {
+    provspec* p = loadspec("table gpt\npartition a 1MiB 8300\npartition b 1MiB 8300\n");
+    REQUIRE(nullptr != p);
+    device d;
+    uintmax_t ext[2][2];
+    setdisk(&d, 512, 1024 * MIB, nullptr);
+    d.blkdev.caps.optxfer = 3 * MIB;
+    CHECK(0 == provision_plan(p, &d, ext));
+    CHECK(3 * 2048 == ext[0][0]);
+    CHECK(6 * 2048 == ext[1][0]);
+    CHECK(6 * 2048 + 2047 == ext[1][1]);
+    provision_free(p);
+  }
+
+  SUBCASE("TooBig") {
+    provspec* p = loadspec("table gpt\npartition a 2GiB 8300\n");
+    REQUIRE(nullptr != p);
+    device d;
+    uintmax_t ext[1][2];
+    setdisk(&d, 512, 1024 * MIB, nullptr);
+    CHECK(0 != provision_plan(p, &d, ext));
+    provision_free(p);
+  }
+
+  // msdos's 32-bit LBAs reach 2TiB with 512-byte sectors, and 16TiB with 4KiB
+  SUBCASE("MsdosLimit") {
+    provspec* rest = loadspec("table dos\npartition a rest 83\n");
+    provspec* small = loadspec("table dos\npartition a 1TiB 83\n");
+    REQUIRE(nullptr != rest);
+    REQUIRE(nullptr != small);
+    device d;
+    uintmax_t ext[1][2];
+    setdisk(&d, 512, 3 * 1024 * 1024 * MIB, nullptr);
+    CHECK(0 != provision_plan(rest, &d, ext));
+    CHECK(0 == provision_plan(small, &d, ext));
+    setdisk(&d, 4096, 3 * 1024 * 1024 * MIB, nullptr);
+    CHECK(0 == provision_plan(rest, &d, ext));
+    provision_free(rest);
+    provision_free(small);
+  }
+
+}
+
+TEST_CASE("ProvisionMatch") {
+
+  // The kernel reports 4Kn partitions in 512-byte units
+  SUBCASE("Matches") {
+    provspec* p = loadspec("table gpt\npartition boot 512MiB ef00\npartition root rest 8300\n");
+    REQUIRE(nullptr != p);
+    device d, p1, p2;
+    uintmax_t ext[2][2];
+    setdisk(&d, 4096, 1024 * MIB, "gpt");
+    REQUIRE(0 == provision_plan(p, &d, ext));
+    setpart(&p2, &d, 2, ext[1], nullptr);
+    setpart(&p1, &d, 1, ext[0], &p2);
+    d.parts = &p1;
+    CHECK(0 != provision_layout_matches(p, &d, ext));
+    provision_free(p);
+  }
+
+  SUBCASE("WrongTable") {
+    provspec* p = loadspec("table gpt\npartition root rest 8300\n");
+    REQUIRE(nullptr != p);
+    device d, p1;
+    uintmax_t ext[1][2];
+    setdisk(&d, 512, 1024 * MIB, "dos");
+    REQUIRE(0 == provision_plan(p, &d, ext));
+    setpart(&p1, &d, 1, ext[0], nullptr);
+    d.parts = &p1;
+    CHECK(0 == provision_layout_matches(p, &d, ext));
+    provision_free(p);
+  }
+
+  SUBCASE("Missing") {
+    provspec* p = loadspec("table gpt\npartition boot 512MiB ef00\npartition root rest 8300\n");
+    REQUIRE(nullptr != p);
+    device d, p1;
+    uintmax_t ext[2][2];
+    setdisk(&d, 512, 1024 * MIB, "gpt");
+    REQUIRE(0 == provision_plan(p, &d, ext));
+    setpart(&p1, &d, 1, ext[0], nullptr);
+    d.parts = &p1;
+    CHECK(0 == provision_layout_matches(p, &d, ext));
+    provision_free(p);
+  }
+
+  SUBCASE("Moved") {
+    provspec* p = loadspec("table gpt\npartition root rest 8300\n");
+    REQUIRE(nullptr != p);
+    device d, p1;
+    uintmax_t ext[1][2];
+    setdisk(&d, 512, 1024 * MIB, "gpt");
+    REQUIRE(0 == provision_plan(p, &d, ext));
+    setpart(&p1, &d, 1, ext[0], nullptr);
+    p1.partdev.fsector = 34;
+    d.parts = &p1;
+    CHECK(0 == provision_layout_matches(p, &d, ext));
+    provision_free(p);
+  }
+
+}
@@ -0,0 +1,59 @@
+#include "main.h"
+#include "growlight.h"
+#include "ptable.h"
+#include <cstring>
+
+#define MIB (1024ull * 1024)
+
+static void
+setdisk(device* d, unsigned physsec){
+  test_disk(d, 512, 0);
+  d->physsec = physsec;
+}
+
+TEST_CASE("IOAlignment") {
+
+  SUBCASE("Floor") {
+    device d;
+    setdisk(&d, 4096);
+    CHECK(MIB == io_alignment(&d, MIB));
+    CHECK(4096 == io_alignment(&d, 0));
+  }
+
+  // The least common multiple of the floor and every granularity
+  SUBCASE("Granularities") {
+    device d;
+    setdisk(&d, 4096);
+    d.blkdev.caps.optxfergran = 64 * 1024;
+    d.blkdev.caps.optxfer = 3 * MIB;
+    d.blkdev.caps.unmapgran = 512 * 1024;
+    CHECK(3 * MIB == io_alignment(&d, MIB));
+    d.blkdev.caps.optxfer = 384 * 1024;
+    CHECK(3 * MIB == io_alignment(&d, MIB));
+  }
+
+  // Granularities which would push alignment past 64MiB are ignored, taking
+  // the transfer granularity before the transfer length
+  SUBCASE("Ceiling") {
+    device d;
+    setdisk(&d, 4096);
+    d.blkdev.caps.optxfer = 65 * MIB;
+    CHECK(MIB == io_alignment(&d, MIB));
+    d.blkdev.caps.optxfer = 63 * MIB;
+    CHECK(63 * MIB == io_alignment(&d, MIB));
+    d.blkdev.caps.optxfergran = 5 * MIB;
+    CHECK(5 * MIB == io_alignment(&d, MIB));
+  }
+
+  // Partitions take their disk's alignment
+  SUBCASE("Partition") {
+    device d, p;
+    setdisk(&d, 4096);
+    d.blkdev.caps.optxfer = 3 * MIB;
+    memset(&p, 0, sizeof(p));
+    p.layout = LAYOUT_PARTITION;
+    p.partdev.parent = &d;
+    CHECK(3 * MIB == io_alignment(&p, MIB));
+  }
+
+}
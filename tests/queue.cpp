@@ -0,0 +1,132 @@
+#include "main.h"
+#include "growlight.h"
+#include "queue.h"
+#include <cstring>
+
+TEST_CASE("QueueParams") {
+
+  SUBCASE("Names") {
+    queueparam p;
+    for(unsigned z = 0 ; z < QUEUE_PARAMS ; ++z){
+      REQUIRE(nullptr != queueparam_str(static_cast<queueparam>(z)));
+      CHECK(0 == queueparam_parse(queueparam_str(static_cast<queueparam>(z)), &p));
+      CHECK(z == p);
+    }
+    CHECK(-1 == queueparam_parse("queue/scheduler", &p));
+  }
+
+  // Parameters the device doesn't offer have neither value nor range
+  SUBCASE("Missing") {
+    queuetunables qt;
+    char buf[64];
+    memset(&qt, 0, sizeof(qt));
+    qt.valid = 1u << QUEUE_NR_REQUESTS;
+    qt.nr_requests = 256;
+    CHECK(-1 == queue_tunable_str(&qt, QUEUE_READ_AHEAD_KB, buf, sizeof(buf)));
+    CHECK(-1 == queue_tunable_range(&qt, QUEUE_READ_AHEAD_KB, buf, sizeof(buf)));
+    CHECK(-1 == queue_tunable_str(&qt, QUEUE_PARAMS, buf, sizeof(buf)));
+    CHECK(0 == queue_tunable_str(&qt, QUEUE_NR_REQUESTS, buf, sizeof(buf)));
+    CHECK(0 == strcmp(buf, "256"));
+    CHECK(-1 == queue_tunable_str(&qt, QUEUE_NR_REQUESTS, buf, 3));
+  }
+
+  SUBCASE("Ranges") {
+    queuetunables qt;
+    char buf[64];
+    memset(&qt, 0, sizeof(qt));
+    qt.valid = ~0u;
+    qt.max_hw_sectors_kb = 1280;
+    qt.wbt_lat_usec = -1;
+    CHECK(0 == queue_tunable_range(&qt, QUEUE_NR_REQUESTS, buf, sizeof(buf)));
+    CHECK(0 == strcmp(buf, "4+"));
+    CHECK(0 == queue_tunable_range(&qt, QUEUE_RQ_AFFINITY, buf, sizeof(buf)));
+    CHECK(0 == strcmp(buf, "0-2"));
+    CHECK(0 == queue_tunable_range(&qt, QUEUE_IO_POLL, buf, sizeof(buf)));
+    CHECK(0 == strcmp(buf, "0-1"));
+    CHECK(0 == queue_tunable_range(&qt, QUEUE_WBT_LAT_USEC, buf, sizeof(buf)));
+    CHECK(0 == strcmp(buf, "-1+"));
+    CHECK(0 == queue_tunable_str(&qt, QUEUE_WBT_LAT_USEC, buf, sizeof(buf)));
+    CHECK(0 == strcmp(buf, "-1"));
+    CHECK(0 == queue_tunable_range(&qt, QUEUE_MAX_SECTORS_KB, buf, sizeof(buf)));
+    CHECK(nullptr != strstr(buf, "-1280"));
+  }
+
+  SUBCASE("Schedulers") {
+    queuetunables qt;
+    char buf[64];
+    char mq[] = "mq-deadline", kyber[] = "kyber", none[] = "none";
+    char* scheds[] = { mq, kyber, none };
+    memset(&qt, 0, sizeof(qt));
+    qt.valid = 1u << QUEUE_SCHEDULER;
+    qt.scheduler = kyber;
+    qt.schedulers = scheds;
+    qt.nschedulers = 3;
+    CHECK(0 == queue_tunable_str(&qt, QUEUE_SCHEDULER, buf, sizeof(buf)));
+    CHECK(0 == strcmp(buf, "kyber"));
+    CHECK(0 == queue_tunable_range(&qt, QUEUE_SCHEDULER, buf, sizeof(buf)));
+    CHECK(0 == strcmp(buf, "mq-deadline kyber none"));
+    CHECK(-1 == queue_tunable_range(&qt, QUEUE_SCHEDULER, buf, 12));
+  }
+
+}
+
+static void
+setdisk(device* d, controller* c, unsigned transport, transport_e dt, int rotation){
+  memset(c, 0, sizeof(*c));
+  c->bus = controller::BUS_PCIe;
+  c->transport = static_cast<decltype(c->transport)>(transport);
+  test_disk(d, 512, 0);
+  d->c = c;
+  d->blkdev.realdev = 1;
+  d->blkdev.transport = dt;
+  d->blkdev.rotation = rotation;
+}
+
+TEST_CASE("QueueProfiles") {
+
+  SUBCASE("Lookup") {
+    const queueprofile* p;
+    unsigned z;
+    for(z = 0 ; (p = queue_profile(z)) ; ++z){
+      CHECK(p == queue_profile_lookup(queue_profile_name(p)));
+      CHECK(nullptr != queue_profile_desc(p));
+    }
+    CHECK(4 == z);
+    CHECK(nullptr == queue_profile_lookup("tape"));
+  }
+
+  SUBCASE("Class") {
+    device d;
+    controller c;
+    setdisk(&d, &c, controller::TRANSPORT_NVME, DIRECT_NVME, SSD_ROTATION);
+    CHECK(queue_profile_lookup("nvme") == queue_profile_for(&d));
+    setdisk(&d, &c, controller::TRANSPORT_ATA, SERIAL_ATAIII, SSD_ROTATION);
+    CHECK(queue_profile_lookup("ssd") == queue_profile_for(&d));
+    setdisk(&d, &c, controller::TRANSPORT_ATA, SERIAL_ATAIII, 7200);
+    CHECK(queue_profile_lookup("hdd") == queue_profile_for(&d));
+    setdisk(&d, &c, controller::TRANSPORT_USB3, SERIAL_ATAIII, SSD_ROTATION);
+    CHECK(queue_profile_lookup("usb") == queue_profile_for(&d));
+    // a USB bridge behind an ATA controller is still USB
+    setdisk(&d, &c, controller::TRANSPORT_ATA, SERIAL_USB3, SSD_ROTATION);
+    CHECK(queue_profile_lookup("usb") == queue_profile_for(&d));
+  }
+
+  // Partitions, aggregates and virtual devices get no profile
+  SUBCASE("None") {
+    device d;
+    controller c;
+    setdisk(&d, &c, controller::TRANSPORT_ATA, SERIAL_ATAIII, 7200);
+    c.bus = controller::BUS_VIRTUAL;
+    CHECK(nullptr == queue_profile_for(&d));
+    setdisk(&d, &c, controller::TRANSPORT_ATA, SERIAL_ATAIII, 7200);
+    d.blkdev.realdev = 0;
+    CHECK(nullptr == queue_profile_for(&d));
+    d.blkdev.realdev = 1;
+    d.c = nullptr;
+    CHECK(nullptr == queue_profile_for(&d));
+    setdisk(&d, &c, controller::TRANSPORT_ATA, SERIAL_ATAIII, 7200);
+    d.layout = LAYOUT_MDADM;
+    CHECK(nullptr == queue_profile_for(&d));
+  }
+
+}
@@ -0,0 +1,144 @@
+#include "main.h"
+#include "growlight.h"
+#include "sg.h"
+#include <cstring>
+
+TEST_CASE("ATAIdentifyCaps") {
+
+  // NCQ with a depth of 32, Gen1-3 supported, Gen2 negotiated
+  SUBCASE("SATA") {
+    uint16_t buf[256] = {};
+    diskcaps dc = {};
+    buf[75] = 31;
+    buf[76] = 0x0100 | 0x000e;
+    buf[77] = 2 << 1;
+    ata_decode_caps(buf, &dc);
+    CHECK(1 == dc.ncq);
+    CHECK(32 == dc.queue_depth);
+    CHECK(6000000000ull == dc.satamax);
+    CHECK(3000000000ull == dc.satacur);
+  }
+
+  // TRIM, deterministic, and reading back zeroes
+  SUBCASE("TRIM") {
+    uint16_t buf[256] = {};
+    diskcaps dc = {};
+    buf[169] = 0x0001;
+    buf[69] = 0x4000 | 0x0020;
+    ata_decode_caps(buf, &dc);
+    CHECK(1 == dc.trim);
+    CHECK(1 == dc.drat);
+    CHECK(1 == dc.rzat);
+  }
+
+  // RZAT means nothing without DRAT
+  SUBCASE("RZATAlone") {
+    uint16_t buf[256] = {};
+    diskcaps dc = {};
+    buf[169] = 0x0001;
+    buf[69] = 0x0020;
+    ata_decode_caps(buf, &dc);
+    CHECK(1 == dc.trim);
+    CHECK(0 == dc.drat);
+    CHECK(0 == dc.rzat);
+  }
+
+  // Words of all ones mean nothing is reported
+  SUBCASE("Absent") {
+    uint16_t buf[256];
+    diskcaps dc = {};
+    memset(buf, 0xff, sizeof(buf));
+    ata_decode_caps(buf, &dc);
+    CHECK(0 == dc.ncq);
+    CHECK(0 == dc.trim);
+    CHECK(0 == dc.satamax);
+    CHECK(ZONED_NONE == dc.zoned);
+  }
+
+  // Zoning from the VPD pages isn't overridden
+  SUBCASE("Zoned") {
+    uint16_t buf[256] = {};
+    diskcaps dc = {};
+    buf[69] = 0x0002;
+    ata_decode_caps(buf, &dc);
+    CHECK(ZONED_DRIVE == dc.zoned);
+    buf[69] = 0x0001;
+    ata_decode_caps(buf, &dc);
+    CHECK(ZONED_DRIVE == dc.zoned);
+  }
+
+}
+
+TEST_CASE("VPDBlockLimits") {
+
+  // Lengths are in logical blocks
+  SUBCASE("4Kn") {
+    unsigned char buf[64] = {};
+    diskcaps dc = {};
+    buf[1] = 0xb0;
+    buf[3] = 0x3c;
+    buf[7] = 8;               // granularity: 8 blocks
+    buf[15] = 0x40;           // optimal transfer: 64 blocks
+    buf[23] = 0xff;           // maximum unmap LBA count
+    buf[31] = 0x01;           // unmap granularity: 1 block
+    CHECK(0 == vpd_decode_block_limits(buf, 4096, &dc));
+    CHECK(32768 == dc.optxfergran);
+    CHECK(262144 == dc.optxfer);
+    CHECK(1 == dc.trim);
+    CHECK(4096 == dc.unmapgran);
+  }
+
+  // Transfer lengths beyond 32 bits of bytes are dropped
+  SUBCASE("Huge") {
+    unsigned char buf[64] = {};
+    diskcaps dc = {};
+    buf[3] = 0x3c;
+    buf[12] = 0x01;
+    CHECK(0 == vpd_decode_block_limits(buf, 512, &dc));
+    CHECK(0 == dc.optxfer);
+    CHECK(0 == dc.trim);
+    CHECK(0 == dc.unmapgran);
+  }
+
+  SUBCASE("Short") {
+    unsigned char buf[64] = {};
+    diskcaps dc = {};
+    buf[3] = 0x10;
+    CHECK(0 != vpd_decode_block_limits(buf, 512, &dc));
+  }
+
+}
+
+TEST_CASE("VPDBlockChars") {
+
+  SUBCASE("SSD") {
+    unsigned char buf[64] = {};
+    diskcaps dc = {};
+    buf[5] = 1;
+    buf[7] = 3;               // 2.5"
+    CHECK(SSD_ROTATION == vpd_decode_block_chars(buf, &dc));
+    CHECK(3 == dc.formfactor);
+  }
+
+  SUBCASE("Rotating") {
+    unsigned char buf[64] = {};
+    diskcaps dc = {};
+    buf[4] = 7200 >> 8;
+    buf[5] = 7200 & 0xff;
+    buf[8] = 2 << 4;
+    CHECK(7200 == vpd_decode_block_chars(buf, &dc));
+    CHECK(ZONED_DRIVE == dc.zoned);
+  }
+
+  // Reserved rates and "not reported" leave the rotation unknown
+  SUBCASE("Unknown") {
+    unsigned char buf[64] = {};
+    diskcaps dc = {};
+    CHECK(0 == vpd_decode_block_chars(buf, &dc));
+    buf[5] = 0x10;
+    CHECK(0 == vpd_decode_block_chars(buf, &dc));
+    buf[4] = buf[5] = 0xff;
+    CHECK(0 == vpd_decode_block_chars(buf, &dc));
+  }
+
+}
@@ -0,0 +1,144 @@
+#include "main.h"
+#include "growlight.h"
+#include "stack.h"
+#include <cstring>
+#include <string>
+
+// sda1 and sdb make up md0, upon which sits the dm device vg-root:
+//
+//   vg-root
+//     md0
+//       sda1
+//         sda
+//       sdb
+struct stackfixture {
+  device sda, sdb, sda1, md0, root;
+  mdslave m1, m2, r1;
+  char n1[8], n2[8], n3[8];
+  controller* bus;
+  device* saved;
+
+  stackfixture(){
+    memset(this, 0, sizeof(*this));
+    strcpy(sda.name, "sda");
+    strcpy(sdb.name, "sdb");
+    strcpy(sda1.name, "sda1");
+    strcpy(md0.name, "md0");
+    strcpy(root.name, "vg-root");
+    sda.layout = sdb.layout = LAYOUT_NONE;
+    sda1.layout = LAYOUT_PARTITION;
+    sda1.partdev.parent = &sda;
+    sda.parts = &sda1;
+    strcpy(n1, "sda1");
+    strcpy(n2, "sdb");
+    strcpy(n3, "md0");
+    m1.name = n1;
+    m1.next = &m2;
+    m2.name = n2;
+    r1.name = n3;
+    md0.layout = LAYOUT_MDADM;
+    md0.mddev.slaves = &m1;
+    root.layout = LAYOUT_DM;
+    root.dmdev.slaves = &r1;
+    sda.next = &sdb;
+    sdb.next = &md0;
+    md0.next = &root;
+    // borrow the virtual bus, present before growlight_init()
+    bus = const_cast<controller*>(get_controllers());
+    saved = bus->blockdevs;
+    bus->blockdevs = &sda;
+  }
+
+  ~stackfixture(){
+    bus->blockdevs = saved;
+  }
+};
+
+static int
+walkcb(const device* d, unsigned depth, void* arg){
+  std::string* s = static_cast<std::string*>(arg);
+  *s += std::to_string(depth) + d->name + " ";
+  return 0;
+}
+
+TEST_CASE("Stack") {
+  stackfixture f;
+  const device* ds[8];
+
+  SUBCASE("Below") {
+    CHECK(0 == stack_below(&f.sda, ds, 8));
+    REQUIRE(1 == stack_below(&f.sda1, ds, 8));
+    CHECK(&f.sda == ds[0]);
+    REQUIRE(2 == stack_below(&f.md0, ds, 8));
+    CHECK(&f.sda1 == ds[0]);
+    CHECK(&f.sdb == ds[1]);
+    CHECK(1 == stack_below(&f.md0, ds, 1));
+    REQUIRE(1 == stack_below(&f.root, ds, 8));
+    CHECK(&f.md0 == ds[0]);
+  }
+
+  SUBCASE("Disks") {
+    REQUIRE(2 == stack_disks(&f.root, ds, 8));
+    CHECK(&f.sda == ds[0]);
+    CHECK(&f.sdb == ds[1]);
+    REQUIRE(1 == stack_disks(&f.sdb, ds, 8));
+    CHECK(&f.sdb == ds[0]);
+  }
+
+  // Nearest first
+  SUBCASE("Above") {
+    REQUIRE(3 == stack_above(&f.sda, ds, 8));
+    CHECK(&f.sda1 == ds[0]);
+    CHECK(&f.md0 == ds[1]);
+    CHECK(&f.root == ds[2]);
+    REQUIRE(2 == stack_above(&f.sdb, ds, 8));
+    CHECK(&f.md0 == ds[0]);
+    CHECK(0 == stack_above(&f.root, ds, 8));
+  }
+
+  SUBCASE("Walk") {
+    std::string s;
+    CHECK(0 == stack_walk(&f.root, walkcb, &s));
+    CHECK(s == "0vg-root 1md0 2sda1 3sda 2sdb ");
+  }
+
+  SUBCASE("IO") {
+    f.md0.statdelta.sectors_read = 3;
+    f.md0.statdelta.sectors_written = 5;
+    CHECK(4096 == stack_io(&f.md0));
+  }
+
+}
+
+// A component named twice is still only one disk
+TEST_CASE("StackRepeated") {
+  stackfixture f;
+  const device* ds[8];
+  f.m2.name = f.n1;
+  REQUIRE(1 == stack_below(&f.md0, ds, 8));
+  REQUIRE(1 == stack_disks(&f.root, ds, 8));
+  CHECK(&f.sda == ds[0]);
+}
+
+// md0 upon vg-root upon md0: walking down ends at the depth limit, and
+// walking up visits each device once
+TEST_CASE("StackCycle") {
+  stackfixture f;
+  const device* ds[8];
+  f.m2.name = f.root.name;
+  REQUIRE(1 == stack_disks(&f.root, ds, 8));
+  CHECK(&f.sda == ds[0]);
+  REQUIRE(3 == stack_above(&f.sda, ds, 8));
+  CHECK(&f.root == ds[2]);
+  REQUIRE(1 == stack_above(&f.root, ds, 8));
+  CHECK(&f.md0 == ds[0]);
+  unsigned n = 0;
+  CHECK(0 == stack_walk(&f.root, [](const device*, unsigned depth, void* arg){
+    unsigned* deepest = static_cast<unsigned*>(arg);
+    if(depth > *deepest){
+      *deepest = depth;
+    }
+    return 0;
+  }, &n));
+  CHECK(STACK_MAX_DEPTH == n);
+}